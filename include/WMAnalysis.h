@@ -4,6 +4,7 @@
 #include "../include/util/TraceReader.h"
 #include "../include/util/FunctionSiteAllocation.h"
 #include "../include/util/Util.h"
+#include "../include/util/TimeQuery.h"
 
 #include <set>
 #include <queue>
@@ -47,6 +48,17 @@ public:
 			bool functions = false, bool allocations = false,
 			bool time_search = false, double time_val=0.0);
 
+	/**
+	 * Constructor for WMAnalysis which breaks down a tracefile at many times, in a single replay of the trace.
+	 * A count of times needs the length of the run first, which takes a quick simple pass.
+	 * @param trace_file The name of the tracefile to read process
+	 * @param graph Should we produce a consumption graph
+	 * @param allocations Should we produce an allocations breakdown
+	 * @param query The times at which to break down the heap
+	 */
+	WMAnalysis(string trace_file, bool graph, bool allocations,
+			const TimeQuery &query);
+
 
 	/*
 	 * Setter for the boolean variable representing if we should print a temporal graph of consumption.
@@ -79,8 +91,18 @@ public:
 	 * A function to actually generate the HWM functional breakdown file.
 	 *
 	 * @param tr The trace reader containing the information about the HWM point.
+	 * @param at_hwm If the breakdown is of the HWM the reader kept, rather than where the reader stopped.
+	 */
+	void generateFunctionBreakdown(TraceReader * tr, bool at_hwm);
+
+	/**
+	 * A function to generate the time query file, from the states captured at each time.
+	 * Each call stack is named once, at the top of the file, then each time lists its memory,
+	 * its breakdown by call stack and its largest live allocations.
+	 *
+	 * @param tr The trace reader which captured the states.
 	 */
-	void generateFunctionBreakdown(TraceReader * tr);
+	void generateTimeQueries(TraceReader * tr);
 
 	/**
 	 * Function to return the actual trace reader from the analysis.
@@ -6,17 +6,53 @@
 #include        <sys/resource.h>
 #include		<iostream>
 
+/* Define the time spent calibrating the tick counter against the monotonic clock - 20ms */
+#define TIMERCALIBRATION 20000000
+
 using namespace std;
 
+/**
+ * WMTimer provides the timestamps of the trace.
+ *
+ * Events are stamped with integer ticks from the invariant time stamp counter (rdtsc), calibrated against
+ * the monotonic clock at start up. Where the counter is unavailable or not invariant, or when built with
+ * -DWMTRACE_NO_TSC, the ticks are nanoseconds of the monotonic clock instead.
+ */
 class WMTimer {
 
 private:
 	struct timeval old_t;
 
-	timespec time1;
-
 	double start_time;
 
+	/* Tick counter state */
+	bool use_tsc;
+	double ticks_per_second;
+	unsigned long start_ticks;
+
+	/**
+	 * Test if the processor has an invariant time stamp counter, which ticks at a constant rate
+	 * regardless of frequency scaling and sleep states.
+	 * @return If the time stamp counter can be used.
+	 */
+	static bool invariantTSC();
+
+	/**
+	 * Measure the tick rate against the monotonic clock.
+	 */
+	void calibrate();
+
+	/**
+	 * Read a clock in nanoseconds.
+	 * @param clock The clock to read.
+	 * @return The clock value in nanoseconds.
+	 */
+	static long readClock(clockid_t clock) {
+		timespec t;
+		clock_gettime(clock, &t);
+		return t.tv_sec * 1000000000L + t.tv_nsec;
+	}
+
 public:
 	/**
 	 * Constructor for WMTimer sets a start time.
@@ -31,6 +67,7 @@ public:
 
 	/**
 	 * Time of day timer returns time as a double since epoch.
+	 * Safe to call from multiple threads.
 	 * @param[out] et Pointer to double where the result should be stored.
 	 */
 	void todTimer(double *et);
@@ -43,11 +80,53 @@ public:
 
 	/**
 	 * A function to calculate the elapsed time since the program started, as a double.
-	 * This is used for the Timer frame for time correction.
+	 * Derived from the tick counter.
 	 * @param[out] et Pointer to the double object to store the elapsed time in.
 	 */
 	void elapsedTime(double *et);
 
+	/**
+	 * Read the tick counter.
+	 * Safe to call from multiple threads, and cheap enough to call on every event.
+	 * @return The current tick count.
+	 */
+	unsigned long getTicks() {
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(WMTRACE_NO_TSC)
+		if (use_tsc) {
+			unsigned int lo, hi;
+			__asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+			return ((unsigned long) hi << 32) | lo;
+		}
+#endif
+		return readClock(CLOCK_MONOTONIC);
+	}
+
+	/**
+	 * Fetch the calibrated tick rate.
+	 * @return The number of ticks per second.
+	 */
+	double getTicksPerSecond() const {
+		return ticks_per_second;
+	}
+
+	/**
+	 * Fetch the tick count when the timer was synchronised.
+	 * @return The start tick count.
+	 */
+	unsigned long getStartTicks() const {
+		return start_ticks;
+	}
+
+	/**
+	 * Read the tick counter together with the wall and process CPU clocks,
+	 * so the reader can relate ticks to both.
+	 *
+	 * @param[out] ticks The current tick count.
+	 * @param[out] wall The wall clock in nanoseconds since the epoch.
+	 * @param[out] cpu The process CPU time in nanoseconds.
+	 */
+	void getCalibration(unsigned long *ticks, long *wall, long *cpu);
+
 };
 
 #endif
@@ -12,12 +12,23 @@
 #include <unistd.h>
 
 #include "WMTimer.h"
+#include "util/TraceWriter.h"
 #include "util/TraceBuffer.h"
 #include "util/StackMap.h"
+#include "util/LiveAllocationTable.h"
 #include "util/CallStackTraversal.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <limits.h>
+#include <map>
+#include <vector>
+#include <algorithm>
+
+/* Define the number of call stacks reported by the live report */
+#define LIVETOPSTACKS 10
 
 extern "C" {
 extern __typeof (malloc) __libc_malloc;
@@ -30,36 +41,71 @@ using namespace std;
 
 using namespace std;
 
+/**
+ * The tracing state of a single application thread.
+ *
+ * Created the first time a thread enters the tracer, each thread has its own buffer,
+ * unwinder, timers and counters, so events never need to take a lock.
+ */
+struct WMThreadState {
+	/* The ID of the thread within the trace */
+	int thread_id;
+
+	/* Data storage objects */
+	TraceBuffer *buffer;
+	StackUnwind *unwind;
+
+	/* Tick count taken on entry to the current event */
+	unsigned long event_ticks;
+
+	/* Function Counters */
+	long malloc_counter;
+	long calloc_counter;
+	long realloc_counter;
+	long free_counter;
+
+	/* Frees of NULL or of addresses never traced, such as allocations from before tracing started */
+	long untracked_frees;
+
+	/* Bytes left to allocate before the next sampled call stack, and the generator state */
+	long sample_bytes;
+	unsigned long sample_seed;
+
+	/* Next thread in the list of live threads */
+	WMThreadState *next;
+};
+
+/* Per-thread recursion guard and state, defined in WMTrace.cpp */
+extern __thread int wmtrace_thread_active;
+extern __thread WMThreadState *wmtrace_thread_state;
+
 class WMTrace {
 private:
 	/* Data storage objects */
-	TraceBuffer *wmtrace_buffer;
-	StackUnwind *unwind;
+	TraceWriter *wmtrace_writer;
 	StackMap *stack_map;
 
+	/* Live thread states, and the lock protecting the list */
+	WMThreadState *thread_states;
+	pthread_mutex_t thread_lock;
+	pthread_key_t thread_key;
+
+	/* The tracer instance, for the thread exit callback */
+	static WMTrace *thread_tracer;
+
 	/* MPI Variables */
 	int wmtrace_rank;
 	int wmtrace_comm;
 
 	/* Application Signals */
-	int wmtrace_started;
-	int wmtrace_finished;
-	int wmtrace_active;
+	volatile int wmtrace_started;
+	volatile int wmtrace_finished;
 
 	/* Timer object */
 	WMTimer *time;
-	long timer_counter;
 
 	/* Timers variables */
 	double wmtrace_app_stime;
-	double wmtrace_fun_stime;
-	double wmtrace_fun_etime;
-
-	/* Function Counters */
-	long wmtrace_malloc_counter;
-	long wmtrace_calloc_counter;
-	long wmtrace_realloc_counter;
-	long wmtrace_free_counter;
 
 	/* Control Variables */
 	bool complex_trace;
@@ -67,6 +113,232 @@ private:
 	bool post_process_graph;
 	bool post_process_functions;
 
+	/* Call stack capture limits, passed to each thread's unwinder */
+	int stack_depth;
+	int stack_skip;
+
+	/* Mean bytes between sampled call stacks, or 0 to capture every call stack */
+	long sample_rate;
+
+	/* Allocations below this size are aggregated rather than traced, or 0 to trace every allocation */
+	long small_threshold;
+
+	/* Fold allocations freed by the next event of their thread into transient events */
+	bool coalesce;
+
+	/* Write every rank to a single shared trace file */
+	bool shared_file;
+
+	/* Send the trace through a collector per node */
+	bool node_collector;
+
+	/* Compression codec of the trace, and its zlib level or CODECADAPTIVE */
+	char codec;
+	int codec_level;
+
+	/* Number of compression worker threads */
+	int compress_threads;
+
+	/* Every live allocation, so the size of each free is known - NULL until tracing starts */
+	LiveAllocationTable *live_allocations;
+
+	/* Untracked frees of the threads already released */
+	volatile long untracked_frees;
+
+	/* Running count of the live bytes, and the highest it has reached */
+	volatile long live_bytes;
+	volatile long hwm_bytes;
+
+	/* Bytes of thread data and seconds between checkpoints of the live heap, 0 for none */
+	long checkpoint_bytes;
+	double checkpoint_seconds;
+	/* Are checkpoints taken, and so events counted */
+	bool checkpoints;
+	/* Thread data bytes and tick count at which the next checkpoint is due */
+	volatile long next_checkpoint_bytes;
+	volatile unsigned long next_checkpoint_ticks;
+	/* Set while a checkpoint is taken, holding every other thread at the start of its next event */
+	volatile int checkpoint_pending;
+	/* Number of threads part way through an event */
+	volatile long events_active;
+	/* Reallocs of a traced allocation, each counted by the reader as a free and a malloc */
+	volatile long realloc_pairs;
+	/* Sequences skipped by the transient events of threads already released */
+	volatile long skipped_sequences;
+	/* Held while a checkpoint is taken */
+	pthread_mutex_t checkpoint_lock;
+
+	/**
+	 * Record a new live allocation, raising the HWM if needed.
+	 *
+	 * @param address The address of the allocation, ignored if 0.
+	 * @param size The size of the allocation.
+	 * @param stack The ID of the call stack of the allocation.
+	 */
+	void addLive(long address, long size, int stack) {
+		if (address == 0)
+			return;
+		live_allocations->insert(address, size, stack);
+
+		/* Raise the HWM, unless another thread has already raised it further */
+		long current = __sync_add_and_fetch(&live_bytes, size);
+		long hwm = hwm_bytes;
+		while (current > hwm
+				&& !__sync_bool_compare_and_swap(&hwm_bytes, hwm, current))
+			hwm = hwm_bytes;
+	}
+
+	/**
+	 * Remove a live allocation, returning its size and call stack.
+	 *
+	 * @param[in] address The address of the allocation.
+	 * @param[out] size The size of the allocation.
+	 * @param[out] stack The ID of the call stack of the allocation.
+	 * @return If the allocation was live.
+	 */
+	bool removeLive(long address, long *size, int *stack) {
+		if (!live_allocations->remove(address, size, stack))
+			return false;
+		__sync_sub_and_fetch(&live_bytes, *size);
+		return true;
+	}
+
+	/**
+	 * Count the calling thread as part way through an event, first waiting for any checkpoint being taken.
+	 * Does nothing unless checkpoints are taken.
+	 */
+	void enterEvent() {
+		if (!checkpoints)
+			return;
+
+		/* The add is a full barrier, so either the checkpoint sees us or we see the checkpoint */
+		__sync_add_and_fetch(&events_active, 1);
+		while (checkpoint_pending) {
+			__sync_sub_and_fetch(&events_active, 1);
+
+			/* Give up the core while the checkpoint walks the live table, as with the event lock */
+			while (checkpoint_pending)
+				sched_yield();
+			__sync_add_and_fetch(&events_active, 1);
+		}
+	}
+
+	/**
+	 * Count the calling thread as having finished its event.
+	 */
+	void exitEvent() {
+		if (checkpoints)
+			__sync_sub_and_fetch(&events_active, 1);
+	}
+
+	/**
+	 * Check if the next checkpoint is due, by the thread data written or the time of the current event.
+	 * @return If a checkpoint should be taken.
+	 */
+	bool checkpointDue() {
+		return wmtrace_thread_state->event_ticks >= next_checkpoint_ticks
+				|| wmtrace_writer->getThreadDataBytes() >= next_checkpoint_bytes;
+	}
+
+	/**
+	 * Write a checkpoint of the live heap, once the calling thread has written its event.
+	 * Every other thread is held at the start of its next event while the live allocations are copied,
+	 * so the checkpoint is exact at the current event sequence. Allocations still waiting in the aggregate
+	 * of a thread are kept, as the aggregate holds the sequence reserved by its first event, before the checkpoint.
+	 * Only one thread takes a checkpoint, should several find it due at once.
+	 */
+	void writeCheckpoint();
+
+	/**
+	 * Create the tracing state for the calling thread, registering it with the writer.
+	 * Must be called inside an active segment, so the allocations are not traced.
+	 *
+	 * @return The new thread state.
+	 */
+	WMThreadState *registerThread();
+
+	/**
+	 * Remove the state of a thread from the live list.
+	 *
+	 * @param state The state to remove.
+	 * @return If the state was found, and so is now owned by the caller.
+	 */
+	bool detachThread(WMThreadState *state);
+
+	/**
+	 * Flush and free the state of a thread, once detached from the live list.
+	 *
+	 * @param state The state to release.
+	 * @param exited If the thread has exited, rather than tracing having finished.
+	 */
+	void releaseThread(WMThreadState *state, bool exited);
+
+	/**
+	 * Destructor callback for the thread key, run as each traced thread exits.
+	 *
+	 * @param state The WMThreadState of the exiting thread.
+	 */
+	static void threadExit(void *state);
+
+	/**
+	 * Permanently exclude the calling thread from tracing.
+	 * Used by the compression worker, so its own allocations are never recorded.
+	 */
+	static void ignoreThread();
+
+	/**
+	 * Draw the number of bytes until the next sampled call stack of a thread.
+	 * Exponentially distributed with a mean of the sample rate, so an allocation of
+	 * s bytes is sampled with probability 1 - exp(-s / rate).
+	 *
+	 * @param state The thread drawing the interval.
+	 * @return The number of bytes until the next sample.
+	 */
+	long nextSampleInterval(WMThreadState *state);
+
+	/**
+	 * Decide if the call stack of an allocation should be captured.
+	 * Always true unless sampling is enabled.
+	 *
+	 * @param size The size of the allocation in bytes.
+	 * @return If the call stack should be captured.
+	 */
+	bool sampleStack(long size) {
+		if (sample_rate <= 0)
+			return true;
+
+		WMThreadState *state = wmtrace_thread_state;
+		state->sample_bytes -= size;
+		if (state->sample_bytes > 0)
+			return false;
+
+		/* Memoryless, so a fresh interval is drawn rather than carrying the overshoot */
+		state->sample_bytes = nextSampleInterval(state);
+		return true;
+	}
+
+	/**
+	 * Find the ID of the call stack of an allocation.
+	 * Repeated call sites are found in the memo of the thread, skipping both the unwind and the stack map.
+	 * Always inlined, so the unwinder skips the same frames as when called from the traced function itself.
+	 *
+	 * @return The ID of the call stack.
+	 */
+	__attribute__((always_inline)) int captureStackID() {
+		StackUnwind *unwind = wmtrace_thread_state->unwind;
+		long key = (long) __builtin_frame_address(0);
+
+		int stackID = unwind->findStack(key);
+		if (stackID != -1)
+			return stackID;
+
+		long *call_stack;
+		int depth = unwind->captureStack(&call_stack);
+		stackID = stack_map->addStack(call_stack, depth);
+		unwind->memoStack(key, stackID);
+		return stackID;
+	}
+
 public:
 	/**
 	 * Constructor for the WMTrace object.
@@ -110,58 +382,45 @@ public:
 		return wmtrace_comm;
 	}
 
-	/**
-	 * A function to print the timer frame, every x number of allocations, if required.
-	 * Uses the WMTimer object to extract the elapsed time, to correct any drift.
-	 * Called on every event, but only output every TIMERFREQUENCY calls.
-	 */
-	void printTimer();
-
 	/**
 	 * Increment Malloc Counter
 	 */
 	void incrementMallocCounter() {
-		wmtrace_malloc_counter++;
+		wmtrace_thread_state->malloc_counter++;
 	}
 
 	/**
 	 * Increment Calloc Counter
 	 */
 	void incrementCallocCounter() {
-		wmtrace_calloc_counter++;
+		wmtrace_thread_state->calloc_counter++;
 	}
 
 	/**
 	 * Increment Realloc Counter
 	 */
 	void incrementReallocCounter() {
-		wmtrace_realloc_counter++;
+		wmtrace_thread_state->realloc_counter++;
 	}
 
 	/**
 	 * Increment Free Counter
 	 */
 	void incrementFreeCounter() {
-		wmtrace_free_counter++;
+		wmtrace_thread_state->free_counter++;
 	}
 
 	/**
-	 * Mark the tracer as having started
+	 * Mark the tracer as having started.
+	 * The calling thread is registered first, so becomes thread 0.
 	 */
-	void startTracing() {
-		time->syncStart();
-		time->todTimer(&wmtrace_fun_etime);
-		wmtrace_started = 1;
-	}
+	void startTracing();
 
 	/**
-	 * Mark the tracer as having finished
+	 * Mark the tracer as having finished.
+	 * Flush the buffers of all live threads, then finish the output stream.
 	 */
-	void finishTracing() {
-		wmtrace_finished = 1;
-		wmtrace_buffer->finishBuffer();
-		//printf("Rank %d - Mallocs %ld Callocs %ld Re-allocs %ld Frees %ld \n", wmtrace_rank, WMTrace_malloc_counter, WMTrace_calloc_counter, WMTrace_realloc_counter, WMTrace_free_counter);
-	}
+	void finishTracing();
 
 	/**
 	 * Determine if tracing is currently active
@@ -170,31 +429,41 @@ public:
 	 */
 	bool testActive() {
 		return wmtrace_started == 0 || wmtrace_finished == 1
-				|| wmtrace_active > 0;
+				|| wmtrace_thread_active > 0;
 	}
 
 	/**
-	 * Enter an active segment, increment blocking semaphore
+	 * Enter an active segment, increment the blocking semaphore of this thread.
+	 * Creates the thread state the first time a thread enters, and stamps the event.
+	 * The buffer of the thread is locked for the event, so the writer only hands it over while the thread is idle.
 	 */
 	void enterActive() {
-		wmtrace_active++; /*time->start();*/
-		time->todTimer(&wmtrace_fun_stime);
+		wmtrace_thread_active++; /*time->start();*/
+		if (wmtrace_thread_state == NULL)
+			wmtrace_thread_state = registerThread();
+		wmtrace_thread_state->buffer->lockEvents();
+		enterEvent();
+		wmtrace_thread_state->event_ticks = time->getTicks();
 	}
 
 	/**
-	 * Exit an active segment, decrement blocking semaphore
+	 * Exit an active segment, decrement the blocking semaphore of this thread.
+	 * Takes a checkpoint of the live heap first, if one is due.
 	 */
 	void exitActive() { /*time->stop(); */
-		wmtrace_active--;
-		time->todTimer(&wmtrace_fun_etime);
+		if (checkpoints && checkpointDue())
+			writeCheckpoint();
+		exitEvent();
+		wmtrace_thread_state->buffer->unlockEvents();
+		wmtrace_thread_active--;
 	}
 
 	/**
-	 * Generate a timing delta from the last function call
-	 * @return The difference between the memory function calls.
+	 * Fetch the timestamp of the current event of this thread
+	 * @return The tick count taken when the event entered the tracer.
 	 */
-	float getTimeDelta() {
-		return (float) (wmtrace_fun_stime - wmtrace_fun_etime);
+	unsigned long getTimestamp() {
+		return wmtrace_thread_state->event_ticks;
 	}
 
 
@@ -299,6 +568,192 @@ public:
 	void setPostProcessGraph(bool postProcessGraph) {
 		this->post_process_graph = postProcessGraph;
 	}
+
+	/**
+	 * Set the maximum number of frames recorded for each call stack, default to STACKDEPTH.
+	 * Must be set before tracing starts.
+	 *
+	 * @param stackDepth The maximum call stack depth.
+	 */
+	void setStackDepth(int stackDepth) {
+		if (stackDepth > 0)
+			this->stack_depth = stackDepth;
+	}
+
+	/**
+	 * Set the number of frames skipped above the stack capture, default to STACKSKIP.
+	 * Allows for extra wrapper layers between the application and the tracer.
+	 * Must be set before tracing starts.
+	 *
+	 * @param stackSkip The number of frames to skip.
+	 */
+	void setStackSkip(int stackSkip) {
+		if (stackSkip >= 0)
+			this->stack_skip = stackSkip;
+	}
+
+	/**
+	 * Set the mean number of bytes allocated between sampled call stacks, default to 0.
+	 * A rate of 0 captures the call stack of every allocation.
+	 * Every event is still recorded, so the HWM remains exact.
+	 * Must be set before tracing starts.
+	 *
+	 * @param sampleRate The mean bytes between samples.
+	 */
+	void setSampleRate(long sampleRate) {
+		if (sampleRate >= 0)
+			this->sample_rate = sampleRate;
+	}
+
+	/**
+	 * Fetch the bytes currently allocated by the application.
+	 * @return The live heap memory in bytes.
+	 */
+	long getCurrentBytes() {
+		return live_bytes;
+	}
+
+	/**
+	 * Fetch the highest the live bytes have reached.
+	 * Matches the HWM of the trace, without reading it back.
+	 * @return The HWM heap memory in bytes.
+	 */
+	long getHWMBytes() {
+		return hwm_bytes;
+	}
+
+	/**
+	 * Fetch the call stacks holding the most live memory.
+	 *
+	 * @param[in] count The maximum number of call stacks to return.
+	 * @param[out] stacks The IDs of the call stacks, largest first.
+	 * @param[out] bytes The live bytes of each call stack.
+	 * @param[out] allocations The number of live allocations of each call stack.
+	 * @return The number of call stacks returned.
+	 */
+	int getTopStacks(int count, int *stacks, long *bytes, long *allocations);
+
+	/**
+	 * Print the live memory of this rank, and optionally the call stacks holding the most of it.
+	 *
+	 * @param stacks The number of call stacks to print.
+	 */
+	void printLiveReport(int stacks);
+
+	/**
+	 * Fetch the static memory of the binary, as written to the trace.
+	 * @return The static memory in bytes.
+	 */
+	long getStaticMem() {
+		return wmtrace_writer->getStaticMem();
+	}
+
+	/**
+	 * Set the size below which allocations are aggregated, default to 0.
+	 * Small allocations and their frees are counted per call stack, and written as periodic
+	 * aggregate events rather than one event each. The HWM remains exact, with any number of threads,
+	 * as an aggregate ends whenever another thread traces an event.
+	 * A threshold of 0 traces every allocation.
+	 * Must be set before tracing starts.
+	 *
+	 * @param smallThreshold The size in bytes below which allocations are aggregated.
+	 */
+	void setSmallThreshold(long smallThreshold) {
+		if (smallThreshold >= 0)
+			this->small_threshold = smallThreshold;
+	}
+
+	/**
+	 * Set if short-lived allocations are coalesced, default to false.
+	 * An allocation freed by the next event of its thread is written as a transient event,
+	 * and repeats of the same pair only increase its count. The HWM remains exact.
+	 * Must be set before tracing starts.
+	 *
+	 * @param coalesce Coalesce short-lived allocations.
+	 */
+	void setCoalesce(bool coalesce) {
+		this->coalesce = coalesce;
+	}
+
+	/**
+	 * Set this to write the traces of every rank to a single shared file, default to false.
+	 * Avoids opening a file per rank on parallel file systems, at the cost of a collective write at the end.
+	 * Must be set before tracing starts.
+	 *
+	 * @param sharedFile If every rank should write to a single shared file.
+	 */
+	void setSharedFile(bool sharedFile) {
+		this->shared_file = sharedFile;
+	}
+
+	/**
+	 * Set this to send the trace of each rank through a single collector per node, default to false.
+	 * The ranks of a node share one compressor and write one file, and hold smaller buffers of their own.
+	 * Takes priority over a shared trace file.
+	 * Must be set before tracing starts.
+	 *
+	 * @param nodeCollector If the trace should go through a collector per node.
+	 */
+	void setNodeCollector(bool nodeCollector) {
+		this->node_collector = nodeCollector;
+	}
+
+	/**
+	 * Set the compression codec of the trace, default to zlib.
+	 * Must be set before tracing starts.
+	 *
+	 * @param codec The codec ID.
+	 */
+	void setCodec(char codec) {
+		this->codec = codec;
+	}
+
+	/**
+	 * Set the zlib level of the trace, default to CODECDEFAULTLEVEL.
+	 * CODECADAPTIVE lowers the level when compression cannot keep up with the application, and raises it when idle.
+	 * Must be set before tracing starts.
+	 *
+	 * @param codecLevel The zlib level, or CODECADAPTIVE.
+	 */
+	void setCodecLevel(int codecLevel) {
+		this->codec_level = codecLevel;
+	}
+
+	/**
+	 * Set the bytes of thread data written between checkpoints of the live heap, default to 0.
+	 * Each checkpoint holds every live allocation, so the analysis of a time or allocation ID can start
+	 * from the last checkpoint before it rather than the start of the trace.
+	 * A value of 0 only takes checkpoints by time, if set.
+	 * Must be set before tracing starts.
+	 *
+	 * @param checkpointBytes The bytes of thread data between checkpoints.
+	 */
+	void setCheckpointBytes(long checkpointBytes) {
+		if (checkpointBytes >= 0)
+			this->checkpoint_bytes = checkpointBytes;
+	}
+
+	/**
+	 * Set the seconds between checkpoints of the live heap, default to 0.
+	 * A value of 0 only takes checkpoints by thread data written, if set.
+	 * Must be set before tracing starts.
+	 *
+	 * @param checkpointSeconds The seconds between checkpoints.
+	 */
+	void setCheckpointSeconds(double checkpointSeconds) {
+		if (checkpointSeconds >= 0)
+			this->checkpoint_seconds = checkpointSeconds;
+	}
+
+	/**
+	 * Set the number of threads compressing the trace, default to COMPRESSWORKERS.
+	 * Must be set before tracing starts.
+	 *
+	 * @param compressThreads The number of compression worker threads.
+	 */
+	void setCompressThreads(int compressThreads) {
+		this->compress_threads = compressThreads;
+	}
 };
 
 #endif
@@ -0,0 +1,41 @@
+#ifndef WMTRACEAPI
+#define WMTRACEAPI
+
+/**
+ * Runtime query interface of WMTrace, for applications linked against or preloading the library.
+ *
+ * The values come from the live counters kept by the tracer, so are cheap to query at any point of the run.
+ * Every function returns 0 before tracing starts.
+ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Fetch the heap memory currently allocated by this process.
+ * @return The live heap memory in bytes.
+ */
+long wmtrace_current_bytes(void);
+
+/**
+ * Fetch the heap memory high water mark of this process so far.
+ * @return The HWM heap memory in bytes.
+ */
+long wmtrace_hwm_bytes(void);
+
+/**
+ * Fetch the call stacks holding the most live heap memory, largest first.
+ * The IDs match the call stacks of the trace file.
+ *
+ * @param[in] count The maximum number of call stacks to return.
+ * @param[out] stack_ids The IDs of the call stacks.
+ * @param[out] bytes The live bytes of each call stack.
+ * @return The number of call stacks returned.
+ */
+int wmtrace_top_stacks(int count, int *stack_ids, long *bytes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,197 @@
+#ifndef ALLOCATIONTABLE
+#define ALLOCATIONTABLE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Define the initial number of slots - must be a power of two */
+#define ALLOCATIONTABLESIZE 65536
+
+using namespace std;
+
+/**
+ * AllocationTable maps the address of each live allocation to its size, call stack and allocation ID,
+ * for the reader to match each free to its allocation.
+ *
+ * An open addressing table with linear probing, held in two flat arrays rather than a node per allocation.
+ * The addresses are kept apart from the entries, so a probe only walks the addresses, eight to a cache line,
+ * and touches a single entry once found. Removal shifts the following entries back, as for LiveAllocationTable,
+ * so the table never fills with tombstones.
+ *
+ * The slot is taken from the top bits of the hash, which depend on every bit of the address,
+ * so strided addresses spread across the table rather than sharing the few slots of their low bits.
+ *
+ * Only ever used by a single thread, so there is no locking.
+ */
+class AllocationTable {
+public:
+	/**
+	 * The live allocation held for an address.
+	 */
+	struct AllocationEntry {
+		/* Size of the allocation */
+		long size;
+		/* Allocation ID of the event which made it */
+		long id;
+		/* ID of the call stack of the allocation */
+		int stack;
+	};
+
+private:
+	/* Address held by each slot, or 0 if empty */
+	long *addresses;
+	/* Entry of each slot */
+	AllocationEntry *entries;
+
+	long capacity;
+	long used;
+	/* Shift of a hash to its home slot, 64 less the bits of the capacity */
+	int shift;
+
+	/**
+	 * Hash an address, spreading the low bits left constant by alignment.
+	 *
+	 * @param address The address.
+	 * @return The 64-bit hash.
+	 */
+	static unsigned long hashAddress(long address) {
+		return ((unsigned long) address >> 4) * 0x9E3779B97F4A7C15UL;
+	}
+
+	/**
+	 * Fetch the home slot of an address, where its probe starts.
+	 *
+	 * @param address The address.
+	 * @return The index of the slot.
+	 */
+	long getHomeSlot(long address) const {
+		return hashAddress(address) >> shift;
+	}
+
+	/**
+	 * Find the slot of an address, or the empty slot where it belongs.
+	 *
+	 * @param address The address.
+	 * @return The index of the slot.
+	 */
+	long findSlot(long address) const {
+		long mask = capacity - 1;
+		long slot = getHomeSlot(address);
+
+		/* Linear probe until the address or an empty slot is found */
+		while (addresses[slot] != 0 && addresses[slot] != address)
+			slot = (slot + 1) & mask;
+		return slot;
+	}
+
+	/**
+	 * Double the size of the table, reinserting every entry.
+	 */
+	void grow();
+
+public:
+	/**
+	 * Constructor for AllocationTable.
+	 * Sets up the empty table.
+	 */
+	AllocationTable();
+
+	/**
+	 * Deconstructor for AllocationTable.
+	 */
+	~AllocationTable();
+
+	/**
+	 * Record a new allocation, replacing any stale entry for the address.
+	 *
+	 * @param address The address of the allocation, ignored if 0.
+	 * @param size The size of the allocation.
+	 * @param stack The ID of the call stack of the allocation.
+	 * @param id The allocation ID of the event.
+	 */
+	void insert(long address, long size, int stack, long id);
+
+	/**
+	 * Find the live allocation of an address.
+	 *
+	 * @param address The address of the allocation.
+	 * @return The entry, or NULL if not found. Only valid until the table next changes.
+	 */
+	const AllocationEntry *find(long address) const {
+		if (address == 0)
+			return NULL;
+		long slot = findSlot(address);
+		return addresses[slot] == 0 ? NULL : &entries[slot];
+	}
+
+	/**
+	 * Remove an allocation, returning its entry, with a single probe.
+	 *
+	 * @param[in] address The address of the allocation.
+	 * @param[out] entry The entry of the allocation.
+	 * @return If the address was found.
+	 */
+	bool remove(long address, AllocationEntry *entry);
+
+	/**
+	 * Start loading the home slot of an address into cache, ahead of a later insert, find or remove.
+	 *
+	 * @param address The address.
+	 */
+	void prefetch(long address) const {
+		__builtin_prefetch(&addresses[getHomeSlot(address)]);
+	}
+
+	/**
+	 * Fetch the number of live allocations.
+	 * @return The number of live allocations.
+	 */
+	long getCount() const {
+		return used;
+	}
+
+	/**
+	 * Fetch the memory held by the table, which only ever grows.
+	 * @return The size of the table in bytes.
+	 */
+	long getFootprint() const {
+		return capacity * (sizeof(long) + sizeof(AllocationEntry));
+	}
+
+	/**
+	 * Fetch the number of slots, to walk every live allocation with isLive.
+	 * @return The number of slots.
+	 */
+	long getCapacity() const {
+		return capacity;
+	}
+
+	/**
+	 * Test if a slot holds a live allocation.
+	 * @param slot The index of the slot.
+	 * @return If the slot is in use.
+	 */
+	bool isLive(long slot) const {
+		return addresses[slot] != 0;
+	}
+
+	/**
+	 * Fetch the address of a slot in use.
+	 * @param slot The index of the slot.
+	 * @return The address.
+	 */
+	long getAddress(long slot) const {
+		return addresses[slot];
+	}
+
+	/**
+	 * Fetch the entry of a slot in use.
+	 * @param slot The index of the slot.
+	 * @return The entry.
+	 */
+	const AllocationEntry &getEntry(long slot) const {
+		return entries[slot];
+	}
+};
+#endif
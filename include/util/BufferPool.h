@@ -0,0 +1,69 @@
+#ifndef BUFFERPOOL
+#define BUFFERPOOL
+
+#include <pthread.h>
+#include <vector>
+
+using namespace std;
+
+/**
+ * BufferPool is a fixed set of equally sized buffers, shared between a producer and the compression worker.
+ *
+ * The owner of a TraceBuffer fills one buffer while the others are queued for compression.
+ * Once the worker has compressed a buffer it is released back to the pool.
+ * Acquiring blocks only when every buffer is still waiting on the worker.
+ */
+class BufferPool {
+private:
+	/* Buffers currently free for use */
+	vector<char *> free_buffers;
+
+	/* Total number of buffers owned by the pool */
+	int buffer_count;
+
+	/* Size of each buffer in bytes */
+	long buffer_size;
+
+	pthread_mutex_t pool_lock;
+	pthread_cond_t pool_cond;
+
+public:
+	/**
+	 * Constructor for the pool, allocating every buffer up front.
+	 *
+	 * @param count The number of buffers in the pool.
+	 * @param size The size of each buffer in bytes.
+	 */
+	BufferPool(int count, long size);
+
+	/**
+	 * Deconstructor for the pool.
+	 * Waits for all buffers to be released before freeing them.
+	 */
+	~BufferPool();
+
+	/**
+	 * Take a free buffer from the pool, waiting for one to be released if needed.
+	 *
+	 * @return The buffer.
+	 */
+	char *acquire();
+
+	/**
+	 * Return a buffer to the pool.
+	 * Safe to call from any thread.
+	 *
+	 * @param buffer The buffer, previously acquired from this pool.
+	 */
+	void release(char *buffer);
+
+	/**
+	 * Fetch the size of the buffers in the pool.
+	 * @return The buffer size in bytes.
+	 */
+	long getBufferSize() const {
+		return buffer_size;
+	}
+};
+
+#endif
@@ -14,8 +14,47 @@ using namespace Dyninst::Stackwalker;
 
 #endif
 
+/* Define the default maximum call stack depth */
+#define STACKDEPTH 1000
+/* Define the default number of tracer frames to skip above the capture function */
+#define STACKSKIP 2
+
+/* Define the number of call stacks memoised per thread, in sets of STACKMEMOWAYS - must be powers of two */
+#define STACKMEMOSIZE 128
+#define STACKMEMOWAYS 4
+/* Define the deepest call stack memoised */
+#define STACKMEMODEPTH 64
+
+/* Memoise call stacks where the slot holding the return address of each frame is known */
+#if !defined(WMTRACE_NO_STACK_MEMO) && !defined(MAKE_DYNA) \
+		&& (defined(WMTRACE_FRAME_POINTER) || (defined(__x86_64__) && !defined(HAVE_UNW_BACKTRACE)))
+#define WMTRACE_STACK_MEMO
+#endif
+
 using namespace std;
 
+/**
+ * A call stack memoised by a thread, with where each of its return addresses was found on the stack.
+ */
+struct StackMemo {
+	/* Frame address of the traced function, or 0 if the entry is empty */
+	long key;
+	/* ID of the call stack in the stack map */
+	int id;
+	int depth;
+	long frames[STACKMEMODEPTH];
+	long *slots[STACKMEMODEPTH];
+};
+
+/**
+ * StackUnwind produces the call stack of an allocation event.
+ *
+ * Each thread owns its own object, which captures into a fixed array so no memory is allocated per event.
+ * The capture method is chosen at build time:
+ * - WMTRACE_FRAME_POINTER - Walk the frame pointer chain, requires the application to keep frame pointers.
+ * - HAVE_UNW_BACKTRACE - Use the libunwind fast path unw_backtrace.
+ * - Otherwise step through the frames with unw_step.
+ */
 class StackUnwind {
 private:
 	unw_cursor_t cursor;
@@ -23,6 +62,31 @@ private:
 	unw_word_t ip, sp;
 	int unw_max_depth;
 
+	/* Number of frames above the capture function to leave out of the stack */
+	int unw_skip;
+
+	/* Fixed capture array, of unw_max_depth + unw_skip + 1 entries */
+	long *frames;
+
+	/* Where the return address of each captured frame is held on the stack, and the depth of the last capture */
+	long **slots;
+	int captured_depth;
+
+	/* Memo of recent call stacks, and the next way of a set to replace */
+	StackMemo *memo;
+	unsigned int memo_victim;
+
+	/**
+	 * Find the first memo entry of the set for a key.
+	 *
+	 * @param key The frame address of the traced function.
+	 * @return The first entry of the set.
+	 */
+	StackMemo *memoSet(long key) {
+		unsigned long hash = ((unsigned long) key >> 4) ^ ((unsigned long) key >> 12);
+		return memo + ((hash & (STACKMEMOSIZE / STACKMEMOWAYS - 1)) * STACKMEMOWAYS);
+	}
+
 #ifdef MAKE_DYNA
 	Walker *walker;
 	vector<Frame> stackwalk;
@@ -40,16 +104,52 @@ public:
 	/**
 	 * Constructor for the StackUnwind object.
 	 * Based on libunwind this object is designed to produce call stacks.
+	 *
+	 * @param max_depth The maximum number of frames to record.
+	 * @param skip The number of frames above the capture function to skip, removing the tracer from the stack.
 	 */
-	StackUnwind();
+	StackUnwind(int max_depth = STACKDEPTH, int skip = STACKSKIP);
+
+	/**
+	 * Deconstructor for the StackUnwind object.
+	 */
+	~StackUnwind();
 
 	/**
 	 * Perform full call stack tracing via libunwind
-	 * Enforced max depth of 1000
+	 * Enforced max depth of the object (default 1000)
 	 *
 	 * @Return stack<long> Stack of the IP's
 	 */
 	vector<long> fullUnwind();
+
+	/**
+	 * Capture the call stack into the fixed array of this object, without allocating memory.
+	 * The array is overwritten by the next capture.
+	 *
+	 * @param[out] stack Pointer to the first recorded frame.
+	 * @return The number of frames recorded.
+	 */
+	int captureStack(long **stack) __attribute__((noinline));
+
+	/**
+	 * Find the ID of the current call stack among those recently memoised by this thread, without unwinding.
+	 * An entry matches when the traced function has the same frame address and every return address
+	 * of the memoised stack is still in its slot, so the caller frames have not changed.
+	 *
+	 * @param key The frame address of the traced function.
+	 * @return The ID of the call stack, or -1 if not memoised.
+	 */
+	int findStack(long key);
+
+	/**
+	 * Memoise the call stack of the last capture, once its ID is known.
+	 * Stacks deeper than STACKMEMODEPTH are not memoised.
+	 *
+	 * @param key The frame address of the traced function.
+	 * @param id The ID of the call stack.
+	 */
+	void memoStack(long key, int id);
 };
 
 #endif
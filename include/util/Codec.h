@@ -0,0 +1,264 @@
+#ifndef CODEC
+#define CODEC
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "VarInt.h"
+
+/* Size of the header identifying the codec at the start of a trace */
+#define CODECHEADERSIZE 4
+/* Size of the header of each independently compressed block of a trace - raw size, encoded size and event count */
+#define BLOCKHEADERSIZE (3 * sizeof(int))
+/* Define the default zlib level */
+#define CODECDEFAULTLEVEL 2
+/* Define the level meaning the zlib level is adapted as the trace is written */
+#define CODECADAPTIVE -1
+/* Define the highest level the adaptive mode will climb to */
+#define CODECMAXADAPTIVE 6
+/* Define the size of each block of the block codecs */
+#define CODECBLOCK 262144
+/* Define the number of bits of the LZ match hash table */
+#define LZHASHBITS 14
+/* Define the shortest match the LZ codec will encode */
+#define LZMINMATCH 4
+
+using namespace std;
+
+/**
+ * Codec is the interface to the compression of the trace stream, shared by Compress and ZlibDecompress.
+ *
+ * Codecs stream in the style of zlib, consuming as much input and producing as much output as space allows.
+ * Each trace starts with a header naming its codec:
+ * 'W''M''C'<(char) Codec ID>
+ * followed by the independently compressed blocks written by Compress.
+ * Traces from before the header are a single zlib stream, which never start with a 'W'.
+ *
+ * A codec object either encodes or decodes a single stream, never both.
+ */
+class Codec {
+public:
+	/* Codec IDs, as found in the header */
+	static const char ZLIB = 'z';
+	static const char LZ = 'l';
+	static const char STORE = 's';
+
+	virtual ~Codec() {
+	}
+
+	/**
+	 * Fetch the ID of the codec.
+	 * @return The codec ID.
+	 */
+	virtual char getID() const = 0;
+
+	/**
+	 * Encode from the input to the output, as far as the space allows.
+	 *
+	 * @param[in,out] in The input position, moved past the data consumed.
+	 * @param[in,out] in_size The bytes of input left.
+	 * @param[in,out] out The output position, moved past the data produced.
+	 * @param[in,out] out_size The space left in the output.
+	 * @param[in] finish Is this the end of the stream, so everything must be flushed.
+	 * @return True once all the input is consumed, and for a finish all the output produced.
+	 */
+	virtual bool encode(const char **in, long *in_size, char **out,
+			long *out_size, bool finish) = 0;
+
+	/**
+	 * Decode from the input to the output, as far as the space allows.
+	 *
+	 * @param[in,out] in The input position, moved past the data consumed.
+	 * @param[in,out] in_size The bytes of input left.
+	 * @param[in,out] out The output position, moved past the data produced.
+	 * @param[in,out] out_size The space left in the output.
+	 * @return 1 while the stream continues, 0 at the end of the stream, -1 on a corrupt stream.
+	 */
+	virtual int decode(const char **in, long *in_size, char **out,
+			long *out_size) = 0;
+
+	/**
+	 * Make a new codec.
+	 *
+	 * @param id The codec ID, an unknown ID gives zlib.
+	 * @param level The compression level, used by zlib.
+	 * @return The new codec.
+	 */
+	static Codec *create(char id, int level = CODECDEFAULTLEVEL);
+
+	/**
+	 * Write the header naming a codec.
+	 *
+	 * @param[out] out The buffer to write to, with at least CODECHEADERSIZE of space.
+	 * @param[in] id The codec ID.
+	 * @return The size of the header.
+	 */
+	static int writeHeader(char *out, char id);
+
+	/**
+	 * Read the codec of a stream from its first bytes.
+	 *
+	 * @param[in] in The first bytes of the stream.
+	 * @param[in] size The number of bytes available.
+	 * @return The codec ID, or 0 if the stream has no header and so is zlib.
+	 */
+	static char readHeader(const char *in, long size);
+
+	/**
+	 * Find the codec ID for a name from the configuration file.
+	 *
+	 * @param name The codec name - zlib, lz or store.
+	 * @return The codec ID, or 0 if not known.
+	 */
+	static char fromName(const char *name);
+};
+
+/**
+ * The zlib codec, the default, and the format of traces from before the codec header.
+ */
+class ZlibCodec: public Codec {
+private:
+	z_stream strm;
+	/* 0 until first used, then 1 for deflate and 2 for inflate */
+	int mode;
+	int level;
+
+public:
+	ZlibCodec(int level);
+	~ZlibCodec();
+
+	char getID() const {
+		return ZLIB;
+	}
+
+	bool encode(const char **in, long *in_size, char **out, long *out_size,
+			bool finish);
+	int decode(const char **in, long *in_size, char **out, long *out_size);
+};
+
+/**
+ * The base of codecs working on whole blocks of up to CODECBLOCK bytes.
+ * Takes care of the streaming, so a codec only has to encode and decode a complete block.
+ * Each block takes the form of:
+ * <(int)Raw size><(int)Encoded size><Encoded data>
+ * The stream ends with a block of raw size 0.
+ */
+class BlockCodec: public Codec {
+private:
+	/* Raw data waiting to be encoded, or encoded data waiting to be decoded */
+	char *block_in;
+	long block_in_used;
+	/* Encoded or decoded data waiting to be copied out */
+	char *block_out;
+	long block_out_used;
+	long block_out_sent;
+
+	/* The header of the block being decoded, and the bytes of it read */
+	char header[2 * sizeof(int)];
+	int header_used;
+
+	/* Has the end of the stream been written or read */
+	bool ended;
+
+	/**
+	 * Encode the raw data held into the output block, with its header.
+	 */
+	void flushBlock();
+
+	/**
+	 * Copy as much of the output block as fits into the output.
+	 *
+	 * @return True once the output block has all been copied.
+	 */
+	bool drainBlock(char **out, long *out_size);
+
+protected:
+	/**
+	 * Encode a block.
+	 *
+	 * @param in The raw block.
+	 * @param size The size of the raw block, at most CODECBLOCK.
+	 * @param out The buffer to encode into, of at least getBound(size) bytes.
+	 * @return The encoded size.
+	 */
+	virtual long encodeBlock(const char *in, long size, char *out) = 0;
+
+	/**
+	 * Decode a block.
+	 *
+	 * @param in The encoded block.
+	 * @param size The encoded size.
+	 * @param out The buffer to decode into.
+	 * @param raw_size The raw size of the block.
+	 * @return If the block decoded to exactly raw_size bytes.
+	 */
+	virtual bool decodeBlock(const char *in, long size, char *out,
+			long raw_size) = 0;
+
+	/**
+	 * The largest encoded size of a block.
+	 *
+	 * @param size The raw size.
+	 * @return The largest encoded size.
+	 */
+	static long getBound(long size) {
+		return size + size / 64 + 64;
+	}
+
+public:
+	BlockCodec();
+	~BlockCodec();
+
+	bool encode(const char **in, long *in_size, char **out, long *out_size,
+			bool finish);
+	int decode(const char **in, long *in_size, char **out, long *out_size);
+};
+
+/**
+ * A fast LZ77 codec with a single entry hash table, for when zlib cannot keep up with the application.
+ * Each block is a run of sequences, the last without a match:
+ * <(VarInt)Literal length><Literals><(VarInt)Match length><(VarInt)Match offset>
+ */
+class LZCodec: public BlockCodec {
+private:
+	/* Position of the last sequence seen with each hash */
+	int *hash_table;
+
+protected:
+	long encodeBlock(const char *in, long size, char *out);
+	bool decodeBlock(const char *in, long size, char *out, long raw_size);
+
+public:
+	LZCodec();
+	~LZCodec();
+
+	char getID() const {
+		return LZ;
+	}
+};
+
+/**
+ * A codec which stores the trace as is, for fast local disks.
+ */
+class StoreCodec: public BlockCodec {
+protected:
+	long encodeBlock(const char *in, long size, char *out) {
+		memcpy(out, in, size);
+		return size;
+	}
+
+	bool decodeBlock(const char *in, long size, char *out, long raw_size) {
+		if (size != raw_size)
+			return false;
+		memcpy(out, in, size);
+		return true;
+	}
+
+public:
+	char getID() const {
+		return STORE;
+	}
+};
+
+#endif
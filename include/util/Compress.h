@@ -5,50 +5,226 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
-#include <fstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <deque>
+#include <map>
+#include <vector>
+#include <string>
 #include <iostream>
-#include <zlib.h>
+#include <time.h>
 
+#include "Codec.h"
 #include "FrameData.h"
+#include "BufferPool.h"
+#include "TraceContainer.h"
+#include "TraceIndex.h"
 
 /* Size definitions - move to util.h? */
-#define CHUNKIN  655360
-#define CHUNKOUT 1048576
 #define FILEOUT 1048576
+#define FILEALIGN 4096
+/* Define the raw size at which small frames are closed into a block of their own */
+#define COMPRESSBLOCK 4194304
+/* Define the default number of compression workers */
+#define COMPRESSWORKERS 1
+/* Define the bytes compressed between each review of an adaptive level */
+#define ADAPTIVEWINDOW 4194304
+/* Define the share of the time the workers may be busy before the level is lowered, or idle before it is raised */
+#define ADAPTIVEBUSY 0.8
+#define ADAPTIVEIDLE 0.2
 
 using namespace std;
 
 /**
- * Compress is a zlib compression library wrapper.
- * It initialises a data buffer and streams data to file though the compressor.
+ * A piece of data queued for compression.
+ */
+struct CompressJob {
+	/* The data to compress */
+	char *data;
+	/* The size of the data in bytes */
+	long size;
+	/* The pool to release the data to once compressed, or NULL if owned by the compressor */
+	BufferPool *pool;
+};
+
+/**
+ * A run of jobs compressed together into one independent block.
+ */
+struct CompressBlock {
+	/* Position of the block in the trace */
+	long id;
+	vector<CompressJob> jobs;
+	/* Total size of the jobs, and the state of the trace after the last buffer of the block */
+	long raw_size;
+	IndexBlock stats;
+	/* The metadata frames of the block, offset from its start */
+	vector<IndexFrame> frames;
+	/* The zlib level, taken as a worker starts on the block */
+	int level;
+	/* The encoded block, once compressed */
+	char *data;
+	long size;
+};
+
+/**
+ * Compress streams data to file through a compression codec, zlib by default.
  *
- * Data is compressed in chunks at output at the end of each phase.
+ * The trace is cut into independently compressed blocks, so several workers can compress at once,
+ * and the reader can decompress the blocks in parallel. After the codec header, the trace takes the form of:
+ * <(int)Raw size><(int)Encoded size><(int)Event count><Encoded block>
+ * <(int)Raw size><(int)Encoded size><(int)Event count><Encoded block>
+ * ...
+ * <(int)0><(int)0><(int)0>
+ * <Index>
+ *
+ * The index, described in TraceIndex, lets readers seek to any block or metadata frame.
+ * Each thread data buffer ends a block, so a buffer is never held waiting for more data and its pool
+ * cannot run dry. Small frames queued in between are carried in the block of the next buffer,
+ * or closed into a block of their own once they reach COMPRESSBLOCK bytes.
+ *
+ * Compression runs on background worker threads, so callers only pay for queueing the data.
+ * Buffers are encoded in place, with no staging copy. Blocks are written in order, by whichever
+ * worker finishes the next one, in aligned writes of FILEOUT bytes.
  * Upon finishing the class will write a 'Z' finish flag to mark the end of the stream, then flush and close.
+ *
+ * With an adaptive level the workers track how much of their time is spent compressing, lowering the
+ * zlib level when they cannot keep up with the application and raising it again when mostly idle.
+ *
+ * When writing to a shared trace file the output is spooled locally, and only copied into the
+ * shared file by the collective finish.
  */
 class Compress {
 private:
-	/* Buffers */
-	char *in;
-	char *out;
+	/* Output buffer, aligned for the file system */
 	char *file_out;
+	long file_used;
 
 	/* IO */
-	ofstream dest;
+	int dest;
+
+	/* The shared trace file, or empty if writing a file of our own */
+	string container;
 
 	/* Flags */
-	int flush_flag;
 	int finish_called;
 
-	/* ZLIB */
-	z_stream strm;
+	/* Codec of every block, and the zlib level of the next block - under out_lock, as adapted by the workers */
+	char codec_id;
+	int level;
+
+	/* Adaptive level - the bytes, busy time and start time of the current window */
+	bool adaptive;
+	long window_bytes;
+	double window_busy;
+	double window_start;
+
+	/* Worker threads and their queue of blocks */
+	vector<pthread_t> workers;
+	pthread_mutex_t queue_lock;
+	pthread_cond_t queue_cond;
+	deque<CompressBlock> queue;
+	bool queue_finished;
+
+	/* The block being filled, and the ID of the next block */
+	CompressBlock pending;
+	long next_block;
+
+	/* Compressed blocks waiting for an earlier block, and the ID of the next block to write */
+	pthread_mutex_t out_lock;
+	map<long, CompressBlock> done;
+	long next_write;
+
+	/* Index of the blocks written, the bytes written to file and the raw bytes they hold */
+	TraceIndex index;
+	long file_written;
+	long raw_written;
+
+	/* The trace state from the last buffer, carried into blocks of small frames only */
+	IndexBlock last_stats;
+
+	/* Called by the worker threads before any other work */
+	void (*worker_init)();
+
+	/**
+	 * Entry point of the worker threads.
+	 *
+	 * @param arg The Compress object.
+	 * @return NULL.
+	 */
+	static void *workerMain(void *arg);
+
+	/**
+	 * Compress blocks from the queue, until the queue is empty and finished.
+	 */
+	void processQueue();
+
+	/**
+	 * Add a job to the pending block, closing the block if it ends there.
+	 * Called with the queue lock held.
+	 *
+	 * @param job The job to add.
+	 * @param stats The event count and last tick count of a buffer, or NULL if unknown or for a metadata frame.
+	 * @param close Close the block after this job.
+	 */
+	void queueJob(CompressJob job, const IndexBlock *stats, bool close);
+
+	/**
+	 * Move the pending block to the queue and wake a worker.
+	 * Called with the queue lock held.
+	 */
+	void closeBlock();
+
+	/**
+	 * Encode the jobs of a block as a single independent stream, then release them.
+	 *
+	 * @param block The block to encode.
+	 */
+	void encodeBlock(CompressBlock *block);
+
+	/**
+	 * Write out every finished block which is next in order, adding it to the index.
+	 * Called with the output lock held.
+	 */
+	void writeBlocks();
+
+	/**
+	 * Account for the time spent encoding, and review the level at the end of each window.
+	 * Called with the output lock held.
+	 *
+	 * @param size The bytes just encoded.
+	 * @param busy The seconds spent encoding them.
+	 */
+	void adaptLevel(long size, double busy);
+
+	/**
+	 * Copy data into the output buffer, writing each full buffer to file.
+	 *
+	 * @param data The data to write.
+	 * @param size The size of the data in bytes.
+	 */
+	void appendOut(const char *data, long size);
+
+	/**
+	 * Write the used part of the output buffer to file.
+	 */
+	void writeOut();
 
 public:
 	/**
-	 * Constructor for the Compress object, backed by ZLIB.
+	 * Constructor for the Compress object.
+	 * Starts the worker threads.
 	 *
 	 * @param[in] filename The string of the filename to output data to.
+	 * @param[in] worker_init Optional function for the worker threads to call when they start.
+	 * @param[in] shared Is the filename a shared trace file, written by every rank.
+	 * @param[in] codec_id The codec ID.
+	 * @param[in] level The zlib level, or CODECADAPTIVE to adapt it as the trace is written.
+	 * @param[in] worker_count The number of worker threads.
 	 */
-	Compress(string filename);
+	Compress(string filename, void (*worker_init)() = NULL, bool shared = false,
+			char codec_id = Codec::ZLIB, int level = CODECDEFAULTLEVEL,
+			int worker_count = COMPRESSWORKERS);
 
 	/**
 	 * Deconstructor for the compress class.
@@ -56,8 +232,8 @@ public:
 	~Compress();
 
 	/**
-	 * The function to actually compress the data.
-	 * Uses a ZLIB compression object.
+	 * Queue a copy of the data for compression.
+	 * Intended for small frames, as the data is copied.
 	 *
 	 * @param[in] data The data to compress.
 	 * @param[in] size The size of the data buffer in bytes.
@@ -67,8 +243,24 @@ public:
 	 */
 	int addData(char * data, int size);
 
+	/**
+	 * Queue a buffer for compression without copying it, ending the current block.
+	 * The buffer is released back to its pool once it has been compressed.
+	 *
+	 * @param[in] data The buffer to compress.
+	 * @param[in] size The number of bytes of the buffer in use.
+	 * @param[in] pool The pool the buffer was acquired from.
+	 * @param[in] stats The event count and last tick count of the buffer, for the index, or NULL.
+	 *
+	 * @return Success of the function.
+	 */
+	int addBuffer(char * data, long size, BufferPool *pool,
+			const IndexBlock *stats = NULL);
+
 	/**
 	 * Finish the compression stream.
+	 * Waits for the workers to compress all queued data, then writes the index.
+	 * For a shared trace file this is collective, as every rank writes its segment together.
 	 *
 	 * @return The success flag of the final write.
 	 */
@@ -7,9 +7,21 @@
 #include "free_obj.h"
 #include "ConsumptionGraph.h"
 #include "FunctionSiteAllocation.h"
+#include "PeakScan.h"
+#include "FrameData.h"
+#include "event_batch.h"
+#include "AllocationTable.h"
+#include "QueryPoint.h"
 
 #include <map>
 #include <set>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <float.h>
+
+/* Define how many events ahead a batch prefetches the slot of the address */
+#define BATCHPREFETCH 8
 
 using namespace std;
 
@@ -21,6 +33,11 @@ using namespace std;
  *
  * HWM is determined upon a free even, to see if we are coming from a HWM point.
  * This means we must always check at the finish to see if the HWM occurred.
+ *
+ * For a functional breakdown it can also keep running totals of the live memory of each call stack.
+ * Each time the HWM rises the totals at the HWM are brought up to date, copying only the call stacks
+ * changed since the last time, so the breakdown at the HWM is known by the end of a single pass.
+ * The same totals give the breakdown at any number of requested times, captured as each is passed.
  */
 class ConsumptionHWMTracker {
 private:
@@ -44,17 +61,123 @@ private:
 	/** Should we store the data for samples rather than a graph */
 	bool samples;
 
+	/** Mean bytes between sampled call stacks, 0 if every call stack was captured */
+	long sample_rate;
+
 	/** Data structure to maintain a consumption graph */
 	ConsumptionGraph *consumption;
 
-	map<long, MallocObj> allocation_map;
-	map<long, MallocObj>::iterator allocation_map_it;
+	/** The live allocations, by address */
+	AllocationTable allocations;
+
+	/**
+	 * The running totals of the live allocations of one call stack.
+	 * The weighted totals are kept as FunctionSiteAllocation would sum them, allocation by allocation.
+	 */
+	struct StackTotals {
+		long memory;
+		long count;
+		double estimate;
+		double estimate_count;
+		double variance;
+		/* Aggregated small allocations, only weighted by their mean size once the breakdown is taken */
+		long aggregate_memory;
+		long aggregate_count;
+	};
+
+	/**
+	 * The change to the small allocations of one call stack, waiting for its aggregate event.
+	 */
+	struct PendingStack {
+		int stack;
+		long bytes;
+		long count;
+	};
+
+	/** Should we keep the totals of each call stack */
+	bool track_stacks;
+	/** The totals of each call stack now, and at the HWM, indexed by stack ID + 1 so unsampled (-1) comes first */
+	vector<StackTotals> stack_totals;
+	vector<StackTotals> hwm_totals;
+	/** The call stacks changed since the totals at the HWM were last brought up to date */
+	vector<int> changed_stacks;
+	vector<char> stack_changed;
+	/** The call stacks of the next aggregate, applied once the HWM before it has been checked */
+	vector<PendingStack> pending_stacks;
+
+	/** The times to capture the state at, in order, and the next to be passed */
+	vector<double> query_times;
+	unsigned int next_query;
+	double next_query_time;
+	/** The number of largest live allocations to keep at each */
+	int query_top;
+	/** The state captured at each time passed so far */
+	vector<QueryPoint *> query_points;
 
 	/**
 	 * A function to check if we are at a HWM point, if so update the HWM variables.
 	 */
 	void checkHWM();
 
+	/**
+	 * Fetch the totals of a call stack to change, marking it as changed since the HWM.
+	 *
+	 * @param stack The ID of the call stack.
+	 * @return The totals of the call stack.
+	 */
+	StackTotals &changeStackTotals(int stack);
+
+	/**
+	 * Add or remove an allocation from the totals of its call stack.
+	 * When sampling, unsampled allocations are left out, as for the breakdown.
+	 *
+	 * @param stack The ID of the call stack.
+	 * @param size The size of the allocation.
+	 * @param sign 1 to add the allocation, -1 to remove it.
+	 */
+	void addStackAllocation(int stack, long size, int sign);
+
+	/**
+	 * Bring the totals at the HWM up to date, copying the call stacks changed since the last time.
+	 */
+	void syncHWMTotals();
+
+	/**
+	 * Capture the state for every query time passed by the last event.
+	 * A single comparison when none are passed, as it is checked after each event.
+	 */
+	void checkQueries() {
+		while (curr_time > next_query_time)
+			captureQuery();
+	}
+
+	/**
+	 * Capture the state for the next query time.
+	 * The breakdown comes from the totals of each call stack, while the largest allocations take a walk of the table.
+	 */
+	void captureQuery();
+
+	/**
+	 * Build a breakdown from the totals of each call stack.
+	 *
+	 * @param totals_by_stack The totals, indexed by stack ID + 1.
+	 * @return A set of the allocations grouped by call stack ID.
+	 */
+	set<FunctionSiteAllocation *, FunctionSiteAllocation::comparator> getTotalsBreakdown(
+			const vector<StackTotals> &totals_by_stack);
+
+	/**
+	 * Add the aggregated small allocations of a call stack to a breakdown, treated as allocations of the mean size.
+	 *
+	 * @param[in,out] functions The breakdown.
+	 * @param stack The ID of the call stack.
+	 * @param memory The live bytes of the aggregated allocations.
+	 * @param count The number of aggregated allocations.
+	 */
+	void addAggregateBreakdown(
+			set<FunctionSiteAllocation *, FunctionSiteAllocation::comparator> &functions,
+			int stack, long memory, long count);
+
 public:
 	/**
 	 * Constructor for the ConsumptionHWMTracker object.
@@ -88,9 +211,8 @@ public:
 	 * Add a free object to the map.
 	 * - Update the memory HWM - as cheaper to do on a free than a malloc.
 	 * - Increment the current time object.
-	 * - Check to see if a matching allocation object exists.
+	 * - Remove the matching allocation, if it exists, with a single probe of the table.
 	 * - Decrease current memory count.
-	 * - Remove the allocation object from the map.
 	 *
 	 * @param free The free object.
 	 * @return The current allocation ID.
@@ -98,13 +220,152 @@ public:
 	long addFree(FreeObj& malloc);
 
 	/**
-	 * Return a reference to the allocation object referred to by the pointer.
-	 * Function returns NULL if allocation object not found.
+	 * Add a realloc as if it was a Free and a Malloc.
+	 * - Remove the original allocation.
+	 * - If not found treat the realloc as a malloc, with -1 as stack ID.
+	 * - Otherwise count the free of the original allocation, then add the new one with its stack ID.
+	 *
+	 * Must be this way around to ensure only a single entry for a key in the map, should the realloc return the same address.
+	 *
+	 * @param old_pointer The existing address of the allocation.
+	 * @param new_pointer The address returned by the realloc.
+	 * @param size The size of the new allocation.
+	 * @param time The time delta since the last event.
+	 * @return The current allocation ID, of the last of the events if matched.
+	 */
+	long addRealloc(long old_pointer, long new_pointer, long size, float time);
+
+	/**
+	 * Add a batch of events, decoded from a Data frame, in order.
+	 * The slot of each address is prefetched BATCHPREFETCH events ahead, hiding the cache miss of the probe.
+	 * A timer event sets the current time rather than adding to it.
+	 * Stops after the event with the search ID, or the first event past the search time.
+	 *
+	 * @param batch The events to add.
+	 * @param stop_id The allocation ID to stop at, or -1.
+	 * @param stop_time The time to stop after (s), or not if 0 or less.
+	 * @return The allocation ID of the last event added, or -1 if it added none.
+	 */
+	long addBatch(const EventBatch& batch, long stop_id, double stop_time);
+
+	/**
+	 * Add an aggregate of small allocations and frees.
+	 * - Update the memory HWM at the peak of the aggregate, so the HWM stays exact.
+	 * - Increment the current time object.
+	 * - Change current memory count by the net bytes.
+	 *
+	 * @param peak The highest the net bytes reached within the aggregate.
+	 * @param bytes The net change in bytes.
+	 * @param time The time delta of the aggregate.
+	 * @return The current allocation ID.
+	 */
+	long addAggregate(long peak, long bytes, float time);
+
+	/**
+	 * Add a transient event, a run of allocations each freed straight after.
+	 * - Update the memory HWM at the peak of the allocation, so the HWM stays exact.
+	 * - Increment the current time object to the start of the run, then by its span to the last free.
+	 * The current memory is unchanged.
+	 *
+	 * @param size The size of each allocation.
+	 * @param stack The ID of the call stack of the allocations.
+	 * @param time The time delta of the event.
+	 * @param span The time from the first allocation of the run to its last free (s).
+	 * @return The current allocation ID.
+	 */
+	long addTransient(long size, int stack, float time, double span);
+
+	/**
+	 * Add a column of events by their change in live bytes alone, without matching frees to allocations.
+	 * Used when every free carries its size, as nothing is then kept for the functional breakdown.
+	 * - Update the memory HWM from the prefix sum of the column (PeakScan), taking the time of the event reaching it.
+	 * - Increment the current time object to the end of the last event.
+	 * - Change current memory count by the sum of the column.
+	 *
+	 * @param deltas The change in live bytes of each event.
+	 * @param peaks The peak of each event, relative to the live bytes before it.
+	 * @param times The elapsed time of each event (s), that of its peak.
+	 * @param ends The elapsed time each event ends (s), only later than its time for a transient run.
+	 * @param count The number of events.
+	 * @return The current allocation ID.
+	 */
+	long addColumn(const long *deltas, const long *peaks, const double *times,
+			const double *ends, long count);
+
+	/**
+	 * Add the change in small allocations of one call stack, from an aggregate.
+	 * Kept for the functional breakdown, the memory is counted by addAggregate.
+	 * Held until the aggregate event itself, so the HWM before it is checked first.
+	 *
+	 * @param stack The ID of the call stack.
+	 * @param bytes The net change in bytes.
+	 * @param count The net change in allocations.
+	 */
+	void addAggregateStack(int stack, long bytes, long count) {
+		if (!track_stacks)
+			return;
+		PendingStack pending = { stack, bytes, count };
+		pending_stacks.push_back(pending);
+	}
+
+	/**
+	 * Add a live allocation from a checkpoint, without counting it as an event.
+	 * Its allocation ID is not known, so is taken as 0.
+	 *
+	 * @param malloc The allocation object to add.
+	 */
+	void addCheckpointAllocation(MallocObj& malloc) {
+		curr_memory += malloc.getSize();
+		allocations.insert(malloc.getPointer(), malloc.getSize(),
+				malloc.getStackID(), 0);
+		if (track_stacks)
+			addStackAllocation(malloc.getStackID(), malloc.getSize(), 1);
+	}
+
+	/**
+	 * Add the live small allocations of one call stack from a checkpoint.
+	 *
+	 * @param stack The ID of the call stack.
+	 * @param bytes The live bytes.
+	 * @param count The number of live allocations.
+	 */
+	void addCheckpointAggregate(int stack, long bytes, long count) {
+		curr_memory += bytes;
+		if (track_stacks) {
+			StackTotals &totals = changeStackTotals(stack);
+			totals.aggregate_memory += bytes;
+			totals.aggregate_count += count;
+		}
+	}
+
+	/**
+	 * Start tracking from a checkpoint, once its allocations have been added.
+	 * The HWM is only known from the checkpoint onwards.
+	 *
+	 * @param id The allocation ID at the checkpoint.
+	 * @param time The time of the checkpoint (s).
+	 */
+	void startFromCheckpoint(long id, double time);
+
+	/**
+	 * Return the live allocation at an address.
+	 * Function returns NULL if the allocation is not found.
 	 *
 	 * @param pointer The memory address of the allocated object.
-	 * @return A pointer to the allocation object.
+	 * @return The entry of the allocation, only valid until the next event.
 	 */
-	MallocObj *getAllocation(long pointer);
+	const AllocationTable::AllocationEntry *getAllocation(long pointer) const {
+		return allocations.find(pointer);
+	}
+
+	/**
+	 * Return the memory held by the table of live allocations.
+	 *
+	 * @return The size of the table in bytes.
+	 */
+	long getAllocationFootprint() const {
+		return allocations.getFootprint();
+	}
 
 	/**
 	 * Return the memory HWM of the trace (so far) in bytes.
@@ -134,6 +395,15 @@ public:
 		return hwmID;
 	}
 
+	/**
+	 * Return the allocation ID of the last event added.
+	 *
+	 * @return The current allocation ID.
+	 */
+	long getCurrentID() {
+		return currID;
+	}
+
 	/**
  	*  Return the current time in the simulation
  	*
@@ -161,11 +431,50 @@ public:
 	/**
 	 * A function the return the amount of memory allocated by different function call stacks.
 	 * We take the allocations currently live and group them by function site recording memory and qualtity.
+	 * If call stacks were sampled, only sampled allocations are grouped, each weighted by the inverse of
+	 * its sampling probability 1 - exp(-size / rate).
 	 *
 	 * @return A set of the allocations grouped by call stack ID.
 	 */
 	set<FunctionSiteAllocation *, FunctionSiteAllocation::comparator> getFunctionBreakdown();
 
+	/**
+	 * A function to return the amount of memory allocated by different function call stacks at the HWM.
+	 * Taken from the totals of each call stack at the HWM, so needs no second pass of the trace,
+	 * though the individual allocation sizes are not known.
+	 * The call stack totals must have been kept from the start (setTrackStacks).
+	 *
+	 * @return A set of the allocations grouped by call stack ID.
+	 */
+	set<FunctionSiteAllocation *, FunctionSiteAllocation::comparator> getHWMFunctionBreakdown();
+
+	/**
+	 * Setter for keeping the totals of each call stack, for a breakdown.
+	 * Must be set before any event is added.
+	 * @param track If the totals should be kept.
+	 */
+	void setTrackStacks(bool track) {
+		track_stacks = track;
+	}
+
+	/**
+	 * Setter for the times to capture the state at, as the events pass each one.
+	 * Needs the totals of each call stack to be kept (setTrackStacks).
+	 * Must be set before any event is added.
+	 *
+	 * @param times The times (s).
+	 * @param top The number of largest live allocations to keep at each.
+	 */
+	void setQueryTimes(const vector<double> &times, int top);
+
+	/**
+	 * Fetch the state captured at each query time, once the trace is finished.
+	 * @return The captured states, in order of time, owned by the tracker.
+	 */
+	const vector<QueryPoint *> &getQueryPoints() const {
+		return query_points;
+	}
+
 	/**
 	 * A function to fetch the finish time of this trace.
 	 *
@@ -221,8 +530,18 @@ public:
 		consumption->setRank(rank);
 	}
 
+	/**
+	 * Setter for the call stack sample rate of the trace.
+	 * Used to weight the sampled allocations in the function breakdown.
+	 * @param sampleRate The mean bytes between samples, or 0 if not sampled.
+	 */
+	void setSampleRate(long sampleRate) {
+		sample_rate = sampleRate;
+	}
+
 	/**
 	 * A function to reset the current time, to the elapsed time as contained within a timer frame of the output.
+	 * Query times passed are left to the next event, so its state is the one captured.
 	 */
 	void updateElapsedTime(double elapsed_time){
 		curr_time = elapsed_time;
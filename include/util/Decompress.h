@@ -2,24 +2,63 @@
 #define DECOMPRESS
 
 #include "Util.h"
+#include "Codec.h"
+#include "FrameData.h"
+#include "TraceContainer.h"
+#include "TraceIndex.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <fstream>
-#include <zlib.h>
 #include <iostream>
+#include <vector>
+#include <unistd.h>
+#include <pthread.h>
+
+/* Define the most blocks decompressed in parallel by each reader */
+#define DECOMPRESSTHREADS 8
 
 using namespace std;
 
 /**
- * The ZLibDecompress class is a wrapper for a zlib decompression object.
+ * An independently compressed block of a trace, read from file and waiting to be decoded.
+ */
+struct DecodeBlock {
+	/* The codec of the trace */
+	char codec_id;
+	/* The encoded block */
+	char *data;
+	long size;
+	/* Where to decode it to, and its raw size */
+	char *out;
+	long raw_size;
+	/* The number of trace events in the block, from its header */
+	int events;
+	/* Did the block decode to exactly its raw size */
+	bool ok;
+};
+
+/**
+ * The ZLibDecompress class is a wrapper for the decompression codec of a trace.
+ * The codec is chosen by the header at the start of the trace, with zlib for traces without one.
+ *
+ * The blocks of a trace are compressed independently, so each refill of the buffer reads the next few
+ * blocks and decodes them in parallel, one thread per block, straight into their place in the buffer.
+ * Traces without a header are a single zlib stream, and are decoded serially.
  *
  * It handles the decompression window to ensure that a buffer can always be accessed.
  *
- * Data from this internal buffer can be requested, and copied out of.
+ * Data from this internal buffer can be requested, and copied out of, or taken in place as a span.
  * When the buffer is near empty it automatically refills itself.
+ *
+ * If the trace was written to a shared trace file, only its segment of that file is read.
+ * If it was written through a node collector, the node trace is read through a second
+ * decompressor, keeping only the records of our rank.
+ *
+ * If the trace ends with an index, it is loaded up front, so the reader can seek to any
+ * offset of the raw stream by decoding only the block holding it.
  */
 class ZlibDecompress {
 private:
@@ -27,15 +66,48 @@ private:
 	/* File */
 	ifstream source;
 
+	/* Start of the trace within the file, and the bytes of it left to read (-1 for the whole file) */
+	long segment_start;
+	long segment_size;
+	long segment_remaining;
+
+	/* The node trace holding our rank, and the rank to extract from it - NULL and -1 if not a node trace */
+	ZlibDecompress *node_stream;
+	int node_rank;
+
 	/* Variables */
 	int ret_d;
-	unsigned have_d;
-	z_stream strm_d;
+
+	/* Codec ID, 0 until the header has been read, and whether we have reached the end of the stream */
+	char codec_id;
+	bool stream_ended;
+
+	/* Codec of a trace without a header, decoded as a single stream - NULL for a trace of blocks */
+	Codec *codec;
+
+	/* Index of the blocks and metadata frames - NULL if the trace has none */
+	TraceIndex *index;
+
+	/* Raw stream offset of the start of the buffer, and of the data after it */
+	long raw_offset_d;
+	long next_raw_offset_d;
+
+	/* The most blocks to decode at once, and a block read but left for the next refill */
+	int decode_threads;
+	DecodeBlock held_block;
 
 	/* Buffers */
 	char *in_d;
-	char *out_d;
 	char *stream_buffer_d;
+	long stream_capacity_d;
+
+	/* Gathers a span running past the end of the buffer, so it can be handed out whole */
+	char *span_buffer_d;
+	size_t span_capacity_d;
+
+	/* Input read from file but not yet decoded */
+	const char *in_pos_d;
+	long in_remaining_d;
 
 	/* Buffer pointers */
 	size_t buffer_remaining_d;
@@ -50,9 +122,59 @@ private:
 	 */
 	int inflateData(void);
 
+	/**
+	 * Internal function to decode the next blocks in parallel into the buffer.
+	 * @return Success of the data request
+	 */
+	int inflateBlocks(void);
+
+	/**
+	 * Internal function to decode a trace without a header, as a single zlib stream.
+	 * @return Success of the data request
+	 */
+	int inflateStream(void);
+
+	/**
+	 * Internal function to read the header and encoded data of the next block.
+	 * @param[out] block The block read.
+	 * @return False at the end of the trace.
+	 */
+	bool readBlock(DecodeBlock *block);
+
+	/**
+	 * Internal function to read bytes from the input, then from file.
+	 * @param[out] out Where to copy the bytes to.
+	 * @param[in] size The number of bytes wanted.
+	 * @return The number of bytes read, less than size only at the end of the trace.
+	 */
+	long readBytes(char *out, long size);
+
+	/**
+	 * Decode a block with a codec of its own.
+	 * @param arg The DecodeBlock.
+	 * @return NULL.
+	 */
+	static void *decodeMain(void *arg);
+
+	/**
+	 * Internal function to read the next chunk of the file, never past the end of our segment.
+	 * @return The number of bytes read
+	 */
+	long readInput(void);
+
+	/**
+	 * Internal function to request more data from the node trace.
+	 * Skips over the records of other ranks, until a record of our rank fills the buffer.
+	 * @return Success of the data request
+	 */
+	int demultiplexData(void);
+
 public:
 	/**
 	 * Constructor for the zlib decompression engine.
+	 * A per-rank trace name is looked up in the shared trace file of its folder first.
+	 *
+	 * @param filename The name of the trace file.
 	 */
 	ZlibDecompress(string filename);
 
@@ -69,6 +191,15 @@ public:
 	 */
 	int request(void * out, size_t length);
 
+	/**
+	 * Function to take the next length bytes in place, rather than copy them out.
+	 * Only a span running past the end of the buffer is copied, into a side buffer, so it is always contiguous.
+	 * The span is only valid until the next call to the decompressor.
+	 * @param[in] length The number of bytes wanted
+	 * @return The start of the span, or NULL at the end of the trace
+	 */
+	const char *span(size_t length);
+
 	/**
 	 * Function to skip through data without storing the result to a data buffer
 	 * @param[in] length The number of bytes to skip through
@@ -83,7 +214,31 @@ public:
 	int resetFiles();
 
 	/**
-	 * Quick check to see if we are at the end of the file.
+	 * Fetch the index of the trace.
+	 * @return The index, or NULL if the trace has none.
+	 */
+	const TraceIndex *getIndex() {
+		return index;
+	}
+
+	/**
+	 * Fetch the offset of the next byte to be read, within the raw trace stream.
+	 * @return The raw offset.
+	 */
+	long tell() {
+		return raw_offset_d + (curr_buffer_pos_d - stream_buffer_d);
+	}
+
+	/**
+	 * Seek to an offset of the raw trace stream, decoding only the block holding it.
+	 * Needs the index of the trace.
+	 * @param[in] offset The raw offset, which should be the start of a frame.
+	 * @return The success of the seek
+	 */
+	int seekRaw(long offset);
+
+	/**
+	 * Check to see if we are at the end of the file, decoding the next data if the buffer is empty.
 	 * @return If we are at the end of the trace file.
 	 */
 	bool eof();
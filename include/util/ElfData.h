@@ -20,7 +20,9 @@
 #include <string>
 #include <utility>
 #include <deque>
+#include <vector>
 #include <sstream>
+#include <link.h>
 
 /* Used to extract the path to binary */
 extern const char *__progname_full;
@@ -28,9 +30,12 @@ extern const char *__progname_full;
 using namespace std;
 
 /**
- * The ElfData object is used to read the elf headers from the currently executing binary.
+ * The ElfData object is used to read the elf headers from a binary, by default the currently executing one.
  *
  * The object reads for two specific bits of information, the static memory allocations and library function addresses.
+ *
+ * The tracer itself only needs getProcessImage, which reads the loaded program headers from memory
+ * rather than the file. The symbol table is read from the binary at analysis time.
  */
 class ElfData {
 
@@ -44,13 +49,85 @@ private:
 	GElf_Phdr phdr;
 	GElf_Shdr shdr;
 
+	/**
+	 * Open a binary, leaving the object invalid if it cannot be read.
+	 *
+	 * @param path The path of the binary.
+	 */
+	void openBinary(const char *path);
+
+	/**
+	 * Find a GNU build-id note within a block of notes.
+	 *
+	 * @param notes The start of the notes.
+	 * @param size The size of the notes in bytes.
+	 * @return The build-id as a hex string, or empty if not found.
+	 */
+	static string findBuildID(const char *notes, long size);
+
+	/**
+	 * Called for each loaded object by dl_iterate_phdr, stopping after the executable itself.
+	 */
+	static int readProgramHeaders(struct dl_phdr_info *info, size_t size,
+			void *data);
+
 public:
 	/**
 	 * Constructor for the ElfData object.
-	 * Initialises the read.
+	 * Initialises the read of the current binary.
 	 */
 	ElfData();
 
+	/**
+	 * Constructor for the ElfData object.
+	 * Initialises the read of the given binary.
+	 *
+	 * @param path The path of the binary.
+	 */
+	ElfData(string path);
+
+	/**
+	 * Deconstructor for the ElfData object.
+	 * Closes the binary.
+	 */
+	~ElfData();
+
+	/**
+	 * Was the binary opened successfully.
+	 *
+	 * @return If the binary can be read.
+	 */
+	bool isValid() const {
+		return e != NULL;
+	}
+
+	/**
+	 * Read the path, build-id and load bias of the running executable, and the size of its static memory.
+	 * Read from the loaded program headers, so does not open the binary.
+	 *
+	 * @param[out] path The absolute path of the executable.
+	 * @param[out] build_id The GNU build-id as a hex string, or empty if the binary has none.
+	 * @param[out] load_bias The difference between the loaded and linked addresses, 0 unless position independent.
+	 * @return The size of the static memory.
+	 */
+	static long getProcessImage(string *path, string *build_id,
+			long *load_bias);
+
+	/**
+	 * Read the GNU build-id of the binary from its note sections.
+	 *
+	 * @return The build-id as a hex string, or empty if the binary has none.
+	 */
+	string getBuildID();
+
+	/**
+	 * A function to extract the functions of the binary from the Elf symbol table, ordered by address.
+	 *
+	 * @param[out] symbols The start address and name of each function.
+	 * @return The number of functions, 0 if the binary has been stripped.
+	 */
+	int getSymbols(vector<pair<long, string> > &symbols);
+
 	/**
 	 * A function to extract the static memory size out of the current binary through the Elf headers.
 	 *
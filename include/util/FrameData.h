@@ -1,15 +1,29 @@
 #ifndef FRAMEDATA
 #define FRAMEDATA
 
+#include "VarInt.h"
+#include "FrameRecords.h"
+
+#include <stddef.h>
+
 using namespace std;
 
 /**
  * The FrameData class is designed to store specific information about the size and content of output frames.
  *
  * This is the one location where the size is defined, enabling it to be easily changed.
+ * The sizes of frames with a packed record (FrameRecords.h) are taken from the record itself.
  * For frames with variable data sizes we store a 'forward' size containing the size of the fixed portion of the data size.
  *
  * The object also contains a static definition of the flags used to represent each frame of the output.
+ *
+ * The events of a Thread data frame are encoded according to the trace version:
+ * - 1 - Fixed width fields, as for the Data frame, each preceded by an (int) sequence delta.
+ * - 2 - Variable length integers (VarInt) holding deltas against the previous event of the frame.
+ * - 3 - As version 2, with timestamps as tick deltas following the sequence delta.
+ * - 4 - As version 3, with Free and Realloc events carrying the size of the freed allocation.
+ * - 5 - As version 4, with the watermark of a Thread data frame bounding the events of every thread, not only its own.
+ * Traces without a Version frame are version 1.
  */
 class FrameData {
 
@@ -21,13 +35,34 @@ private:
 	int realloc_frame_size;
 	int free_frame_size;
 	int timer_frame_size;
+	int sequence_frame_size;
+	int thread_frame_size;
+	int sample_frame_size;
+	int version_frame_size;
+	int calibration_frame_size;
+
+	/* Largest possible size of a version 2 compact event */
+	int compact_event_size;
+
+	/* Largest possible size of an aggregate event, and of each call stack entry within it */
+	int aggregate_event_size;
+	int aggregate_entry_size;
+
+	/* Largest possible size of a transient event */
+	int transient_event_size;
+
+	/* Size of the sequence delta carried by events in a thread data frame */
+	int sequence_delta_size;
 
 	/* Partial frame sizes */
 	int data_forward;
 	int elf_forward;
+	int binary_forward;
 	int virtual_forward;
 	int stacks_forward;
 	int cores_forward;
+	int thread_data_forward;
+	int checkpoint_forward;
 
 public:
 	/* Static definitions of frame flags */
@@ -36,13 +71,35 @@ public:
 	static const char REALLOCFLAG = 'R';
 	static const char FREEFLAG = 'F';
 	static const char TIMERFLAG = 'T';
+	static const char SEQUENCEFLAG = 'Q';
+	static const char AGGREGATEFLAG = 'A';
+	static const char TRANSIENTFLAG = 'J';
+	/* Never written, marks the call stack entries of an aggregate once decoded */
+	static const char AGGREGATESTACKFLAG = 'G';
 
 	static const char STACKFLAG = 'S';
 	static const char ELFFLAG = 'E';
+	static const char BINARYFLAG = 'B';
 	static const char VIRTUALFLAG = 'V';
 	static const char DATAFLAG = 'D';
 	static const char FINISHFLAG = 'Z';
 	static const char CORESFLAG = 'C';
+	static const char THREADDATAFLAG = 'P';
+	static const char THREADFLAG = 'H';
+	static const char SAMPLEFLAG = 'W';
+	static const char VERSIONFLAG = 'Y';
+	static const char CALIBRATIONFLAG = 'K';
+	static const char CHECKPOINTFLAG = 'L';
+	static const char UNTRACKEDFLAG = 'U';
+	/* Only found in node traces, wrapping part of the trace of one rank */
+	static const char NODEDATAFLAG = 'N';
+
+	/* The trace version written by this build */
+	static const int TRACEVERSION = 5;
+
+	/* Static definitions of the thread frame states */
+	static const char THREADSTART = 'S';
+	static const char THREADEXIT = 'X';
 
 	/**
 	 * Constructor for frame data.
@@ -90,6 +147,83 @@ public:
 		return timer_frame_size;
 	}
 
+	/**
+	 * Getter for Sequence frame size
+	 * @return Sequence frame size
+	 */
+	int getSequenceFrameSize() const {
+		return sequence_frame_size;
+	}
+
+	/**
+	 * Getter for Thread frame size
+	 * @return Thread frame size
+	 */
+	int getThreadFrameSize() const {
+		return thread_frame_size;
+	}
+
+	/**
+	 * Getter for Sample frame size
+	 * @return Sample frame size
+	 */
+	int getSampleFrameSize() const {
+		return sample_frame_size;
+	}
+
+	/**
+	 * Getter for Version frame size
+	 * @return Version frame size
+	 */
+	int getVersionFrameSize() const {
+		return version_frame_size;
+	}
+
+	/**
+	 * Getter for Calibration frame size
+	 * @return Calibration frame size
+	 */
+	int getCalibrationFrameSize() const {
+		return calibration_frame_size;
+	}
+
+	/**
+	 * Getter for the largest possible size of a version 2 compact event.
+	 * Used to reserve space before encoding.
+	 * @return Compact event size
+	 */
+	int getCompactEventSize() const {
+		return compact_event_size;
+	}
+
+	/**
+	 * Getter for the largest possible size of an aggregate event.
+	 * Used to reserve space before encoding.
+	 * @param entries The number of call stack entries in the event.
+	 * @return Aggregate event size
+	 */
+	int getAggregateEventSize(int entries) const {
+		return aggregate_event_size + entries * aggregate_entry_size;
+	}
+
+	/**
+	 * Getter for the largest possible size of a transient event.
+	 * Used to reserve space before encoding.
+	 * @return Transient event size
+	 */
+	int getTransientEventSize() const {
+		return transient_event_size;
+	}
+
+	/**
+	 * Getter for the size of the sequence delta which follows the flag of each
+	 * Malloc / Calloc / Realloc / Free event within a thread data frame.
+	 * @return Sequence delta size
+	 */
+	int getSequenceDeltaSize() const {
+		return sequence_delta_size;
+	}
+
 	/**
 	 * Getter for the partial size of the Data frame.
 	 * Before the remaining data is added.
@@ -108,6 +242,15 @@ public:
 		return elf_forward;
 	}
 
+	/**
+	 * Getter for the partial size of the Binary frame.
+	 * Before the build-id and path are added.
+	 * @return The initial size of the binary frame.
+	 */
+	int getBinaryForward() const {
+		return binary_forward;
+	}
+
 	/**
 	 * Getter for the partial size of the Virtual functions frame.
 	 * Before the remaining data is added.
@@ -134,6 +277,45 @@ public:
 	int getCoresForward() const {
 		return cores_forward;
 	}
+
+	/**
+	 * Getter for the partial size of the Thread data frame.
+	 *
+	 * @return The initial size of the Thread data frame.
+	 */
+	int getThreadDataForward() const {
+		return thread_data_forward;
+	}
+
+	/**
+	 * Getter for the partial size of the Checkpoint frame.
+	 * Before the live allocations and call stack totals are added.
+	 *
+	 * @return The initial size of the Checkpoint frame.
+	 */
+	int getCheckpointForward() const {
+		return checkpoint_forward;
+	}
+
+	/**
+	 * Getter for the offset of the watermark sequence within a Thread data frame.
+	 * The watermark is only known once the frame is written, so is patched in last.
+	 *
+	 * @return The offset (B) of the watermark from the start of the frame.
+	 */
+	int getThreadDataWatermarkOffset() const {
+		return offsetof(SizedFrameRecord<ThreadDataRecord>, record)
+				+ offsetof(ThreadDataRecord, watermark);
+	}
+
+	/**
+	 * Getter for the offset of the frame size within any variable frame.
+	 *
+	 * @return The offset (B) of the frame size from the start of the frame.
+	 */
+	int getFrameSizeOffset() const {
+		return offsetof(SizedFrameRecord<ThreadDataRecord>, size);
+	}
 };
 
 #endif
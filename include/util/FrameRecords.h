@@ -0,0 +1,175 @@
+#ifndef FRAMERECORDS
+#define FRAMERECORDS
+
+#include <string.h>
+
+/**
+ * Packed record layouts of the fixed portion of each trace frame, shared by the writer and the reader.
+ *
+ * Each record lists the fields of a frame in the order they are written, without padding,
+ * so a frame is written with a single copy and read back with a single request.
+ * The frame sizes held by FrameData are taken from these records, so the layouts cannot drift apart.
+ *
+ * Fixed frames are the flag followed by the record, FrameRecord.
+ * Variable frames are the flag, the (long) size of the rest of the frame, then the record, SizedFrameRecord.
+ */
+
+/**
+ * A fixed frame, the flag followed by its record.
+ */
+template<class Record>
+struct FrameRecord {
+	char flag;
+	Record record;
+}__attribute__((packed));
+
+/**
+ * A variable frame, the flag and frame size followed by the record of its fixed portion.
+ */
+template<class Record>
+struct SizedFrameRecord {
+	char flag;
+	long size;
+	Record record;
+}__attribute__((packed));
+
+/**
+ * Malloc / Calloc event of a Data frame, or version 1 Thread data frame - 'M'<(long)Address><(float)Time delta><(long)Size><(int)Stack ID>
+ */
+struct MallocRecord {
+	long address;
+	float time;
+	long size;
+	int stack;
+}__attribute__((packed));
+
+/**
+ * Realloc event of a Data frame, or version 1 Thread data frame - 'R'<(long)Old address><(long)New address><(float)Time delta><(long)Size>
+ */
+struct ReallocRecord {
+	long address;
+	long address_new;
+	float time;
+	long size;
+}__attribute__((packed));
+
+/**
+ * Free event of a Data frame, or version 1 Thread data frame - 'F'<(long)Address><(float)Time delta>
+ */
+struct FreeRecord {
+	long address;
+	float time;
+}__attribute__((packed));
+
+/**
+ * Thread frame - 'H'<(int)Thread ID><(char)State><(long)Sequence><(double)Time>
+ */
+struct ThreadRecord {
+	int thread_id;
+	char state;
+	long sequence;
+	double time;
+}__attribute__((packed));
+
+/**
+ * Sample frame - 'W'<(long)Sample rate>
+ */
+struct SampleRecord {
+	long sample_rate;
+}__attribute__((packed));
+
+/**
+ * Untracked frees frame - 'U'<(long)Frees filtered>
+ */
+struct UntrackedRecord {
+	long frees;
+}__attribute__((packed));
+
+/**
+ * Version frame - 'Y'<(int)Version>
+ */
+struct VersionRecord {
+	int version;
+}__attribute__((packed));
+
+/**
+ * Calibration frame - 'K'<(double)Ticks per second><(long)Ticks><(long)Wall ns><(long)CPU ns>
+ */
+struct CalibrationRecord {
+	double rate;
+	unsigned long ticks;
+	long wall;
+	long cpu;
+}__attribute__((packed));
+
+/**
+ * Thread data frame header - 'P'<(long)Frame size><(int)Thread ID><(long)Watermark sequence><(long)Base sequence><(long)Base ticks>
+ * The base ticks are only present from version 3.
+ */
+struct ThreadDataRecord {
+	int thread_id;
+	long watermark;
+	long base_sequence;
+	unsigned long base_ticks;
+}__attribute__((packed));
+
+/**
+ * Checkpoint frame header - 'L'<(long)Frame size><(long)Sequence><(long)Allocation ID><(long)Ticks>
+ * 		<(long)Live bytes><(long)Allocation count><(int)Stack count>
+ */
+struct CheckpointRecord {
+	long sequence;
+	long allocation_id;
+	unsigned long ticks;
+	long memory;
+	long allocations;
+	int stacks;
+}__attribute__((packed));
+
+/**
+ * A live allocation of a Checkpoint frame - <(long)Address><(long)Size><(int)Stack ID>
+ */
+struct CheckpointAllocationRecord {
+	long address;
+	long size;
+	int stack;
+}__attribute__((packed));
+
+/**
+ * The small allocations of a call stack in a Checkpoint frame - <(int)Stack ID><(long)Small bytes><(long)Small count>
+ */
+struct CheckpointStackRecord {
+	int stack;
+	long bytes;
+	long count;
+}__attribute__((packed));
+
+/**
+ * Copy a record into a buffer.
+ *
+ * @param[out] out The position to write to, with at least sizeof(Record) of space.
+ * @param[in] record The record.
+ * @return The position after the record.
+ */
+template<class Record>
+inline char *putRecord(char *out, const Record &record) {
+	memcpy(out, &record, sizeof(Record));
+	return out + sizeof(Record);
+}
+
+/**
+ * Build a fixed frame from its flag and record.
+ *
+ * @param flag The frame flag.
+ * @param record The record.
+ * @return The frame, ready to write as sizeof(FrameRecord<Record>) bytes.
+ */
+template<class Record>
+inline FrameRecord<Record> makeFrame(char flag, const Record &record) {
+	FrameRecord<Record> frame;
+	frame.flag = flag;
+	frame.record = record;
+	return frame;
+}
+
+#endif
@@ -9,6 +9,8 @@
 #define FUNCTIONSITEALLOCATION_H_
 
 #include <deque>
+#include <vector>
+#include <math.h>
 
 using namespace std;
 
@@ -17,6 +19,9 @@ using namespace std;
  *
  * It also records the number of allocations + a vector of the individual sizes.
  * This is used later in the model to provide better comparisons.
+ *
+ * When call stacks are sampled each allocation is weighted by the inverse of its probability of being sampled.
+ * The estimated memory is then the Horvitz-Thompson estimate, with its variance kept to give error bounds.
  */
 class FunctionSiteAllocation {
 private:
@@ -28,6 +33,11 @@ private:
 	int count;
 	/* Individual allocation memory consumptions */
 	vector<long> allocs;
+	/* Estimated memory and allocation count, weighted for sampling */
+	double estimate;
+	double estimate_count;
+	/* Variance of the memory estimate */
+	double variance;
 
 public:
 	/**
@@ -37,11 +47,54 @@ public:
 	 * @param stackID The ID of the call stack represented by this object.
 	 * @param memory The first install of memory
 	 */
-	FunctionSiteAllocation(int stackID, long memory) {
+	FunctionSiteAllocation(int stackID, long memory, double probability = 1.0) {
+		this->memory = 0;
+		this->count = 0;
+		this->estimate = 0;
+		this->estimate_count = 0;
+		this->variance = 0;
+		this->stackID = stackID;
+		addMemory(memory, probability);
+	}
+
+	/**
+	 * Constructor for the FunctionSiteAllocation object, from an aggregate of allocations.
+	 *
+	 * @param stackID The ID of the call stack represented by this object.
+	 * @param memory The memory of the aggregated allocations.
+	 * @param count The number of aggregated allocations.
+	 * @param probability The probability each allocation was sampled, 1 if not sampling.
+	 */
+	FunctionSiteAllocation(int stackID, long memory, long count,
+			double probability) {
 		this->memory = 0;
 		this->count = 0;
+		this->estimate = 0;
+		this->estimate_count = 0;
+		this->variance = 0;
 		this->stackID = stackID;
-		addMemory(memory);
+		addAggregate(memory, count, probability);
+	}
+
+	/**
+	 * Constructor for the FunctionSiteAllocation object, from running totals of its allocations.
+	 * The individual sizes are not known, so are not added to the allocation sizes.
+	 *
+	 * @param stackID The ID of the call stack represented by this object.
+	 * @param memory The memory of the allocations.
+	 * @param count The number of allocations.
+	 * @param estimate The memory of the allocations, each weighted by the inverse of its sampling probability.
+	 * @param estimate_count The number of allocations, weighted as the estimate.
+	 * @param variance The variance of the memory estimate.
+	 */
+	FunctionSiteAllocation(int stackID, long memory, long count,
+			double estimate, double estimate_count, double variance) {
+		this->stackID = stackID;
+		this->memory = memory;
+		this->count = count;
+		this->estimate = estimate;
+		this->estimate_count = estimate_count;
+		this->variance = variance;
 	}
 
 	/**
@@ -49,11 +102,37 @@ public:
 	 * Adds the memory of the allocation, and increments the counter.
 	 *
 	 * @param memory The new memory to add the the existing memory of the object.
+	 * @param probability The probability the allocation was sampled, 1 if not sampling.
 	 */
-	void addMemory(long memory) {
+	void addMemory(long memory, double probability = 1.0) {
 		this->memory += memory;
 		this->count++;
 		allocs.push_back(memory);
+
+		/* Scale up by the inverse probability, and add the variance of the estimate */
+		estimate += memory / probability;
+		estimate_count += 1.0 / probability;
+		variance += (1.0 - probability) / (probability * probability)
+				* ((double) memory * memory);
+	}
+
+	/**
+	 * A function to add an aggregate of allocations to this object, treated as allocations of the mean size.
+	 * The individual sizes are not known, so are not added to the allocation sizes.
+	 *
+	 * @param memory The memory of the aggregated allocations.
+	 * @param count The number of aggregated allocations.
+	 * @param probability The probability each allocation was sampled, 1 if not sampling.
+	 */
+	void addAggregate(long memory, long count, double probability = 1.0) {
+		this->memory += memory;
+		this->count += count;
+
+		double mean = (double) memory / count;
+		estimate += memory / probability;
+		estimate_count += count / probability;
+		variance += count * (1.0 - probability) / (probability * probability)
+				* mean * mean;
 	}
 
 	/**
@@ -74,6 +153,36 @@ public:
 		return memory;
 	}
 
+	/**
+	 * Getter for the estimated memory of this call stack in bytes.
+	 * Equal to getMemory unless call stacks were sampled.
+	 *
+	 * @return The estimated memory associated with this stack ID.
+	 */
+	double getEstimate() const {
+		return estimate;
+	}
+
+	/**
+	 * Getter for the estimated number of allocations of this call stack.
+	 * Equal to getCount unless call stacks were sampled.
+	 *
+	 * @return The estimated allocation count for this stack ID.
+	 */
+	double getEstimateCount() const {
+		return estimate_count;
+	}
+
+	/**
+	 * Getter for the 95% error bound of the memory estimate in bytes.
+	 * Zero unless call stacks were sampled.
+	 *
+	 * @return The half width of the 95% confidence interval.
+	 */
+	double getErrorBound() const {
+		return 1.96 * sqrt(variance);
+	}
+
 	/**
 	 * Getter for the stack ID of this object.
 	 *
@@ -104,10 +213,10 @@ public:
 	 */
 	struct comparatorMem {
 		bool operator ()(FunctionSiteAllocation *a, FunctionSiteAllocation *b) {
-			if(a->getMemory() == b->getMemory())
+			if(a->getEstimate() == b->getEstimate())
 				return a->getStackId() < b->getStackId();
 			else
-				return a->getMemory() < b->getMemory();
+				return a->getEstimate() < b->getEstimate();
 		}
 	};
 };
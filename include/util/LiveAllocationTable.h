@@ -0,0 +1,168 @@
+#ifndef LIVEALLOCATIONTABLE
+#define LIVEALLOCATIONTABLE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <vector>
+
+/* Define the number of independently locked shards, as a power of two */
+#define LIVETABLESHARDBITS 6
+#define LIVETABLESHARDS (1 << LIVETABLESHARDBITS)
+/* Define the initial number of slots in each shard - must be a power of two */
+#define LIVETABLESIZE 1024
+
+using namespace std;
+
+/**
+ * LiveAllocationTable maps the address of each live allocation to its size and call stack.
+ * It lets the tracer know the size of each free, keeping its own count of the live memory.
+ *
+ * The table is split into shards by the top bits of the hash of the address, each an open addressing table with
+ * linear probing behind its own spin lock. Threads allocating or freeing different addresses rarely
+ * touch the same shard, so the tracer can look up every free without serialising the threads.
+ * Removal shifts the following entries back, so the table never fills with tombstones.
+ *
+ * Within a shard, the slot is taken from the bits of the hash just below those of the shard.
+ * These depend on every bit of the address, where the low bits of the hash would leave strided addresses colliding.
+ */
+class LiveAllocationTable {
+public:
+	/**
+	 * A slot of a shard.
+	 */
+	struct LiveEntry {
+		/* Address of the allocation, or 0 if the slot is empty */
+		long address;
+		/* Size of the allocation */
+		long size;
+		/* ID of the call stack of the allocation */
+		int stack;
+	};
+
+private:
+
+	/**
+	 * A shard of the table, kept on its own cache line.
+	 */
+	struct LiveShard {
+		volatile int lock;
+		LiveEntry *slots;
+		long size;
+		long used;
+	} __attribute__((aligned(64)));
+
+	LiveShard shards[LIVETABLESHARDS];
+
+	/**
+	 * Hash an address, spreading the low bits left constant by alignment.
+	 *
+	 * @param address The address.
+	 * @return The 64-bit hash.
+	 */
+	static unsigned long hashAddress(long address) {
+		return ((unsigned long) address >> 4) * 0x9E3779B97F4A7C15UL;
+	}
+
+	/**
+	 * Fetch the shard of a hash.
+	 *
+	 * @param hash The hash of an address.
+	 * @return The shard holding the address.
+	 */
+	LiveShard &getShard(unsigned long hash) {
+		return shards[hash >> (64 - LIVETABLESHARDBITS)];
+	}
+
+	/**
+	 * Fetch the home slot of a hash in its shard, from the bits below those of the shard.
+	 *
+	 * @param shard The shard of the hash.
+	 * @param hash The hash of an address.
+	 * @return The index of the first slot to probe.
+	 */
+	static long getHomeSlot(const LiveShard &shard, unsigned long hash) {
+		return (hash << LIVETABLESHARDBITS) >> (64 - __builtin_ctzl(shard.size));
+	}
+
+	static void lockShard(LiveShard &shard) {
+		while (__sync_lock_test_and_set(&shard.lock, 1))
+			while (shard.lock)
+				;
+	}
+
+	static void unlockShard(LiveShard &shard) {
+		__sync_lock_release(&shard.lock);
+	}
+
+	/**
+	 * Find the slot of an address, or the empty slot where it belongs.
+	 * The shard lock must be held.
+	 *
+	 * @param shard The shard to search.
+	 * @param hash The hash of the address.
+	 * @param address The address.
+	 * @return The index of the slot.
+	 */
+	static long findSlot(LiveShard &shard, unsigned long hash, long address);
+
+	/**
+	 * Double the size of a shard, reinserting every entry.
+	 * The shard lock must be held.
+	 *
+	 * @param shard The shard to grow.
+	 */
+	static void growShard(LiveShard &shard);
+
+public:
+	/**
+	 * Constructor for LiveAllocationTable.
+	 * Sets up the empty shards.
+	 */
+	LiveAllocationTable();
+
+	/**
+	 * Deconstructor for LiveAllocationTable.
+	 */
+	~LiveAllocationTable();
+
+	/**
+	 * Record a new allocation, replacing any stale entry for the address.
+	 * Safe to call from multiple threads.
+	 *
+	 * @param address The address of the allocation, ignored if 0.
+	 * @param size The size of the allocation.
+	 * @param stack The ID of the call stack of the allocation.
+	 */
+	void insert(long address, long size, int stack);
+
+	/**
+	 * Remove an allocation, returning its size and call stack.
+	 * Safe to call from multiple threads.
+	 *
+	 * @param[in] address The address of the allocation.
+	 * @param[out] size The size of the allocation.
+	 * @param[out] stack The ID of the call stack of the allocation.
+	 * @return If the address was found.
+	 */
+	bool remove(long address, long *size, int *stack);
+
+	/**
+	 * Sum the live allocations by call stack.
+	 * Each shard is locked in turn, so the result is not a single snapshot while other threads allocate.
+	 *
+	 * @param[out] bytes The live bytes of each call stack.
+	 * @param[out] counts The number of live allocations of each call stack.
+	 */
+	void sumByStack(map<int, long> &bytes, map<int, long> &counts);
+
+	/**
+	 * Copy out every live allocation.
+	 * As with sumByStack, the result is only a single snapshot if no other thread is allocating.
+	 *
+	 * @param[out] entries The live allocations, appended in no particular order.
+	 */
+	void getAllocations(vector<LiveEntry> &entries);
+};
+#endif
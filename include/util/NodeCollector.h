@@ -0,0 +1,154 @@
+#ifndef NODECOLLECTOR
+#define NODECOLLECTOR
+
+#include "Util.h"
+
+#include "Compress.h"
+#include "FrameData.h"
+#include "BufferPool.h"
+#include "TraceContainer.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/* Define the number of blocks in the ring shared by the ranks of a node */
+#define NODESLOTS 64
+/* Define the size of each block of the ring */
+#define NODEBLOCK 1048576
+/* Define the number of record buffers the collector compresses from */
+#define NODEBUFFERS 4
+
+using namespace std;
+
+/**
+ * A block of the raw trace of one rank, waiting in the ring for the collector.
+ */
+struct NodeSlot {
+	/* Set by the rank once the block has been filled */
+	volatile int ready;
+	/* The world rank the block belongs to */
+	int rank;
+	/* The number of bytes of the block in use */
+	int size;
+	char data[NODEBLOCK];
+};
+
+/**
+ * The head of the ring, at the start of the shared memory of a node.
+ * Slots are taken in order by incrementing head, and freed in order by the collector incrementing tail.
+ */
+struct NodeRing {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	long head;
+	long tail;
+	/* The number of ranks on the node, and how many have finished */
+	int ranks;
+	int finished;
+};
+
+/**
+ * NodeCollector sends the trace of a rank through a single collector per node, rather than a file per rank.
+ *
+ * The ranks of each node share a ring of raw trace blocks, in memory from MPI_Win_allocate_shared.
+ * The lowest rank of the node also runs a collector thread, which drains the ring into one compressed stream,
+ * so each node holds one compressor and one file rather than one per rank.
+ *
+ * Each rank's raw stream is identical to that of a per-rank trace file, and is wrapped in records
+ * as it passes through the ring. The node trace takes the form of:
+ * 'N'<(int)Rank><(int)Size><Raw trace of rank>
+ * 'N'<(int)Rank><(int)Size><Raw trace of rank>
+ * ...
+ * 'Z'
+ *
+ * The reader demultiplexes a rank by concatenating its records.
+ */
+class NodeCollector {
+private:
+#ifndef NO_MPI
+	MPI_Comm node_comm;
+	MPI_Win window;
+#endif
+
+	/* The shared ring */
+	NodeRing *ring;
+	NodeSlot *slots;
+
+	int world_rank;
+	int node_rank;
+
+	/* The compressor and record buffers of the collector, NULL on the other ranks */
+	Compress *z_comp;
+	BufferPool *pool;
+	FrameData *frame_data;
+
+	/* Collector thread */
+	pthread_t collector;
+	void (*worker_init)();
+
+	bool finish_called;
+
+	/**
+	 * Entry point of the collector thread.
+	 *
+	 * @param arg The NodeCollector object.
+	 * @return NULL.
+	 */
+	static void *collectorMain(void *arg);
+
+	/**
+	 * Drain the ring into the node trace, until every rank of the node has finished.
+	 */
+	void collect();
+
+public:
+	/**
+	 * Constructor for the NodeCollector.
+	 * Collective over MPI_COMM_WORLD - splits the ranks by node, maps the shared ring and writes the node map.
+	 *
+	 * @param folder The trace folder.
+	 * @param worker_init Optional function for the collector threads to call when they start.
+	 * @param codec_id The codec ID of the node trace.
+	 * @param codec_level The zlib level of the node trace, or CODECADAPTIVE.
+	 * @param compress_threads The number of compression worker threads of the collector.
+	 */
+	NodeCollector(string folder, void (*worker_init)() = NULL,
+			char codec_id = Codec::ZLIB, int codec_level = CODECDEFAULTLEVEL,
+			int compress_threads = COMPRESSWORKERS);
+
+	/**
+	 * Deconstructor for the NodeCollector.
+	 */
+	~NodeCollector();
+
+	/**
+	 * Copy data into the ring, waiting for space if the collector has fallen behind.
+	 *
+	 * @param data The raw trace data.
+	 * @param size The size of the data in bytes.
+	 * @return Success of the function.
+	 */
+	int addData(char *data, long size);
+
+	/**
+	 * Copy a buffer into the ring, then release it straight back to its pool.
+	 *
+	 * @param data The buffer.
+	 * @param size The number of bytes of the buffer in use.
+	 * @param pool The pool the buffer was acquired from.
+	 * @return Success of the function.
+	 */
+	int addBuffer(char *data, long size, BufferPool *pool);
+
+	/**
+	 * Finish the trace of this rank, ending with the finish flag.
+	 * Collective over the node - the collector waits for every rank, then writes out the node trace.
+	 *
+	 * @return Success of the function.
+	 */
+	int finish();
+};
+
+#endif
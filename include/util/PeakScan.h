@@ -0,0 +1,125 @@
+#ifndef PEAKSCAN
+#define PEAKSCAN
+
+#include <limits.h>
+#include <string.h>
+
+/* Define the number of events held in each column before they are scanned */
+#define PEAKSCANCOLUMN 8192
+
+/**
+ * PeakScan is a collection of static functions to find the memory HWM of a run of events
+ * from the change in live bytes of each event alone.
+ *
+ * Each event is given as a delta, the change in live bytes it leaves behind, and a peak,
+ * the highest the live bytes reach within it, relative to before the event.
+ * The peak of a single allocation or free is its delta, while an aggregate or transient event can peak above its net change.
+ * The live bytes at the peak of event i is then the prefix sum of the deltas before it plus its own peak.
+ *
+ * With GCC the prefix sum is taken four events at a time through vector extensions,
+ * which compile to whatever vector instructions the target has, otherwise one event at a time.
+ * Define PEAKSCANSCALAR to always take one event at a time, such as to test the two against each other.
+ */
+class PeakScan {
+private:
+
+#if defined(__GNUC__) && !defined(__clang__) && !defined(PEAKSCANSCALAR)
+	typedef long LongVector __attribute__((vector_size(4 * sizeof(long))));
+#endif
+
+	/**
+	 * Scan the events one at a time.
+	 *
+	 * @param[in] deltas The change in live bytes of each event.
+	 * @param[in] peaks The peak of each event, relative to the live bytes before it.
+	 * @param[in] count The number of events.
+	 * @param[in,out] memory The live bytes before the events, updated to after them.
+	 * @param[in,out] hwm The highest live bytes so far, raised by any higher peak.
+	 * @param[in,out] index The index of the event of the HWM, updated if the HWM is raised.
+	 * @param[in] offset The index of the first event, added to any updated index.
+	 */
+	static void scanScalar(const long *deltas, const long *peaks, long count,
+			long *memory, long *hwm, long *index, long offset) {
+		long current = *memory;
+		long i;
+		for (i = 0; i < count; i++) {
+			if (current + peaks[i] > *hwm) {
+				*hwm = current + peaks[i];
+				*index = offset + i;
+			}
+			current += deltas[i];
+		}
+		*memory = current;
+	}
+
+public:
+
+	/**
+	 * Find the highest live bytes reached within a run of events, and the first event to reach it.
+	 *
+	 * @param[in] deltas The change in live bytes of each event.
+	 * @param[in] peaks The peak of each event, relative to the live bytes before it.
+	 * @param[in] count The number of events.
+	 * @param[in,out] memory The live bytes before the events, updated to after them.
+	 * @param[out] index The index of the first event to reach the peak, or -1 if there are no events.
+	 * @return The peak live bytes, or LONG_MIN if there are no events.
+	 */
+	static long scan(const long *deltas, const long *peaks, long count,
+			long *memory, long *index) {
+		long hwm = LONG_MIN;
+		*index = -1;
+		long i = 0;
+
+#if defined(__GNUC__) && !defined(__clang__) && !defined(PEAKSCANSCALAR)
+		LongVector zero = { 0, 0, 0, 0 };
+		LongVector carry = { *memory, *memory, *memory, *memory };
+		LongVector best = { LONG_MIN, LONG_MIN, LONG_MIN, LONG_MIN };
+		LongVector best_at = { -1, -1, -1, -1 };
+		LongVector at = { 0, 1, 2, 3 };
+		LongVector step = { 4, 4, 4, 4 };
+
+		/* Lane masks to shift the events up one and two lanes, filling with zero */
+		LongVector shift_one = { 0, 4, 5, 6 };
+		LongVector shift_two = { 0, 1, 4, 5 };
+		LongVector last = { 3, 3, 3, 3 };
+
+		for (; i + 4 <= count; i += 4) {
+			LongVector delta, peak;
+			memcpy(&delta, deltas + i, sizeof(LongVector));
+			memcpy(&peak, peaks + i, sizeof(LongVector));
+
+			/* The live bytes after each event, from the prefix sum within the four and the carry before them */
+			LongVector after = delta + __builtin_shuffle(zero, delta, shift_one);
+			after += __builtin_shuffle(zero, after, shift_two);
+			after += carry;
+
+			/* Strictly higher, so each lane keeps the first event to reach its peak */
+			LongVector value = after - delta + peak;
+			LongVector higher = value > best;
+			best = (value & higher) | (best & ~higher);
+			best_at = (at & higher) | (best_at & ~higher);
+
+			carry = __builtin_shuffle(after, last);
+			at += step;
+		}
+
+		/* The highest lane, taking the first event should lanes tie */
+		int lane;
+		for (lane = 0; lane < 4; lane++) {
+			if (best_at[lane] < 0)
+				continue;
+			if (best[lane] > hwm || (best[lane] == hwm && best_at[lane] < *index)) {
+				hwm = best[lane];
+				*index = best_at[lane];
+			}
+		}
+		*memory = carry[0];
+#endif
+
+		/* The events left over, or all of them without vector extensions */
+		scanScalar(deltas + i, peaks + i, count - i, memory, &hwm, index, i);
+		return hwm;
+	}
+};
+
+#endif
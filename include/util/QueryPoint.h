@@ -0,0 +1,128 @@
+#ifndef QUERYPOINT
+#define QUERYPOINT
+
+#include "FunctionSiteAllocation.h"
+
+#include <set>
+#include <vector>
+
+using namespace std;
+
+/* Define the number of largest live allocations kept at each query time */
+#define QUERYTOPALLOCATIONS 10
+
+/**
+ * QueryPoint holds the state of the heap captured for one requested time, while the trace is replayed.
+ * This is the memory, the breakdown by call stack, and the largest live allocations.
+ *
+ * Like a search for a single time, it is taken after the first event past the requested time,
+ * or at the end of the trace if no event comes after it.
+ */
+class QueryPoint {
+public:
+	/**
+	 * One of the largest live allocations.
+	 */
+	struct TopAllocation {
+		long address;
+		long size;
+		int stack;
+	};
+
+private:
+	/* The time requested (s) */
+	double query_time;
+	/* The time of the event the state was taken after (s) */
+	double time;
+	/* The allocation ID of the event the state was taken after */
+	long id;
+	/* The live memory (B) */
+	long memory;
+
+	/* The live allocations grouped by call stack, owned by this object */
+	set<FunctionSiteAllocation *, FunctionSiteAllocation::comparator> functions;
+
+	/* The largest live allocations, largest first */
+	vector<TopAllocation> top;
+
+public:
+	/**
+	 * Constructor for the QueryPoint object.
+	 *
+	 * @param query_time The time requested (s).
+	 * @param time The time of the state (s).
+	 * @param id The allocation ID of the state.
+	 * @param memory The live memory (B).
+	 * @param functions The breakdown by call stack, which this object then owns.
+	 * @param top The largest live allocations, largest first.
+	 */
+	QueryPoint(double query_time, double time, long id, long memory,
+			const set<FunctionSiteAllocation *, FunctionSiteAllocation::comparator> &functions,
+			const vector<TopAllocation> &top) :
+			functions(functions), top(top) {
+		this->query_time = query_time;
+		this->time = time;
+		this->id = id;
+		this->memory = memory;
+	}
+
+	/**
+	 * Deconstructor for the QueryPoint object.
+	 * Frees the breakdown.
+	 */
+	~QueryPoint() {
+		set<FunctionSiteAllocation *, FunctionSiteAllocation::comparator>::iterator it;
+		for (it = functions.begin(); it != functions.end(); it++)
+			delete *it;
+	}
+
+	/**
+	 * Getter for the time requested.
+	 * @return The time requested (s).
+	 */
+	double getQueryTime() const {
+		return query_time;
+	}
+
+	/**
+	 * Getter for the time of the state.
+	 * @return The time of the event the state was taken after (s).
+	 */
+	double getTime() const {
+		return time;
+	}
+
+	/**
+	 * Getter for the allocation ID of the state.
+	 * @return The allocation ID of the event the state was taken after.
+	 */
+	long getID() const {
+		return id;
+	}
+
+	/**
+	 * Getter for the live memory.
+	 * @return The live memory (B).
+	 */
+	long getMemory() const {
+		return memory;
+	}
+
+	/**
+	 * Getter for the breakdown by call stack.
+	 * @return The live allocations grouped by call stack ID.
+	 */
+	const set<FunctionSiteAllocation *, FunctionSiteAllocation::comparator> &getFunctions() const {
+		return functions;
+	}
+
+	/**
+	 * Getter for the largest live allocations.
+	 * @return The largest live allocations, largest first.
+	 */
+	const vector<TopAllocation> &getTopAllocations() const {
+		return top;
+	}
+};
+
+#endif
@@ -4,37 +4,102 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <vector>
-#include <deque>
-#include <utility>
-#include <map>
-#include <sstream>
+#include <pthread.h>
+
+/* Define the initial number of slots in the stack hash table - must be a power of two */
+#define STACKTABLESIZE 4096
+/* Define the initial number of frames in the stack arena */
+#define STACKARENASIZE 65536
 
 using namespace std;
+
+/**
+ * StackMap interns call stacks, giving each distinct stack a unique ID.
+ *
+ * Frames of every stack are stored contiguously in an append-only arena.
+ * Stacks are found through an open addressing hash table over a 64-bit hash of the frames,
+ * so interning takes roughly constant time regardless of the number of stacks.
+ * Stacks are numbered in order of insertion, so the print queue is simply the range of IDs
+ * added since the last print, serialised straight from the arena.
+ */
 class StackMap {
 private:
-	/* Print queue - What is new */
-	deque<pair<int, vector<long> > > print_queue;
-	long print_queue_size;
+	/**
+	 * A slot of the hash table.
+	 */
+	struct StackSlot {
+		/* Hash of the stack frames */
+		unsigned long hash;
+		/* ID of the stack, or -1 if the slot is empty */
+		int id;
+	};
+
+	/**
+	 * The location of a stack within the arena.
+	 */
+	struct StackEntry {
+		/* Offset of the first frame in the arena */
+		long offset;
+		/* Number of frames */
+		int depth;
+	};
+
+	/* Hash table */
+	StackSlot *table;
+	long table_size;
 
-	/* Full stack map - everything */
-	map<vector<long>, int> call_stack_map;
-	map<vector<long>, int>::iterator call_stack_map_it;
-	vector<long>::iterator vector_it;
-	pair<map<vector<long>, int>::iterator, bool> call_stack_insert;
+	/* Arena of frames */
+	long *arena;
+	long arena_size;
+	long arena_used;
+
+	/* Stacks, indexed by ID */
+	StackEntry *entries;
+	int entries_size;
 	int stack_map_ID;
 
+	/* Print queue - What is new, as the IDs from print_start_ID */
+	int print_start_ID;
+	long print_queue_size;
+
 	/** Should we maintain a print queue - Defaults to true*/
 	bool print;
 
+	/** Lock shared by all threads adding stacks or draining the print queue */
+	pthread_mutex_t stack_lock;
+
 	/**
-	 * Add a newly formed stack entry into the print queue.
-	 * A private function for internal use only.
+	 * Hash the frames of a call stack.
 	 *
-	 * @param[in] new_stack The new call stack
-	 * @param[in] id The id of the new call stack within the map
+	 * @param[in] stack The call stack.
+	 * @param[in] depth The number of frames in the call stack.
+	 * @return The 64-bit hash.
 	 */
-	void addToPrintQueue(vector<long>& new_stack, int id);
+	static unsigned long hashStack(const long *stack, int depth);
+
+	/**
+	 * Find the slot of a stack, or the empty slot where it belongs.
+	 *
+	 * @param[in] hash The hash of the stack.
+	 * @param[in] stack The call stack.
+	 * @param[in] depth The number of frames in the call stack.
+	 * @return The index of the slot.
+	 */
+	long findSlot(unsigned long hash, const long *stack, int depth);
+
+	/**
+	 * Double the size of the hash table, reinserting every stack from its stored hash.
+	 */
+	void growTable();
+
+	/**
+	 * Copy a new stack to the end of the arena, growing it if needed.
+	 *
+	 * @param[in] stack The call stack.
+	 * @param[in] depth The number of frames in the call stack.
+	 * @return The offset of the stack in the arena.
+	 */
+	long appendToArena(const long *stack, int depth);
 
 public:
 	/**
@@ -45,20 +110,28 @@ public:
 	 */
 	StackMap(bool print = true);
 
+	/**
+	 * Deconstructor for StackMap.
+	 */
+	~StackMap();
+
 	/**
 	 * Add a newly found call stack to the map object.
 	 * Before insertion the structure is checked to see if it already contains the object.
 	 * If so the existing stack ID is returned, otherwise a new one is generated.
+	 * Safe to call from multiple threads.
 	 *
-	 * @param[in] newStack The new call stack to be added to the structure.
+	 * @param[in] stack The new call stack to be added to the structure.
+	 * @param[in] depth The number of frames in the call stack.
 	 * @return The ID of the call stack, either old or new.
 	 */
-	int addStack(vector<long> newStack);
+	int addStack(const long *stack, int depth);
 
 	/**
 	 * A means of requesting the new stacks since the last print.
 	 *
 	 * @param[out] size The size (in bytes) of the array.
+	 * @param[out] count The number of stacks in the array.
 	 * @return The array of data for the print queue.
 	 */
 	char *getPrintQueue(long *size, int *count);
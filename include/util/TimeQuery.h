@@ -0,0 +1,84 @@
+#ifndef TIMEQUERY
+#define TIMEQUERY
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdlib.h>
+#include <math.h>
+
+/* The most times a query may ask for, each holding a breakdown of the heap */
+#define TIMEQUERYMAX 10000
+
+using namespace std;
+
+/**
+ * TimeQuery holds the times at which the heap is to be broken down, as given to --time.
+ *
+ * The times may be given as:
+ * - A single time, "x".
+ * - A list of times, "x,y,z".
+ * - A range of times, "start:end:step", including the end.
+ * - A count of evenly spaced times across the whole run, "@n".
+ *
+ * A count is only turned into times once the length of the run is known.
+ * A range or count of more than TIMEQUERYMAX times is rejected.
+ */
+class TimeQuery {
+private:
+	/* The times given, in order */
+	vector<double> times;
+	/* The number of evenly spaced times, or 0 if the times were given */
+	int count;
+
+	/**
+	 * Parse a time, the whole string must be a number.
+	 *
+	 * @param[in] text The text of the time.
+	 * @param[out] value The time (s).
+	 * @return If the text is a number.
+	 */
+	static bool parseTime(const string &text, double *value);
+
+public:
+	/**
+	 * Constructor for an empty TimeQuery.
+	 */
+	TimeQuery() {
+		count = 0;
+	}
+
+	/**
+	 * Parse the argument of --time.
+	 *
+	 * @param spec The argument.
+	 * @return If the argument was understood, otherwise the query is left empty.
+	 */
+	bool parse(const string &spec);
+
+	/**
+	 * Test if the query is a single time, answered as a functions file as it always has been.
+	 * @return If a single time was given.
+	 */
+	bool isSingle() const {
+		return count == 0 && times.size() == 1;
+	}
+
+	/**
+	 * Test if the query needs the length of the run to find its times.
+	 * @return If a count of times was given.
+	 */
+	bool needsEndTime() const {
+		return count > 0;
+	}
+
+	/**
+	 * Fetch the times of the query, in order, without repeats.
+	 *
+	 * @param end_time The length of the run (s), only used for a count of times.
+	 * @return The times (s).
+	 */
+	vector<double> getTimes(double end_time) const;
+};
+
+#endif
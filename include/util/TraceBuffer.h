@@ -3,87 +3,138 @@
 
 #include "Util.h"
 
-#include "Compress.h"
-#include "ElfData.h"
-#include "VirtualMemoryData.h"
+#include "TraceWriter.h"
 #include "FrameData.h"
-#include "StackMap.h"
+#include "BufferPool.h"
+#include "VarInt.h"
 #include "stdlib.h"
-#include <sstream>
 
 #include <iostream>
+#include <map>
+#include <limits.h>
+#include <sched.h>
+
+/* Define the number of call stacks an aggregate event can hold */
+#define AGGREGATESTACKS 32
+/* Define the number of small allocation events per aggregate event */
+#define AGGREGATEFREQUENCY 4096
 
 using namespace std;
 
 
 /**
- * TraceBuffer is the internal buffer for WMTrace.
+ * TraceBuffer is the internal per-thread buffer for WMTrace.
  *
- * It maintains a buffer which can be written to, which is periodically dumped to the zlib compressor.
+ * It maintains a buffer which can be written to, which is periodically dumped to the shared TraceWriter.
+ * A full buffer is swapped for a free one from its pool, so compression never runs on the traced thread.
  * It provides an interface for adding data, and automatically appends the correct frame data to the payload.
+ *
+ * Each buffer is only ever written by its owning thread, so no locking is needed to add events.
+ * Every event is tagged with a delta of the global event sequence, so the reader can merge the threads back in order.
+ * The buffer publishes the sequence of its first event not yet handed to the writer, so the writer knows how far
+ * the whole trace is complete. The owner holds the event lock of the buffer while tracing an event, so that when
+ * the owner is idle the writer can hand over a partial buffer holding the trace back.
+ *
+ * Events are written in the compact (version 3) encoding - a flag followed by VarInts.
+ * Addresses and stack IDs are stored as signed deltas against the previous event of the frame.
+ * Timestamps are integer WMTimer ticks, stored as a signed delta against the previous event of the thread,
+ * starting from the base tick in the frame header. The deltas restart with each frame, so every frame decodes on its own.
+ *
+ * Small allocations can instead be summed into a pending aggregate, per call stack, and written as a single event
+ * every AGGREGATEFREQUENCY small events, and before any other event, so the order against the rest of the thread is kept.
+ *
+ * With coalescing, an allocation freed by the very next event of the thread, while still in the current buffer,
+ * is rewritten in place as a transient event. Further identical alloc/free pairs straight after extend the
+ * count of the same transient event, leaving the sequence of their allocation unused.
  */
 class TraceBuffer {
 
 private:
 	/* Objects */
-	Compress *z_comp;
-	ElfData *elf_data;
-	VirtualMemoryData *vmd;
+	TraceWriter *writer;
 	FrameData *frame_data;
 
-	StackMap *stack_map;
+	/* Thread owning this buffer */
+	int thread_id;
 
-	/* Buffer */
-	stringbuf internal_string_buffer;
-	char * internal_buffer;
-	long buffer_used;
+	/* Sequence and tick count of the last event written by this thread */
+	long last_sequence;
+	unsigned long last_ticks;
 
-	/**
-	 * Function to write elf data to the internal buffer.
-	 * Uses an internal buffer which it maintains then prints to file.
-	 * Takes the form of:
-	 * 'E'<(long)Elf static memory><(int)Elf function count><(long)Frame size (b)>
-	 * 		<(long)Function start><(int)Function name length><Function Name>
-	 * 		<(long)Function start><(int)Function name length><Function Name>
-	 * 		...
-	 * 	@return Success of the function.
-	 */
-	int fetchElfData();
+	/* Previous address and stack ID of this frame, to delta encode against */
+	long prev_address;
+	int prev_stack;
 
 	/**
-	 * A function to fetch the virtual address memory space functions. These differ between ranks due to memory offsets.
-	 * Takes the form of:
-	 * 'V'<(long) Frame size (b)><(int) Function count>
-	 * 		<(long) start address><(long) End address><(int) Name length><(char *) Name>
-	 * 		<(long) start address><(long) End address><(int) Name length><(char *) Name>
-	 * 		...
-	 * @return Success of the function.
+	 * The pending change of the small allocations of one call stack.
 	 */
-	int fetchVirtualAddresses();
+	struct AggregateEntry {
+		int stack;
+		long bytes;
+		long count;
+	};
 
-	/**
-	 * Write out new call stacks from the StackMap print buffer to the zlib compression buffer.
-	 * Must be written before allocation data which makes use of the stacks.
-	 * If print buffer is empty, do not print frame.
-	 * Takes the form of:
-	 * 'S'<(long)Frame size><(int)Stack count>
-	 * <(int)Stack ID><(int)Stack entries>< <(long)Address><(long)Address>... >
-	 * <(int)Stack ID><(int)Stack entries>< <(long)Address><(long)Address>... >
-	 * ...
-	 *
-	 * @return Success of the function.
-	 */
-	int fetchCallStacks();
+	/* Pending aggregate - net bytes, the peak of the net bytes, the event count and time of the last event */
+	long aggregate_bytes;
+	long aggregate_peak;
+	long aggregate_events;
+	unsigned long aggregate_ticks;
+	AggregateEntry aggregate_stacks[AGGREGATESTACKS];
+	int aggregate_stack_count;
+	/* Sequence reserved by the first event of the pending aggregate, and if no more events may join it */
+	long aggregate_sequence;
+	bool aggregate_closed;
 
 	/**
-	 * Write out core data about the current job, including rank, comm size, machine name and machine rank.
-	 * This allows the data to be used later without having to manually remember it.
-	 * Takes the form of:
-	 * 'C'<(long)Frame size><(int) Rank><(int) Comm size><(int) Machine name size><(String) Machine name>
-	 *
-	 * @return Success of the function.
+	 * The last Malloc / Calloc event of the buffer, with the encoder state before it, so it can be undone.
 	 */
-	int fetchCoreData();
+	struct TransientCandidate {
+		/* Offset of the event in the buffer, or -1 if the last event was not an allocation */
+		long offset;
+		long address;
+		long size;
+		int stack;
+		unsigned long ticks;
+		long sequence;
+
+		long prev_sequence;
+		unsigned long prev_ticks;
+		long prev_address;
+		int prev_stack;
+	};
+
+	/* Rewrite short-lived alloc/free pairs as transient events */
+	bool coalesce;
+	TransientCandidate candidate;
+
+	/* The transient event the next identical pair can extend - its offset, or -1, and where it ends */
+	long run_offset;
+	long run_end;
+	long run_address;
+	long run_size;
+	int run_stack;
+	int run_count;
+	unsigned long run_ticks;
+	/* Sequence of the allocation of the last pair in the run */
+	long run_last_sequence;
+
+	/* Sequences taken by allocations later folded into an existing transient event */
+	long skipped_sequences;
+
+	/* Sequence of the first event not yet handed to the writer, or LONG_MAX if none */
+	volatile long pending_sequence;
+	/* Sequence taken ahead of its event, or LONG_MAX if none */
+	long reserved_sequence;
+	/* Held by the owner while tracing an event, or by the writer while handing over the buffer */
+	volatile int event_lock;
+
+	/* Buffer */
+	BufferPool *pool;
+	char * internal_buffer;
+	long buffer_size;
+	long buffer_used;
+	/* Events in the buffer, and the last tick count, for the trace index */
+	IndexBlock buffer_stats;
 
 	/**
 	 * Function to make sure there is enough space in the buffer before adding to it.
@@ -94,35 +145,58 @@ private:
 	int ensureBufferSpace(long size);
 
 	/**
-	 * A function to dump the content of the internal buffer to file through the compressor.
-	 * First we print any new call stacks we have sound along the way.
+	 * A function to hand the internal buffer to the writer for compression, and swap in a free buffer.
 	 *
-	 * @return The success of the zlib compression.
+	 * @return The success of queueing the buffer.
 	 */
 	int printBuffer();
 
 	/**
-	 * A function to copy data from a pointer into the buffer.
-	 * Assumes ensureBufferSpace has been called successfully.
+	 * Start encoding an event, writing its flag, the delta of the global event sequence and the tick delta.
+	 * Space must have been reserved for a compact event.
+	 *
+	 * @param flag The flag of the event.
+	 * @param ticks The timestamp of the event.
+	 * @param sequence The sequence of the event, or -1 to take the next global sequence.
+	 * @return The position to encode the rest of the event at.
+	 */
+	unsigned char *startEvent(const char flag, unsigned long ticks,
+			long sequence = -1);
+
+	/**
+	 * Finish encoding an event, marking the bytes up to the position as used.
 	 *
-	 * @param data The input data pointer.
-	 * @param size The volume of data to copy in bytes.
+	 * @param pos The position after the last byte of the event.
+	 */
+	void finishEvent(unsigned char *pos) {
+		buffer_used = (char *) pos - internal_buffer;
+	}
+
+	/**
+	 * Add a small allocation or free to the pending aggregate, writing it out when full.
 	 *
-	 * @return Success of the function.
+	 * @param bytes The change in live bytes.
+	 * @param count The change in live allocations.
+	 * @param stackid The ID of the call stack of the allocation.
+	 * @param ticks The timestamp of the event.
 	 */
-	int copyToBuffer(void* data, long size);
+	void addToAggregate(long bytes, long count, int stackid,
+			unsigned long ticks);
 
 	/**
-	 * Write a flag to the output buffer to signify the start of a frame.
-	 * @param flag The flag to write
+	 * Fold the free of the candidate allocation into a transient event.
+	 * The allocation is removed from the buffer, then either extends the transient event
+	 * just before it or is rewritten as a new one, keeping its sequence.
 	 *
-	 * @return The success of the function
+	 * @param ticks The timestamp of the free.
 	 */
-	int copyFlag(const char flag);
+	void coalesceFree(unsigned long ticks);
 
 	/**
 	 * Format the buffer to enable easy file output.
-	 * Starts with a Data Flag followed by the size of the data in the buffer
+	 * Takes the form of:
+	 * 'P'<(long)Frame size><(int)Thread ID><(long)Watermark sequence><(long)Base sequence><(long)Base ticks>
+	 * The size is filled in by printBuffer and the watermark by the TraceWriter.
 	 */
 	void initBuffer();
 
@@ -130,83 +204,247 @@ public:
 
 	/**
 	 * Constructor for the buffer object.
-	 * Start the file by writing the ELF data.
+	 *
+	 * @param writer The shared writer to dump the buffer through.
+	 * @param thread_id The ID of the thread owning this buffer.
+	 * @param sequence The global event sequence at the time the thread started.
+	 * @param ticks The tick count at the time the thread started.
+	 * @param size The size of each buffer in bytes.
+	 * @param coalesce Rewrite short-lived alloc/free pairs as transient events.
 	 */
-	TraceBuffer(StackMap *stackmap);
+	TraceBuffer(TraceWriter *writer, int thread_id, long sequence,
+			unsigned long ticks, long size = BUFFERSIZE, bool coalesce = false);
 
 	/**
 	 * Deconstructor for the buffer object.
-	 * Frees the memory of allocated objects.
+	 * Frees the memory of allocated objects, once any queued buffers have been compressed.
 	 */
 	~TraceBuffer();
 
 	/**
-	 * Finish the buffer object, which in turn flushes the zlib buffer.
-	 * Also print the Virtual Memory function addresses.
+	 * Finish the buffer object, flushing the remaining events through the writer.
 	 */
 	void finishBuffer();
 
+	/**
+	 * Fetch the ID of the thread owning this buffer.
+	 * @return The thread ID.
+	 */
+	int getThreadID() const {
+		return thread_id;
+	}
+
 	/**
 	 * Function to write a Malloc event to the buffer stream.
-	 * Fixed size - mallocFrameSize
 	 * Takes the form of:
-	 * 'M'<(long)Address><(float)Timestamp as delta><(long)Alloc size><(int)StackID>
+	 * 'M'<(VarInt)Sequence delta><(Signed VarInt)Tick delta><(Signed VarInt)Address delta>
+	 * 		<(VarInt)Alloc size><(Signed VarInt)StackID delta>
 	 *
 	 * @param[in] address The return address of the malloc
-	 * @param[in] time The time since the last event
+	 * @param[in] ticks The timestamp of the event
 	 * @param[in] allocationsize The size of the new allocation
 	 * @param[in] stackid The ID of the call stack associated with this event (or -1 of not stack)
 	 *
 	 */
-	void addMalloc(long address, float time, long allocationsize, int stackid);
+	void addMalloc(long address, unsigned long ticks, long allocationsize, int stackid);
 
 	/**
 	 * Function to write a Calloc event to the buffer stream.
-	 * Fixed size - callocFrameSize
 	 * Takes the form of:
-	 * 'C'<(long)Address><(float)Timestamp as delta><(long)Alloc size><(int)StackID>
+	 * 'C'<(VarInt)Sequence delta><(Signed VarInt)Tick delta><(Signed VarInt)Address delta>
+	 * 		<(VarInt)Alloc size><(Signed VarInt)StackID delta>
 	 *
 	 * @param[in] address The return address of the calloc
-	 * @param[in] time The time since the last event
+	 * @param[in] ticks The timestamp of the event
 	 * @param[in] allocationsize The size of the new allocation
 	 * @param[in] stackid The ID of the call stack associated with this event (or -1 of not stack)
 	 */
-	void addCalloc(long address, float time, long allocationsize, int stackid);
+	void addCalloc(long address, unsigned long ticks, long allocationsize, int stackid);
 
 	/**
 	 * Function to write a realloc event to the buffer stream.
-	 * Fixed size - reallocFrameSize
+	 * The new address is a delta against the old address.
+	 * The size of the old allocation is carried too, so the reader need not look it up.
 	 * Takes the form of:
-	 * 'R'<(long)Old address><(long)New address><(float)Timestamp as delta><(long)Alloc size>
+	 * 'R'<(VarInt)Sequence delta><(Signed VarInt)Tick delta><(Signed VarInt)Old address delta>
+	 * 		<(Signed VarInt)New address delta><(VarInt)Alloc size><(Signed VarInt)Old size>
 	 *
 	 * @param[in] addressold The existing address of the allocation
 	 * @param[in] addressnew The return address of the realloc
-	 * @param[in] time The time since the last event
+	 * @param[in] ticks The timestamp of the event
 	 * @param[in] allocationsize The size of the new allocation
+	 * @param[in] oldsize The size of the existing allocation, or -1 if it was not traced
+	 * @param[in] sequence The sequence reserved for the event, or -1 to take the next global sequence
 	 */
-	void addRealloc(long addressold, long addressnew, float time,
-			long allocationsize);
+	void addRealloc(long addressold, long addressnew, unsigned long ticks,
+			long allocationsize, long oldsize, long sequence = -1);
 
 	/**
 	 * Function to write a Free event to the buffer stream.
-	 * Fixed size - freeFrameSize
+	 * The size and call stack of the freed allocation are carried, so the reader need not look them up.
 	 * Takes the form of:
-	 * 'F'<(long)Address><(float)Timestamp as delta>
+	 * 'F'<(VarInt)Sequence delta><(Signed VarInt)Tick delta><(Signed VarInt)Address delta>
+	 * 		<(VarInt)Freed size><(Signed VarInt)StackID delta>
 	 *
 	 * @param[in] address The existing address of the allocation
-	 * @param[in] time The time since the last event
+	 * @param[in] ticks The timestamp of the event
+	 * @param[in] freedsize The size of the freed allocation
+	 * @param[in] stackid The ID of the call stack of the freed allocation
+	 * @param[in] sequence The sequence reserved for the event, or -1 to take the next global sequence
 	 */
-	void addFree(long address, float time);
+	void addFree(long address, unsigned long ticks, long freedsize, int stackid,
+			long sequence = -1);
 
 	/**
-	 * Function to write a timer frame to the output stream.
-	 * Used to correct timer drift.
-	 * Fixed frame size - timer_frame_size
-	 * 'T'<(double) elapsed time>
+	 * Take the sequence of an event ahead of writing it, such as for a realloc before the old address is released.
+	 * Any pending aggregate is written first, so the events of the thread stay in sequence order.
+	 * The reserved sequence must be used by the next event written, or released.
 	 *
-	 * @param[in] time The elapsed time since application start.
+	 * @return The reserved sequence.
+	 */
+	long reserveSequence();
+
+	/**
+	 * Give up a reserved sequence, should no event need it.
+	 * The sequence never reaches the trace, so is counted as skipped.
+	 */
+	void releaseSequence() {
+		reserved_sequence = LONG_MAX;
+		skipped_sequences++;
+	}
+
+	/**
+	 * Fetch the sequence reserved ahead of its event, still to be written.
+	 * @return The sequence, or LONG_MAX if none.
+	 */
+	long getReservedSequence() const {
+		return reserved_sequence;
+	}
+
+	/*
+	 * A transient event replaces a run of allocations each freed by the next event of the thread.
+	 * The count and tick span are fixed width, so further pairs can update them in place.
+	 * Takes the form of:
+	 * 'J'<(VarInt)Sequence delta><(Signed VarInt)Tick delta><(Signed VarInt)Address delta>
+	 * 		<(VarInt)Alloc size><(Signed VarInt)StackID delta><(int)Count><(long)Tick span>
+	 */
+
+	/**
+	 * Function to add a small allocation to the pending aggregate, rather than write a Malloc event.
+	 *
+	 * @param[in] allocationsize The size of the new allocation
+	 * @param[in] stackid The ID of the call stack associated with this event (or -1 of not stack)
+	 * @param[in] ticks The timestamp of the event
+	 */
+	void addSmallAllocation(long allocationsize, int stackid,
+			unsigned long ticks) {
+		addToAggregate(allocationsize, 1, stackid, ticks);
+	}
+
+	/**
+	 * Function to add the free of a small allocation to the pending aggregate, rather than write a Free event.
+	 *
+	 * @param[in] allocationsize The size of the freed allocation
+	 * @param[in] stackid The ID of the call stack of the freed allocation
+	 * @param[in] ticks The timestamp of the event
+	 */
+	void addSmallFree(long allocationsize, int stackid, unsigned long ticks) {
+		addToAggregate(-allocationsize, -1, stackid, ticks);
+	}
+
+	/**
+	 * Function to write the pending aggregate to the buffer stream, if it holds any events.
+	 * The peak is the highest the net bytes reached since the last aggregate,
+	 * so the reader can keep an exact HWM.
+	 * The aggregate takes the sequence reserved by its first event, and no other thread has taken one since,
+	 * so its peak lands in the right place among the events of every thread.
+	 * Takes the form of:
+	 * 'A'<(VarInt)Sequence delta><(Signed VarInt)Tick delta><(Signed VarInt)Net bytes><(VarInt)Peak bytes>
+	 * 		<(VarInt)Entry count>< <(Signed VarInt)StackID delta><(Signed VarInt)Bytes><(Signed VarInt)Count>... >
+	 */
+	void flushAggregate();
+
+	/**
+	 * Stop any event already in the buffer, or the pending aggregate, from being undone or extended.
+	 * Used by checkpoints, as the events before the checkpoint must not change.
+	 * The owning thread must not be adding events.
+	 */
+	void closeEvents() {
+		candidate.offset = -1;
+		run_offset = -1;
+		aggregate_closed = true;
+	}
+
+	/**
+	 * Take the event lock, waiting while the writer hands over the buffer.
+	 * Held by the owning thread for the whole of each traced event.
+	 */
+	void lockEvents() {
+		while (__sync_lock_test_and_set(&event_lock, 1))
+			sched_yield();
+	}
+
+	/**
+	 * Take the event lock only if the owning thread is between events.
+	 * @return If the lock was taken.
+	 */
+	bool tryLockEvents() {
+		return __sync_lock_test_and_set(&event_lock, 1) == 0;
+	}
+
+	/**
+	 * Release the event lock.
+	 */
+	void unlockEvents() {
+		__sync_lock_release(&event_lock);
+	}
+
+	/**
+	 * Fetch the sequence of the first event not yet handed to the writer.
+	 * Any event the owning thread has yet to write will have a sequence no lower.
+	 * @return The sequence, or LONG_MAX if the buffer holds no events.
+	 */
+	long getPendingSequence() const {
+		return pending_sequence;
+	}
+
+	/**
+	 * Seal the frame of the buffer for the writer, filling in its size.
+	 *
+	 * @param[out] size The size of the frame in bytes.
+	 * @return The frame.
+	 */
+	char *sealFrame(long *size);
+
+	/**
+	 * Swap in a free buffer once the writer has taken the frame, and start the next frame.
+	 */
+	void nextFrame();
+
+	/**
+	 * Fetch the pool the buffers are acquired from.
+	 * @return The pool.
+	 */
+	BufferPool *getPool() {
+		return pool;
+	}
+
+	/**
+	 * Fetch the event count of the frame and its last tick count, for the trace index.
+	 * @return The statistics of the frame.
+	 */
+	IndexBlock *getStats() {
+		return &buffer_stats;
+	}
+
+	/**
+	 * Fetch the number of sequences taken by allocations folded into an existing transient event,
+	 * or reserved and released. These sequences never reach the trace.
+	 * @return The number of sequences skipped.
 	 */
-	void addTimer(double time);
+	long getSkippedSequences() const {
+		return skipped_sequences;
+	}
 
 };
 
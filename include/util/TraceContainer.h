@@ -0,0 +1,172 @@
+#ifndef TRACECONTAINER
+#define TRACECONTAINER
+
+#include "Util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <utility>
+
+/* Name of the shared trace file within the trace folder */
+#define WMTRACECONTAINER "traces.wmc"
+/* Marker at the very end of a shared trace file */
+#define CONTAINERMAGIC "WMTRACEC"
+/* Define the size of each collective write when filling the shared trace file */
+#define CONTAINERCHUNK 16777216
+/* Name of the file mapping each rank to its node trace */
+#define WMTRACENODEMAP "nodes.map"
+
+using namespace std;
+
+/**
+ * TraceContainer packs the traces of every rank into a single shared file.
+ *
+ * Opening a file per rank swamps the metadata server of a parallel file system at scale,
+ * both when the traces are written and when they are found again for analysis.
+ * Instead each rank spools its compressed trace to an unlinked node local file while it runs,
+ * then at the end of the job all ranks copy their spool into the shared file with collective MPI-IO writes.
+ *
+ * Each rank's trace is a contiguous segment, identical to the contents of a per-rank trace file.
+ * The shared file takes the form of:
+ * 	<Segment 0><Segment 1>...<Segment N-1>
+ * 	<(long)Offset 0><(long)Size 0><(long)Offset 1><(long)Size 1>...
+ * 	<(long)Index offset><(int)Rank count><"WMTRACEC">
+ *
+ * Readers ask for the usual per-rank trace name, which is resolved to a segment of the shared
+ * file through the index, so the analysis tools need no knowledge of the layout.
+ *
+ * Traces written through a NodeCollector are found the same way, through the node map
+ * written alongside the node traces:
+ * 	<(int)Rank count><(int)Node of rank 0><(int)Node of rank 1>...
+ */
+class TraceContainer {
+
+private:
+	/* The index of the shared file last read, kept as readers open each rank in turn */
+	static string index_name;
+	static vector<pair<long, long> > index;
+
+	/**
+	 * Read the index of a shared file, if not already held.
+	 *
+	 * @param container The name of the shared file.
+	 * @return If the file is a valid shared trace file.
+	 */
+	static bool readIndex(string container);
+
+	/* The node map last read */
+	static string node_map_name;
+	static vector<int> node_map;
+
+	/**
+	 * Read the node map of a trace folder, if not already held.
+	 *
+	 * @param folder The trace folder.
+	 * @return If the folder holds node traces.
+	 */
+	static bool readNodeMap(string folder);
+
+	/**
+	 * Extract the folder and rank from a per-rank trace name.
+	 *
+	 * @param[in] filename The name of the per-rank trace file, of the form <folder>/trace-<rank>.z
+	 * @param[out] folder The trace folder.
+	 * @return The rank, or -1 if not a per-rank trace name.
+	 */
+	static int parseTraceName(string filename, string *folder);
+
+public:
+
+	/**
+	 * Make the name of the shared file within a trace folder.
+	 *
+	 * @param folder The trace folder.
+	 * @return The name of the shared trace file.
+	 */
+	static string makeContainerName(string folder);
+
+	/**
+	 * Open an anonymous spool file for the compressed trace of this rank.
+	 * Made in TMPDIR (default /tmp) and unlinked at once, so it never touches the parallel file system.
+	 *
+	 * @return The file descriptor of the spool, or -1 on failure.
+	 */
+	static int openSpool();
+
+	/**
+	 * Copy the spool of every rank into its segment of the shared file, then write the index.
+	 * Collective over MPI_COMM_WORLD.
+	 *
+	 * @param container The name of the shared file.
+	 * @param spool The file descriptor of the spool of this rank.
+	 * @return The success of the write.
+	 */
+	static int writeSegments(string container, int spool);
+
+	/**
+	 * Find the segment of a shared file holding a per-rank trace.
+	 * Used when the trace was written to a shared file rather than its own.
+	 *
+	 * @param[in] filename The name of the per-rank trace file, of the form <folder>/trace-<rank>.z
+	 * @param[out] container The name of the shared file.
+	 * @param[out] offset The offset of the segment within the shared file.
+	 * @param[out] size The size of the segment in bytes.
+	 * @return If the trace was found in a shared file.
+	 */
+	static bool findSegment(string filename, string *container, long *offset,
+			long *size);
+
+	/**
+	 * Count the ranks held in the shared file of a trace folder.
+	 *
+	 * @param folder The trace folder.
+	 * @return The number of ranks, or -1 if the folder has no shared file.
+	 */
+	static int countSegments(string folder);
+
+	/**
+	 * Make the name of the trace of a node.
+	 *
+	 * @param folder The trace folder.
+	 * @param node The world rank of the collector of the node.
+	 * @return The name of the node trace file.
+	 */
+	static string makeNodeFileName(string folder, int node);
+
+	/**
+	 * Write the node map of a trace folder.
+	 *
+	 * @param folder The trace folder.
+	 * @param nodes The node of each rank.
+	 * @param count The number of ranks.
+	 * @return The success of the write.
+	 */
+	static int writeNodeMap(string folder, int *nodes, int count);
+
+	/**
+	 * Find the node trace holding a per-rank trace.
+	 * Used when the trace was written through a NodeCollector rather than to its own file.
+	 *
+	 * @param[in] filename The name of the per-rank trace file, of the form <folder>/trace-<rank>.z
+	 * @param[out] node_file The name of the node trace file.
+	 * @param[out] rank The rank to extract from the node trace.
+	 * @return If the trace was found in a node trace.
+	 */
+	static bool findNodeStream(string filename, string *node_file, int *rank);
+
+	/**
+	 * Count the ranks in the node map of a trace folder.
+	 *
+	 * @param folder The trace folder.
+	 * @return The number of ranks, or -1 if the folder has no node traces.
+	 */
+	static int countNodeRanks(string folder);
+
+};
+
+#endif
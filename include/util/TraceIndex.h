@@ -0,0 +1,145 @@
+#ifndef TRACEINDEX
+#define TRACEINDEX
+
+#include <stdlib.h>
+#include <string.h>
+#include <fstream>
+#include <vector>
+
+/* Marker at the very end of a trace with an index */
+#define INDEXMAGIC "WMTRACEI"
+
+using namespace std;
+
+/**
+ * The index entry of a compressed block.
+ */
+struct IndexBlock {
+	/* Offset of the block header from the start of the trace file */
+	long file_offset;
+	/* Offset of the block within the raw trace stream, and its raw size */
+	long raw_offset;
+	long raw_size;
+	/* Number of events in the block */
+	int events;
+	/* Highest tick count of any event up to the end of the block */
+	unsigned long ticks;
+};
+
+/**
+ * The index entry of a frame other than thread data, such as a stack or binary frame.
+ */
+struct IndexFrame {
+	char flag;
+	/* Offset of the frame within the raw trace stream */
+	long raw_offset;
+};
+
+/**
+ * TraceIndex is the footer of a trace, giving where each block and each metadata frame can be found.
+ *
+ * It is written after the final empty block, so readers which stop there never see it:
+ * <(long)File offset><(long)Raw offset><(long)Raw size><(int)Events><(long)Ticks>...
+ * <(char)Flag><(long)Raw offset>...
+ * <(long)Index offset><(int)Block count><(int)Frame count><"WMTRACEI">
+ *
+ * The reader finds it from the end of the trace, then looks up blocks and frames by binary search,
+ * so it can seek straight to the metadata it needs without inflating the events before it.
+ */
+class TraceIndex {
+private:
+	vector<IndexBlock> blocks;
+	vector<IndexFrame> frames;
+
+public:
+	/**
+	 * Add the next block.
+	 *
+	 * @param block The block entry.
+	 */
+	void addBlock(const IndexBlock &block) {
+		blocks.push_back(block);
+	}
+
+	/**
+	 * Add the next metadata frame.
+	 *
+	 * @param flag The frame flag.
+	 * @param raw_offset The offset of the frame in the raw stream.
+	 */
+	void addFrame(char flag, long raw_offset) {
+		IndexFrame frame = { flag, raw_offset };
+		frames.push_back(frame);
+	}
+
+	/**
+	 * Fetch the number of blocks.
+	 * @return The number of blocks.
+	 */
+	int getBlockCount() const {
+		return blocks.size();
+	}
+
+	/**
+	 * Fetch a block entry.
+	 * @param i The block number.
+	 * @return The block entry.
+	 */
+	const IndexBlock &getBlock(int i) const {
+		return blocks[i];
+	}
+
+	/**
+	 * Fetch the number of metadata frames.
+	 * @return The number of frames.
+	 */
+	int getFrameCount() const {
+		return frames.size();
+	}
+
+	/**
+	 * Fetch a metadata frame entry, in the order the frames were written.
+	 * @param i The frame number.
+	 * @return The frame entry.
+	 */
+	const IndexFrame &getFrame(int i) const {
+		return frames[i];
+	}
+
+	/**
+	 * Serialise the index, with its trailer, for the end of the trace.
+	 *
+	 * @param[out] out The serialised index.
+	 * @param[in] index_offset The offset the index will be written at, from the start of the trace file.
+	 */
+	void write(vector<char> &out, long index_offset) const;
+
+	/**
+	 * Read the index from the end of a trace.
+	 *
+	 * @param source The trace file.
+	 * @param start The offset of the trace within the file.
+	 * @param size The size of the trace, or -1 if it runs to the end of the file.
+	 * @return If an index was found.
+	 */
+	bool read(ifstream &source, long start, long size);
+
+	/**
+	 * Find the block holding an offset of the raw stream.
+	 *
+	 * @param raw_offset The raw offset.
+	 * @return The block number, or -1 if beyond the end of the trace.
+	 */
+	int findRawOffset(long raw_offset) const;
+
+	/**
+	 * Find the next metadata frame of one of a set of flags, at or after an offset of the raw stream.
+	 *
+	 * @param raw_offset The raw offset to search from.
+	 * @param flags The flags wanted, as a string.
+	 * @return The raw offset of the frame, or -1 if there are none.
+	 */
+	long findFrame(long raw_offset, const char *flags) const;
+};
+
+#endif
@@ -11,16 +11,40 @@
 #include "FunctionSiteAllocation.h"
 #include "FunctionMap.h"
 #include "RunData.h"
+#include "ElfData.h"
 #include "malloc_obj.h"
 #include "free_obj.h"
+#include "event_obj.h"
+#include "event_batch.h"
 
 #include <iostream>
 #include <assert.h>
+#include <limits.h>
 #include <set>
 #include <vector>
+#include <map>
+#include <deque>
 
 using namespace std;
 
+/**
+ * The decoded events of a single traced thread, waiting to be merged into the global timeline.
+ */
+struct ThreadStream {
+	/* Decoded events not yet merged, in sequence order */
+	deque<EventObj> events;
+	/* Every event of this thread below the watermark has been read */
+	long watermark;
+	/* The sequence of the last event read from this thread */
+	long last_sequence;
+	/* The elapsed time on the timeline of this thread */
+	double clock;
+	/* The tick count of the last event read from this thread (version 3) */
+	unsigned long ticks;
+	/* Has the thread exited - no further events will arrive */
+	bool exited;
+};
+
 /**
  * Class to read trace files.
  * Operates on two mode:
@@ -67,69 +91,230 @@ private:
 	/* Store the elf recorded static memory */
 	long static_mem;
 
+	/* Identity of the traced binary, from the Binary frame */
+	string binary_path;
+	string build_id;
+	long load_bias;
+	/* Have the symbols of the binary been added to the function map */
+	bool symbols_loaded;
+
+	/* Symbol tables already read, keyed by build-id (or path), shared by every trace of a job */
+	static map<string, vector<pair<long, string> > > symbol_cache;
+	/* Mean bytes between sampled call stacks, 0 if every call stack was captured */
+	long sample_rate;
+
+	/* Frees dropped by the tracer as they matched no traced allocation */
+	long untracked_frees;
+
+	/* The format version of the trace, 1 unless a Version frame is found */
+	int trace_version;
+
+	/* Tick rate and origin of the event timestamps, from the first Calibration frame */
+	double ticks_per_second;
+	unsigned long start_ticks;
+	int calibration_count;
+
+	/* Wall and CPU clocks at the start, and the time spent in each by the end of the run */
+	long start_wall;
+	long start_cpu;
+	double wall_time;
+	double cpu_time;
+
+	/* Reusable columns holding the events of a Data frame while they are applied */
+	EventBatch event_batch;
+
+	/* The event streams of each traced thread, keyed by thread ID */
+	map<int, ThreadStream> thread_streams;
+
+	/* Events below this sequence are held by the checkpoint the reader started from */
+	long resume_sequence;
+	/* Every event of every thread below this sequence has been read (version 5) */
+	long merge_watermark;
+
+	/*
+	 * Simple mode on a version 4 trace, where every free carries its size.
+	 * Merged events are then held as columns of their change in live bytes, peak, time and end time,
+	 * and the HWM found by a scan of each column, rather than by matching frees to allocations.
+	 */
+	vector<long> delta_column;
+	vector<long> peak_column;
+	vector<double> time_column;
+	vector<double> end_column;
+
 	void read();
 
 	/**
-	 * Read a Malloc from the Buffer
-	 * Takes the form of:
-	 * 'M'<(long)Address><(float)Timestamp as delta><(long)Alloc size><(int)StackID>
+	 * Process a frame, once its flag has been read.
 	 *
-	 *  Form a Malloc object (MallocObj) and add it to the storage structure.
+	 * @param flag The flag of the frame.
+	 * @return False at the end of the trace, or for an unknown frame.
+	 */
+	bool processFrame(char flag);
+
+	/**
+	 * Seek to a frame of the raw trace stream and process it.
+	 *
+	 * @param offset The raw offset of the frame.
+	 * @return False if the seek failed, or as processFrame.
+	 */
+	bool processFrameAt(long offset);
+
+	/**
+	 * Test if a checkpoint is before the searched allocation ID or time, from its header.
 	 *
-	 *  @return The allocation ID of the event.
+	 * @param offset The raw offset of the checkpoint frame.
+	 * @return If the searched event comes after the checkpoint, false if the header could not be read.
 	 */
-	long processMalloc();
+	bool isBeforeSearch(long offset);
 
 	/**
-	 * Read a Calloc from the Buffer
+	 * Start a search for an allocation ID or time from the last checkpoint before it, if the trace has any.
+	 * Uses the trace index to find the checkpoints, binary searching their headers as the checkpoints
+	 * are in order of both allocation ID and time, then reads the metadata frames before the one found, such as
+	 * the call stacks and threads. The events before the checkpoint are never inflated.
+	 * Otherwise the trace is read from its start.
+	 */
+	void resumeFromCheckpoint();
+
+	/**
+	 * Read a Checkpoint frame, skipping it as the state it holds is already known.
+	 * 'L'<(long)Frame size>...
+	 */
+	void processCheckpoint();
+
+	/**
+	 * Read a Checkpoint frame, restoring the live allocations it holds.
 	 * Takes the form of:
-	 * 'C'<(long)Address><(float)Timestamp as delta><(long)Alloc size><(int)StackID>
+	 * 'L'<(long)Frame size><(long)Sequence><(long)Allocation ID><(long)Ticks><(long)Live bytes>
+	 * 		<(long)Allocation count><(int)Stack count>
+	 * 		<(long)Address><(long)Size><(int)Stack ID>...
+	 * 		<(int)Stack ID><(long)Small bytes><(long)Small count>...
+	 */
+	void loadCheckpoint();
+
+	/**
+	 * Apply a decoded event to the storage structure.
+	 * Realloc events are processed as a free then a malloc, as described for ConsumptionHWMTracker::addRealloc.
 	 *
-	 * Form a Malloc object (MallocObj) and add it to the storage structure.
-	 * At this point the system does not differentiate between Malloc and Calloc.
+	 * @param event The event to apply.
+	 * @param time The time delta since the last event.
+	 * @return The allocation ID of the event.
+	 */
+	long applyEvent(const EventObj& event, float time);
+
+	/**
+	 * Should merged events be added to the columns, rather than applied one at a time.
+	 * Only in simple mode, from version 4, as the frees carry their size.
+	 *
+	 * @return True if the events are added to the columns.
+	 */
+	bool useColumns() const {
+		return !complex && trace_version >= 4;
+	}
+
+	/**
+	 * Add a merged event to the columns, as its change in live bytes and the peak within it.
+	 * A free is the negative of its size, a transient event peaks at its size and an aggregate at its peak.
+	 * The columns are scanned once full.
 	 *
-	 *  @return The allocation ID of the event.
+	 * @param event The event to add.
+	 */
+	void addToColumns(const EventObj& event);
+
+	/**
+	 * Scan the events held in the columns into the HWM tracker, and empty them.
 	 */
-	long processCalloc();
+	void flushColumns();
 
 	/**
-	 * Read a Realloc from the Buffer
+	 * Read in a Thread Data frame, containing the events of a single thread.
 	 * Takes the form of:
-	 * 'R'<(long)Old address><(long)New address><(float)Timestamp as delta><(long)Alloc size>
+	 * 'P'<(long) Data size><(int) Thread ID><(long) Watermark sequence><(long) Base sequence>
+	 * 		[<(long) Base ticks> - version 3]<Malloc / Calloc / Realloc / Free / Aggregate / Timer / Sequence>...
+	 * The events are encoded according to the trace version.
+	 * From version 5 the watermark bounds the events of every thread, before then only those of its own.
 	 *
-	 * Process a Realloc as if it was a Free and a Malloc.
-	 * - Find the original allocation
-	 * - If not found treat realloc as malloc, with -1 as stack ID. Add to the storage structure.
-	 * - Otherwise form a new malloc object (MallocObj) from the old data.
-	 * - Form a free object (FreeObj) from the malloc data.
-	 * - Execute the free.
-	 * - Execute the allocation.
+	 * The events are queued on the thread stream, then any events now known to be
+	 * next in the global sequence are merged.
+	 */
+	void processThreadEvents();
+
+	/**
+	 * Decode the fixed width (version 1) events of a Thread data frame onto the thread stream.
+	 * Each allocation event flag is followed by an (int) delta of the global event sequence,
+	 * then the record of the matching Data frame event. The frame is decoded in place.
 	 *
-	 * Must be this way around to ensure only a single entry for a key in the map, should the realloc return the same address.
+	 * @param stream The stream of the thread.
+	 * @param data_remaining The size of the events in bytes.
+	 */
+	void decodeThreadEvents(ThreadStream &stream, long data_remaining);
+
+	/**
+	 * Decode the compact (version 2 to 4) events of a Thread data frame onto the thread stream.
+	 * The frame is taken in place from the decompressor, then decoded from memory.
+	 * Version 2 events carry a nanosecond delta after the addresses, version 3 events a tick delta after the sequence.
+	 * Version 4 frees carry the size and call stack of the freed allocation, and reallocs the old size.
+	 * When the columns are used, such a realloc is queued as the free of the old allocation then a malloc.
+	 * See TraceBuffer for the encoding of each event.
 	 *
-	 *  @return The allocation ID of the last of the events as a realloc (if matched) represents a free and a malloc.
+	 * @param stream The stream of the thread.
+	 * @param size The size of the events in bytes.
 	 */
-	long processRealloc();
+	void decodeCompactEvents(ThreadStream &stream, long size);
 
 	/**
-	 * Read a Free from the Buffer
+	 * Read a Thread frame, marking the start or exit of a thread.
 	 * Takes the form of:
-	 * 'F'<(long)Address><(float)Timestamp as delta>
+	 * 'H'<(int) Thread ID><(char) State><(long) Sequence><(double) Elapsed time>
+	 */
+	void processThread();
+
+	/**
+	 * Fetch the stream of a thread, creating it should this be the first frame seen for the thread.
 	 *
-	 * Make a free object (FreeObj) from the data and add to the storage structure.
+	 * @param thread_id The ID of the thread.
+	 * @param sequence The global event sequence the thread starts from, if new.
+	 * @param time The elapsed time the thread starts from, if new.
+	 * @return The stream of the thread.
+	 */
+	ThreadStream &getThreadStream(int thread_id, long sequence, double time);
+
+	/**
+	 * Merge the queued thread events in global sequence order.
+	 * An event is only applied once below the highest watermark read (version 5),
+	 * or before then once every live thread has a watermark above it,
+	 * as no thread can then still hold an earlier event.
 	 *
-	 *  @return The allocation ID of the event.
+	 * @param flush If true apply all remaining events, used at the end of the trace.
 	 */
-	long processFree();
+	void mergeThreadEvents(bool flush);
 
 	/**
 	 * Read in an Events frame, which will contain allocation events.
 	 * Contains a collection of malloc / calloc / realloc and free frames.
 	 * Takes the form of:
-	 * 'E'<(long) Data size ><Malloc / Calloc / Realloc / Free >...
+	 * 'E'<(long) Data size ><Malloc / Calloc / Realloc / Free / Timer >...
+	 *
+	 * The frame is taken in place from the decompressor, decoded into a batch,
+	 * then applied to the storage structure in one call.
 	 */
 	void processEvents();
 
+	/**
+	 * Decode the events of a Data frame into a batch, stopping at the end of the trace or any unknown event.
+	 * Each event is the flag followed by its packed record (FrameRecords.h):
+	 * 'M'<(long)Address><(float)Timestamp as delta><(long)Alloc size><(int)StackID>
+	 * 'C'<(long)Address><(float)Timestamp as delta><(long)Alloc size><(int)StackID>
+	 * 'R'<(long)Old address><(long)New address><(float)Timestamp as delta><(long)Alloc size>
+	 * 'F'<(long)Address><(float)Timestamp as delta>
+	 * 'T'<(double) elapsed time>
+	 *
+	 * @param data The events of the frame.
+	 * @param size The size of the events in bytes.
+	 * @param[out] batch The batch to add the events to.
+	 */
+	void decodeDataEvents(const char *data, long size, EventBatch &batch);
+
 	/**
 	 * Read a stack frame, which will contain a number of call stacks.
 	 * Takes the form of:
@@ -149,6 +334,30 @@ private:
 	 */
 	void processElf();
 
+	/**
+	 * Read a Binary Frame, recording where to load the symbols from.
+	 * Format of Binary Frame is:
+	 *  'B' < (long)Frame size > < (long)Static memory > < (long)Load bias >
+	 * 		<(int)Build-id length><Build-id><(int)Path length><Path>
+	 */
+	void processBinary();
+
+	/**
+	 * Load the symbols of the traced binary into the function map, on first use.
+	 * Symbol tables are cached, so the binary is only read once however many traces use it.
+	 * A warning is printed if the binary cannot be read, or no longer matches the build-id of the trace.
+	 */
+	void loadSymbols();
+
+	/**
+	 * Add the functions of the binary to the function map.
+	 * Uses _init and _end as markers to start and stop function recording, each function ending where the next begins.
+	 *
+	 * @param symbols The start address and name of each symbol, ordered by address.
+	 * @param bias The load bias to add to each address.
+	 */
+	void addElfSymbols(const vector<pair<long, string> > &symbols, long bias);
+
 	/**
 	 * Read an Cores Frame
 	 * Format of Cores Frame is:
@@ -175,13 +384,39 @@ private:
 
 
 	/**
-	 * A function to read a timer frame.
-	 * A timer frame contains the elapsed time since the program started.
-	 * This is used to correct the timer drift introduced to excessive compression of tiny numbers.
-	 * 'T'<(double) elapsed time>
-	 *
+	 * A function to read a version frame, giving the encoding of the events that follow.
+	 * 'Y'<(int) Version>
+	 */
+	void processVersion();
+
+	/**
+	 * A function to read a sample frame, recording that call stacks were sampled.
+	 * 'W'<(long) Mean bytes between samples>
 	 */
-	void processTimer();
+	void processSampleRate();
+
+	/**
+	 * A function to read an untracked frees frame, counting the frees the tracer dropped.
+	 * 'U'<(long) Frees filtered>
+	 */
+	void processUntrackedFrees();
+
+	/**
+	 * A function to read a calibration frame.
+	 * The first fixes the tick rate and the origin of the timeline, the last the wall and CPU time of the run.
+	 * 'K'<(double) Ticks per second><(long) Ticks><(long) Wall clock (ns)><(long) Process CPU time (ns)>
+	 */
+	void processCalibration();
+
+	/**
+	 * Convert a tick count to the elapsed time since tracing started.
+	 * Computed from the absolute count, so no error builds up over the run.
+	 * @param ticks The tick count.
+	 * @return The elapsed time in seconds.
+	 */
+	double ticksToSeconds(unsigned long ticks) const {
+		return (long) (ticks - start_ticks) / ticks_per_second;
+	}
 
 public:
 	/**
@@ -197,10 +432,12 @@ public:
 	 * @param samples Should we collect point information for heat map samples
 	 * @param searchID Specify a an allocation ID to search for - used to support multipass searches
 	 * @param searchTime Stop at a specific time
+	 * @param queryTimes Capture the state at each of these times, without stopping - needs a complex trace
 	 */
 	TraceReader(string filename = "", bool consumptionGraph = false,
 			bool functionGraph = false, bool allocationGraph = false,
-			bool samples = false, long searchID = -1, double searchTime = -1);
+			bool samples = false, long searchID = -1, double searchTime = -1,
+			const vector<double> &queryTimes = vector<double>());
 
 	/**
 	 * Deconstructor for the TraceReader object.
@@ -252,6 +489,26 @@ public:
 		return hwm_tracker->getFunctionBreakdown();
 	}
 
+	/**
+	 * A function to return the amount of memory allocated by different function call stacks at the HWM.
+	 * Kept as the trace is read by a complex reader, so needs no second pass to the HWM ID,
+	 * though the individual allocation sizes are not known.
+	 *
+	 * @return A set of the allocations at the HWM grouped by call stack ID.
+	 */
+	set<FunctionSiteAllocation *, FunctionSiteAllocation::comparator> getHWMFunctionBreakdown() {
+		return hwm_tracker->getHWMFunctionBreakdown();
+	}
+
+	/**
+	 * Fetch the state captured at each of the query times.
+	 *
+	 * @return The captured states, in order of time, owned by the reader.
+	 */
+	const vector<QueryPoint *> &getQueryPoints() {
+		return hwm_tracker->getQueryPoints();
+	}
+
 	/**
 	 * A function to fetch the composite functions of a call stack in terms of their strings.
 	 *
@@ -266,6 +523,7 @@ public:
 	 * @return The FunctionMap object.
 	 */
 	FunctionMap* getFunctionMap() {
+		loadSymbols();
 		return f_map;
 	}
 
@@ -297,6 +555,15 @@ public:
 		return hwm_tracker->getFinishTime();
 	}
 
+	/**
+	 * Find the time of the last event of a trace from its index, without reading the events.
+	 * The last block holds the highest tick count of the run, timed from the first calibration frame.
+	 *
+	 * @param filename The trace file.
+	 * @return The time (s), or -1 if the trace has no index or calibration.
+	 */
+	static double findFinishTime(string filename);
+
 	/**
 	 * Using the data of all the allocation points reduce to a vector of samples points.
 	 * Calculate time offset and record the memory consumption at each time.
@@ -317,6 +584,46 @@ public:
 	long getStaticMem() {
 		return static_mem;
 	}
+
+	/**
+	 * A function to return the call stack sample rate of the trace.
+	 * @return The mean bytes between sampled call stacks, or 0 if every call stack was captured.
+	 */
+	long getSampleRate() {
+		return sample_rate;
+	}
+
+	/**
+	 * A function to return the number of frees dropped by the tracer, as they matched no traced allocation.
+	 * @return The number of frees filtered.
+	 */
+	long getUntrackedFrees() {
+		return untracked_frees;
+	}
+
+	/**
+	 * A function to return the memory held by the reader to match frees to their allocations.
+	 * @return The size of the table of live allocations in bytes.
+	 */
+	long getAllocationFootprint() {
+		return hwm_tracker->getAllocationFootprint();
+	}
+
+	/**
+	 * A function to return the wall clock time of the traced run.
+	 * @return The wall time in seconds, or 0 if not recorded.
+	 */
+	double getWallTime() {
+		return wall_time;
+	}
+
+	/**
+	 * A function to return the process CPU time of the traced run.
+	 * @return The CPU time in seconds, or 0 if not recorded.
+	 */
+	double getCPUTime() {
+		return cpu_time;
+	}
 };
 
 #endif
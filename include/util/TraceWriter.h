@@ -0,0 +1,333 @@
+#ifndef TRACEWRITER
+#define TRACEWRITER
+
+#include "Util.h"
+
+#include "Compress.h"
+#include "NodeCollector.h"
+#include "ElfData.h"
+#include "VirtualMemoryData.h"
+#include "FrameData.h"
+#include "StackMap.h"
+#include "BufferPool.h"
+#include "LiveAllocationTable.h"
+#include "stdlib.h"
+#include <sstream>
+#include <vector>
+#include <map>
+#include <pthread.h>
+
+#include <iostream>
+
+using namespace std;
+
+class TraceBuffer;
+
+/**
+ * TraceWriter is the output side of WMTrace shared by every traced thread.
+ *
+ * It owns the zlib compressor and writes the per-job frames (Binary, Cores, Virtual, Stacks).
+ * Each thread fills its own TraceBuffer without locking, and only takes the writer lock when
+ * handing a full buffer over to the compression worker.
+ *
+ * The writer also hands out the global event sequence, used by TraceReader to merge the thread
+ * streams back into a single ordered timeline. Each thread data frame carries a watermark, below which
+ * every event of every thread has been written, so the reader never waits on a thread which is idle.
+ * The partial buffer of a thread which has held the watermark back since the last frame, while idle,
+ * is handed over with the next frame of any thread.
+ */
+class TraceWriter {
+
+private:
+	/* Objects - the trace goes through either our own compressor or the collector of the node */
+	Compress *z_comp;
+	NodeCollector *node_collector;
+	FrameData *frame_data;
+
+	StackMap *stack_map;
+
+	/* Lock protecting the compressor and the stack print queue */
+	pthread_mutex_t writer_lock;
+
+	/* Global event sequence, shared by all threads */
+	volatile long event_sequence;
+
+	/* The buffers of the live threads, and the watermark of the last thread data frame */
+	vector<TraceBuffer *> buffers;
+	long last_watermark;
+
+	/* Number of threads registered with the writer */
+	int thread_count;
+
+	/* Bytes of thread data queued so far, to space out checkpoints */
+	volatile long thread_data_bytes;
+
+	/* Has the stream been finished */
+	bool finished;
+
+	/* Static memory of the binary, from its program headers */
+	long static_mem;
+
+	/**
+	 * Pass a copy of a frame on to the output.
+	 *
+	 * @param data The frame.
+	 * @param size The size of the frame in bytes.
+	 * @return Success of the function.
+	 */
+	int writeData(char *data, int size);
+
+	/**
+	 * Pass a fixed frame on to the output, as its flag followed by its packed record.
+	 *
+	 * @param flag The frame flag.
+	 * @param record The record of the frame.
+	 * @return Success of the function.
+	 */
+	template<class Record>
+	int writeRecord(char flag, const Record &record) {
+		FrameRecord<Record> frame = makeFrame(flag, record);
+		return writeData((char *) &frame, sizeof(frame));
+	}
+
+	/**
+	 * Function to write the identity of the binary to the compressor.
+	 * The symbol table is not copied into the trace, but loaded from the binary at analysis time.
+	 * Takes the form of:
+	 * 'B'<(long)Frame size><(long)Static memory><(long)Load bias>
+	 * 		<(int)Build-id length><Build-id><(int)Path length><Path>
+	 * 	@return Success of the function.
+	 */
+	int fetchBinaryData();
+
+	/**
+	 * A function to fetch the virtual address memory space functions. These differ between ranks due to memory offsets.
+	 * Takes the form of:
+	 * 'V'<(long) Frame size (b)><(int) Function count>
+	 * 		<(long) start address><(long) End address><(int) Name length><(char *) Name>
+	 * 		<(long) start address><(long) End address><(int) Name length><(char *) Name>
+	 * 		...
+	 * @return Success of the function.
+	 */
+	int fetchVirtualAddresses();
+
+	/**
+	 * Write out new call stacks from the StackMap print buffer to the zlib compression buffer.
+	 * Must be written before allocation data which makes use of the stacks.
+	 * If print buffer is empty, do not print frame.
+	 * Takes the form of:
+	 * 'S'<(long)Frame size><(int)Stack count>
+	 * <(int)Stack ID><(int)Stack entries>< <(long)Address><(long)Address>... >
+	 * <(int)Stack ID><(int)Stack entries>< <(long)Address><(long)Address>... >
+	 * ...
+	 *
+	 * @return Success of the function.
+	 */
+	int fetchCallStacks();
+
+	/**
+	 * Write out core data about the current job, including rank, comm size, machine name and machine rank.
+	 * This allows the data to be used later without having to manually remember it.
+	 * Takes the form of:
+	 * 'C'<(long)Frame size><(int) Rank><(int) Comm size><(int) Machine name size><(String) Machine name>
+	 *
+	 * @return Success of the function.
+	 */
+	int fetchCoreData();
+
+	/**
+	 * Write out the version of the trace format, which must precede any thread data.
+	 * Takes the form of:
+	 * 'Y'<(int) Version>
+	 */
+	void fetchVersion();
+
+	/**
+	 * Write a thread frame, marking the start or exit of a thread.
+	 * Must be called with the writer lock held.
+	 * Takes the form of:
+	 * 'H'<(int) Thread ID><(char) State><(long) Sequence><(double) Elapsed time>
+	 *
+	 * @param thread_id The ID of the thread.
+	 * @param state The state of the thread - FrameData::THREADSTART or FrameData::THREADEXIT.
+	 * @param sequence The global event sequence at the time of the change.
+	 * @param time The elapsed time since application start.
+	 */
+	void writeThreadFrame(int thread_id, char state, long sequence,
+			double time);
+
+	/**
+	 * Queue the frame of a thread buffer for compression, with the writer lock held.
+	 * The lowest sequence still held by any other buffer is patched into the frame header as its watermark.
+	 * The buffer must then start its next frame.
+	 *
+	 * @param buffer The buffer of the frame, which its owner is not adding to.
+	 * @return The success of queueing the buffer.
+	 */
+	int queueThreadData(TraceBuffer *buffer);
+
+public:
+
+	/**
+	 * Constructor for the writer object.
+	 * Start the file by writing the Binary and Cores data.
+	 *
+	 * @param stackmap The StackMap shared by all threads, drained before each data frame.
+	 * @param worker_init Optional function for the compression worker thread to call when it starts.
+	 * @param shared Write every rank to a single shared trace file, rather than a file each.
+	 * @param node Send the trace through a collector per node, rather than compressing it ourselves.
+	 * @param codec_id The compression codec ID.
+	 * @param codec_level The zlib level, or CODECADAPTIVE to adapt it as the trace is written.
+	 * @param compress_threads The number of compression worker threads.
+	 */
+	TraceWriter(StackMap *stackmap, void (*worker_init)() = NULL,
+			bool shared = false, bool node = false, char codec_id = Codec::ZLIB,
+			int codec_level = CODECDEFAULTLEVEL, int compress_threads =
+					COMPRESSWORKERS);
+
+	/**
+	 * Deconstructor for the writer object.
+	 * Frees the memory of allocated objects.
+	 */
+	~TraceWriter();
+
+	/**
+	 * Fetch the next value of the global event sequence.
+	 * Lock free, so can be called from any thread.
+	 *
+	 * @return The sequence number of the new event.
+	 */
+	long nextSequence() {
+		return __sync_fetch_and_add(&event_sequence, 1);
+	}
+
+	/**
+	 * Fetch the current value of the global event sequence, without taking a new one.
+	 * @return The sequence the next event will be given.
+	 */
+	long getSequence() {
+		return event_sequence;
+	}
+
+	/**
+	 * Fetch the bytes of thread data queued so far.
+	 * @return The bytes of thread data.
+	 */
+	long getThreadDataBytes() {
+		return thread_data_bytes;
+	}
+
+	/**
+	 * Register a new thread with the writer, writing a thread start frame.
+	 *
+	 * @param[in] time The elapsed time since application start, to start the thread timeline from.
+	 * @param[out] sequence The global event sequence at the point the thread started.
+	 * @return The ID of the new thread.
+	 */
+	int registerThread(double time, long *sequence);
+
+	/**
+	 * Mark a thread as having exited, once its buffer has been flushed.
+	 * Lets the reader stop waiting for further events from it.
+	 *
+	 * @param thread_id The ID of the exiting thread.
+	 * @param time The elapsed time since application start.
+	 */
+	void exitThread(int thread_id, double time);
+
+	/**
+	 * Record that call stacks are sampled, so the reader can weight the sampled allocations.
+	 * Must be written before any thread data.
+	 * Takes the form of:
+	 * 'W'<(long) Mean bytes between samples>
+	 *
+	 * @param sample_rate The mean number of bytes allocated between each sampled call stack.
+	 */
+	void addSampleRate(long sample_rate);
+
+	/**
+	 * Add the number of frees dropped by the tracer, as they matched no traced allocation.
+	 * Takes the form of:
+	 * 'U'<(long) Frees filtered>
+	 *
+	 * @param frees The number of frees filtered.
+	 */
+	void addUntrackedFrees(long frees);
+
+	/**
+	 * Record the tick rate of the event timestamps, and the wall and CPU clocks at a given tick.
+	 * Written when tracing starts, fixing the origin of the timeline, and again when it finishes.
+	 * Takes the form of:
+	 * 'K'<(double) Ticks per second><(long) Ticks><(long) Wall clock (ns)><(long) Process CPU time (ns)>
+	 *
+	 * @param rate The number of ticks per second.
+	 * @param ticks The tick count the clocks were read at.
+	 * @param wall The wall clock in nanoseconds since the epoch.
+	 * @param cpu The process CPU time in nanoseconds.
+	 */
+	void addCalibration(double rate, unsigned long ticks, long wall, long cpu);
+
+	/**
+	 * Write a checkpoint of the live heap, so the reader can start from it rather than the start of the trace.
+	 * Describes the state once every event below the sequence has been applied, so no event may be
+	 * added while it is written. Any new call stacks are written first.
+	 * Takes the form of:
+	 * 'L'<(long)Frame size><(long)Sequence><(long)Allocation ID><(long)Ticks><(long)Live bytes>
+	 * 		<(long)Allocation count><(int)Stack count>
+	 * 		<(long)Address><(long)Size><(int)Stack ID>...
+	 * 		<(int)Stack ID><(long)Small bytes><(long)Small count>...
+	 *
+	 * @param sequence The global event sequence of the checkpoint.
+	 * @param allocation_id The allocation ID the reader will have reached at the sequence.
+	 * @param ticks The tick count of the checkpoint.
+	 * @param allocations The live allocations traced by their own events.
+	 * @param small_bytes The live bytes of the aggregated small allocations of each call stack.
+	 * @param small_counts The number of live small allocations of each call stack.
+	 */
+	void addCheckpoint(long sequence, long allocation_id, unsigned long ticks,
+			const vector<LiveAllocationTable::LiveEntry> &allocations,
+			const map<int, long> &small_bytes,
+			const map<int, long> &small_counts);
+
+	/**
+	 * Queue the full thread data frame of a buffer for compression.
+	 * Any new call stacks are written first, then the partial buffers of idle threads holding the watermark back,
+	 * then the frame with its watermark patched into the header.
+	 * The frame is handed over, and released back to the pool of the buffer once compressed.
+	 * The rest of the trace state is filled in to the statistics of the frame, for the index.
+	 * The buffer must then start its next frame.
+	 *
+	 * @param buffer The buffer of the frame, owned by the calling thread.
+	 * @return The success of queueing the buffer.
+	 */
+	int addThreadData(TraceBuffer *buffer);
+
+	/**
+	 * Add the buffer of a new thread, so its pending sequence bounds the watermark.
+	 * @param buffer The buffer.
+	 */
+	void attachBuffer(TraceBuffer *buffer);
+
+	/**
+	 * Remove the buffer of an exiting thread, once flushed.
+	 * @param buffer The buffer.
+	 */
+	void detachBuffer(TraceBuffer *buffer);
+
+	/**
+	 * Fetch the static memory of the binary, as written to the Binary frame.
+	 * @return The static memory in bytes.
+	 */
+	long getStaticMem() {
+		return static_mem;
+	}
+
+	/**
+	 * Finish the output stream.
+	 * Print the Virtual Memory function addresses, then wait for the compressor to flush.
+	 * Collective when writing a shared trace file or through a node collector.
+	 */
+	void finish();
+};
+
+#endif
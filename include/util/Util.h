@@ -26,15 +26,18 @@ using namespace std;
 #define WMANALYSISGRAPH ".graph"
 #define WMANALYSISFUNCTIONS ".functions"
 #define WMANALYSISALLOCATIONS ".allocations"
+#define WMANALYSISTIMES ".times"
 
 /* Define the default spacing between points on the output graph - 1kb */
 #define GRAPHINTERVAL 1024
 /* Define the size of the trace buffer used throughout */
 #define BUFFERSIZE 33554432
+/* Define the size of the trace buffer of each additional thread */
+#define THREADBUFFERSIZE 4194304
+/* Define the number of trace buffers each thread swaps between while compression runs */
+#define BUFFERCOUNT 2
 /* Define the size of the decompression chunk */
 #define DCCHUNK 1048576
-/* Define the timer frame frequency */
-#define TIMERFREQUENCY 100
 
 /**
  * WMUtils is a collection of static utility functions.
@@ -133,6 +136,15 @@ public:
 	 */
 	static string makeFunctionsFilename(string tracefile);
 
+	/**
+	 * Make a filename for the time query output file.
+	 * Use the original filename + the suffix recorded.
+	 *
+	 * @param tracefile The filename of the original trace.
+	 * @return The new filename.
+	 */
+	static string makeTimesFilename(string tracefile);
+
 	/**
 	 * Make a filename for the allocations output file.
 	 * Use the original filename + the suffix recorded.
@@ -173,6 +185,7 @@ public:
 
 	/**
 	 * A function to determine the number of traces in a run, based on the number of trace files in the folder.
+	 * If the run wrote a shared trace file or node traces, the count is read from their index instead.
 	 * Not a perfect guarentee - best to check data stored within trace for comm size.
 	 * @param base The name of the folder to check in.
 	 * @return The number of trace files in the folder.
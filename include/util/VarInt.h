@@ -0,0 +1,91 @@
+#ifndef VARINT
+#define VARINT
+
+/**
+ * VarInt is a collection of static functions for the variable length integer encoding of trace events.
+ *
+ * Unsigned values are written 7 bits per byte, least significant first, with the top bit marking that
+ * more bytes follow. Signed values are first zigzag encoded, so small negative deltas stay small.
+ */
+class VarInt {
+public:
+	/* The largest number of bytes a 64-bit value can take */
+	static const int MAXBYTES = 10;
+
+	/**
+	 * Encode an unsigned value.
+	 *
+	 * @param[out] out The buffer to write to, with at least MAXBYTES of space.
+	 * @param[in] value The value to encode.
+	 * @return The number of bytes written.
+	 */
+	static int encode(unsigned char *out, unsigned long value) {
+		int i = 0;
+		while (value >= 0x80) {
+			out[i++] = (unsigned char) (value | 0x80);
+			value >>= 7;
+		}
+		out[i++] = (unsigned char) value;
+		return i;
+	}
+
+	/**
+	 * Encode a signed value through zigzag encoding.
+	 *
+	 * @param[out] out The buffer to write to, with at least MAXBYTES of space.
+	 * @param[in] value The value to encode.
+	 * @return The number of bytes written.
+	 */
+	static int encodeSigned(unsigned char *out, long value) {
+		return encode(out, zigzag(value));
+	}
+
+	/**
+	 * Decode an unsigned value.
+	 *
+	 * @param[in,out] in The position to read from, moved past the value.
+	 * @return The decoded value.
+	 */
+	static unsigned long decode(const unsigned char **in) {
+		const unsigned char *pos = *in;
+		unsigned long value = 0;
+		int shift = 0;
+		while (*pos & 0x80) {
+			value |= ((unsigned long) (*pos++ & 0x7F)) << shift;
+			shift += 7;
+		}
+		value |= ((unsigned long) *pos++) << shift;
+		*in = pos;
+		return value;
+	}
+
+	/**
+	 * Decode a zigzag encoded signed value.
+	 *
+	 * @param[in,out] in The position to read from, moved past the value.
+	 * @return The decoded value.
+	 */
+	static long decodeSigned(const unsigned char **in) {
+		return unzigzag(decode(in));
+	}
+
+	/**
+	 * Map a signed value to unsigned, interleaving negative and positive values.
+	 * @param value The signed value.
+	 * @return The zigzag encoded value.
+	 */
+	static unsigned long zigzag(long value) {
+		return (((unsigned long) value) << 1) ^ (unsigned long) (value >> 63);
+	}
+
+	/**
+	 * Reverse the zigzag encoding.
+	 * @param value The zigzag encoded value.
+	 * @return The signed value.
+	 */
+	static long unzigzag(unsigned long value) {
+		return (long) (value >> 1) ^ -((long) (value & 1));
+	}
+};
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef EVENT_BATCH
+#define EVENT_BATCH
+
+#include <vector>
+
+using namespace std;
+
+/**
+ * The EventBatch class stores the decoded events of a whole Data frame, one column per field.
+ *
+ * A frame is decoded into the columns in one pass, then handed to the tracker in one call,
+ * rather than each field of each event being requested from the decompressor in turn.
+ * The columns keep their capacity when cleared, so a batch is reused for every frame.
+ *
+ * Holds the same events as event_obj, without the global sequence of the thread events.
+ */
+class EventBatch {
+private:
+	vector<char> flags;
+	vector<long> pointers;
+	vector<long> new_pointers;
+	vector<long> sizes;
+	vector<double> times;
+	vector<int> stacks;
+
+public:
+	/**
+	 * Add an event to the end of the batch
+	 * @param flag The flag of the event ('M', 'C', 'R', 'F', or 'T' for a timer)
+	 * @param pointer The address of the event (the old address for a realloc)
+	 * @param pointer_new The new address of a realloc, otherwise unused
+	 * @param size The size of the allocation, or 0 for a free
+	 * @param time The time delta since the last event, or the elapsed time of a timer
+	 * @param id The stack ID of the call stack associated with this event
+	 */
+	void add(char flag, long pointer, long pointer_new, long size, double time,
+			int id) {
+		flags.push_back(flag);
+		pointers.push_back(pointer);
+		new_pointers.push_back(pointer_new);
+		sizes.push_back(size);
+		times.push_back(time);
+		stacks.push_back(id);
+	}
+
+	/**
+	 * Empty the batch, keeping the space of the columns
+	 */
+	void clear() {
+		flags.clear();
+		pointers.clear();
+		new_pointers.clear();
+		sizes.clear();
+		times.clear();
+		stacks.clear();
+	}
+
+	/**
+	 * Getter for the number of events
+	 * @return The number of events in the batch
+	 */
+	long size() const {
+		return flags.size();
+	}
+
+	/**
+	 * Getter for the event flag
+	 * @param i The index of the event
+	 * @return The event flag
+	 */
+	char getFlag(long i) const {
+		return flags[i];
+	}
+
+	/**
+	 * Getter for the event address
+	 * @param i The index of the event
+	 * @return The event pointer
+	 */
+	long getPointer(long i) const {
+		return pointers[i];
+	}
+
+	/**
+	 * Getter for the new address of a realloc
+	 * @param i The index of the event
+	 * @return The new realloc pointer
+	 */
+	long getNewPointer(long i) const {
+		return new_pointers[i];
+	}
+
+	/**
+	 * Getter for the allocation size
+	 * @param i The index of the event
+	 * @return The allocation size
+	 */
+	long getSize(long i) const {
+		return sizes[i];
+	}
+
+	/**
+	 * Getter for the event time
+	 * @param i The index of the event
+	 * @return The time delta of the event, or the elapsed time of a timer
+	 */
+	double getTime(long i) const {
+		return times[i];
+	}
+
+	/**
+	 * Getter for the event stack ID
+	 * @param i The index of the event
+	 * @return The event stack ID
+	 */
+	int getStackID(long i) const {
+		return stacks[i];
+	}
+};
+#endif
@@ -0,0 +1,113 @@
+#ifndef EVENT_OBJ
+#define EVENT_OBJ
+
+#include <stdio.h>
+
+/**
+ * The EventObj class is a glorified struct to store a decoded thread event.
+ *
+ * Thread data frames are decoded into a queue of these, until the events of every
+ * thread can be merged back into global sequence order.
+ *
+ * Similar to malloc_obj and free_obj, but able to hold any of the allocation events.
+ */
+class EventObj {
+private:
+	char event_flag;
+	long event_sequence;
+	long event_pointer;
+	long event_pointer_new;
+	long event_size;
+	double event_time;
+	double event_end_time;
+	int stack_id;
+
+public:
+	/**
+	 * Constructor for the event object
+	 * @param flag The flag of the event ('M', 'C', 'R', 'F', 'J' for a transient run, or 'A' and 'G' for an aggregate and its call stacks)
+	 * @param sequence The global sequence number of the event
+	 * @param pointer The address of the event (the old address for a realloc)
+	 * @param pointer_new The new address of a realloc, or the count of a transient run, otherwise unused
+	 * @param size The size of the allocation, or for a free the freed size from version 4, otherwise 0
+	 * @param time The elapsed time of the event, on the timeline of its thread
+	 * @param id The stack ID of the call stack associated with this event (of the freed allocation for a free)
+	 * @param end_time The elapsed time of the last free of a transient run, if later than the time of the event
+	 */
+	EventObj(char flag, long sequence, long pointer, long pointer_new,
+			long size, double time, int id, double end_time = 0.0) {
+		event_flag = flag;
+		event_sequence = sequence;
+		event_pointer = pointer;
+		event_pointer_new = pointer_new;
+		event_size = size;
+		event_time = time;
+		event_end_time = end_time > time ? end_time : time;
+		stack_id = id;
+	}
+
+	/**
+	 * Getter for the event flag
+	 * @return The event flag
+	 */
+	char getFlag() const {
+		return event_flag;
+	}
+
+	/**
+	 * Getter for the global sequence number
+	 * @return The event sequence number
+	 */
+	long getSequence() const {
+		return event_sequence;
+	}
+
+	/**
+	 * Getter for the event address
+	 * @return The event pointer
+	 */
+	long getPointer() const {
+		return event_pointer;
+	}
+
+	/**
+	 * Getter for the new address of a realloc
+	 * @return The new realloc pointer
+	 */
+	long getNewPointer() const {
+		return event_pointer_new;
+	}
+
+	/**
+	 * Getter for the allocation size
+	 * @return The allocation size
+	 */
+	long getSize() const {
+		return event_size;
+	}
+
+	/**
+	 * Getter for the event time
+	 * @return The elapsed time of the event
+	 */
+	double getTime() const {
+		return event_time;
+	}
+
+	/**
+	 * Getter for the end time, the time of the last free of a transient run
+	 * @return The elapsed time the event ends, the same as its time for any other event
+	 */
+	double getEndTime() const {
+		return event_end_time;
+	}
+
+	/**
+	 * Getter for the event stack ID
+	 * @return The event stack ID
+	 */
+	int getStackID() const {
+		return stack_id;
+	}
+};
+#endif
@@ -9,6 +9,7 @@
 
 #include "../include/WMTimer.h"
 #include "../include/WMTrace.h"
+#include "../include/WMTraceAPI.h"
 #include "../include/WMAnalysis.h"
 #include "../include/util/TraceReader.h"
 
@@ -105,6 +106,34 @@ void init(){
                         } else if (strcmp(line, "--WMTOOLSPOSTPROCESSFUNCTIONS") == 0) {
                                 WMT->setPostProcess(true);
                                 WMT->setPostProcessFunctions(true);
+                        } else if (strncmp(line, "--WMTOOLSSTACKDEPTH=", 20) == 0) {
+                                WMT->setStackDepth(atoi(line + 20));
+                        } else if (strncmp(line, "--WMTOOLSSTACKSKIP=", 19) == 0) {
+                                WMT->setStackSkip(atoi(line + 19));
+                        } else if (strncmp(line, "--WMTOOLSSAMPLERATE=", 20) == 0) {
+                                WMT->setSampleRate(atol(line + 20));
+                        } else if (strncmp(line, "--WMTOOLSSMALLTHRESHOLD=", 24) == 0) {
+                                WMT->setSmallThreshold(atol(line + 24));
+                        } else if (strcmp(line, "--WMTOOLSCOALESCE") == 0) {
+                                WMT->setCoalesce(true);
+                        } else if (strcmp(line, "--WMTOOLSSHAREDFILE") == 0) {
+                                WMT->setSharedFile(true);
+                        } else if (strcmp(line, "--WMTOOLSNODECOLLECTOR") == 0) {
+                                WMT->setNodeCollector(true);
+                        } else if (strcmp(line, "--WMTOOLSCODEC=adaptive") == 0) {
+                                WMT->setCodec(Codec::ZLIB);
+                                WMT->setCodecLevel(CODECADAPTIVE);
+                        } else if (strncmp(line, "--WMTOOLSCODEC=", 15) == 0) {
+                                if (Codec::fromName(line + 15) != 0)
+                                        WMT->setCodec(Codec::fromName(line + 15));
+                        } else if (strncmp(line, "--WMTOOLSCODECLEVEL=", 20) == 0) {
+                                WMT->setCodecLevel(atoi(line + 20));
+                        } else if (strncmp(line, "--WMTOOLSCOMPRESSTHREADS=", 25) == 0) {
+                                WMT->setCompressThreads(atoi(line + 25));
+                        } else if (strncmp(line, "--WMTOOLSCHECKPOINTMB=", 22) == 0) {
+                                WMT->setCheckpointBytes(atol(line + 22) * 1048576);
+                        } else if (strncmp(line, "--WMTOOLSCHECKPOINTSECONDS=", 27) == 0) {
+                                WMT->setCheckpointSeconds(atof(line + 27));
                         }
                 }
 
@@ -156,12 +185,14 @@ void fini(){
 
 	/* Only post process if we have told it to */
 	if (WMT->isPostProcess()) {
-		WMAnalysis *wm = new WMAnalysis(WMUtils::makeFileName(), WMT->isPostProcessGraph(), WMT->isPostProcessFunctions(), false, false);
-		TraceReader *tr = wm->getTraceReader();
-		//TraceReader *tr = new TraceReader(WMUtils::makeFileName(),
-				//WMT->isPostProcessGraph(), WMT->isPostProcessFunctions());
-		long mem = tr->getHWMMemory();
-		long elf = tr->getStaticMem();
+		/* The HWM is kept by the tracer, so the trace is only read back for graphs and breakdowns */
+		if (WMT->isPostProcessGraph() || WMT->isPostProcessFunctions()) {
+			WMAnalysis *wm = new WMAnalysis(WMUtils::makeFileName(), WMT->isPostProcessGraph(), WMT->isPostProcessFunctions(), false, false);
+			delete wm;
+		}
+
+		long mem = WMT->getHWMBytes();
+		long elf = WMT->getStaticMem();
 		long total_mem[WMT->getCommSize()];
 
 		/* Gather the HWMs from all ranks */
@@ -196,12 +227,59 @@ void fini(){
 			cout << "Standard deviation - " << std << "(B) \n";
 			cout << "Static memory consumption of " << elf << "(B).\n";
 		}
-
-		delete wm;
 	}
 
 }
 
+/**
+ * Wrapper to MPI_Pcontrol
+ * A level of 1 prints the current and HWM memory of the rank, 2 or above also the call stacks holding the most memory.
+ *
+ * @param level The profiling level
+ * @return MPI_Error
+ */
+int MPI_Pcontrol(const int level, ...) {
+	if (WMT != NULL && init_called && level > 0)
+		WMT->printLiveReport(level > 1 ? LIVETOPSTACKS : 0);
+
+	return PMPI_Pcontrol(level);
+}
+
+/**
+ * Runtime query of the live heap memory
+ * @return The live heap memory in bytes
+ */
+_EXTERN_C_ long wmtrace_current_bytes(void) {
+	if (WMT == NULL)
+		return 0;
+	return WMT->getCurrentBytes();
+}
+
+/**
+ * Runtime query of the heap memory HWM
+ * @return The HWM heap memory in bytes
+ */
+_EXTERN_C_ long wmtrace_hwm_bytes(void) {
+	if (WMT == NULL)
+		return 0;
+	return WMT->getHWMBytes();
+}
+
+/**
+ * Runtime query of the call stacks holding the most live heap memory
+ * @param count The maximum number of call stacks
+ * @param stack_ids The IDs of the call stacks
+ * @param bytes The live bytes of each call stack
+ * @return The number of call stacks returned
+ */
+_EXTERN_C_ int wmtrace_top_stacks(int count, int *stack_ids, long *bytes) {
+	if (WMT == NULL || count <= 0)
+		return 0;
+
+	long allocations[count];
+	return WMT->getTopStacks(count, stack_ids, bytes, allocations);
+}
+
 /**
  * Wrapper to MPI_Finalize
  * @return MPI_Error
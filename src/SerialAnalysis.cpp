@@ -16,6 +16,7 @@ int main(int argc, char* argv[]) {
 	bool single_file = false;
 	bool time_search = false;
 	double time_val = 0.0;
+	TimeQuery time_query;
 
 	/* Default to file - may fail */
 	string filename("WMTrace/trace-0.z");
@@ -32,7 +33,11 @@ int main(int argc, char* argv[]) {
 		else if (arg.compare("--time") == 0){
 			time_search = true;
 			i++;
-			time_val =  atof(argv[i]);
+			if (i >= argc || !time_query.parse(argv[i])) {
+				cout
+						<< "Please give --time a time, a list x,y,z, a range start:end:step or a count @n.\n";
+				return 1;
+			}
 		}else if (arg.compare("--help") == 0) {
 			cout << "Usage for WMAnalysis\n";
 			cout << "Optional arguments: \n";
@@ -42,6 +47,10 @@ int main(int argc, char* argv[]) {
 					<< "--functions : Prints a function breakdown of consumption at point of high water mark.\n";
 			cout
 					<< "--allocations : Prints a list of 'live' allocations at point of high water mark.\n";
+			cout
+					<< "--time <x> : Prints a function breakdown at time x (s), rather than the high water mark.\n";
+			cout
+					<< "--time <x,y,z | start:end:step | @n> : Prints the heap, a function breakdown and the largest allocations at each time, or at n times across the run, in one pass.\n";
 			cout << "--help : This help message.\n";
 			cout << "<Trace File Name> : The name of the file to trace.\n\n";
 			return 0;
@@ -58,7 +67,15 @@ int main(int argc, char* argv[]) {
 
 	}
 
-	WMAnalysis *wm = new WMAnalysis(filename, graph, functions, allocations, time_search, time_val);
+	/* A single time keeps to the functions file, many times share a single replay */
+	WMAnalysis *wm;
+	if (time_search && !time_query.isSingle())
+		wm = new WMAnalysis(filename, graph, allocations, time_query);
+	else {
+		if (time_search)
+			time_val = time_query.getTimes(0.0)[0];
+		wm = new WMAnalysis(filename, graph, functions, allocations, time_search, time_val);
+	}
 
 	/* Extract the trace readers- to get at actual data */
 	TraceReader * tr = wm->getTraceReader();
@@ -69,6 +86,21 @@ int main(int argc, char* argv[]) {
 	cout << "Memory consumption of " << filename << " is:\n\t" << mem
 			<< "(B) - Heap\n\t" << elf << "(B) - Static Memory\n";
 
+	/* Only recorded by traces with calibrated timers */
+	if (tr->getWallTime() > 0)
+		cout << "Run time:\n\t" << tr->getWallTime() << "(s) - Wall\n\t"
+				<< tr->getCPUTime() << "(s) - CPU\n";
+
+	/* Frees which matched no traced allocation are counted rather than traced */
+	if (tr->getUntrackedFrees() > 0)
+		cout << "Untracked frees:\n\t" << tr->getUntrackedFrees()
+				<< " - Filtered by the tracer\n";
+
+	/* The live allocations are only tracked for a breakdown */
+	if (functions || allocations)
+		cout << "Analysis memory:\n\t" << tr->getAllocationFootprint()
+				<< "(B) - Live allocation table\n";
+
 	delete wm;
 
 }
@@ -23,41 +23,151 @@ WMAnalysis::WMAnalysis(string tracefile, bool graph, bool functions,
                                 allocations, false, -1, time_val);
 
 		
-                    generateFunctionBreakdown(trace_reader);
+                    generateFunctionBreakdown(trace_reader, false);
 		return;
 	}
 
 
 
-	/* Make a new trace reader with the flags + perform first iteration */
-	trace_reader = new TraceReader(tracefile, allocation_graph);
+	/*
+	 * Make a new trace reader with the flags + perform a single iteration.
+	 * A breakdown needs a complex reader, which keeps the call stacks at the HWM as it goes.
+	 */
+	trace_reader = new TraceReader(tracefile, allocation_graph, functions,
+			allocations);
 
-	/* If needed perform a second iteration */
-	if (hwm_profile || hwm_allocations) {
-		/* Extract the HWMID from first pass */
-		long hwmID = trace_reader->getHWMID();
-		TraceReader *secondPass = new TraceReader(tracefile, false, functions,
-				allocations, false, hwmID);
+	/* If required dump the graph */
+	if (hwm_profile)
+		generateFunctionBreakdown(trace_reader, true);
+}
+
+WMAnalysis::WMAnalysis(string tracefile, bool graph, bool allocations,
+		const TimeQuery &query) {
 
-		/* If required dump the graph */
-		if (hwm_profile)
-			generateFunctionBreakdown(secondPass);
+	/* Generate a tracefile name (from rank id) if not provided with one */
+	if (tracefile.empty())
+		tracefile = WMUtils::makeFileName();
+
+	trace_file_name = tracefile;
+
+	/* Set the flags */
+	allocation_graph = graph;
+	hwm_profile = false;
+	hwm_allocations = allocations;
 
-		delete secondPass;
+	/* Spreading a count of times needs the length of the run, from the index or else a simple pass over the events */
+	double end_time = 0.0;
+	if (query.needsEndTime()) {
+		end_time = TraceReader::findFinishTime(tracefile);
+		if (end_time < 0.0) {
+			TraceReader *firstPass = new TraceReader(tracefile);
+			end_time = firstPass->getFinishTime();
+			delete firstPass;
+		}
 	}
+
+	/* Replay once, capturing the state as each time is passed */
+	trace_reader = new TraceReader(tracefile, allocation_graph, true,
+			allocations, false, -1, -1, query.getTimes(end_time));
+
+	generateTimeQueries(trace_reader);
 }
 
-void WMAnalysis::generateFunctionBreakdown(TraceReader * tr) {
+void WMAnalysis::generateTimeQueries(TraceReader * tr) {
+	const vector<QueryPoint *> &points = tr->getQueryPoints();
+
+	/* Sampled traces report estimates rather than exact values */
+	long sample_rate = tr->getSampleRate();
+
+	/* Make a temp string buffer for writing to, noting each call stack used */
+	stringstream temp_stream (stringstream::in | stringstream::out);
+	set<int> stacks;
+
+	unsigned int i;
+	for (i = 0; i < points.size(); i++) {
+		const QueryPoint *point = points[i];
+		temp_stream << "T " << point->getQueryTime() << " " << point->getTime()
+				<< " " << point->getID() << " " << point->getMemory() << "\n";
+
+		/* Largest first, as for the functions file */
+		set<FunctionSiteAllocation *, FunctionSiteAllocation::comparatorMem> call_sites_mem(
+				point->getFunctions().begin(), point->getFunctions().end());
+		set<FunctionSiteAllocation *, FunctionSiteAllocation::comparatorMem>::reverse_iterator it;
+		for (it = call_sites_mem.rbegin(); it != call_sites_mem.rend(); it++) {
+			FunctionSiteAllocation * fsa = *it;
+			stacks.insert(fsa->getStackId());
+			if (sample_rate > 0)
+				temp_stream << "F " << fsa->getStackId() << " "
+						<< (long) fsa->getEstimate() << " "
+						<< (long) fsa->getEstimateCount() << " "
+						<< (long) fsa->getErrorBound() << "\n";
+			else
+				temp_stream << "F " << fsa->getStackId() << " "
+						<< fsa->getMemory() << " " << fsa->getCount() << "\n";
+		}
+
+		const vector<QueryPoint::TopAllocation> &top = point->getTopAllocations();
+		unsigned int j;
+		for (j = 0; j < top.size(); j++) {
+			stacks.insert(top[j].stack);
+			temp_stream << "A " << hex << top[j].address << dec << " "
+					<< top[j].size << " " << top[j].stack << "\n";
+		}
+	}
+
+	/* Generate filename */
+	string times_filename = WMUtils::makeTimesFilename(trace_file_name);
+
+	/* Make file object */
+	ofstream times_file(times_filename.c_str());
+
+	times_file << "# Time query file from WMTools - " << times_filename
+			<< " with " << points.size() << " times\n";
+	times_file << "# T <requested time (s)> <time (s)> <allocation ID> <heap (B)>\n";
+	if (sample_rate > 0) {
+		times_file << "# F <call stack> <~heap (B)> <~allocations> <+/- 95% error bound (B)>\n";
+		times_file << "# Call stacks sampled every " << sample_rate
+				<< "(B) on average - values are estimates\n";
+	} else {
+		times_file << "# F <call stack> <heap (B)> <allocations>\n";
+	}
+	times_file << "# A <address> <size (B)> <call stack> - the "
+			<< QUERYTOPALLOCATIONS << " largest live allocations\n";
+	times_file << "# S <call stack> <functions, outermost last>\n";
+	times_file << "#\n";
+
+	/* Each call stack is only named once */
+	set<int>::iterator stack_it;
+	for (stack_it = stacks.begin(); stack_it != stacks.end(); stack_it++) {
+		times_file << "S " << *stack_it;
+		vector <string> functions = tr->getCallStack(*stack_it);
+		unsigned int k;
+		for (k = 0; k < functions.size(); k++)
+			times_file << (k == 0 ? " " : ";") << functions[k];
+		times_file << "\n";
+	}
+
+	/* Copy contents of temp stream buffer to final file */
+	times_file << temp_stream.str();
+
+	/* Close the files */
+	times_file.close();
+}
+
+void WMAnalysis::generateFunctionBreakdown(TraceReader * tr, bool at_hwm) {
 
 	/* Extract call site allocation data */
 	set<FunctionSiteAllocation *, FunctionSiteAllocation::comparator> call_sites =
-			tr->getFunctionBreakdown();
+			at_hwm ? tr->getHWMFunctionBreakdown() : tr->getFunctionBreakdown();
 
 	set<FunctionSiteAllocation *, FunctionSiteAllocation::comparatorMem> call_sites_mem(
 			call_sites.begin(), call_sites.end());
 
 	/* Get High Water Mark */
-	long HWM = tr->getCurrMemory();
+	long HWM = at_hwm ? tr->getHWMMemory() : tr->getCurrMemory();
+
+	/* Sampled traces report estimates rather than exact values */
+	long sample_rate = tr->getSampleRate();
 
 	/* Make a temp string buffer for writing to */
 	stringstream temp_stream (stringstream::in | stringstream::out);
@@ -82,13 +192,21 @@ void WMAnalysis::generateFunctionBreakdown(TraceReader * tr) {
 
 		FunctionSiteAllocation * fsa = *it;
 		int stackID = fsa->getStackId();
-		double percentage = ((double) fsa->getMemory()) / HWM;
+		double percentage = fsa->getEstimate() / HWM;
 		percentage *= 100;
 
 		/* Output stack ID + data */
-		temp_stream << "Call Stack: " << stackID << " Allocated "
-				<< fsa->getMemory() << "(B) (" << percentage << "(%) ) from "
-				<< fsa->getCount() << " allocations\n";
+		if (sample_rate > 0) {
+			temp_stream << "Call Stack: " << stackID << " Allocated ~"
+					<< (long) fsa->getEstimate() << "(B) +/- "
+					<< (long) fsa->getErrorBound() << "(B) (" << percentage
+					<< "(%) ) from ~" << (long) fsa->getEstimateCount()
+					<< " allocations (" << fsa->getCount() << " sampled)\n";
+		} else {
+			temp_stream << "Call Stack: " << stackID << " Allocated "
+					<< fsa->getMemory() << "(B) (" << percentage
+					<< "(%) ) from " << fsa->getCount() << " allocations\n";
+		}
 
 		vector <string> functions = tr->getCallStack(stackID);
 		int i;
@@ -101,7 +219,7 @@ void WMAnalysis::generateFunctionBreakdown(TraceReader * tr) {
 			temp_stream << functions[i] << "\n";
 
 			if(!mpi_found && functions[i].find(mpi_function_name)!=string::npos){
-				mpi_memory += fsa->getMemory();
+				mpi_memory += (long) fsa->getEstimate();
 				mpi_found = true;
 			}
 
@@ -123,11 +241,15 @@ void WMAnalysis::generateFunctionBreakdown(TraceReader * tr) {
 
 	hwm_file << "# HWM Functions file from WMTools - " << hwm_filename
 			<< " HWM of " << HWM << "(B)\n";
-	hwm_file << "# Time: " << tr->getCurrTime() << " (s)\n";
+	hwm_file << "# Time: " << (at_hwm ? tr->getHWMTime() : tr->getCurrTime())
+			<< " (s)\n";
 
 	/* Dump MPI Memory to file */
 	mpi_memory_percentage = (((double) mpi_memory) / HWM)*100;
 	hwm_file << "# MPI Memory summary: " << mpi_memory << "(B) (" << mpi_memory_percentage << "%) of memory attributed to MPI (" << mpi_function_name << ")\n";
+	if (sample_rate > 0)
+		hwm_file << "# Call stacks sampled every " << sample_rate
+				<< "(B) on average - values are estimates with 95% error bounds\n";
 	hwm_file << "#\n";
 	hwm_file << "# High Water Mark Function Breakdown\n";
 	hwm_file << "\n";
@@ -2,14 +2,56 @@
 
 WMTimer::WMTimer() {
 	start_time = 0.0;
+	start_ticks = 0;
+
+	use_tsc = invariantTSC();
+	calibrate();
 	syncStart();
 }
 
+bool WMTimer::invariantTSC() {
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(WMTRACE_NO_TSC)
+	unsigned int eax, ebx, ecx, edx;
+
+	/* Check the extended leaf exists, then the invariant TSC bit (EDX bit 8) */
+	__asm__ __volatile__ ("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (0x80000000));
+	if (eax < 0x80000007)
+		return false;
+
+	__asm__ __volatile__ ("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (0x80000007));
+	return (edx & (1 << 8)) != 0;
+#else
+	return false;
+#endif
+}
+
+void WMTimer::calibrate() {
+	if (!use_tsc) {
+		ticks_per_second = 1.0e9;
+		return;
+	}
+
+	/* Count ticks across a fixed span of the monotonic clock */
+	long mono_start = readClock(CLOCK_MONOTONIC);
+	unsigned long tick_start = getTicks();
+	long mono_end;
+	do {
+		mono_end = readClock(CLOCK_MONOTONIC);
+	} while (mono_end - mono_start < TIMERCALIBRATION);
+	unsigned long tick_end = getTicks();
+
+	ticks_per_second = (double) (tick_end - tick_start) * 1.0e9
+			/ (mono_end - mono_start);
+}
+
 void WMTimer::syncStart(){
 	todTimer(&start_time);
+	start_ticks = getTicks();
 }
 
 void WMTimer::todTimer(double *et) {
+	/* Local so the timer can be shared between threads */
+	timespec time1;
 
 	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time1);
 	*et = time1.tv_sec + time1.tv_nsec * 1.0e-9;
@@ -25,7 +67,11 @@ void WMTimer::micoTimer(float *tm) {
 
 
 void WMTimer::elapsedTime(double *et){
-	double current_time;
-	todTimer(&current_time);
-	*et = (double)current_time - start_time;
+	*et = (double) (getTicks() - start_ticks) / ticks_per_second;
+}
+
+void WMTimer::getCalibration(unsigned long *ticks, long *wall, long *cpu) {
+	*ticks = getTicks();
+	*wall = readClock(CLOCK_REALTIME);
+	*cpu = readClock(CLOCK_PROCESS_CPUTIME_ID);
 }
@@ -23,10 +23,19 @@
  * @par Compression / IO
  *   The full output is compressed through a zlib compression stream and output to file.
  *   On a one file per rank basis.
+ *
+ * @par Threads
+ *   Each thread records its events into its own buffer, tagged with a global sequence.
+ *   The buffers are merged back into a single timeline by the TraceReader.
  */
 
 #include "../include/WMTrace.h"
 
+__thread int wmtrace_thread_active = 0;
+__thread WMThreadState *wmtrace_thread_state = NULL;
+
+WMTrace *WMTrace::thread_tracer = NULL;
+
 /**
  * WMTrace is the base class for the tracing element of WMTools.
  *
@@ -37,8 +46,14 @@ WMTrace::WMTrace() {
 
 	/* Define data storage objects */
 	stack_map = new StackMap();
-	unwind = new StackUnwind();
-	wmtrace_buffer = new TraceBuffer(stack_map);
+	/* Only created once the output mode is known */
+	wmtrace_writer = NULL;
+
+	/* Thread states are created as each thread first enters the tracer */
+	thread_states = NULL;
+	pthread_mutex_init(&thread_lock, NULL);
+	pthread_key_create(&thread_key, WMTrace::threadExit);
+	thread_tracer = this;
 
 	/* Default mpi values */
 	wmtrace_rank = -1;
@@ -47,19 +62,11 @@ WMTrace::WMTrace() {
 	/* Application Signals */
 	wmtrace_started = 0;
 	wmtrace_finished = 0;
-	wmtrace_active = 0;
 
 	/* Timers */
 	wmtrace_app_stime = 0;
 
-	/* Function Counters */
-	wmtrace_malloc_counter = 0;
-	wmtrace_calloc_counter = 0;
-	wmtrace_realloc_counter = 0;
-	wmtrace_free_counter = 0;
-
 	time = new WMTimer();
-	timer_counter=0;
 
 
 	/* Control flags */
@@ -67,76 +74,482 @@ WMTrace::WMTrace() {
 	post_process = false;
 	post_process_graph = false;
 	post_process_functions = false;
+	stack_depth = STACKDEPTH;
+	stack_skip = STACKSKIP;
+	sample_rate = 0;
+	small_threshold = 0;
+	coalesce = false;
+	shared_file = false;
+	node_collector = false;
+	codec = Codec::ZLIB;
+	codec_level = CODECDEFAULTLEVEL;
+	compress_threads = COMPRESSWORKERS;
+	live_allocations = NULL;
+	untracked_frees = 0;
+	live_bytes = 0;
+	hwm_bytes = 0;
+	checkpoint_bytes = 0;
+	checkpoint_seconds = 0;
+	checkpoints = false;
+	next_checkpoint_bytes = LONG_MAX;
+	next_checkpoint_ticks = ULONG_MAX;
+	checkpoint_pending = 0;
+	events_active = 0;
+	realloc_pairs = 0;
+	skipped_sequences = 0;
+	pthread_mutex_init(&checkpoint_lock, NULL);
 }
 
 WMTrace::~WMTrace() {
 	/* Free objects */
+	while (thread_states != NULL) {
+		WMThreadState *state = thread_states;
+		detachThread(state);
+		releaseThread(state, false);
+	}
+	thread_tracer = NULL;
+	pthread_key_delete(thread_key);
+	pthread_mutex_destroy(&thread_lock);
+	pthread_mutex_destroy(&checkpoint_lock);
+	delete wmtrace_writer;
 	delete stack_map;
-	delete unwind;
-	delete wmtrace_buffer;
+	delete live_allocations;
 	delete time;
 }
 
-void WMTrace::printTimer(){
-	timer_counter++;
-	/* Only print ever TIMERFREQUENCY invocations */
-	if(timer_counter%TIMERFREQUENCY == 0){
+WMThreadState *WMTrace::registerThread() {
+	WMThreadState *state = new WMThreadState();
+
+	long sequence;
+	double elapsed_time;
+	time->elapsedTime(&elapsed_time);
+	state->thread_id = wmtrace_writer->registerThread(elapsed_time, &sequence);
+
+	/* The first thread gets the full buffer, helper threads a smaller one - as does every thread when the node compresses for us */
+	long size =
+			state->thread_id == 0 && !node_collector ?
+					BUFFERSIZE : THREADBUFFERSIZE;
+	unsigned long ticks = time->getTicks();
+	state->buffer = new TraceBuffer(wmtrace_writer, state->thread_id, sequence,
+			ticks, size, coalesce);
+	state->unwind = new StackUnwind(stack_depth, stack_skip);
+
+	state->malloc_counter = 0;
+	state->calloc_counter = 0;
+	state->realloc_counter = 0;
+	state->free_counter = 0;
+	state->untracked_frees = 0;
+	state->event_ticks = ticks;
+
+	/* Seed each thread differently, so threads do not sample in lockstep */
+	state->sample_seed = ticks
+			^ (0x9E3779B97F4A7C15UL * (state->thread_id + 1));
+	if (state->sample_seed == 0)
+		state->sample_seed = 1;
+	state->sample_bytes = nextSampleInterval(state);
+
+	/* Add to the live list, and ask to be told when the thread exits */
+	pthread_mutex_lock(&thread_lock);
+	state->next = thread_states;
+	thread_states = state;
+	pthread_mutex_unlock(&thread_lock);
+	pthread_setspecific(thread_key, state);
+
+	return state;
+}
+
+bool WMTrace::detachThread(WMThreadState *state) {
+	bool found = false;
+
+	/* Remove from the live list - only if still there, finishTracing may have got there first */
+	pthread_mutex_lock(&thread_lock);
+	WMThreadState **it = &thread_states;
+	while (*it != NULL) {
+		if (*it == state) {
+			*it = state->next;
+			found = true;
+			break;
+		}
+		it = &(*it)->next;
+	}
+	pthread_mutex_unlock(&thread_lock);
+
+	return found;
+}
+
+void WMTrace::releaseThread(WMThreadState *state, bool exited) {
+	state->buffer->lockEvents();
+	state->buffer->finishBuffer();
+	state->buffer->unlockEvents();
+	__sync_fetch_and_add(&untracked_frees, state->untracked_frees);
+	__sync_fetch_and_add(&skipped_sequences,
+			state->buffer->getSkippedSequences());
+	if (exited) {
 		double elapsed_time;
 		time->elapsedTime(&elapsed_time);
-		wmtrace_buffer->addTimer(elapsed_time);
+		wmtrace_writer->exitThread(state->thread_id, elapsed_time);
 	}
+
+	delete state->buffer;
+	delete state->unwind;
+	delete state;
 }
 
+void WMTrace::threadExit(void *state) {
+	WMThreadState *thread_state = (WMThreadState *) state;
+	if (thread_tracer == NULL)
+		return;
 
-void *WMTrace::traceMalloc(long size) {
-	/* Call Timer */
-	printTimer();
+	/* Block tracing of the clean up, and stop this thread using the released state */
+	wmtrace_thread_active++;
+	wmtrace_thread_state = NULL;
+
+	/*
+	 * Only touch the state if still live - it is freed once tracing finishes.
+	 * The last aggregate is written as an event, so must not land part way through a checkpoint.
+	 */
+	thread_tracer->enterEvent();
+	if (thread_tracer->detachThread(thread_state))
+		thread_tracer->releaseThread(thread_state, true);
+	thread_tracer->exitEvent();
+	wmtrace_thread_active--;
+}
+
+long WMTrace::nextSampleInterval(WMThreadState *state) {
+	if (sample_rate <= 0)
+		return 0;
+
+	/* xorshift64* generator, cheap and good enough for sampling */
+	unsigned long x = state->sample_seed;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	state->sample_seed = x;
+	x *= 0x2545F4914F6CDD1DUL;
+
+	/* Uniform in (0, 1], then exponentially distributed */
+	double u = ((x >> 11) + 1) * (1.0 / 9007199254740992.0);
+	long interval = (long) (-log(u) * sample_rate);
+	return interval > 0 ? interval : 1;
+}
+
+void WMTrace::ignoreThread() {
+	/* Never decremented, so every allocation of this thread is passed straight through */
+	wmtrace_thread_active++;
+}
+
+void WMTrace::startTracing() {
+	wmtrace_writer = new TraceWriter(stack_map, WMTrace::ignoreThread,
+			shared_file, node_collector, codec, codec_level, compress_threads);
+
+	time->syncStart();
+
+	/* Relate the tick counter to the wall and CPU clocks at the start */
+	unsigned long ticks;
+	long wall, cpu;
+	time->getCalibration(&ticks, &wall, &cpu);
+	wmtrace_writer->addCalibration(time->getTicksPerSecond(), ticks, wall, cpu);
+
+	/* Tell the reader how to weight the sampled call stacks */
+	if (complex_trace && sample_rate > 0)
+		wmtrace_writer->addSampleRate(sample_rate);
+	else
+		sample_rate = 0;
+
+	live_allocations = new LiveAllocationTable();
+
+	/* Space out the checkpoints of the live heap from the start of the trace */
+	if (checkpoint_bytes > 0)
+		next_checkpoint_bytes = checkpoint_bytes;
+	if (checkpoint_seconds > 0)
+		next_checkpoint_ticks = ticks
+				+ (unsigned long) (checkpoint_seconds * time->getTicksPerSecond());
+	checkpoints = checkpoint_bytes > 0 || checkpoint_seconds > 0;
+
+	/* Register the calling thread, so it is always thread 0 */
+	wmtrace_thread_active++;
+	if (wmtrace_thread_state == NULL)
+		wmtrace_thread_state = registerThread();
+	wmtrace_thread_active--;
+
+	wmtrace_started = 1;
+}
+
+void WMTrace::finishTracing() {
+	wmtrace_finished = 1;
+
+	wmtrace_thread_active++;
+
+	/* Let any checkpoint being taken finish, no more will start */
+	pthread_mutex_lock(&checkpoint_lock);
+	pthread_mutex_unlock(&checkpoint_lock);
+
+	/* Take the whole list, so exiting threads leave their state to us */
+	pthread_mutex_lock(&thread_lock);
+	WMThreadState *state = thread_states;
+	thread_states = NULL;
+	pthread_mutex_unlock(&thread_lock);
+
+	/* Flush every thread still alive */
+	long mallocs = 0, callocs = 0, reallocs = 0, frees = 0;
+	while (state != NULL) {
+		WMThreadState *next = state->next;
+		mallocs += state->malloc_counter;
+		callocs += state->calloc_counter;
+		reallocs += state->realloc_counter;
+		frees += state->free_counter;
+		releaseThread(state, false);
+		state = next;
+	}
+	wmtrace_thread_state = NULL;
+
+	/* So the reader knows how many frees never reached the trace */
+	if (untracked_frees > 0)
+		wmtrace_writer->addUntrackedFrees(untracked_frees);
+
+	/* And again at the end, so the reader can report the wall and CPU time of the run */
+	unsigned long ticks;
+	long wall, cpu;
+	time->getCalibration(&ticks, &wall, &cpu);
+	wmtrace_writer->addCalibration(time->getTicksPerSecond(), ticks, wall, cpu);
+
+	wmtrace_writer->finish();
+	//printf("Rank %d - Mallocs %ld Callocs %ld Re-allocs %ld Frees %ld \n", wmtrace_rank, mallocs, callocs, reallocs, frees);
 
+	wmtrace_thread_active--;
+}
+
+void *WMTrace::traceMalloc(long size) {
 	int stackID = 0;
 	void * ptr = __libc_malloc(size);
-	if (complex_trace) {	//Stack Traversal
-		vector<long> call_stack = unwind->fullUnwind();
-		stackID = stack_map->addStack(call_stack);
+	if (complex_trace && sampleStack(size)) {	//Stack Traversal
+		stackID = captureStackID();
+	} else if (complex_trace) {	//Not sampled
+		stackID = -1;
 	}
 
-	wmtrace_buffer->addMalloc((long) ptr, getTimeDelta(), size, stackID);
+	addLive((long) ptr, size, stackID);
+	if (size < small_threshold) {
+		wmtrace_thread_state->buffer->addSmallAllocation(size, stackID,
+				getTimestamp());
+	} else {
+		wmtrace_thread_state->buffer->addMalloc((long) ptr, getTimestamp(),
+				size, stackID);
+	}
 	return ptr;
 }
 
 void * WMTrace::traceCalloc(long size, long count) {
-	/* Call Timer */
-	printTimer();
-
-
 	int stackID = 0;
-	if (complex_trace) {	//Stack Traversal
-		vector<long> call_stack = unwind->fullUnwind();
-		stackID = stack_map->addStack(call_stack);
+	if (complex_trace && sampleStack(size * count)) {	//Stack Traversal
+		stackID = captureStackID();
+	} else if (complex_trace) {	//Not sampled
+		stackID = -1;
 	}
 
 	void * ptr = __libc_calloc(size, count);
 
-	wmtrace_buffer->addCalloc((long) ptr, getTimeDelta(), size *count, stackID);
+	addLive((long) ptr, size * count, stackID);
+	if (size * count < small_threshold) {
+		wmtrace_thread_state->buffer->addSmallAllocation(size * count, stackID,
+				getTimestamp());
+	} else {
+		wmtrace_thread_state->buffer->addCalloc((long) ptr, getTimestamp(),
+				size * count, stackID);
+	}
 
 	return ptr;
 }
 
 void *WMTrace::traceRealloc(void *ptrold, long size) {
-	/* Call Timer */
-	printTimer();
+	/* Removed first, as once reallocated the old address may be handed to another thread */
+	long old_size = 0;
+	int old_stack = -1;
+	bool old_live = removeLive((long) ptrold, &old_size, &old_stack);
+	bool old_small = old_live && old_size < small_threshold;
+	TraceBuffer *buffer = wmtrace_thread_state->buffer;
 
+	/*
+	 * Any event naming the old address takes its sequence before the address is released,
+	 * so comes before the event of another thread handed the same address.
+	 */
+	long sequence = -1;
+	if (ptrold != NULL && !old_small)
+		sequence = buffer->reserveSequence();
 
 	void *ptr_new = __libc_realloc(ptrold, size);
-	wmtrace_buffer->addRealloc((long) ptrold, (long) ptr_new, getTimeDelta(),
-			size);
+
+	/* Failed, so the old allocation is untouched */
+	if (ptr_new == NULL && size > 0) {
+		if (old_live)
+			addLive((long) ptrold, old_size, old_stack);
+		if (sequence >= 0)
+			buffer->releaseSequence();
+		return ptr_new;
+	}
+
+	/* Keeps the call stack of the old allocation, as the reader does */
+	addLive((long) ptr_new, size, old_stack);
+
+	/* Neither side is small, so trace as usual */
+	if (!old_small && size >= small_threshold) {
+		buffer->addRealloc((long) ptrold, (long) ptr_new, getTimestamp(), size,
+				old_live ? old_size : -1, sequence);
+		if (checkpoints && old_live)
+			__sync_fetch_and_add(&realloc_pairs, 1);
+		return ptr_new;
+	}
+
+	/* Otherwise split into a free of the old allocation and a new allocation */
+	if (old_small)
+		buffer->addSmallFree(old_size, old_stack, getTimestamp());
+	else if (old_live)
+		buffer->addFree((long) ptrold, getTimestamp(), old_size, old_stack,
+				sequence);
+	else if (ptrold != NULL) {
+		buffer->releaseSequence();
+		wmtrace_thread_state->untracked_frees++;
+	}
+
+	if (ptr_new == NULL)
+		return ptr_new;
+
+	if (size < small_threshold)
+		buffer->addSmallAllocation(size, old_stack, getTimestamp());
+	else
+		buffer->addMalloc((long) ptr_new, getTimestamp(), size, old_stack);
 	return ptr_new;
 }
 
 void WMTrace::traceFree(void *ptr) {
-	/* Call Timer */
-	printTimer();
-
+	long size;
+	int stack;
 
-	wmtrace_buffer->addFree((long) ptr, getTimeDelta());
+	/*
+	 * Every traced allocation is in the live table before its address is returned,
+	 * so a free of any other address can never match and is only counted.
+	 * Aggregated allocations are freed into the aggregate.
+	 */
+	if (!removeLive((long) ptr, &size, &stack)) {
+		wmtrace_thread_state->untracked_frees++;
+	} else if (size < small_threshold) {
+		wmtrace_thread_state->buffer->addSmallFree(size, stack, getTimestamp());
+	} else {
+		wmtrace_thread_state->buffer->addFree((long) ptr, getTimestamp(), size,
+				stack);
+	}
 	__libc_free(ptr);
 }
+
+void WMTrace::writeCheckpoint() {
+	/* Only one thread takes each checkpoint */
+	if (pthread_mutex_trylock(&checkpoint_lock) != 0)
+		return;
+	if (wmtrace_finished || !checkpointDue()) {
+		pthread_mutex_unlock(&checkpoint_lock);
+		return;
+	}
+
+	/* Hold every other thread at the start of its next event, and wait for those part way through one */
+	checkpoint_pending = 1;
+	__sync_synchronize();
+	while (events_active > 1)
+		sched_yield();
+
+	/* Every event below the sequence has now updated the live table, and none above it */
+	unsigned long ticks = time->getTicks();
+	long sequence = wmtrace_writer->getSequence();
+
+	vector<LiveAllocationTable::LiveEntry> allocations;
+	live_allocations->getAllocations(allocations);
+
+	/* Small allocations are only known to the reader by the totals of their call stack */
+	map<int, long> small_bytes, small_counts;
+	unsigned long i, kept = 0;
+	for (i = 0; i < allocations.size(); i++) {
+		if (allocations[i].size < small_threshold) {
+			small_bytes[allocations[i].stack] += allocations[i].size;
+			small_counts[allocations[i].stack]++;
+		} else {
+			allocations[kept++] = allocations[i];
+		}
+	}
+	allocations.resize(kept);
+
+	/* Events before the checkpoint must no longer be folded into transient events, nor join a pending aggregate */
+	long skipped = skipped_sequences;
+	pthread_mutex_lock(&thread_lock);
+	WMThreadState *state;
+	for (state = thread_states; state != NULL; state = state->next) {
+		state->buffer->closeEvents();
+		skipped += state->buffer->getSkippedSequences();
+	}
+	pthread_mutex_unlock(&thread_lock);
+
+	wmtrace_writer->addCheckpoint(sequence,
+			sequence + realloc_pairs - skipped, ticks, allocations,
+			small_bytes, small_counts);
+
+	if (checkpoint_bytes > 0)
+		next_checkpoint_bytes = wmtrace_writer->getThreadDataBytes()
+				+ checkpoint_bytes;
+	if (checkpoint_seconds > 0)
+		next_checkpoint_ticks = ticks
+				+ (unsigned long) (checkpoint_seconds * time->getTicksPerSecond());
+
+	__sync_synchronize();
+	checkpoint_pending = 0;
+	pthread_mutex_unlock(&checkpoint_lock);
+}
+
+int WMTrace::getTopStacks(int count, int *stacks, long *bytes,
+		long *allocations) {
+	if (live_allocations == NULL || count <= 0)
+		return 0;
+
+	/* The sums allocate, so must not be traced */
+	wmtrace_thread_active++;
+
+	map<int, long> stack_bytes, stack_counts;
+	live_allocations->sumByStack(stack_bytes, stack_counts);
+
+	/* Order by bytes, largest first */
+	vector<pair<long, int> > order;
+	map<int, long>::iterator it;
+	for (it = stack_bytes.begin(); it != stack_bytes.end(); it++)
+		order.push_back(make_pair(-it->second, it->first));
+
+	int found = count < (int) order.size() ? count : (int) order.size();
+	partial_sort(order.begin(), order.begin() + found, order.end());
+
+	int i;
+	for (i = 0; i < found; i++) {
+		stacks[i] = order[i].second;
+		bytes[i] = -order[i].first;
+		allocations[i] = stack_counts[order[i].second];
+	}
+
+	wmtrace_thread_active--;
+	return found;
+}
+
+void WMTrace::printLiveReport(int stacks) {
+	wmtrace_thread_active++;
+
+	cout << "Rank " << wmtrace_rank << " - Current mem " << getCurrentBytes()
+			<< "(B) HWM " << getHWMBytes() << "(B)\n";
+
+	if (stacks > 0) {
+		int top_stacks[stacks];
+		long top_bytes[stacks], top_counts[stacks];
+		int found = getTopStacks(stacks, top_stacks, top_bytes, top_counts);
+
+		int i;
+		for (i = 0; i < found; i++)
+			cout << "\tCall Stack: " << top_stacks[i] << " Allocated "
+					<< top_bytes[i] << "(B) from " << top_counts[i]
+					<< " allocations\n";
+	}
+
+	wmtrace_thread_active--;
+}
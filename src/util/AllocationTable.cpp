@@ -0,0 +1,87 @@
+#include "../../include/util/AllocationTable.h"
+using namespace std;
+
+AllocationTable::AllocationTable() {
+	capacity = ALLOCATIONTABLESIZE;
+	used = 0;
+	shift = 64 - __builtin_ctzl(capacity);
+	addresses = new long[capacity];
+	entries = new AllocationEntry[capacity];
+	memset(addresses, 0, capacity * sizeof(long));
+}
+
+AllocationTable::~AllocationTable() {
+	delete[] addresses;
+	delete[] entries;
+}
+
+void AllocationTable::grow() {
+	long *old_addresses = addresses;
+	AllocationEntry *old_entries = entries;
+	long old_capacity = capacity;
+
+	capacity *= 2;
+	shift--;
+	addresses = new long[capacity];
+	entries = new AllocationEntry[capacity];
+	memset(addresses, 0, capacity * sizeof(long));
+
+	/* Every address is unique, so only need to find an empty slot */
+	long i;
+	for (i = 0; i < old_capacity; i++) {
+		if (old_addresses[i] == 0)
+			continue;
+		long slot = findSlot(old_addresses[i]);
+		addresses[slot] = old_addresses[i];
+		entries[slot] = old_entries[i];
+	}
+
+	delete[] old_addresses;
+	delete[] old_entries;
+}
+
+void AllocationTable::insert(long address, long size, int stack, long id) {
+	if (address == 0)
+		return;
+
+	/* Keep the load below three quarters */
+	if ((used + 1) * 4 > capacity * 3)
+		grow();
+
+	long slot = findSlot(address);
+	if (addresses[slot] == 0)
+		used++;
+	addresses[slot] = address;
+	entries[slot].size = size;
+	entries[slot].id = id;
+	entries[slot].stack = stack;
+}
+
+bool AllocationTable::remove(long address, AllocationEntry *entry) {
+	if (address == 0)
+		return false;
+
+	long slot = findSlot(address);
+	if (addresses[slot] == 0)
+		return false;
+
+	*entry = entries[slot];
+
+	/* Shift back any later entry of the probe run which could sit in the hole */
+	long mask = capacity - 1;
+	long hole = slot;
+	long next = (slot + 1) & mask;
+	while (addresses[next] != 0) {
+		long home = getHomeSlot(addresses[next]);
+		if (((next - home) & mask) >= ((next - hole) & mask)) {
+			addresses[hole] = addresses[next];
+			entries[hole] = entries[next];
+			hole = next;
+		}
+		next = (next + 1) & mask;
+	}
+	addresses[hole] = 0;
+	used--;
+
+	return true;
+}
@@ -0,0 +1,50 @@
+#include "../../include/util/BufferPool.h"
+
+BufferPool::BufferPool(int count, long size) {
+	buffer_count = count;
+	buffer_size = size;
+
+	pthread_mutex_init(&pool_lock, NULL);
+	pthread_cond_init(&pool_cond, NULL);
+
+	/* Reserve up front so releasing a buffer never allocates */
+	free_buffers.reserve(buffer_count);
+
+	int i;
+	for (i = 0; i < buffer_count; i++)
+		free_buffers.push_back(new char[buffer_size]);
+}
+
+BufferPool::~BufferPool() {
+	/* Buffers may still be queued for compression */
+	pthread_mutex_lock(&pool_lock);
+	while ((int) free_buffers.size() < buffer_count)
+		pthread_cond_wait(&pool_cond, &pool_lock);
+	pthread_mutex_unlock(&pool_lock);
+
+	int i;
+	for (i = 0; i < buffer_count; i++)
+		delete[] free_buffers[i];
+
+	pthread_mutex_destroy(&pool_lock);
+	pthread_cond_destroy(&pool_cond);
+}
+
+char *BufferPool::acquire() {
+	pthread_mutex_lock(&pool_lock);
+	while (free_buffers.empty())
+		pthread_cond_wait(&pool_cond, &pool_lock);
+
+	char *buffer = free_buffers.back();
+	free_buffers.pop_back();
+
+	pthread_mutex_unlock(&pool_lock);
+	return buffer;
+}
+
+void BufferPool::release(char *buffer) {
+	pthread_mutex_lock(&pool_lock);
+	free_buffers.push_back(buffer);
+	pthread_cond_broadcast(&pool_cond);
+	pthread_mutex_unlock(&pool_lock);
+}
@@ -1,9 +1,23 @@
 #include "../../include/util/CallStackTraversal.h"
 
-StackUnwind::StackUnwind() {
+#include <string.h>
+
+StackUnwind::StackUnwind(int max_depth, int skip) {
 	ip = 0;
 	sp = 0;
-	unw_max_depth = 1000;
+	unw_max_depth = max_depth;
+	unw_skip = skip;
+
+	/* Room for the skipped frames and the capture function itself */
+	frames = new long[unw_max_depth + unw_skip + 1];
+	slots = new long *[unw_max_depth + unw_skip + 1];
+	captured_depth = 0;
+
+	memo = new StackMemo[STACKMEMOSIZE];
+	memo_victim = 0;
+	int i;
+	for (i = 0; i < STACKMEMOSIZE; i++)
+		memo[i].key = 0;
 
 	#ifdef MAKE_DYNA
 	walker = Walker::newWalker();
@@ -11,6 +25,12 @@ StackUnwind::StackUnwind() {
 
 }
 
+StackUnwind::~StackUnwind() {
+	delete[] frames;
+	delete[] slots;
+	delete[] memo;
+}
+
 vector<long> StackUnwind::fullUnwind() {
 
 #ifdef MAKE_DYNA
@@ -23,10 +43,10 @@ vector<long> StackUnwind::fullUnwind() {
 	vector<long> call_stack;
 
 	/* Need to step twice to remove mention of WMTrace from the call stack */
-	if (unw_step(&cursor) <= 0)
-		return call_stack;
-	if (unw_step(&cursor) <= 0)
-		return call_stack;
+	int i;
+	for (i = 0; i < unw_skip; i++)
+		if (unw_step(&cursor) <= 0)
+			return call_stack;
 
 	int counter = 0;
 	while (unw_step(&cursor) > 0 && counter < unw_max_depth) {
@@ -38,6 +58,120 @@ vector<long> StackUnwind::fullUnwind() {
 	return call_stack;
 }
 
+int StackUnwind::captureStack(long **stack) {
+	int depth = 0;
+
+#if defined(MAKE_DYNA)
+	vector<long> call_stack = dynaUnwind();
+	for (depth = 0; depth < call_stack.size() && depth < unw_max_depth; depth++)
+		frames[depth] = call_stack[depth];
+	*stack = frames;
+
+#elif defined(WMTRACE_FRAME_POINTER)
+	long *fp = (long *) __builtin_frame_address(0);
+	int skipped = 0;
+
+	while (fp != NULL && depth < unw_max_depth) {
+		long ret = fp[1];
+		long *next = (long *) fp[0];
+		if (ret == 0)
+			break;
+
+		if (skipped < unw_skip) {
+			skipped++;
+		} else {
+			slots[depth] = fp + 1;
+			frames[depth++] = ret;
+		}
+
+		/* The stack grows down, so each caller frame must be above this one and aligned */
+		if (next <= fp || ((long) next & (sizeof(long) - 1)) != 0)
+			break;
+		fp = next;
+	}
+	*stack = frames;
+
+#elif defined(HAVE_UNW_BACKTRACE)
+	/* The first entry is within this function, so skip it too */
+	depth = unw_backtrace((void **) frames, unw_max_depth + unw_skip + 1)
+			- unw_skip - 1;
+	if (depth < 0)
+		depth = 0;
+	*stack = frames + unw_skip + 1;
+
+#else
+	unw_getcontext(&uc);
+	unw_init_local(&cursor, &uc);
+
+	int i;
+	for (i = 0; i < unw_skip; i++)
+		if (unw_step(&cursor) <= 0) {
+			*stack = frames;
+			return 0;
+		}
+
+	while (unw_step(&cursor) > 0 && depth < unw_max_depth) {
+		unw_get_reg(&cursor, UNW_REG_IP, &ip);
+#ifdef WMTRACE_STACK_MEMO
+		/* The call pushed the return address just below the stack pointer of the caller */
+		unw_get_reg(&cursor, UNW_REG_SP, &sp);
+		slots[depth] = (long *) sp - 1;
+#endif
+		frames[depth++] = (long) ip;
+	}
+	*stack = frames;
+#endif
+
+	captured_depth = depth;
+	return depth;
+}
+
+int StackUnwind::findStack(long key) {
+#ifdef WMTRACE_STACK_MEMO
+	StackMemo *set = memoSet(key);
+
+	int way;
+	for (way = 0; way < STACKMEMOWAYS; way++) {
+		StackMemo &entry = set[way];
+		if (entry.key != key)
+			continue;
+
+		/* Check the return addresses in place, far cheaper than unwinding */
+		int i;
+		for (i = 0; i < entry.depth; i++)
+			if (*entry.slots[i] != entry.frames[i])
+				break;
+		if (i == entry.depth)
+			return entry.id;
+	}
+#endif
+
+	return -1;
+}
+
+void StackUnwind::memoStack(long key, int id) {
+#ifdef WMTRACE_STACK_MEMO
+	if (captured_depth > STACKMEMODEPTH)
+		return;
+
+	/* Fill an empty way first, otherwise replace in turn */
+	StackMemo *set = memoSet(key);
+	StackMemo *entry = NULL;
+	int way;
+	for (way = 0; way < STACKMEMOWAYS && entry == NULL; way++)
+		if (set[way].key == 0)
+			entry = &set[way];
+	if (entry == NULL)
+		entry = &set[memo_victim++ & (STACKMEMOWAYS - 1)];
+
+	entry->key = key;
+	entry->id = id;
+	entry->depth = captured_depth;
+	memcpy(entry->frames, frames, captured_depth * sizeof(long));
+	memcpy(entry->slots, slots, captured_depth * sizeof(long *));
+#endif
+}
+
 #ifdef MAKE_DYNA
 vector<long> StackUnwind::dynaUnwind() {
 	walker->walkStack(stackwalk);
@@ -0,0 +1,346 @@
+#include "../../include/util/Codec.h"
+
+Codec *Codec::create(char id, int level) {
+	if (id == LZ)
+		return new LZCodec();
+	if (id == STORE)
+		return new StoreCodec();
+	return new ZlibCodec(level);
+}
+
+int Codec::writeHeader(char *out, char id) {
+	out[0] = 'W';
+	out[1] = 'M';
+	out[2] = 'C';
+	out[3] = id;
+	return CODECHEADERSIZE;
+}
+
+char Codec::readHeader(const char *in, long size) {
+	if (size < CODECHEADERSIZE || in[0] != 'W' || in[1] != 'M' || in[2] != 'C')
+		return 0;
+	return in[3];
+}
+
+char Codec::fromName(const char *name) {
+	if (strcmp(name, "zlib") == 0)
+		return ZLIB;
+	if (strcmp(name, "lz") == 0)
+		return LZ;
+	if (strcmp(name, "store") == 0)
+		return STORE;
+	return 0;
+}
+
+/* ZlibCodec */
+
+ZlibCodec::ZlibCodec(int level) {
+	strm.zalloc = Z_NULL;
+	strm.zfree = Z_NULL;
+	strm.opaque = Z_NULL;
+	strm.avail_in = 0;
+	strm.next_in = Z_NULL;
+	mode = 0;
+	this->level = level;
+}
+
+ZlibCodec::~ZlibCodec() {
+	if (mode == 1)
+		deflateEnd(&strm);
+	else if (mode == 2)
+		inflateEnd(&strm);
+}
+
+bool ZlibCodec::encode(const char **in, long *in_size, char **out,
+		long *out_size, bool finish) {
+	if (mode == 0) {
+		deflateInit(&strm, level);
+		mode = 1;
+	}
+
+	strm.next_out = (Bytef *) *out;
+	strm.avail_out = *out_size;
+	strm.next_in = (Bytef *) *in;
+	strm.avail_in = *in_size;
+
+	int ret = deflate(&strm, finish ? Z_FINISH : Z_NO_FLUSH);
+
+	*in = (const char *) strm.next_in;
+	*in_size = strm.avail_in;
+	*out = (char *) strm.next_out;
+	*out_size = strm.avail_out;
+
+	if (finish)
+		return ret == Z_STREAM_END;
+	return *in_size == 0;
+}
+
+int ZlibCodec::decode(const char **in, long *in_size, char **out,
+		long *out_size) {
+	if (mode == 0) {
+		inflateInit(&strm);
+		mode = 2;
+	}
+
+	strm.next_in = (Bytef *) *in;
+	strm.avail_in = *in_size;
+	strm.next_out = (Bytef *) *out;
+	strm.avail_out = *out_size;
+
+	int ret = inflate(&strm, Z_NO_FLUSH);
+
+	*in = (const char *) strm.next_in;
+	*in_size = strm.avail_in;
+	*out = (char *) strm.next_out;
+	*out_size = strm.avail_out;
+
+	if (ret == Z_STREAM_END)
+		return 0;
+	if (ret == Z_OK || ret == Z_BUF_ERROR)
+		return 1;
+	return -1;
+}
+
+/* BlockCodec */
+
+BlockCodec::BlockCodec() {
+	block_in = new char[getBound(CODECBLOCK)];
+	block_out = new char[getBound(CODECBLOCK) + sizeof(header)];
+	block_in_used = 0;
+	block_out_used = 0;
+	block_out_sent = 0;
+	header_used = 0;
+	ended = false;
+}
+
+BlockCodec::~BlockCodec() {
+	delete[] block_in;
+	delete[] block_out;
+}
+
+void BlockCodec::flushBlock() {
+	int raw_size = block_in_used;
+	int encoded_size = 0;
+	if (raw_size > 0)
+		encoded_size = encodeBlock(block_in, raw_size,
+				block_out + sizeof(header));
+	else
+		ended = true;
+
+	memcpy(block_out, &raw_size, sizeof(int));
+	memcpy(block_out + sizeof(int), &encoded_size, sizeof(int));
+	block_out_used = sizeof(header) + encoded_size;
+	block_out_sent = 0;
+	block_in_used = 0;
+}
+
+bool BlockCodec::drainBlock(char **out, long *out_size) {
+	long count = block_out_used - block_out_sent;
+	if (count > *out_size)
+		count = *out_size;
+
+	memcpy(*out, block_out + block_out_sent, count);
+	block_out_sent += count;
+	*out += count;
+	*out_size -= count;
+
+	return block_out_sent == block_out_used;
+}
+
+bool BlockCodec::encode(const char **in, long *in_size, char **out,
+		long *out_size, bool finish) {
+	while (true) {
+		/* The last block must be written out before another is started */
+		if (!drainBlock(out, out_size))
+			return false;
+
+		if (*in_size > 0) {
+			long count = CODECBLOCK - block_in_used;
+			if (count > *in_size)
+				count = *in_size;
+
+			memcpy(block_in + block_in_used, *in, count);
+			block_in_used += count;
+			*in += count;
+			*in_size -= count;
+
+			if (block_in_used == CODECBLOCK)
+				flushBlock();
+			continue;
+		}
+
+		if (!finish || ended)
+			return true;
+
+		/* Write the final partial block, then the empty block ending the stream */
+		flushBlock();
+	}
+}
+
+int BlockCodec::decode(const char **in, long *in_size, char **out,
+		long *out_size) {
+	while (true) {
+		if (!drainBlock(out, out_size))
+			return 1;
+		if (ended)
+			return 0;
+
+		/* Collect the block header */
+		if (header_used < (int) sizeof(header)) {
+			long count = sizeof(header) - header_used;
+			if (count > *in_size)
+				count = *in_size;
+			memcpy(header + header_used, *in, count);
+			header_used += count;
+			*in += count;
+			*in_size -= count;
+			if (header_used < (int) sizeof(header))
+				return 1;
+		}
+
+		int raw_size, encoded_size;
+		memcpy(&raw_size, header, sizeof(int));
+		memcpy(&encoded_size, header + sizeof(int), sizeof(int));
+
+		if (raw_size == 0) {
+			ended = true;
+			continue;
+		}
+		if (raw_size < 0 || raw_size > CODECBLOCK || encoded_size < 0
+				|| encoded_size > getBound(CODECBLOCK))
+			return -1;
+
+		/* Then the encoded block */
+		long count = encoded_size - block_in_used;
+		if (count > *in_size)
+			count = *in_size;
+		memcpy(block_in + block_in_used, *in, count);
+		block_in_used += count;
+		*in += count;
+		*in_size -= count;
+
+		if (block_in_used < encoded_size)
+			return 1;
+
+		if (!decodeBlock(block_in, encoded_size, block_out, raw_size))
+			return -1;
+
+		block_out_used = raw_size;
+		block_out_sent = 0;
+		block_in_used = 0;
+		header_used = 0;
+	}
+}
+
+/* LZCodec */
+
+LZCodec::LZCodec() {
+	hash_table = new int[1 << LZHASHBITS];
+}
+
+LZCodec::~LZCodec() {
+	delete[] hash_table;
+}
+
+/**
+ * The number of bytes a value takes as a VarInt.
+ */
+static int varIntSize(unsigned long value) {
+	int size = 1;
+	while (value >= 0x80) {
+		value >>= 7;
+		size++;
+	}
+	return size;
+}
+
+long LZCodec::encodeBlock(const char *in_data, long size, char *out_data) {
+	const unsigned char *in = (const unsigned char *) in_data;
+	unsigned char *out = (unsigned char *) out_data;
+	unsigned char *pos_out = out;
+
+	/* Blocks are independent, so forget the last one */
+	int i;
+	for (i = 0; i < (1 << LZHASHBITS); i++)
+		hash_table[i] = -1;
+
+	long anchor = 0;
+	long pos = 0;
+	while (pos + LZMINMATCH <= size) {
+		unsigned int sequence;
+		memcpy(&sequence, in + pos, sizeof(unsigned int));
+		unsigned int hash = (sequence * 2654435761U) >> (32 - LZHASHBITS);
+
+		long candidate = hash_table[hash];
+		hash_table[hash] = pos;
+
+		if (candidate >= 0 && memcmp(in + candidate, in + pos, LZMINMATCH) == 0) {
+			long length = LZMINMATCH;
+			while (pos + length < size && in[candidate + length] == in[pos + length])
+				length++;
+
+			/* Only take matches that are shorter encoded than as literals */
+			long offset = pos - candidate;
+			if (length >= 1 + varIntSize(length) + varIntSize(offset)) {
+				pos_out += VarInt::encode(pos_out, pos - anchor);
+				memcpy(pos_out, in + anchor, pos - anchor);
+				pos_out += pos - anchor;
+				pos_out += VarInt::encode(pos_out, length);
+				pos_out += VarInt::encode(pos_out, offset);
+
+				pos += length;
+				anchor = pos;
+				continue;
+			}
+		}
+		pos++;
+	}
+
+	/* The remaining literals, with no match */
+	pos_out += VarInt::encode(pos_out, size - anchor);
+	memcpy(pos_out, in + anchor, size - anchor);
+	pos_out += size - anchor;
+	pos_out += VarInt::encode(pos_out, 0);
+
+	return pos_out - out;
+}
+
+bool LZCodec::decodeBlock(const char *in_data, long size, char *out_data,
+		long raw_size) {
+	const unsigned char *in = (const unsigned char *) in_data;
+	const unsigned char *in_end = in + size;
+	unsigned char *out = (unsigned char *) out_data;
+	unsigned char *out_end = out + raw_size;
+
+	while (in < in_end) {
+		unsigned long literals = VarInt::decode(&in);
+		if (literals > (unsigned long) (out_end - out)
+				|| literals > (unsigned long) (in_end - in))
+			return false;
+		memcpy(out, in, literals);
+		out += literals;
+		in += literals;
+
+		if (in >= in_end)
+			return false;
+		unsigned long length = VarInt::decode(&in);
+		if (length == 0)
+			break;
+
+		if (in >= in_end)
+			return false;
+		unsigned long offset = VarInt::decode(&in);
+		if (offset == 0 || offset > (unsigned long) (out - (unsigned char *) out_data)
+				|| length > (unsigned long) (out_end - out))
+			return false;
+
+		/* Byte by byte, as the match may overlap itself */
+		const unsigned char *match = out - offset;
+		unsigned long i;
+		for (i = 0; i < length; i++)
+			out[i] = match[i];
+		out += length;
+	}
+
+	return out == out_end && in == in_end;
+}
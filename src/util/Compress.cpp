@@ -1,69 +1,311 @@
 #include "../../include/util/Compress.h"
 
-Compress::Compress(string filename) {
-	in = new char[CHUNKIN];
-	out = new char[CHUNKOUT];
-	file_out = new char[FILEOUT];
-
-	dest.open(filename.c_str(), ios::out | ios::binary);
+/**
+ * Monotonic time in seconds, for the adaptive level.
+ */
+static double monotonicTime() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
 
-	/* Set the buffersize of the output */
-	dest.rdbuf()->pubsetbuf(file_out, FILEOUT);
+Compress::Compress(string filename, void (*worker_init)(), bool shared,
+		char codec_id, int level, int worker_count) {
+	int ret = posix_memalign((void **) &file_out, FILEALIGN, FILEOUT);
+	assert(ret == 0);
 
-	flush_flag = Z_NO_FLUSH;
+	if (shared) {
+		container = filename;
+		dest = TraceContainer::openSpool();
+	} else {
+		dest = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
 
-	/* allocate deflate state */
+	/* An adaptive level starts from the default */
+	adaptive = level == CODECADAPTIVE;
+	if (adaptive)
+		level = CODECDEFAULTLEVEL;
+	this->codec_id = codec_id;
+	this->level = level;
+	window_bytes = 0;
+	window_busy = 0;
+	window_start = monotonicTime();
 
-	strm.zalloc = Z_NULL;
-	strm.zfree = Z_NULL;
-	strm.opaque = Z_NULL;
-	int ret = deflateInit(&strm, 2); //Z_DEFAULT_COMPRESSION);
-	assert(ret == Z_OK);
+	/* The stream starts with the codec header */
+	file_used = Codec::writeHeader(file_out, codec_id);
+	file_written = file_used;
 
 	finish_called = 0;
 
+	memset(&last_stats, 0, sizeof(IndexBlock));
+	pending.id = 0;
+	pending.raw_size = 0;
+	pending.stats = last_stats;
+	next_block = 0;
+	next_write = 0;
+	queue_finished = false;
+	raw_written = 0;
+
+	/* Start the workers last, once the stream is ready */
+	this->worker_init = worker_init;
+	pthread_mutex_init(&queue_lock, NULL);
+	pthread_cond_init(&queue_cond, NULL);
+	pthread_mutex_init(&out_lock, NULL);
+
+	if (worker_count < 1)
+		worker_count = 1;
+	workers.resize(worker_count);
+	int i;
+	for (i = 0; i < worker_count; i++)
+		pthread_create(&workers[i], NULL, workerMain, this);
+
 }
 
 Compress::~Compress() {
 	if (finish_called == 0)
 		finish();
-	delete[] in;
-	delete[] out;
+	free(file_out);
+	pthread_mutex_destroy(&queue_lock);
+	pthread_cond_destroy(&queue_cond);
+	pthread_mutex_destroy(&out_lock);
 }
 
-int Compress::addData(char * data, int size) {
+void *Compress::workerMain(void *arg) {
+	Compress *comp = (Compress *) arg;
+	if (comp->worker_init != NULL)
+		comp->worker_init();
+	comp->processQueue();
+	return NULL;
+}
+
+void Compress::processQueue() {
+	while (true) {
+		pthread_mutex_lock(&queue_lock);
+		while (queue.empty() && !queue_finished)
+			pthread_cond_wait(&queue_cond, &queue_lock);
+		if (queue.empty()) {
+			pthread_mutex_unlock(&queue_lock);
+			break;
+		}
+		CompressBlock block = queue.front();
+		queue.pop_front();
+		pthread_mutex_unlock(&queue_lock);
+
+		pthread_mutex_lock(&out_lock);
+		block.level = level;
+		pthread_mutex_unlock(&out_lock);
+
+		double start = adaptive ? monotonicTime() : 0;
+		encodeBlock(&block);
+		double busy = adaptive ? monotonicTime() - start : 0;
 
-	//Reset the variables
-	size_t written_total = 0;
-	size_t block_length = CHUNKIN;
-	size_t compress_size;
-
-	int z_return = 0;
-	//Loop while you still have data
-	for (written_total = 0; written_total < size; written_total +=
-			block_length) {
-		//Not enough data left for complete compression buffer
-		if (written_total + CHUNKIN >= size) {
-			block_length = size - written_total;
+		/* Blocks finish out of order, so each waits for those before it */
+		pthread_mutex_lock(&out_lock);
+		if (adaptive)
+			adaptLevel(block.raw_size, busy);
+		done[block.id] = block;
+		writeBlocks();
+		pthread_mutex_unlock(&out_lock);
+	}
+}
+
+void Compress::queueJob(CompressJob job, const IndexBlock *stats, bool close) {
+	/* Buffers carry the trace state, the frames between them are indexed by their flag */
+	if (job.pool != NULL) {
+		/* A buffer without stats leaves the trace state as it was */
+		int events = pending.stats.events;
+		if (stats != NULL) {
+			/* Ticks arrive from several threads, so keep the highest */
+			unsigned long ticks = pending.stats.ticks;
+			events += stats->events;
+			pending.stats = *stats;
+			if (pending.stats.ticks < ticks)
+				pending.stats.ticks = ticks;
 		}
+		pending.stats.events = events;
+		last_stats = pending.stats;
+	} else if (job.size > 0) {
+		IndexFrame frame = { job.data[0], pending.raw_size };
+		pending.frames.push_back(frame);
+	}
 
-		//Copy the data to the input chunk
-		memcpy(in, (char *) (data + written_total), block_length);
+	pending.jobs.push_back(job);
+	pending.raw_size += job.size;
 
-		//Set up input / output buffers
-		strm.avail_in = block_length;
-		strm.next_in = (Bytef *) in;
-		strm.avail_out = CHUNKOUT;
-		strm.next_out = (Bytef *) out;
+	if (close || pending.raw_size >= COMPRESSBLOCK)
+		closeBlock();
+}
 
-		//Perform deflate & record data output
-		z_return = deflate(&strm, flush_flag);
-		compress_size = CHUNKOUT - strm.avail_out;
+void Compress::closeBlock() {
+	if (pending.jobs.empty())
+		return;
 
-		dest.write(out, compress_size);
+	pending.id = next_block++;
+	queue.push_back(pending);
+	pthread_cond_signal(&queue_cond);
 
+	pending.jobs.clear();
+	pending.frames.clear();
+	pending.raw_size = 0;
+	pending.stats = last_stats;
+	pending.stats.events = 0;
+}
+
+void Compress::encodeBlock(CompressBlock *block) {
+	Codec *codec = Codec::create(codec_id, block->level);
+
+	long capacity = block->raw_size + block->raw_size / 8 + 1024;
+	char *out = new char[capacity];
+	char *out_pos = out;
+	long out_left = capacity;
+
+	//Encode each job in turn, finishing the stream with the last
+	int i;
+	int count = block->jobs.size();
+	for (i = 0; i < count; i++) {
+		CompressJob *job = &block->jobs[i];
+		const char *in = job->data;
+		long in_size = job->size;
+
+		while (!codec->encode(&in, &in_size, &out_pos, &out_left,
+				i == count - 1)) {
+			/* Only grows on data which does not compress */
+			long used = out_pos - out;
+			char *grown = new char[capacity * 2];
+			memcpy(grown, out, used);
+			delete[] out;
+			out = grown;
+			out_pos = out + used;
+			capacity *= 2;
+			out_left = capacity - used;
+		}
+
+		/* Hand the buffer back to its owner */
+		if (job->pool != NULL)
+			job->pool->release(job->data);
+		else
+			delete[] job->data;
 	}
 
+	delete codec;
+	block->jobs.clear();
+	block->data = out;
+	block->size = out_pos - out;
+}
+
+void Compress::writeBlocks() {
+	map<long, CompressBlock>::iterator it;
+	while ((it = done.find(next_write)) != done.end()) {
+		CompressBlock *block = &it->second;
+
+		/* An empty block would read as the end of the trace */
+		if (block->raw_size > 0) {
+			block->stats.file_offset = file_written;
+			block->stats.raw_offset = raw_written;
+			block->stats.raw_size = block->raw_size;
+			index.addBlock(block->stats);
+
+			unsigned int i;
+			for (i = 0; i < block->frames.size(); i++)
+				index.addFrame(block->frames[i].flag,
+						raw_written + block->frames[i].raw_offset);
+
+			int header[3];
+			header[0] = block->raw_size;
+			header[1] = block->size;
+			header[2] = block->stats.events;
+			appendOut((char *) header, BLOCKHEADERSIZE);
+			appendOut(block->data, block->size);
+			raw_written += block->raw_size;
+		}
+
+		delete[] block->data;
+		done.erase(it);
+		next_write++;
+	}
+}
+
+void Compress::adaptLevel(long size, double busy) {
+	window_bytes += size;
+	window_busy += busy;
+	if (window_bytes < ADAPTIVEWINDOW)
+		return;
+
+	/* The share of the window the workers spent compressing, rather than waiting for data */
+	double now = monotonicTime();
+	double elapsed = (now - window_start) * workers.size();
+	double usage = elapsed > 0 ? window_busy / elapsed : 1;
+
+	if (usage > ADAPTIVEBUSY && level > 1)
+		level--;
+	else if (usage < ADAPTIVEIDLE && level < CODECMAXADAPTIVE)
+		level++;
+
+	window_bytes = 0;
+	window_busy = 0;
+	window_start = now;
+}
+
+void Compress::appendOut(const char *data, long size) {
+	while (size > 0) {
+		long count = FILEOUT - file_used;
+		if (count > size)
+			count = size;
+
+		memcpy(file_out + file_used, data, count);
+		file_used += count;
+		file_written += count;
+		data += count;
+		size -= count;
+
+		if (file_used == FILEOUT)
+			writeOut();
+	}
+}
+
+void Compress::writeOut() {
+	size_t compress_size = file_used;
+	size_t written = 0;
+
+	while (written < compress_size) {
+		ssize_t ret = write(dest, file_out + written, compress_size - written);
+		if (ret <= 0)
+			break;
+		written += ret;
+	}
+
+	file_used = 0;
+}
+
+int Compress::addData(char * data, int size) {
+	if (finish_called == 1)
+		return 1;
+
+	/* Copy, as the caller keeps ownership of the data */
+	char *copy = new char[size];
+	memcpy(copy, data, size);
+
+	CompressJob job = { copy, size, NULL };
+	pthread_mutex_lock(&queue_lock);
+	queueJob(job, NULL, false);
+	pthread_mutex_unlock(&queue_lock);
+
+	return 0;
+}
+
+int Compress::addBuffer(char * data, long size, BufferPool *pool,
+		const IndexBlock *stats) {
+	if (finish_called == 1) {
+		pool->release(data);
+		return 1;
+	}
+
+	/* Never held back, the owner may be waiting on its pool */
+	CompressJob job = { data, size, pool };
+	pthread_mutex_lock(&queue_lock);
+	queueJob(job, stats, true);
+	pthread_mutex_unlock(&queue_lock);
+
 	return 0;
 }
 
@@ -71,15 +313,39 @@ int Compress::finish() {
 	if (finish_called == 1)
 		return 1;
 	finish_called = 1;
-	flush_flag = Z_FINISH;
+
 	FrameData *f = new FrameData();
-	char fin = f->FINISHFLAG;
-	int ret = addData(&fin, 1);
-	deflateEnd(&strm);
+	char *fin = new char[1];
+	fin[0] = f->FINISHFLAG;
+	delete f;
+
+	/* Queue the finish flag, then wait for the workers to drain the queue */
+	CompressJob job = { fin, 1, NULL };
+	pthread_mutex_lock(&queue_lock);
+	queueJob(job, NULL, true);
+	queue_finished = true;
+	pthread_cond_broadcast(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+
+	unsigned int i;
+	for (i = 0; i < workers.size(); i++)
+		pthread_join(workers[i], NULL);
 
-	dest.flush();
-	dest.close();
+	/* End with an empty block and the index, then write the final partial buffer */
+	int end[3] = { 0, 0, 0 };
+	appendOut((char *) end, BLOCKHEADERSIZE);
+
+	vector<char> index_data;
+	index.write(index_data, file_written);
+	appendOut(&index_data[0], index_data.size());
+	writeOut();
+
+	/* Copy the spooled stream into our segment of the shared file */
+	int ret = 0;
+	if (!container.empty())
+		ret = TraceContainer::writeSegments(container, dest);
+
+	close(dest);
 
 	return ret;
 }
-
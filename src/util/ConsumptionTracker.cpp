@@ -15,13 +15,21 @@ ConsumptionHWMTracker::ConsumptionHWMTracker(string filename,
 	/* Store passed parameters */
 	this->graph = graph;
 	this->samples = samples;
+	sample_rate = 0;
+	track_stacks = false;
+	next_query = 0;
+	next_query_time = DBL_MAX;
+	query_top = 0;
 	consumption = new ConsumptionGraph(filename, samples);
 
 }
 
 ConsumptionHWMTracker::~ConsumptionHWMTracker() {
 	delete consumption;
-	allocation_map.clear();
+
+	unsigned int i;
+	for (i = 0; i < query_points.size(); i++)
+		delete query_points[i];
 }
 
 long ConsumptionHWMTracker::addAllocation(MallocObj& malloc) {
@@ -29,12 +37,16 @@ long ConsumptionHWMTracker::addAllocation(MallocObj& malloc) {
 	curr_memory += malloc.getSize();
 	curr_time += malloc.getTime();
 
-	allocation_map.insert(pair<long, MallocObj>(malloc.getPointer(), malloc));
+	allocations.insert(malloc.getPointer(), malloc.getSize(),
+			malloc.getStackID(), currID);
+	if (track_stacks)
+		addStackAllocation(malloc.getStackID(), malloc.getSize(), 1);
 
 	/* If we are graphing then add point to consumption graph */
 	if (graph)
 		consumption->addAllocation(curr_time, curr_memory);
 
+	checkQueries();
 	return currID;
 }
 
@@ -47,35 +59,195 @@ long ConsumptionHWMTracker::addFree(FreeObj& free) {
 	currID++;
 	curr_time += free.getTime();
 
-	/* Try to fetch corresponding malloc, to know free size */
-	MallocObj * malloc = getAllocation(free.getPointer());
-	if (malloc != NULL) {
+	/* Try to remove corresponding malloc, to know free size */
+	AllocationTable::AllocationEntry entry;
+	if (allocations.remove(free.getPointer(), &entry)) {
 
 		/* Decrease mem by corresponding values */
-		curr_memory -= malloc->getSize();
-		allocation_map.erase(free.getPointer());
+		curr_memory -= entry.size;
+		if (track_stacks)
+			addStackAllocation(entry.stack, entry.size, -1);
 
 		/* If we are graphing then add point to consumption graph */
 		if (graph)
 			consumption->addAllocation(curr_time, curr_memory);
 	}
 
+	checkQueries();
+	return currID;
+}
+
+long ConsumptionHWMTracker::addRealloc(long old_pointer, long new_pointer,
+		long size, float time) {
+	/* Remove old malloc object, if it existed */
+	AllocationTable::AllocationEntry entry;
+
+	/* If object didnt exist, then act as malloc - otherwise free then malloc */
+	if (!allocations.remove(old_pointer, &entry)) {
+		MallocObj mal2(new_pointer, size, time, -1);
+		return addAllocation(mal2);
+	}
+
+	/* The free, as addFree, with the allocation already removed */
+	checkHWM();
+	currID++;
+	curr_memory -= entry.size;
+	if (track_stacks)
+		addStackAllocation(entry.stack, entry.size, -1);
+	if (graph)
+		consumption->addAllocation(curr_time, curr_memory);
+
+	MallocObj mal2(new_pointer, size, time, entry.stack);
+	return addAllocation(mal2);
+}
+
+long ConsumptionHWMTracker::addBatch(const EventBatch& batch, long stop_id,
+		double stop_time) {
+	long id = -1;
+	long count = batch.size();
+	long i;
+
+	for (i = 0; i < count; i++) {
+		char flag = batch.getFlag(i);
+
+		/* Timer events carry no address, so prefetching them is harmless */
+		if (i + BATCHPREFETCH < count)
+			allocations.prefetch(batch.getPointer(i + BATCHPREFETCH));
+
+		/* Malloc and Calloc are not differentiated at this point */
+		if (flag == FrameData::MALLOCFLAG || flag == FrameData::CALLOCFLAG) {
+			MallocObj mal(batch.getPointer(i), batch.getSize(i),
+					batch.getTime(i), batch.getStackID(i));
+			id = addAllocation(mal);
+		} else if (flag == FrameData::REALLOCFLAG) {
+			id = addRealloc(batch.getPointer(i), batch.getNewPointer(i),
+					batch.getSize(i), batch.getTime(i));
+		} else if (flag == FrameData::FREEFLAG) {
+			FreeObj fr(batch.getPointer(i), batch.getTime(i));
+			id = addFree(fr);
+		} else if (flag == FrameData::TIMERFLAG) {
+			updateElapsedTime(batch.getTime(i));
+		}
+
+		if ((stop_id != -1 && id == stop_id)
+				|| (stop_time > 0.0 && curr_time > stop_time))
+			break;
+	}
+
+	return id;
+}
+
+long ConsumptionHWMTracker::addAggregate(long peak, long bytes, float time) {
+
+	/* Check if we are at HWM before the aggregate, and again at its peak */
+	checkHWM();
+
+	/* The call stacks count from the aggregate on, the HWM before it is settled */
+	unsigned int i;
+	for (i = 0; i < pending_stacks.size(); i++) {
+		StackTotals &totals = changeStackTotals(pending_stacks[i].stack);
+		totals.aggregate_memory += pending_stacks[i].bytes;
+		totals.aggregate_count += pending_stacks[i].count;
+	}
+	pending_stacks.clear();
+
+	currID++;
+	curr_time += time;
+	curr_memory += peak;
+	checkHWM();
+
+	curr_memory += bytes - peak;
+
+	/* If we are graphing then add the peak and the end point to consumption graph */
+	if (graph) {
+		consumption->addAllocation(curr_time, curr_memory - bytes + peak);
+		consumption->addAllocation(curr_time, curr_memory);
+	}
+
+	checkQueries();
 	return currID;
 }
 
-MallocObj *ConsumptionHWMTracker::getAllocation(long pointer) {
-	MallocObj * res;
-	allocation_map_it = allocation_map.find(pointer);
-	if (allocation_map_it == allocation_map.end())
-		return NULL;
+long ConsumptionHWMTracker::addTransient(long size, int stack, float time,
+		double span) {
+
+	/* Every allocation of the run reaches the same peak */
+	checkHWM();
+
+	currID++;
+	curr_time += time;
+	curr_memory += size;
+	if (track_stacks)
+		addStackAllocation(stack, size, 1);
+	checkHWM();
+
+	curr_memory -= size;
+	if (track_stacks)
+		addStackAllocation(stack, size, -1);
+
+	/* If we are graphing then add the peak at the start of the run, and the end point at its last free */
+	if (graph)
+		consumption->addAllocation(curr_time, curr_memory + size);
+	curr_time += span;
+	if (graph)
+		consumption->addAllocation(curr_time, curr_memory);
 
-	return &allocation_map_it->second;
+	checkQueries();
+	return currID;
+}
+
+long ConsumptionHWMTracker::addColumn(const long *deltas, const long *peaks,
+		const double *times, const double *ends, long count) {
+	if (count <= 0)
+		return currID;
+
+	long before = curr_memory;
+	long index;
+	long peak = PeakScan::scan(deltas, peaks, count, &curr_memory, &index);
+
+	/* Only strictly higher, so the HWM stays at the first event to reach it */
+	if (peak > hwm) {
+		hwm = peak;
+		hwm_time = times[index];
+		hwmID = currID + index + 1;
+	}
+
+	/* If we are graphing then add the peak of each event, where above its end point, and the end point */
+	if (graph) {
+		long i;
+		for (i = 0; i < count; i++) {
+			if (peaks[i] != deltas[i])
+				consumption->addAllocation(times[i], before + peaks[i]);
+			before += deltas[i];
+			consumption->addAllocation(ends[i], before);
+		}
+	}
+
+	currID += count;
+	curr_time = ends[count - 1];
+
+	return currID;
+}
+
+void ConsumptionHWMTracker::startFromCheckpoint(long id, double time) {
+	currID = id;
+	curr_time = time;
+
+	hwm = curr_memory;
+	hwm_time = curr_time;
+	hwmID = currID;
+	if (track_stacks)
+		syncHWMTotals();
 }
 
 void ConsumptionHWMTracker::finish() {
 	/* Check if we are at HWM */
 	checkHWM();
 
+	/* Times past the last event take the state at the end of the trace */
+	while (next_query < query_times.size())
+		captureQuery();
+
 	consumption->setLocalHwm(hwm);
 
 	if (graph && !samples)
@@ -87,6 +259,92 @@ void ConsumptionHWMTracker::checkHWM(){
 			hwm = curr_memory;
 			hwm_time = curr_time;
 			hwmID = currID;
+			if (track_stacks)
+				syncHWMTotals();
+	}
+}
+
+ConsumptionHWMTracker::StackTotals &ConsumptionHWMTracker::changeStackTotals(
+		int stack) {
+	unsigned int index = stack + 1;
+
+	/* Stack IDs are handed out in order, so the totals grow one call stack at a time */
+	if (index >= stack_totals.size()) {
+		StackTotals empty = { 0, 0, 0.0, 0.0, 0.0, 0, 0 };
+		stack_totals.resize(index + 1, empty);
+		stack_changed.resize(index + 1, 0);
+	}
+
+	if (!stack_changed[index]) {
+		stack_changed[index] = 1;
+		changed_stacks.push_back(index);
+	}
+	return stack_totals[index];
+}
+
+void ConsumptionHWMTracker::addStackAllocation(int stack, long size,
+		int sign) {
+	double probability = 1.0;
+
+	/* Must match getFunctionBreakdown, so an allocation is removed exactly as added */
+	if (sample_rate > 0) {
+		if (stack < 0)
+			return;
+		probability = 1.0 - exp(-((double) size) / sample_rate);
+		if (probability <= 0.0)
+			return;
+	}
+
+	StackTotals &totals = changeStackTotals(stack);
+	totals.memory += sign * size;
+	totals.count += sign;
+	totals.estimate += sign * size / probability;
+	totals.estimate_count += sign / probability;
+	totals.variance += sign * (1.0 - probability) / (probability * probability)
+			* size * size;
+}
+
+void ConsumptionHWMTracker::syncHWMTotals() {
+	if (hwm_totals.size() < stack_totals.size()) {
+		StackTotals empty = { 0, 0, 0.0, 0.0, 0.0, 0, 0 };
+		hwm_totals.resize(stack_totals.size(), empty);
+	}
+
+	/* Each change is copied at most once per rise of the HWM, however many rises there are */
+	unsigned int i;
+	for (i = 0; i < changed_stacks.size(); i++) {
+		int index = changed_stacks[i];
+		hwm_totals[index] = stack_totals[index];
+		stack_changed[index] = 0;
+	}
+	changed_stacks.clear();
+}
+
+void ConsumptionHWMTracker::addAggregateBreakdown(
+		set<FunctionSiteAllocation *, FunctionSiteAllocation::comparator> &functions,
+		int stack, long memory, long count) {
+	if (memory <= 0 || count <= 0)
+		return;
+
+	double probability = 1.0;
+	if (sample_rate > 0) {
+		if (stack < 0)
+			return;
+		probability = 1.0 - exp(-((double) memory / count) / sample_rate);
+		if (probability <= 0.0)
+			return;
+	}
+
+	FunctionSiteAllocation * fsa = new FunctionSiteAllocation(stack, memory,
+			count, probability);
+	pair<
+			set<FunctionSiteAllocation *, FunctionSiteAllocation::comparator>::iterator,
+			bool> insert_test = functions.insert(fsa);
+
+	if (insert_test.second == false) {
+		FunctionSiteAllocation * fsa_2 = *insert_test.first;
+		fsa_2->addAggregate(memory, count, probability);
+		delete fsa;
 	}
 }
 
@@ -94,14 +352,29 @@ void ConsumptionHWMTracker::checkHWM(){
 set<FunctionSiteAllocation *, FunctionSiteAllocation::comparator> ConsumptionHWMTracker::getFunctionBreakdown() {
 	set<FunctionSiteAllocation *, FunctionSiteAllocation::comparator> functions;
 
-	allocation_map_it = allocation_map.begin();
 	long total_count = 0;
-	while (allocation_map_it != allocation_map.end()) {
-		/* Make a new FunctionSiteAllocation object from the values from the allocation map */
-		FunctionSiteAllocation * fsa = new FunctionSiteAllocation(
-				allocation_map_it->second.getStackID(),
-				allocation_map_it->second.getSize());
-		total_count += allocation_map_it->second.getSize();
+	long slot;
+	for (slot = 0; slot < allocations.getCapacity(); slot++) {
+		if (!allocations.isLive(slot))
+			continue;
+
+		const AllocationTable::AllocationEntry &entry = allocations.getEntry(slot);
+		long size = entry.size;
+		double probability = 1.0;
+
+		/* Unsampled allocations are represented by the weighted sampled ones */
+		if (sample_rate > 0) {
+			if (entry.stack < 0)
+				continue;
+			probability = 1.0 - exp(-((double) size) / sample_rate);
+			if (probability <= 0.0)
+				continue;
+		}
+
+		/* Make a new FunctionSiteAllocation object from the values from the allocation table */
+		FunctionSiteAllocation * fsa = new FunctionSiteAllocation(entry.stack,
+				size, probability);
+		total_count += size;
 		/* Try to inser the new object - but test to see if it clashed with an existing stack id value. */
 		pair<
 				set<FunctionSiteAllocation *, FunctionSiteAllocation::comparator>::iterator,
@@ -109,13 +382,93 @@ set<FunctionSiteAllocation *, FunctionSiteAllocation::comparator> ConsumptionHWM
 
 		if (insert_test.second == false) {
 			FunctionSiteAllocation * fsa_2 = *insert_test.first;
-			fsa_2->addMemory(allocation_map_it->second.getSize());
+			fsa_2->addMemory(size, probability);
+			delete fsa;
 		}
-
-		allocation_map_it++;
 	}
 
+	/* Aggregated small allocations, treated as allocations of the mean size */
+	unsigned int index;
+	for (index = 0; index < stack_totals.size(); index++)
+		addAggregateBreakdown(functions, (int) index - 1,
+				stack_totals[index].aggregate_memory,
+				stack_totals[index].aggregate_count);
 
 	return functions;
 
 }
+
+set<FunctionSiteAllocation *, FunctionSiteAllocation::comparator> ConsumptionHWMTracker::getHWMFunctionBreakdown() {
+	return getTotalsBreakdown(hwm_totals);
+}
+
+set<FunctionSiteAllocation *, FunctionSiteAllocation::comparator> ConsumptionHWMTracker::getTotalsBreakdown(
+		const vector<StackTotals> &totals_by_stack) {
+	set<FunctionSiteAllocation *, FunctionSiteAllocation::comparator> functions;
+
+	unsigned int index;
+	for (index = 0; index < totals_by_stack.size(); index++) {
+		const StackTotals &totals = totals_by_stack[index];
+		int stack = (int) index - 1;
+
+		if (totals.count > 0)
+			functions.insert(
+					new FunctionSiteAllocation(stack, totals.memory,
+							totals.count, totals.estimate,
+							totals.estimate_count, totals.variance));
+
+		/* Aggregated small allocations, treated as allocations of the mean size */
+		addAggregateBreakdown(functions, stack, totals.aggregate_memory,
+				totals.aggregate_count);
+	}
+
+	return functions;
+}
+
+void ConsumptionHWMTracker::setQueryTimes(const vector<double> &times,
+		int top) {
+	query_times = times;
+	sort(query_times.begin(), query_times.end());
+	query_top = top;
+	next_query = 0;
+	next_query_time = query_times.empty() ? DBL_MAX : query_times[0];
+}
+
+void ConsumptionHWMTracker::captureQuery() {
+	/* Keep the largest allocations in a min-heap, so the smallest is replaced */
+	vector<pair<long, long> > heap;
+	long slot;
+	for (slot = 0; query_top > 0 && slot < allocations.getCapacity(); slot++) {
+		if (!allocations.isLive(slot))
+			continue;
+
+		long size = allocations.getEntry(slot).size;
+		if ((int) heap.size() < query_top) {
+			heap.push_back(make_pair(size, slot));
+			push_heap(heap.begin(), heap.end(), greater<pair<long, long> >());
+		} else if (size > heap.front().first) {
+			pop_heap(heap.begin(), heap.end(), greater<pair<long, long> >());
+			heap.back() = make_pair(size, slot);
+			push_heap(heap.begin(), heap.end(), greater<pair<long, long> >());
+		}
+	}
+	sort_heap(heap.begin(), heap.end(), greater<pair<long, long> >());
+
+	vector<QueryPoint::TopAllocation> top;
+	unsigned int i;
+	for (i = 0; i < heap.size(); i++) {
+		const AllocationTable::AllocationEntry &entry = allocations.getEntry(
+				heap[i].second);
+		QueryPoint::TopAllocation allocation = { allocations.getAddress(
+				heap[i].second), entry.size, entry.stack };
+		top.push_back(allocation);
+	}
+
+	query_points.push_back(
+			new QueryPoint(query_times[next_query], curr_time, currID,
+					curr_memory, getTotalsBreakdown(stack_totals), top));
+
+	next_query++;
+	next_query_time =
+			next_query < query_times.size() ? query_times[next_query] : DBL_MAX;
+}
@@ -2,60 +2,290 @@
 
 ZlibDecompress::ZlibDecompress(string filename) {
 
-	source.open(filename.c_str(), ifstream::in | ifstream::binary);
+	/* Open the segment of the shared file directly, if the trace is in one */
+	string container;
+	node_stream = NULL;
+	node_rank = -1;
+	if (TraceContainer::findSegment(filename, &container, &segment_start,
+			&segment_size)) {
+		source.open(container.c_str(), ifstream::in | ifstream::binary);
+		source.seekg(segment_start, ios::beg);
+	} else if (TraceContainer::findNodeStream(filename, &container,
+			&node_rank)) {
+		node_stream = new ZlibDecompress(container);
+		segment_start = 0;
+		segment_size = -1;
+	} else {
+		source.open(filename.c_str(), ifstream::in | ifstream::binary);
+		segment_start = 0;
+		segment_size = -1;
+	}
+	segment_remaining = segment_size;
+
+	/* Load the index from the end of the trace, then return to its start */
+	index = NULL;
+	if (node_stream == NULL) {
+		index = new TraceIndex();
+		if (!index->read(source, segment_start, segment_size)) {
+			delete index;
+			index = NULL;
+		}
+		source.clear();
+		source.seekg(segment_start, ios::beg);
+	}
+	raw_offset_d = 0;
+	next_raw_offset_d = 0;
 
 	/* Create buffers */
 	stream_buffer_d = new char[BUFFERSIZE];
+	stream_capacity_d = BUFFERSIZE;
 	in_d = new char[DCCHUNK];
-	out_d = new char[DCCHUNK];
+	span_buffer_d = NULL;
+	span_capacity_d = 0;
 	buffer_remaining_d = 0;
-	have_d = 0;
 	space_remaining_d = BUFFERSIZE;
 	curr_buffer_pos_d = stream_buffer_d;
 
-	strm_d.zalloc = Z_NULL;
-	strm_d.zfree = Z_NULL;
-	strm_d.opaque = Z_NULL;
-	strm_d.avail_in = 0;
-	strm_d.next_in = Z_NULL;
-
-	ret_d = inflateInit(&strm_d);
-	assert(ret_d == Z_OK);
+	/* The codec is known once the header has been read */
+	codec_id = 0;
+	codec = NULL;
+	stream_ended = false;
+	held_block.data = NULL;
+	in_pos_d = in_d;
+	in_remaining_d = 0;
+	ret_d = 0;
+
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	decode_threads = cores < 1 ? 1 : (cores > DECOMPRESSTHREADS ? DECOMPRESSTHREADS : cores);
 }
 
 ZlibDecompress::~ZlibDecompress() {
+	delete node_stream;
+	delete index;
+	delete codec;
+	delete[] held_block.data;
 	delete[] stream_buffer_d;
+	delete[] span_buffer_d;
 	delete[] in_d;
-	delete[] out_d;
+}
+
+long ZlibDecompress::readInput(void) {
+	/* Never read past the end of our segment */
+	long chunk = DCCHUNK;
+	if (segment_remaining >= 0 && segment_remaining < chunk)
+		chunk = segment_remaining;
+
+	source.read(in_d, chunk);
+	in_remaining_d = source.gcount();
+	in_pos_d = in_d;
+	if (segment_remaining >= 0)
+		segment_remaining -= in_remaining_d;
+
+	return in_remaining_d;
 }
 
 int ZlibDecompress::inflateData(void) {
 	buffer_remaining_d = 0;
 	space_remaining_d = BUFFERSIZE;
 	curr_buffer_pos_d = stream_buffer_d;
+	raw_offset_d = next_raw_offset_d;
+
+	if (node_stream != NULL)
+		return demultiplexData();
+
+	if (stream_ended)
+		return -1;
+
+	/* The first read names the codec, a trace without a header is a zlib stream */
+	if (codec_id == 0) {
+		if (readInput() == 0)
+			return -1;
+
+		codec_id = Codec::readHeader(in_pos_d, in_remaining_d);
+		if (codec_id != 0) {
+			in_pos_d += CODECHEADERSIZE;
+			in_remaining_d -= CODECHEADERSIZE;
+		} else {
+			codec_id = Codec::ZLIB;
+			codec = Codec::create(codec_id);
+		}
+	}
+
+	int ret = codec != NULL ? inflateStream() : inflateBlocks();
+	next_raw_offset_d += buffer_remaining_d;
+	return ret;
+}
 
-	int t1 = source.tellg();
-	source.read(in_d, DCCHUNK);
-	int t2 = source.tellg();
-	strm_d.avail_in = t2 - t1;
+int ZlibDecompress::inflateBlocks(void) {
+	vector<DecodeBlock> batch;
+	long total = 0;
+
+	/* Take as many blocks as there are threads, while they fit in the buffer */
+	while ((int) batch.size() < decode_threads) {
+		DecodeBlock block;
+		if (held_block.data != NULL) {
+			block = held_block;
+			held_block.data = NULL;
+		} else if (!readBlock(&block)) {
+			stream_ended = true;
+			break;
+		}
+
+		if (!batch.empty() && total + block.raw_size > stream_capacity_d) {
+			held_block = block;
+			break;
+		}
+
+		batch.push_back(block);
+		total += block.raw_size;
+	}
 
-	if (strm_d.avail_in == 0)
+	if (batch.empty())
 		return -1;
 
-	strm_d.next_in = (Bytef *) in_d;
+	/* A single block larger than the buffer grows it */
+	if (total > stream_capacity_d) {
+		delete[] stream_buffer_d;
+		stream_buffer_d = new char[total];
+		stream_capacity_d = total;
+		curr_buffer_pos_d = stream_buffer_d;
+	}
+
+	/* Each block decodes straight into its place in the buffer */
+	int count = batch.size();
+	long offset = 0;
+	int i;
+	for (i = 0; i < count; i++) {
+		batch[i].out = stream_buffer_d + offset;
+		offset += batch[i].raw_size;
+	}
+
+	pthread_t threads[count];
+	for (i = 1; i < count; i++)
+		pthread_create(&threads[i], NULL, decodeMain, &batch[i]);
+	decodeMain(&batch[0]);
+	for (i = 1; i < count; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < count; i++)
+		delete[] batch[i].data;
+
+	/* Keep the data up to the first bad block, the rest of the buffer would not follow on from it */
+	for (i = 0; i < count; i++) {
+		if (!batch[i].ok) {
+			cerr << "WMTools: Corrupt trace block" << endl;
+			stream_ended = true;
+			break;
+		}
+		buffer_remaining_d += batch[i].raw_size;
+	}
+
+	return buffer_remaining_d > 0 ? 1 : -1;
+}
+
+void *ZlibDecompress::decodeMain(void *arg) {
+	DecodeBlock *block = (DecodeBlock *) arg;
+	Codec *codec = Codec::create(block->codec_id);
 
-	do {
-		strm_d.avail_out = DCCHUNK;
-		strm_d.next_out = (Bytef *) out_d;
-		ret_d = inflate(&strm_d, Z_NO_FLUSH);
+	const char *in = block->data;
+	long in_size = block->size;
+	char *out = block->out;
+	long out_size = block->raw_size;
 
-		assert(ret_d != Z_STREAM_ERROR);
+	int ret = codec->decode(&in, &in_size, &out, &out_size);
+	block->ok = ret == 0 && out_size == 0;
 
-		have_d = DCCHUNK - strm_d.avail_out;
-		memcpy(stream_buffer_d + buffer_remaining_d, out_d, have_d);
-		buffer_remaining_d += have_d;
+	delete codec;
+	return NULL;
+}
 
-	} while (strm_d.avail_out == 0);
+bool ZlibDecompress::readBlock(DecodeBlock *block) {
+	int header[3];
+	if (readBytes((char *) header, BLOCKHEADERSIZE) != (long) BLOCKHEADERSIZE)
+		return false;
+
+	/* An empty block marks the end of the trace */
+	if (header[0] <= 0 || header[1] < 0)
+		return false;
+
+	block->codec_id = codec_id;
+	block->raw_size = header[0];
+	block->size = header[1];
+	block->events = header[2];
+	block->data = new char[block->size];
+	block->ok = false;
+
+	if (readBytes(block->data, block->size) != block->size) {
+		cerr << "WMTools: Truncated trace block" << endl;
+		delete[] block->data;
+		block->data = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+long ZlibDecompress::readBytes(char *out, long size) {
+	long count = 0;
+	while (count < size) {
+		if (in_remaining_d == 0 && readInput() == 0)
+			break;
+
+		long chunk = size - count;
+		if (chunk > in_remaining_d)
+			chunk = in_remaining_d;
+		memcpy(out + count, in_pos_d, chunk);
+		in_pos_d += chunk;
+		in_remaining_d -= chunk;
+		count += chunk;
+	}
+	return count;
+}
+
+int ZlibDecompress::inflateStream(void) {
+	/* Decode until the buffer is full, or the input runs out */
+	char *out = stream_buffer_d;
+	long out_size = stream_capacity_d;
+	while (out_size > 0) {
+		if (in_remaining_d == 0 && readInput() == 0)
+			break;
+
+		ret_d = codec->decode(&in_pos_d, &in_remaining_d, &out, &out_size);
+		if (ret_d <= 0) {
+			stream_ended = true;
+			if (ret_d < 0)
+				cerr << "WMTools: Corrupt trace stream" << endl;
+			break;
+		}
+	}
+
+	buffer_remaining_d = stream_capacity_d - out_size;
+	return buffer_remaining_d > 0 ? 1 : -1;
+}
+
+int ZlibDecompress::demultiplexData(void) {
+	FrameData f;
+
+	/* Loop until a record of our rank is found */
+	while (buffer_remaining_d == 0) {
+		char flag;
+		int rank, size;
+
+		if (node_stream->request(&flag, sizeof(char)) != 1
+				|| flag != f.NODEDATAFLAG)
+			return -1;
+
+		node_stream->request(&rank, sizeof(int));
+		node_stream->request(&size, sizeof(int));
+
+		if (rank == node_rank) {
+			if (node_stream->request(stream_buffer_d, size) != 1)
+				return -1;
+			buffer_remaining_d = size;
+		} else {
+			node_stream->skip(size);
+		}
+	}
 
 	return 1;
 }
@@ -87,6 +317,26 @@ int ZlibDecompress::request(void * out, size_t length) {
 	return 1;
 }
 
+const char *ZlibDecompress::span(size_t length) {
+	/* Already whole within the buffer */
+	if (length <= buffer_remaining_d) {
+		const char *start = curr_buffer_pos_d;
+		curr_buffer_pos_d += length;
+		buffer_remaining_d -= length;
+		return start;
+	}
+
+	/* Otherwise gather it across the refills */
+	if (length > span_capacity_d) {
+		delete[] span_buffer_d;
+		span_buffer_d = new char[length];
+		span_capacity_d = length;
+	}
+	if (request(span_buffer_d, length) != 1)
+		return NULL;
+	return span_buffer_d;
+}
+
 int ZlibDecompress::skip(size_t length) {
 	while (length > buffer_remaining_d) { //Loop to get enough data
 
@@ -106,24 +356,70 @@ int ZlibDecompress::skip(size_t length) {
 	return 1;
 }
 
+int ZlibDecompress::seekRaw(long offset) {
+	/* The header must have been read, and only traces of blocks can be seeked */
+	if (index == NULL || (codec_id == 0 && inflateData() != 1)
+			|| codec != NULL)
+		return -1;
+
+	/* Within the data already decoded, just move along */
+	long pos = tell();
+	if (offset >= pos && offset <= next_raw_offset_d)
+		return skip(offset - pos);
+
+	int found = index->findRawOffset(offset);
+	if (found < 0)
+		return -1;
+	const IndexBlock &block = index->getBlock(found);
+
+	source.clear();
+	source.seekg(segment_start + block.file_offset, ios::beg);
+	if (segment_size >= 0)
+		segment_remaining = segment_size - block.file_offset;
+
+	delete[] held_block.data;
+	held_block.data = NULL;
+	stream_ended = false;
+	in_pos_d = in_d;
+	in_remaining_d = 0;
+
+	/* Decode from the start of the block, then skip to the offset within it */
+	next_raw_offset_d = block.raw_offset;
+	if (inflateData() != 1)
+		return -1;
+	return skip(offset - block.raw_offset);
+}
+
 int ZlibDecompress::resetFiles() {
 	buffer_remaining_d = 0;
 	space_remaining_d = BUFFERSIZE;
 	curr_buffer_pos_d = stream_buffer_d;
+	raw_offset_d = 0;
+	next_raw_offset_d = 0;
 
-	//fseek(source_d, 0, SEEK_SET);
-	source.seekg(0, ios::beg);
-
-	strm_d.zalloc = Z_NULL;
-	strm_d.zfree = Z_NULL;
-	strm_d.opaque = Z_NULL;
-	strm_d.avail_in = 0;
-	strm_d.next_in = Z_NULL;
+	if (node_stream != NULL)
+		return node_stream->resetFiles();
 
-	ret_d = inflateInit(&strm_d);
-	return ret_d;
+	//fseek(source_d, 0, SEEK_SET);
+	source.clear();
+	source.seekg(segment_start, ios::beg);
+	segment_remaining = segment_size;
+
+	delete codec;
+	codec = NULL;
+	codec_id = 0;
+	delete[] held_block.data;
+	held_block.data = NULL;
+	stream_ended = false;
+	in_pos_d = in_d;
+	in_remaining_d = 0;
+
+	return Z_OK;
 }
 
 bool ZlibDecompress::eof() {
-	return buffer_remaining_d == 0 && source.eof();
+	/* The codec may hold data beyond the input, so the only test is to decode more */
+	if (buffer_remaining_d == 0)
+		inflateData();
+	return buffer_remaining_d == 0;
 }
@@ -2,14 +2,140 @@
 
 
 ElfData::ElfData() {
+	openBinary(__progname_full);
+}
+
+ElfData::ElfData(string path) {
+	openBinary(path.c_str());
+}
+
+ElfData::~ElfData() {
+	if (e != NULL)
+		elf_end(e);
+	if (fd >= 0)
+		close(fd);
+}
+
+void ElfData::openBinary(const char *path) {
+	e = NULL;
 	assert(elf_version(EV_CURRENT) != EV_NONE);
 
-	assert((fd = open(__progname_full, O_RDONLY, 0)) >= 0);
+	if ((fd = open(path, O_RDONLY, 0)) < 0)
+		return;
 
-	assert((e = elf_begin(fd, ELF_C_READ, NULL)) != NULL);
+	if ((e = elf_begin(fd, ELF_C_READ, NULL)) == NULL)
+		return;
 
-	assert(elf_kind(e) == ELF_K_ELF);
+	if (elf_kind(e) != ELF_K_ELF) {
+		elf_end(e);
+		e = NULL;
+	}
+}
 
+string ElfData::findBuildID(const char *notes, long size) {
+	long offset = 0;
+
+	/* Each note is a header, then the name and description each padded to 4 bytes */
+	while (offset + (long) (3 * sizeof(uint32_t)) <= size) {
+		uint32_t name_size, desc_size, type;
+		memcpy(&name_size, notes + offset, sizeof(uint32_t));
+		memcpy(&desc_size, notes + offset + sizeof(uint32_t), sizeof(uint32_t));
+		memcpy(&type, notes + offset + 2 * sizeof(uint32_t), sizeof(uint32_t));
+		offset += 3 * sizeof(uint32_t);
+
+		const char *name = notes + offset;
+		offset += (name_size + 3) & ~3;
+		const unsigned char *desc = (const unsigned char *) notes + offset;
+		offset += (desc_size + 3) & ~3;
+
+		if (offset > size)
+			break;
+
+		if (type == NT_GNU_BUILD_ID && name_size == 4
+				&& memcmp(name, "GNU", 4) == 0) {
+			string id;
+			char hex[3];
+			uint32_t i;
+			for (i = 0; i < desc_size; i++) {
+				snprintf(hex, sizeof(hex), "%02x", desc[i]);
+				id.append(hex);
+			}
+			return id;
+		}
+	}
+	return string();
+}
+
+/**
+ * The image of the executable, filled in by ElfData::readProgramHeaders
+ */
+struct ProcessImage {
+	long static_mem;
+	long load_bias;
+	string build_id;
+};
+
+int ElfData::readProgramHeaders(struct dl_phdr_info *info, size_t size,
+		void *data) {
+	ProcessImage *image = (ProcessImage *) data;
+	image->load_bias = info->dlpi_addr;
+
+	int i;
+	for (i = 0; i < info->dlpi_phnum; i++) {
+		const ElfW(Phdr) &header = info->dlpi_phdr[i];
+		image->static_mem += (long) header.p_memsz;
+
+		/* Notes are loaded, so the build-id can be read from memory */
+		if (header.p_type == PT_NOTE && image->build_id.empty())
+			image->build_id = findBuildID(
+					(const char *) (info->dlpi_addr + header.p_vaddr),
+					header.p_memsz);
+	}
+
+	/* The executable is always first */
+	return 1;
+}
+
+long ElfData::getProcessImage(string *path, string *build_id,
+		long *load_bias) {
+	ProcessImage image;
+	image.static_mem = 0;
+	image.load_bias = 0;
+	dl_iterate_phdr(ElfData::readProgramHeaders, &image);
+
+	/* Prefer the resolved path, so the binary can be found from any directory */
+	char exe[4096];
+	ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+	if (len > 0) {
+		exe[len] = '\0';
+		*path = exe;
+	} else {
+		*path = __progname_full;
+	}
+
+	*build_id = image.build_id;
+	*load_bias = image.load_bias;
+	return image.static_mem;
+}
+
+string ElfData::getBuildID() {
+	Elf_Scn *scn = NULL;
+
+	while ((scn = elf_nextscn(e, scn)) != NULL) {
+		gelf_getshdr(scn, &shdr);
+		if (shdr.sh_type != SHT_NOTE)
+			continue;
+
+		Elf_Data *elfdata = elf_getdata(scn, NULL);
+		if (elfdata == NULL)
+			continue;
+
+		string id = findBuildID((const char *) elfdata->d_buf,
+				elfdata->d_size);
+		if (!id.empty())
+			return id;
+	}
+	return string();
 }
 
 
@@ -36,32 +162,26 @@ long ElfData::getElfMem() {
 }
 
 
-int ElfData::getFunctions(char ** data, long * size) {
-
-	/* Construct temporary storage for our functions */
-	deque < pair<long, string> > functions;
-	long running_size = 0;
-	int function_count = 0;
+int ElfData::getSymbols(vector<pair<long, string> > &symbols) {
 
 	int count = 0;
 	int ii;
 	int found = 0;
 
-
 	Elf_Scn *scn = NULL;
 
 	/* Loop over the file symbol headers looking for functions frame*/
 	while ((scn = elf_nextscn(e, scn)) != NULL) {
 		gelf_getshdr(scn, &shdr);
 		if (shdr.sh_type == SHT_SYMTAB) {
-			// found a symbol table, go print it.
 			found = 1;
 			break;
 		}
 	}
 
-	/* Ensure that we have found it */
-	assert(found == 1 && shdr.sh_entsize > 0);
+	/* A stripped binary has no symbol table */
+	if (found == 0 || shdr.sh_entsize == 0)
+		return 0;
 
 	/* Calculate the count from the size */
 	Elf_Data *elfdata = elf_getdata(scn, NULL);
@@ -77,43 +197,46 @@ int ElfData::getFunctions(char ** data, long * size) {
 		long function_address = sym.st_value;
 
 		/* Only consider functions with a non 0 address + with a name */
-		if (function_address != 0 && function_name.length() > 0) {
-			/* Add the function to our list */
-			functions.push_back(
+		if (function_address != 0 && function_name.length() > 0)
+			symbols.push_back(
 					pair<long, string>(function_address, function_name));
-			running_size += sizeof(long) + sizeof(int)
-					+ (function_name.size() + 1);
-
-		}
-
 	}
 
-	/* Order the deque Structure */
+	/* Order by address */
 	DequeSorter ds;
-	sort(functions.begin(), functions.end(), ds);
+	sort(symbols.begin(), symbols.end(), ds);
+
+	return symbols.size();
+}
+
+int ElfData::getFunctions(char ** data, long * size) {
+
+	/* Construct temporary storage for our functions */
+	vector < pair<long, string> > functions;
+	getSymbols(functions);
+
+	long running_size = 0;
+	int function_count = 0;
+	unsigned int i;
+	for (i = 0; i < functions.size(); i++)
+		running_size += sizeof(long) + sizeof(int)
+				+ (functions[i].second.size() + 1);
 
 	/* Size the array by the count of elements*/
 	stringbuf out_data;
 	char *arr = new char[running_size];
 	out_data.pubsetbuf(arr, running_size);
 
-	long currentWritten = 0;
 	/* Loop over functions outputting them to the array */
-	while (!functions.empty()) {
+	for (i = 0; i < functions.size(); i++) {
 		function_count++;
-		out_data.sputn((char *) &(functions.front().first), sizeof(long));
+		out_data.sputn((char *) &(functions[i].first), sizeof(long));
 
-		int size = (int) functions.front().second.length();
+		int size = (int) functions[i].second.length();
 		size++;
 
 		out_data.sputn((char *) &size, sizeof(int));
-
-		const char * str = functions.front().second.c_str();
-
-		out_data.sputn((char *) str, sizeof(char) * size);
-
-		functions.pop_front();
-
+		out_data.sputn(functions[i].second.c_str(), sizeof(char) * size);
 	}
 	*data = arr;
 	*size = running_size;
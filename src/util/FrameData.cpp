@@ -3,19 +3,38 @@
 
 FrameData::FrameData() {
 	//Frame sizes
-	malloc_frame_size = sizeof(char) + (2 * sizeof(long)) + sizeof(int)
-			+ sizeof(float);
-	calloc_frame_size = sizeof(char) + (2 * sizeof(long)) + sizeof(int)
-			+ sizeof(float);
-	realloc_frame_size = sizeof(char) + (3 * sizeof(long)) + sizeof(float);
-	free_frame_size = sizeof(char) + sizeof(long) + sizeof(float);
+	malloc_frame_size = sizeof(FrameRecord<MallocRecord>);
+	calloc_frame_size = sizeof(FrameRecord<MallocRecord>);
+	realloc_frame_size = sizeof(FrameRecord<ReallocRecord>);
+	free_frame_size = sizeof(FrameRecord<FreeRecord>);
 
 	timer_frame_size = sizeof(char) + sizeof(double);
+	sequence_frame_size = sizeof(char) + sizeof(long);
+	thread_frame_size = sizeof(FrameRecord<ThreadRecord>);
+	sample_frame_size = sizeof(FrameRecord<SampleRecord>);
+	version_frame_size = sizeof(FrameRecord<VersionRecord>);
+	calibration_frame_size = sizeof(FrameRecord<CalibrationRecord>);
+
+	/* Flag, then at most sequence, time, two addresses and two sizes as VarInts */
+	compact_event_size = sizeof(char) + (6 * VarInt::MAXBYTES);
+
+	/* Flag, sequence, time, bytes, peak and entry count, then stack, bytes and count per entry */
+	aggregate_event_size = sizeof(char) + (5 * VarInt::MAXBYTES);
+	aggregate_entry_size = 3 * VarInt::MAXBYTES;
+
+	/* Flag, sequence, time, address, size and stack, then the fixed width count and tick span */
+	transient_event_size = sizeof(char) + (5 * VarInt::MAXBYTES) + sizeof(int)
+			+ sizeof(long);
+
+	sequence_delta_size = sizeof(int);
 
 	data_forward = sizeof(char) + sizeof(long);
 	elf_forward = sizeof(char) + (2 * sizeof(long)) + sizeof(int);
+	binary_forward = sizeof(char) + (3 * sizeof(long)) + (2 * sizeof(int));
 	virtual_forward = sizeof(char) + sizeof(long) + sizeof(int);
 	stacks_forward = sizeof(char) + sizeof(long) + sizeof(int);
 	cores_forward = sizeof(char) + sizeof(long) + (3 * sizeof(int));
+	thread_data_forward = sizeof(SizedFrameRecord<ThreadDataRecord>);
+	checkpoint_forward = sizeof(SizedFrameRecord<CheckpointRecord>);
 
 }
@@ -0,0 +1,144 @@
+#include "../../include/util/LiveAllocationTable.h"
+using namespace std;
+
+LiveAllocationTable::LiveAllocationTable() {
+	int i;
+	for (i = 0; i < LIVETABLESHARDS; i++) {
+		shards[i].lock = 0;
+		shards[i].size = LIVETABLESIZE;
+		shards[i].used = 0;
+		shards[i].slots = new LiveEntry[LIVETABLESIZE];
+		memset(shards[i].slots, 0, LIVETABLESIZE * sizeof(LiveEntry));
+	}
+}
+
+LiveAllocationTable::~LiveAllocationTable() {
+	int i;
+	for (i = 0; i < LIVETABLESHARDS; i++)
+		delete[] shards[i].slots;
+}
+
+long LiveAllocationTable::findSlot(LiveShard &shard, unsigned long hash,
+		long address) {
+	long mask = shard.size - 1;
+	long slot = getHomeSlot(shard, hash);
+
+	/* Linear probe until the address or an empty slot is found */
+	while (shard.slots[slot].address != 0
+			&& shard.slots[slot].address != address)
+		slot = (slot + 1) & mask;
+	return slot;
+}
+
+void LiveAllocationTable::growShard(LiveShard &shard) {
+	LiveEntry *old_slots = shard.slots;
+	long old_size = shard.size;
+
+	shard.size *= 2;
+	shard.slots = new LiveEntry[shard.size];
+	memset(shard.slots, 0, shard.size * sizeof(LiveEntry));
+
+	/* Every address is unique, so only need to find an empty slot */
+	long i;
+	for (i = 0; i < old_size; i++) {
+		if (old_slots[i].address == 0)
+			continue;
+		long slot = findSlot(shard, hashAddress(old_slots[i].address),
+				old_slots[i].address);
+		shard.slots[slot] = old_slots[i];
+	}
+
+	delete[] old_slots;
+}
+
+void LiveAllocationTable::insert(long address, long size, int stack) {
+	if (address == 0)
+		return;
+
+	unsigned long hash = hashAddress(address);
+	LiveShard &shard = getShard(hash);
+	lockShard(shard);
+
+	/* Keep the load below three quarters */
+	if ((shard.used + 1) * 4 > shard.size * 3)
+		growShard(shard);
+
+	long slot = findSlot(shard, hash, address);
+	if (shard.slots[slot].address == 0)
+		shard.used++;
+	shard.slots[slot].address = address;
+	shard.slots[slot].size = size;
+	shard.slots[slot].stack = stack;
+
+	unlockShard(shard);
+}
+
+bool LiveAllocationTable::remove(long address, long *size, int *stack) {
+	if (address == 0)
+		return false;
+
+	unsigned long hash = hashAddress(address);
+	LiveShard &shard = getShard(hash);
+	lockShard(shard);
+
+	long slot = findSlot(shard, hash, address);
+	if (shard.slots[slot].address == 0) {
+		unlockShard(shard);
+		return false;
+	}
+
+	*size = shard.slots[slot].size;
+	*stack = shard.slots[slot].stack;
+
+	/* Shift back any later entry of the probe run which could sit in the hole */
+	long mask = shard.size - 1;
+	long hole = slot;
+	long next = (slot + 1) & mask;
+	while (shard.slots[next].address != 0) {
+		long home = getHomeSlot(shard, hashAddress(shard.slots[next].address));
+		if (((next - home) & mask) >= ((next - hole) & mask)) {
+			shard.slots[hole] = shard.slots[next];
+			hole = next;
+		}
+		next = (next + 1) & mask;
+	}
+	shard.slots[hole].address = 0;
+	shard.used--;
+
+	unlockShard(shard);
+	return true;
+}
+
+void LiveAllocationTable::sumByStack(map<int, long> &bytes,
+		map<int, long> &counts) {
+	int i;
+	for (i = 0; i < LIVETABLESHARDS; i++) {
+		LiveShard &shard = shards[i];
+		lockShard(shard);
+
+		long j;
+		for (j = 0; j < shard.size; j++) {
+			if (shard.slots[j].address == 0)
+				continue;
+			bytes[shard.slots[j].stack] += shard.slots[j].size;
+			counts[shard.slots[j].stack]++;
+		}
+
+		unlockShard(shard);
+	}
+}
+
+void LiveAllocationTable::getAllocations(vector<LiveEntry> &entries) {
+	int i;
+	for (i = 0; i < LIVETABLESHARDS; i++) {
+		LiveShard &shard = shards[i];
+		lockShard(shard);
+
+		long j;
+		for (j = 0; j < shard.size; j++)
+			if (shard.slots[j].address != 0)
+				entries.push_back(shard.slots[j]);
+
+		unlockShard(shard);
+	}
+}
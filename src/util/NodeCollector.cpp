@@ -0,0 +1,215 @@
+#include "../../include/util/NodeCollector.h"
+
+#ifndef NO_MPI
+NodeCollector::NodeCollector(string folder, void (*worker_init)(),
+		char codec_id, int codec_level, int compress_threads) {
+	this->worker_init = worker_init;
+	z_comp = NULL;
+	pool = NULL;
+	frame_data = new FrameData();
+	finish_called = false;
+
+	MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+	MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, world_rank,
+			MPI_INFO_NULL, &node_comm);
+	MPI_Comm_rank(node_comm, &node_rank);
+
+	int node_size;
+	MPI_Comm_size(node_comm, &node_size);
+
+	/* Only the collector holds the ring, the other ranks map it */
+	MPI_Aint size = 0;
+	if (node_rank == 0)
+		size = sizeof(NodeRing) + NODESLOTS * sizeof(NodeSlot);
+
+	char *base;
+	MPI_Win_allocate_shared(size, 1, MPI_INFO_NULL, node_comm, &base,
+			&window);
+
+	int disp;
+	MPI_Win_shared_query(window, 0, &size, &disp, &base);
+	ring = (NodeRing *) base;
+	slots = (NodeSlot *) (base + sizeof(NodeRing));
+
+	if (node_rank == 0) {
+		pthread_mutexattr_t mutex_attr;
+		pthread_mutexattr_init(&mutex_attr);
+		pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+		pthread_mutex_init(&ring->lock, &mutex_attr);
+		pthread_mutexattr_destroy(&mutex_attr);
+
+		pthread_condattr_t cond_attr;
+		pthread_condattr_init(&cond_attr);
+		pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+		pthread_cond_init(&ring->not_empty, &cond_attr);
+		pthread_cond_init(&ring->not_full, &cond_attr);
+		pthread_condattr_destroy(&cond_attr);
+
+		ring->head = 0;
+		ring->tail = 0;
+		ring->ranks = node_size;
+		ring->finished = 0;
+
+		int i;
+		for (i = 0; i < NODESLOTS; i++)
+			slots[i].ready = 0;
+
+		z_comp = new Compress(
+				TraceContainer::makeNodeFileName(folder, world_rank),
+				worker_init, false, codec_id, codec_level, compress_threads);
+		pool = new BufferPool(NODEBUFFERS,
+				NODEBLOCK + sizeof(char) + 2 * sizeof(int));
+		pthread_create(&collector, NULL, collectorMain, this);
+	}
+
+	/* The ring must be ready before any rank of the node writes to it */
+	MPI_Barrier(node_comm);
+
+	/* Record which node trace holds each rank, named by the world rank of its collector */
+	int node = world_rank;
+	MPI_Bcast(&node, 1, MPI_INT, 0, node_comm);
+
+	int world_size;
+	MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+	int *nodes = NULL;
+	if (world_rank == 0)
+		nodes = new int[world_size];
+	MPI_Gather(&node, 1, MPI_INT, nodes, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+	if (world_rank == 0) {
+		TraceContainer::writeNodeMap(folder, nodes, world_size);
+		delete[] nodes;
+	}
+}
+
+int NodeCollector::finish() {
+	if (finish_called)
+		return 1;
+	finish_called = true;
+
+	char fin = frame_data->FINISHFLAG;
+	addData(&fin, 1);
+
+	pthread_mutex_lock(&ring->lock);
+	ring->finished++;
+	pthread_cond_signal(&ring->not_empty);
+	pthread_mutex_unlock(&ring->lock);
+
+	/* The collector stops once every rank of the node has finished */
+	if (node_rank == 0) {
+		pthread_join(collector, NULL);
+		z_comp->finish();
+	}
+
+	/* Collective, so the ring is not unmapped until the collector is done with it */
+	MPI_Win_free(&window);
+	MPI_Comm_free(&node_comm);
+
+	return 0;
+}
+#else
+NodeCollector::NodeCollector(string folder, void (*worker_init)(),
+		char codec_id, int codec_level, int compress_threads) {
+	/* Implemented without MPI use, node traces can only be read */
+	this->worker_init = worker_init;
+	ring = NULL;
+	slots = NULL;
+	z_comp = NULL;
+	pool = NULL;
+	frame_data = new FrameData();
+	finish_called = true;
+}
+
+int NodeCollector::finish() {
+	return 1;
+}
+#endif
+
+NodeCollector::~NodeCollector() {
+	if (!finish_called)
+		finish();
+	delete z_comp;
+	delete pool;
+	delete frame_data;
+}
+
+void *NodeCollector::collectorMain(void *arg) {
+	NodeCollector *node = (NodeCollector *) arg;
+	if (node->worker_init != NULL)
+		node->worker_init();
+	node->collect();
+	return NULL;
+}
+
+void NodeCollector::collect() {
+	char nf = frame_data->NODEDATAFLAG;
+
+	pthread_mutex_lock(&ring->lock);
+	while (true) {
+		/* Wait for the next block to be filled, or for every rank to finish */
+		while ((ring->tail == ring->head && ring->finished < ring->ranks)
+				|| (ring->tail != ring->head
+						&& !slots[ring->tail % NODESLOTS].ready))
+			pthread_cond_wait(&ring->not_empty, &ring->lock);
+
+		if (ring->tail == ring->head)
+			break;
+
+		NodeSlot *slot = &slots[ring->tail % NODESLOTS];
+		pthread_mutex_unlock(&ring->lock);
+
+		/* Wrap the block in a record, freeing the slot before it is compressed */
+		char *record = pool->acquire();
+		record[0] = nf;
+		memcpy(record + sizeof(char), &slot->rank, sizeof(int));
+		memcpy(record + sizeof(char) + sizeof(int), &slot->size, sizeof(int));
+		memcpy(record + sizeof(char) + 2 * sizeof(int), slot->data, slot->size);
+		long record_size = sizeof(char) + 2 * sizeof(int) + slot->size;
+
+		pthread_mutex_lock(&ring->lock);
+		slot->ready = 0;
+		ring->tail++;
+		pthread_cond_broadcast(&ring->not_full);
+		pthread_mutex_unlock(&ring->lock);
+
+		z_comp->addBuffer(record, record_size, pool);
+
+		pthread_mutex_lock(&ring->lock);
+	}
+	pthread_mutex_unlock(&ring->lock);
+}
+
+int NodeCollector::addData(char *data, long size) {
+	while (size > 0) {
+		int chunk = size < NODEBLOCK ? size : NODEBLOCK;
+
+		/* Take the next slot, waiting for the collector to free one if the ring is full */
+		pthread_mutex_lock(&ring->lock);
+		while (ring->head - ring->tail >= NODESLOTS)
+			pthread_cond_wait(&ring->not_full, &ring->lock);
+		NodeSlot *slot = &slots[ring->head % NODESLOTS];
+		ring->head++;
+		pthread_mutex_unlock(&ring->lock);
+
+		/* Filled outside the lock, so the ranks copy in parallel */
+		slot->rank = world_rank;
+		slot->size = chunk;
+		memcpy(slot->data, data, chunk);
+		__sync_synchronize();
+
+		pthread_mutex_lock(&ring->lock);
+		slot->ready = 1;
+		pthread_cond_signal(&ring->not_empty);
+		pthread_mutex_unlock(&ring->lock);
+
+		data += chunk;
+		size -= chunk;
+	}
+	return 0;
+}
+
+int NodeCollector::addBuffer(char *data, long size, BufferPool *pool) {
+	int ret = addData(data, size);
+	pool->release(data);
+	return ret;
+}
@@ -4,72 +4,175 @@ using namespace std;
 StackMap::StackMap(bool print) {
 	this->print = print;
 	stack_map_ID = 0;
+	print_start_ID = 0;
 	print_queue_size = 0;
+
+	/* Set up the empty table */
+	table_size = STACKTABLESIZE;
+	table = new StackSlot[table_size];
+	long i;
+	for (i = 0; i < table_size; i++)
+		table[i].id = -1;
+
+	/* Set up the arena and entries, which grow as stacks are added */
+	arena_size = STACKARENASIZE;
+	arena = new long[arena_size];
+	arena_used = 0;
+
+	entries_size = STACKTABLESIZE / 2;
+	entries = new StackEntry[entries_size];
+
+	pthread_mutex_init(&stack_lock, NULL);
 }
 
-int StackMap::addStack(vector<long> new_stack) {
+StackMap::~StackMap() {
+	delete[] table;
+	delete[] arena;
+	delete[] entries;
+	pthread_mutex_destroy(&stack_lock);
+}
 
-	/* Try to insert a new object with the vector */
-	call_stack_insert = call_stack_map.insert(
-			pair<vector<long>, int>(new_stack, stack_map_ID));
+unsigned long StackMap::hashStack(const long *stack, int depth) {
+	/* Multiplicative mixing of each frame, seeded with the depth */
+	unsigned long hash = 0x9E3779B97F4A7C15UL ^ (unsigned long) depth;
+	int i;
+	for (i = 0; i < depth; i++) {
+		hash ^= (unsigned long) stack[i];
+		hash *= 0xBF58476D1CE4E5B9UL;
+		hash ^= hash >> 31;
+	}
+	return hash;
+}
 
-	/* If it was inserted, add it to the print queue, and increment */
-	if (call_stack_insert.second == true) {	//new Element
-		stack_map_ID++;
-		if (print)
-			addToPrintQueue(new_stack, call_stack_insert.first->second);
+long StackMap::findSlot(unsigned long hash, const long *stack, int depth) {
+	long mask = table_size - 1;
+	long slot = hash & mask;
+
+	/* Linear probe until the stack or an empty slot is found */
+	while (table[slot].id != -1) {
+		if (table[slot].hash == hash) {
+			StackEntry &entry = entries[table[slot].id];
+			if (entry.depth == depth
+					&& memcmp(arena + entry.offset, stack,
+							depth * sizeof(long)) == 0)
+				return slot;
+		}
+		slot = (slot + 1) & mask;
 	}
+	return slot;
+}
 
-	/* Return the ID of the stack */
-	return call_stack_insert.first->second;
+void StackMap::growTable() {
+	StackSlot *old_table = table;
+	long old_size = table_size;
+
+	table_size *= 2;
+	table = new StackSlot[table_size];
+	long i;
+	for (i = 0; i < table_size; i++)
+		table[i].id = -1;
+
+	/* Every stack is unique, so only need to find an empty slot */
+	long mask = table_size - 1;
+	for (i = 0; i < old_size; i++) {
+		if (old_table[i].id == -1)
+			continue;
+		long slot = old_table[i].hash & mask;
+		while (table[slot].id != -1)
+			slot = (slot + 1) & mask;
+		table[slot] = old_table[i];
+	}
 
+	delete[] old_table;
 }
 
-void StackMap::addToPrintQueue(vector<long>& newStack, int id) {
-	/* Add the element to the back of the queue, and increase the size */
-	print_queue.push_back(pair<int, vector<long> >(id, newStack));
-	print_queue_size += (2 * sizeof(int)) + (newStack.size() * sizeof(long));
+long StackMap::appendToArena(const long *stack, int depth) {
+	if (arena_used + depth > arena_size) {
+		long new_size = arena_size * 2;
+		while (arena_used + depth > new_size)
+			new_size *= 2;
+
+		/* Offsets are kept rather than pointers, so the frames can move */
+		long *new_arena = new long[new_size];
+		memcpy(new_arena, arena, arena_used * sizeof(long));
+		delete[] arena;
+		arena = new_arena;
+		arena_size = new_size;
+	}
+
+	long offset = arena_used;
+	memcpy(arena + offset, stack, depth * sizeof(long));
+	arena_used += depth;
+	return offset;
+}
+
+int StackMap::addStack(const long *stack, int depth) {
+	unsigned long hash = hashStack(stack, depth);
+
+	pthread_mutex_lock(&stack_lock);
+
+	long slot = findSlot(hash, stack, depth);
+	int id = table[slot].id;
+
+	if (id == -1) {	//new Element
+		if (stack_map_ID == entries_size) {
+			StackEntry *new_entries = new StackEntry[entries_size * 2];
+			memcpy(new_entries, entries, entries_size * sizeof(StackEntry));
+			delete[] entries;
+			entries = new_entries;
+			entries_size *= 2;
+		}
+
+		id = stack_map_ID++;
+		entries[id].offset = appendToArena(stack, depth);
+		entries[id].depth = depth;
+
+		table[slot].hash = hash;
+		table[slot].id = id;
+
+		/* Keep the table at most half full, so probes stay short */
+		if (2 * (long) stack_map_ID > table_size)
+			growTable();
+
+		if (print)
+			print_queue_size += (2 * sizeof(int)) + (depth * sizeof(long));
+		else
+			print_start_ID = stack_map_ID;
+	}
+
+	pthread_mutex_unlock(&stack_lock);
+
+	/* Return the ID of the stack */
+	return id;
+
 }
 
 char *StackMap::getPrintQueue(long *size, int *count) {
+	pthread_mutex_lock(&stack_lock);
+
 	*size = print_queue_size;
-	*count = print_queue.size();
+	*count = stack_map_ID - print_start_ID;
 
-	/* Set up string buffer */
 	char *data = new char[print_queue_size];
-	stringbuf out_data;
-	out_data.pubsetbuf(data, print_queue_size);
-
-	int buffercounter = 0;
-	int i = 0;
-	pair<int, vector<long> > curr;
-	int vecSize;
-
-	/* Loop over the elements in the print queue writing it to the output array */
-	while (!print_queue.empty()) {
-		curr = print_queue.front();	//Get from top
-		print_queue.pop_front();		//Remove element
-		vecSize = curr.second.size();
-
-		/* Write data to the buffer */
-		out_data.sputn((char *) &(curr.first), sizeof(int));
-		out_data.sputn((char *) &vecSize, sizeof(int));
-
-		/**
-		 * Could perhaps use:
-		 * memcpy((void *)(ret+buffercounter), &curr.second[0], curr.second.size() * sizeof(long));
-		 * buffercounter+=curr.second.size() * sizeof(long);
-		 *
-		 * But this assumes that the vector is stored in contigious memory - Dangerous.
-		 * Deep copy slower but safer.
-		 */
-
-		for (i = 0; i < curr.second.size(); i++)
-			out_data.sputn((char *) &(curr.second[i]), sizeof(long));
-
+	char *pos = data;
+
+	/* Serialise each new stack straight from the arena */
+	int id;
+	for (id = print_start_ID; id < stack_map_ID; id++) {
+		StackEntry &entry = entries[id];
+
+		memcpy(pos, &id, sizeof(int));
+		pos += sizeof(int);
+		memcpy(pos, &entry.depth, sizeof(int));
+		pos += sizeof(int);
+		memcpy(pos, arena + entry.offset, entry.depth * sizeof(long));
+		pos += entry.depth * sizeof(long);
 	}
 
+	print_start_ID = stack_map_ID;
 	print_queue_size = 0;
 
+	pthread_mutex_unlock(&stack_lock);
+
 	return data;
 }
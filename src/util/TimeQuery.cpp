@@ -0,0 +1,80 @@
+#include "../../include/util/TimeQuery.h"
+
+bool TimeQuery::parseTime(const string &text, double *value) {
+	if (text.empty())
+		return false;
+
+	char *end;
+	*value = strtod(text.c_str(), &end);
+	return *end == '\0';
+}
+
+bool TimeQuery::parse(const string &spec) {
+	times.clear();
+	count = 0;
+
+	/* A count of evenly spaced times */
+	if (!spec.empty() && spec[0] == '@') {
+		char *end;
+		count = strtol(spec.c_str() + 1, &end, 10);
+		if (count <= 0 || count > TIMEQUERYMAX || *end != '\0') {
+			count = 0;
+			return false;
+		}
+		return true;
+	}
+
+	/* A range, start:end:step */
+	size_t first = spec.find(':');
+	if (first != string::npos) {
+		size_t second = spec.find(':', first + 1);
+		double start, end, step;
+		if (second == string::npos
+				|| !parseTime(spec.substr(0, first), &start)
+				|| !parseTime(spec.substr(first + 1, second - first - 1), &end)
+				|| !parseTime(spec.substr(second + 1), &step) || step <= 0.0
+				|| end < start)
+			return false;
+
+		/* Counted as a double first, a tiny step would overflow the count */
+		double steps = floor((end - start) / step + 1.0e-9);
+		if (!(steps < TIMEQUERYMAX))
+			return false;
+
+		/* Step by index rather than adding, so the error does not build up */
+		long i;
+		for (i = 0; i <= (long) steps; i++)
+			times.push_back(start + i * step);
+		return true;
+	}
+
+	/* A list of times, or a single one */
+	size_t pos = 0;
+	while (pos <= spec.size()) {
+		size_t comma = spec.find(',', pos);
+		if (comma == string::npos)
+			comma = spec.size();
+
+		double value;
+		if (!parseTime(spec.substr(pos, comma - pos), &value)) {
+			times.clear();
+			return false;
+		}
+		times.push_back(value);
+		pos = comma + 1;
+	}
+	return true;
+}
+
+vector<double> TimeQuery::getTimes(double end_time) const {
+	vector<double> result(times);
+
+	/* Spread the count across the run, the last at its end */
+	int i;
+	for (i = 1; i <= count; i++)
+		result.push_back(end_time * i / count);
+
+	sort(result.begin(), result.end());
+	result.erase(unique(result.begin(), result.end()), result.end());
+	return result;
+}
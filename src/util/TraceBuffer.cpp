@@ -1,298 +1,413 @@
 #include "../../include/util/TraceBuffer.h"
 
-TraceBuffer::TraceBuffer(StackMap *stackmap) {
+TraceBuffer::TraceBuffer(TraceWriter *writer, int thread_id, long sequence,
+		unsigned long ticks, long size, bool coalesce) {
 
-	this->stack_map = stackmap;
+	this->writer = writer;
+	this->thread_id = thread_id;
+	this->last_sequence = sequence;
+	this->last_ticks = ticks;
+
+	aggregate_bytes = 0;
+	aggregate_peak = 0;
+	aggregate_events = 0;
+	aggregate_ticks = ticks;
+	aggregate_stack_count = 0;
+	aggregate_sequence = -1;
+	aggregate_closed = false;
+
+	this->coalesce = coalesce;
+	skipped_sequences = 0;
+
+	pending_sequence = LONG_MAX;
+	reserved_sequence = LONG_MAX;
+	event_lock = 0;
 
-	/* Initiate new data objects */
-	z_comp = new Compress(WMUtils::makeFileName(true));
-	elf_data = new ElfData();
 	frame_data = new FrameData();
 
-	/* Set up global string buffer */
-	internal_buffer = new char[BUFFERSIZE];
-	internal_string_buffer.pubsetbuf(internal_buffer, BUFFERSIZE);
+	/* Set up the buffer for this thread */
+	buffer_size = size;
+	pool = new BufferPool(BUFFERCOUNT, buffer_size);
+	internal_buffer = pool->acquire();
 	buffer_used = 0;
 
-	/* Get data for start of trace file */
-	fetchElfData();
-	fetchCoreData();
-
 	//Set up flag and placeholder for size variable
 	initBuffer();
 
+	/* Only known to the writer once set up, so it can hand over the buffer */
+	writer->attachBuffer(this);
+
 }
 
 TraceBuffer::~TraceBuffer() {
-	delete z_comp;
-	delete elf_data;
+	writer->detachBuffer(this);
 	delete frame_data;
-	delete[] internal_buffer;
+	pool->release(internal_buffer);
+	delete pool;
 }
 
 void TraceBuffer::initBuffer() {
-	internal_string_buffer.pubseekoff(0, ios_base::beg);
-	copyFlag(frame_data->DATAFLAG);
-	long data = 0;
-	copyToBuffer(&data, sizeof(long));
+	memset(&buffer_stats, 0, sizeof(IndexBlock));
+
+	/* The size and watermark are filled in once the frame is full */
+	SizedFrameRecord<ThreadDataRecord> header;
+	header.flag = frame_data->THREADDATAFLAG;
+	header.size = 0;
+	header.record.thread_id = thread_id;
+	header.record.watermark = 0;
+	header.record.base_sequence = last_sequence;
+	header.record.base_ticks = last_ticks;
+
+	buffer_used = putRecord(internal_buffer, header) - internal_buffer;
+
+	/* Deltas restart with each frame */
+	prev_address = 0;
+	prev_stack = 0;
+
+	/* Events already handed to the writer can no longer change */
+	candidate.offset = -1;
+	run_offset = -1;
 }
 
 void TraceBuffer::finishBuffer() {
-	printBuffer();
-	fetchVirtualAddresses();
-	z_comp->finish();
-}
-
-int TraceBuffer::fetchCallStacks() {
-	long size;
-	int count;
-
-	char * data = stack_map->getPrintQueue(&size, &count);
-	if (size == 0 || count == 0)
-		return 1;
-
-	/* Set up string buffer */
-	long out_size = frame_data->getStacksForward() + size;
-	char * stack_array = new char[out_size];
-	stringbuf out_data;
-	out_data.pubsetbuf(stack_array, out_size);
-
-	/* Extract data */
-	long data_size = size + sizeof(int);
-	char sf = frame_data->STACKFLAG;
+	flushAggregate();
 
-	/* Write data to the buffer */
-	out_data.sputn((char *) &sf, sizeof(char));
-	out_data.sputn((char *) &data_size, sizeof(long));
-	out_data.sputn((char *) &count, sizeof(int));
-	out_data.sputn((char *) data, size);
-
-	/* Write data to compression buffer */
-	int ret = z_comp->addData(stack_array, out_size);
-	//cout << "Written Stack: " << out_size << "(B) Data\n";
+	/* Only print if the buffer holds any events */
+	if (buffer_used > frame_data->getThreadDataForward())
+		printBuffer();
+}
 
-	/* Free buffer */
-	delete[] data;
-	delete[] stack_array;
+unsigned char *TraceBuffer::startEvent(const char flag, unsigned long ticks,
+		long sequence) {
+	/*
+	 * Must be fetched after the space check - a flush publishes everything below the watermark.
+	 * The first event of a frame publishes a sequence no higher than its own before taking it,
+	 * so the writer either sees the thread holding the trace back or the sequence comes after what it read.
+	 */
+	if (pending_sequence == LONG_MAX) {
+		pending_sequence = writer->getSequence();
+		__sync_synchronize();
+	}
+	if (sequence < 0)
+		sequence = writer->nextSequence();
+	else if (sequence == reserved_sequence)
+		reserved_sequence = LONG_MAX;
+	unsigned long delta = sequence - last_sequence;
+	candidate.offset = -1;
+	last_sequence = sequence;
+
+	/* Signed, the counters of different cores may be very slightly apart */
+	long tick_delta = (long) (ticks - last_ticks);
+	last_ticks = ticks;
+
+	buffer_stats.events++;
+	buffer_stats.ticks = ticks;
+
+	unsigned char *pos = (unsigned char *) internal_buffer + buffer_used;
+	*pos++ = flag;
+	pos += VarInt::encode(pos, delta);
+	pos += VarInt::encodeSigned(pos, tick_delta);
+	return pos;
+}
 
+int TraceBuffer::ensureBufferSpace(long size) {
+	if (buffer_size - buffer_used <= size) {
+		return printBuffer();
+	}
 	return 0;
-
 }
 
-int TraceBuffer::fetchCoreData() {
-
-	/* Collect MPI information */
-	int rank = WMUtils::getMPIRank();
-	int comm = WMUtils::getMPICommSize();
-
-	string name = WMUtils::getMPIProcName();
-	char * name_str = (char *) name.c_str();
-	int name_len = name.size() + 1;
-
-	/* Set up string buffer */
-	long out_size = frame_data->getCoresForward() + name_len;
-	char * stack_array = new char[out_size];
-	stringbuf out_data;
-	out_data.pubsetbuf(stack_array, out_size);
-
-	/* Set up variables */
-	long data_size = 3 * sizeof(int) + name_len;
-	char cf = frame_data->CORESFLAG;
-
-	/* Copy data into string buffer */
-	out_data.sputn((char *) &cf, sizeof(char));
-	out_data.sputn((char *) &data_size, sizeof(long));
-	out_data.sputn((char *) &rank, sizeof(int));
-	out_data.sputn((char *) &comm, sizeof(int));
-	out_data.sputn((char *) &name_len, sizeof(int));
-	out_data.sputn((char *) name_str, name_len);
-
-	/* Write data to compression buffer */
-	int ret = z_comp->addData(stack_array, out_size);
-	//cout << "Written Cores: " << out_size << "(B) Data\n";
-
-	/* Free buffer */
-	delete[] stack_array;
+int TraceBuffer::printBuffer() {
 
-	return 0;
+	/* Hand the buffer over and swap in the next free one */
+	int ret = writer->addThreadData(this);
+	nextFrame();
 
+	return ret;
 }
 
-int TraceBuffer::fetchVirtualAddresses() {
-	VirtualMemoryData *vmd = new VirtualMemoryData();
-	char * vFunctions_data;
-	int vFunctions_size;
-	int vFunctions_count = vmd->getData(&vFunctions_data, &vFunctions_size);
-
-	/* Set up string buffer */
-	long out_size = frame_data->getVirtualForward() + vFunctions_size;
-	char * stack_array = new char[out_size];
-	stringbuf out_data;
-	out_data.pubsetbuf(stack_array, out_size);
-
-	/* Set up variables */
-	long size = vFunctions_size + sizeof(int);
-	char vf = frame_data->VIRTUALFLAG;
-
-	/* Copy data into string buffer */
-	out_data.sputn((char *) &vf, sizeof(char));
-	out_data.sputn((char *) &size, sizeof(long));
-	out_data.sputn((char *) &vFunctions_count, sizeof(int));
-	out_data.sputn((char *) vFunctions_data, vFunctions_size);
-
-	/* Write data to compression buffer */
-	int ret = z_comp->addData(stack_array, out_size);
-	//cout << "Written Virtual: " << out_size << "(B) Data\n";
-
-	/* Free buffer */
-	delete[] stack_array;
-	delete[] vFunctions_data;
-	delete vmd;
+char *TraceBuffer::sealFrame(long *size) {
 
-	return 0;
+	/* Insert the frame size after the flag */
+	long frame_size = buffer_used - frame_data->getDataForward();
+	memcpy(internal_buffer + frame_data->getFrameSizeOffset(), &frame_size,
+			sizeof(long));
 
+	*size = buffer_used;
+	return internal_buffer;
 }
 
-int TraceBuffer::copyToBuffer(void* data, long size) {
-	buffer_used += internal_string_buffer.sputn((char *) data, size);
-	return 0;
-}
+long TraceBuffer::reserveSequence() {
+	flushAggregate();
 
-int TraceBuffer::copyFlag(const char flag) {
-	buffer_used += internal_string_buffer.sputn((char *) &flag, sizeof(char));
-	return 0;
-}
-
-int TraceBuffer::ensureBufferSpace(long size) {
-	if (BUFFERSIZE - buffer_used <= size) {
-		return printBuffer();
+	/* Published first, as for the first event of a frame */
+	if (pending_sequence == LONG_MAX) {
+		pending_sequence = writer->getSequence();
+		__sync_synchronize();
 	}
-	return 0;
+	reserved_sequence = writer->nextSequence();
+	return reserved_sequence;
 }
 
-int TraceBuffer::printBuffer() {
-
-	fetchCallStacks();
+void TraceBuffer::nextFrame() {
+	/* Every event so far is now with the writer, bar one with a sequence reserved */
+	pending_sequence = reserved_sequence;
 
-	/* Store old current position */
-	long frame_size = buffer_used - frame_data->getDataForward();
-
-	/* Move to pos 1 and insert data */
-	internal_string_buffer.pubseekoff(1, ios_base::beg);
-	internal_string_buffer.sputn((char *) &frame_size, sizeof(long));
+	internal_buffer = pool->acquire();
+	initBuffer();
+}
 
-	/* Return to old position */
-	internal_string_buffer.pubseekoff(buffer_used, ios_base::beg);
+void TraceBuffer::addMalloc(long address, unsigned long ticks, long allocationsize,
+		int stackid) {
+	flushAggregate();
+	ensureBufferSpace(
+			coalesce ?
+					frame_data->getTransientEventSize() :
+					frame_data->getCompactEventSize());
 
-	int ret = z_comp->addData(internal_buffer, buffer_used);
+	/* Enough to undo the event, should its free follow straight after */
+	TransientCandidate saved = { buffer_used, address, allocationsize,
+			stackid, ticks, 0, last_sequence, last_ticks, prev_address,
+			prev_stack };
 
+	//Flag
+	unsigned char *pos = startEvent(frame_data->MALLOCFLAG, ticks);
 
-	buffer_used = 0;
-	initBuffer();
+	//Data
+	pos += VarInt::encodeSigned(pos, address - prev_address);
+	pos += VarInt::encode(pos, allocationsize);
+	pos += VarInt::encodeSigned(pos, (long) stackid - prev_stack);
+	finishEvent(pos);
+
+	prev_address = address;
+	prev_stack = stackid;
+
+	/* Starting the event cleared the last candidate */
+	if (coalesce) {
+		candidate = saved;
+		candidate.sequence = last_sequence;
+	}
 
-	return ret;
 }
 
-int TraceBuffer::fetchElfData() {
+void TraceBuffer::addCalloc(long address, unsigned long ticks, long allocationsize,
+		int stackid) {
+	flushAggregate();
+	ensureBufferSpace(
+			coalesce ?
+					frame_data->getTransientEventSize() :
+					frame_data->getCompactEventSize());
 
-	long elf_mem = elf_data->getElfMem();
-	char *functions;
-	long elf_functions;
-	int function_count = elf_data->getFunctions(&functions, &elf_functions);
+	/* Enough to undo the event, should its free follow straight after */
+	TransientCandidate saved = { buffer_used, address, allocationsize,
+			stackid, ticks, 0, last_sequence, last_ticks, prev_address,
+			prev_stack };
 
-	/* Set up string buffer */
-	long out_size = frame_data->getElfForward() + elf_functions;
-	char * stack_array = new char[out_size];
-	stringbuf out_data;
-	out_data.pubsetbuf(stack_array, out_size);
+	//Flag
+	unsigned char *pos = startEvent(frame_data->CALLOCFLAG, ticks);
 
-	/* Set up variables */
-	char ef = frame_data->ELFFLAG;
+	//Data
+	pos += VarInt::encodeSigned(pos, address - prev_address);
+	pos += VarInt::encode(pos, allocationsize);
+	pos += VarInt::encodeSigned(pos, (long) stackid - prev_stack);
+	finishEvent(pos);
+
+	prev_address = address;
+	prev_stack = stackid;
+
+	/* Starting the event cleared the last candidate */
+	if (coalesce) {
+		candidate = saved;
+		candidate.sequence = last_sequence;
+	}
 
-	/* Copy data into string buffer */
-	out_data.sputn((char *) &ef, sizeof(char));
-	out_data.sputn((char *) &elf_mem, sizeof(long));
-	out_data.sputn((char *) &function_count, sizeof(int));
-	out_data.sputn((char *) &elf_functions, sizeof(long));
-	out_data.sputn((char *) functions, elf_functions);
+}
 
-	/* Write data to compression buffer */
-	int ret = z_comp->addData(stack_array, out_size);
+void TraceBuffer::addRealloc(long addressold, long addressnew, unsigned long ticks,
+		long allocationsize, long oldsize, long sequence) {
+	flushAggregate();
+	ensureBufferSpace(frame_data->getCompactEventSize());
 
-	/* Free buffer */
-	delete[] stack_array;
-	delete[] functions;
+	//Flag
+	unsigned char *pos = startEvent(frame_data->REALLOCFLAG, ticks, sequence);
 
-	return 0;
+	//Data
+	pos += VarInt::encodeSigned(pos, addressold - prev_address);
+	pos += VarInt::encodeSigned(pos, addressnew - addressold);
+	pos += VarInt::encode(pos, allocationsize);
+	pos += VarInt::encodeSigned(pos, oldsize);
+	finishEvent(pos);
 
+	prev_address = addressnew;
 }
 
-void TraceBuffer::addMalloc(long address, float time, long allocationsize,
-		int stackid) {
+void TraceBuffer::addFree(long address, unsigned long ticks, long freedsize,
+		int stackid, long sequence) {
+	/*
+	 * Freed by the very next event, so fold the pair into a transient event - not with a sequence already taken.
+	 * The allocation must match in full, and no other thread may have taken a sequence since,
+	 * or the pair could hide an event of another thread between them.
+	 */
+	if (sequence < 0 && candidate.offset >= 0 && candidate.address == address
+			&& candidate.size == freedsize && candidate.stack == stackid
+			&& writer->getSequence() == candidate.sequence + 1) {
+		coalesceFree(ticks);
+		return;
+	}
 
-	ensureBufferSpace(frame_data->getMallocFrameSize());
+	flushAggregate();
+	ensureBufferSpace(frame_data->getCompactEventSize());
 
 	//Flag
-	copyFlag(frame_data->MALLOCFLAG);
+	unsigned char *pos = startEvent(frame_data->FREEFLAG, ticks, sequence);
 
 	//Data
-	copyToBuffer(&address, sizeof(long));
-	copyToBuffer(&time, sizeof(float));
-	copyToBuffer(&allocationsize, sizeof(long));
-	copyToBuffer(&stackid, sizeof(int));
+	pos += VarInt::encodeSigned(pos, address - prev_address);
+	pos += VarInt::encode(pos, freedsize);
+	pos += VarInt::encodeSigned(pos, (long) stackid - prev_stack);
+	finishEvent(pos);
 
+	prev_address = address;
+	prev_stack = stackid;
 
 }
 
-void TraceBuffer::addCalloc(long address, float time, long allocationsize,
-		int stackid) {
-	ensureBufferSpace(frame_data->getCallocFrameSize());
+void TraceBuffer::addToAggregate(long bytes, long count, int stackid,
+		unsigned long ticks) {
 
-	//Flag
-	copyFlag(frame_data->CALLOCFLAG);
+	/* A small event now follows the last allocation */
+	candidate.offset = -1;
 
-	//Data
-	copyToBuffer(&address, sizeof(long));
-	copyToBuffer(&time, sizeof(float));
-	copyToBuffer(&allocationsize, sizeof(long));
-	copyToBuffer(&stackid, sizeof(int));
+	/* The aggregate is applied at its reserved sequence, so must end before any sequence taken since */
+	if (aggregate_events > 0
+			&& (aggregate_closed
+					|| writer->getSequence() != aggregate_sequence + 1))
+		flushAggregate();
 
-}
+	/* Find the entry of the call stack, writing out the aggregate if there is no room for a new one */
+	int i;
+	for (i = 0; i < aggregate_stack_count; i++)
+		if (aggregate_stacks[i].stack == stackid)
+			break;
 
-void TraceBuffer::addRealloc(long addressold, long addressnew, float time,
-		long allocationsize) {
-	ensureBufferSpace(frame_data->getReallocFrameSize());
+	if (i == AGGREGATESTACKS) {
+		flushAggregate();
+		i = 0;
+	}
+	if (aggregate_events == 0)
+		aggregate_sequence = reserveSequence();
+	if (i == aggregate_stack_count) {
+		aggregate_stacks[i].stack = stackid;
+		aggregate_stacks[i].bytes = 0;
+		aggregate_stacks[i].count = 0;
+		aggregate_stack_count++;
+	}
 
-	//Flag
-	copyFlag(frame_data->REALLOCFLAG);
+	aggregate_stacks[i].bytes += bytes;
+	aggregate_stacks[i].count += count;
 
-	//Data
-	copyToBuffer(&addressold, sizeof(long));
-	copyToBuffer(&addressnew, sizeof(long));
-	copyToBuffer(&time, sizeof(float));
-	copyToBuffer(&allocationsize, sizeof(long));
+	aggregate_bytes += bytes;
+	if (aggregate_bytes > aggregate_peak)
+		aggregate_peak = aggregate_bytes;
+	aggregate_ticks = ticks;
+
+	if (++aggregate_events >= AGGREGATEFREQUENCY)
+		flushAggregate();
 }
 
-void TraceBuffer::addFree(long address, float time) {
-	ensureBufferSpace(frame_data->getFreeFrameSize());
+void TraceBuffer::coalesceFree(unsigned long ticks) {
+	TransientCandidate pair = candidate;
+
+	/* Undo the allocation event, it is still the last event of the buffer */
+	buffer_used = pair.offset;
+	last_sequence = pair.prev_sequence;
+	last_ticks = pair.prev_ticks;
+	prev_address = pair.prev_address;
+	prev_stack = pair.prev_stack;
+	buffer_stats.events--;
+	candidate.offset = -1;
+
+	/*
+	 * The same allocation again, straight after the transient event, so just count it.
+	 * Only if no other thread took a sequence since the last pair, as the whole run is applied at its first.
+	 */
+	if (run_offset >= 0 && run_end == buffer_used
+			&& run_address == pair.address && run_size == pair.size
+			&& run_stack == pair.stack && run_count < INT_MAX
+			&& pair.sequence == run_last_sequence + 1) {
+		run_count++;
+		run_last_sequence = pair.sequence;
+		unsigned long span = ticks - run_ticks;
+		memcpy(internal_buffer + run_end - sizeof(long) - sizeof(int),
+				&run_count, sizeof(int));
+		memcpy(internal_buffer + run_end - sizeof(long), &span, sizeof(long));
+
+		/* The sequence of the allocation is left unused */
+		skipped_sequences++;
+		buffer_stats.ticks = ticks;
+		return;
+	}
 
-	//Flag
-	copyFlag(frame_data->FREEFLAG);
+	/* Otherwise rewrite the allocation as a new transient event, keeping its sequence */
+	unsigned char *pos = startEvent(frame_data->TRANSIENTFLAG, pair.ticks,
+			pair.sequence);
 
 	//Data
-	copyToBuffer(&address, sizeof(long));
-	copyToBuffer(&time, sizeof(float));
-
+	pos += VarInt::encodeSigned(pos, pair.address - prev_address);
+	pos += VarInt::encode(pos, pair.size);
+	pos += VarInt::encodeSigned(pos, (long) pair.stack - prev_stack);
+
+	int count = 1;
+	unsigned long span = ticks - pair.ticks;
+	memcpy(pos, &count, sizeof(int));
+	pos += sizeof(int);
+	memcpy(pos, &span, sizeof(long));
+	pos += sizeof(long);
+	finishEvent(pos);
+
+	/* The run ends with the free */
+	buffer_stats.ticks = ticks;
+	prev_address = pair.address;
+	prev_stack = pair.stack;
+
+	run_offset = pair.offset;
+	run_end = buffer_used;
+	run_address = pair.address;
+	run_size = pair.size;
+	run_stack = pair.stack;
+	run_count = count;
+	run_ticks = pair.ticks;
+	run_last_sequence = pair.sequence;
 }
 
-void TraceBuffer::addTimer(double time){
-	ensureBufferSpace(frame_data->getTimerFrameSize());
+void TraceBuffer::flushAggregate() {
+	if (aggregate_events == 0)
+		return;
+
+	ensureBufferSpace(frame_data->getAggregateEventSize(aggregate_stack_count));
 
 	//Flag
-	copyFlag(frame_data->TIMERFLAG);
+	unsigned char *pos = startEvent(frame_data->AGGREGATEFLAG, aggregate_ticks,
+			aggregate_sequence);
 
 	//Data
-	copyToBuffer(&time, sizeof(double));
+	pos += VarInt::encodeSigned(pos, aggregate_bytes);
+	pos += VarInt::encode(pos, aggregate_peak);
+	pos += VarInt::encode(pos, aggregate_stack_count);
+
+	int i;
+	for (i = 0; i < aggregate_stack_count; i++) {
+		pos += VarInt::encodeSigned(pos,
+				(long) aggregate_stacks[i].stack - prev_stack);
+		pos += VarInt::encodeSigned(pos, aggregate_stacks[i].bytes);
+		pos += VarInt::encodeSigned(pos, aggregate_stacks[i].count);
+		prev_stack = aggregate_stacks[i].stack;
+	}
+	finishEvent(pos);
 
+	aggregate_bytes = 0;
+	aggregate_peak = 0;
+	aggregate_events = 0;
+	aggregate_stack_count = 0;
+	aggregate_closed = false;
 }
-
@@ -0,0 +1,278 @@
+#include "../../include/util/TraceContainer.h"
+
+string TraceContainer::index_name;
+vector<pair<long, long> > TraceContainer::index;
+string TraceContainer::node_map_name;
+vector<int> TraceContainer::node_map;
+
+string TraceContainer::makeContainerName(string folder) {
+	stringstream file;
+	file << folder << "/" << WMTRACECONTAINER;
+	return file.str();
+}
+
+int TraceContainer::openSpool() {
+	const char *dir = getenv("TMPDIR");
+	if (dir == NULL || dir[0] == '\0')
+		dir = "/tmp";
+
+	char name[strlen(dir) + 32];
+	sprintf(name, "%s/WMTraceSpoolXXXXXX", dir);
+
+	int fd = mkstemp(name);
+
+	/* Unlinked straight away, so it is cleaned up however the job ends */
+	if (fd >= 0)
+		unlink(name);
+
+	return fd;
+}
+
+#ifndef NO_MPI
+int TraceContainer::writeSegments(string container, int spool) {
+	int rank = WMUtils::getMPIRank();
+	int comm = WMUtils::getMPICommSize();
+
+	long size = lseek(spool, 0, SEEK_END);
+	if (size < 0)
+		size = 0;
+	lseek(spool, 0, SEEK_SET);
+
+	/* Each segment starts where the segments of the lower ranks end */
+	long offset = 0;
+	MPI_Exscan(&size, &offset, 1, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
+	if (rank == 0)
+		offset = 0;
+
+	/* Every rank must take part in each collective write, even once its own segment is done */
+	long chunks = (size + CONTAINERCHUNK - 1) / CONTAINERCHUNK;
+	long max_chunks;
+	MPI_Allreduce(&chunks, &max_chunks, 1, MPI_LONG, MPI_MAX, MPI_COMM_WORLD);
+
+	MPI_File fh;
+	if (MPI_File_open(MPI_COMM_WORLD, (char *) container.c_str(),
+			MPI_MODE_WRONLY | MPI_MODE_CREATE, MPI_INFO_NULL, &fh)
+			!= MPI_SUCCESS)
+		return 1;
+
+	char *buffer = new char[CONTAINERCHUNK];
+	long written = 0;
+
+	long i;
+	for (i = 0; i < max_chunks; i++) {
+		/* Read the next chunk of the spool, if any is left */
+		long count = 0;
+		long want = size - written;
+		if (want > CONTAINERCHUNK)
+			want = CONTAINERCHUNK;
+		while (count < want) {
+			ssize_t ret = read(spool, buffer + count, want - count);
+			if (ret <= 0)
+				break;
+			count += ret;
+		}
+
+		MPI_Status status;
+		MPI_File_write_at_all(fh, (MPI_Offset) (offset + written), buffer,
+				(int) count, MPI_BYTE, &status);
+		written += count;
+	}
+
+	delete[] buffer;
+
+	/* Rank 0 writes the index after the last segment */
+	long *sizes = NULL;
+	if (rank == 0)
+		sizes = new long[comm];
+	MPI_Gather(&written, 1, MPI_LONG, sizes, 1, MPI_LONG, 0, MPI_COMM_WORLD);
+
+	if (rank == 0) {
+		long index_size = 2 * comm * sizeof(long) + sizeof(long) + sizeof(int)
+				+ strlen(CONTAINERMAGIC);
+		char *index_data = new char[index_size];
+		stringbuf out_data;
+		out_data.pubsetbuf(index_data, index_size);
+
+		long segment_offset = 0;
+		int r;
+		for (r = 0; r < comm; r++) {
+			out_data.sputn((char *) &segment_offset, sizeof(long));
+			out_data.sputn((char *) &sizes[r], sizeof(long));
+			segment_offset += sizes[r];
+		}
+
+		/* The segments end where the index starts */
+		out_data.sputn((char *) &segment_offset, sizeof(long));
+		out_data.sputn((char *) &comm, sizeof(int));
+		out_data.sputn(CONTAINERMAGIC, strlen(CONTAINERMAGIC));
+
+		MPI_Status status;
+		MPI_File_write_at(fh, (MPI_Offset) segment_offset, index_data,
+				(int) index_size, MPI_BYTE, &status);
+
+		delete[] index_data;
+		delete[] sizes;
+	}
+
+	MPI_File_close(&fh);
+
+	return written == size ? 0 : 1;
+}
+#else
+int TraceContainer::writeSegments(string container, int spool) {
+	/* Implemented without MPI use, shared files can only be read */
+	return 1;
+}
+#endif
+
+bool TraceContainer::readIndex(string container) {
+	if (container == index_name)
+		return !index.empty();
+
+	/* Remembered even if not found, so each per-rank trace is not checked again */
+	index_name = container;
+	index.clear();
+
+	int fd = open(container.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	/* Read the trailer from the end of the file */
+	int magic_size = strlen(CONTAINERMAGIC);
+	long trailer_size = sizeof(long) + sizeof(int) + magic_size;
+	long file_size = lseek(fd, 0, SEEK_END);
+
+	char trailer[trailer_size];
+	if (file_size < trailer_size
+			|| pread(fd, trailer, trailer_size, file_size - trailer_size)
+					!= trailer_size
+			|| memcmp(trailer + sizeof(long) + sizeof(int), CONTAINERMAGIC,
+					magic_size) != 0) {
+		close(fd);
+		return false;
+	}
+
+	long index_offset;
+	int count;
+	memcpy(&index_offset, trailer, sizeof(long));
+	memcpy(&count, trailer + sizeof(long), sizeof(int));
+
+	/* Then the offset and size of every segment */
+	long entries_size = 2 * count * sizeof(long);
+	if (count > 0 && index_offset + entries_size + trailer_size == file_size) {
+		long *entries = new long[2 * count];
+		if (pread(fd, entries, entries_size, index_offset) == entries_size) {
+			index.reserve(count);
+			int i;
+			for (i = 0; i < count; i++)
+				index.push_back(
+						pair<long, long>(entries[2 * i], entries[2 * i + 1]));
+		}
+		delete[] entries;
+	}
+
+	close(fd);
+	return !index.empty();
+}
+
+int TraceContainer::parseTraceName(string filename, string *folder) {
+	*folder = WMUtils::extractFolder(filename);
+	if (*folder == filename)
+		*folder = ".";
+
+	int rank;
+	string base = filename.substr(filename.find_last_of('/') + 1);
+	if (sscanf(base.c_str(), "trace-%d", &rank) != 1 || rank < 0
+			|| WMUtils::stichFileName(*folder, rank) != *folder + "/" + base)
+		return -1;
+
+	return rank;
+}
+
+bool TraceContainer::findSegment(string filename, string *container,
+		long *offset, long *size) {
+
+	/* Only per-rank trace names can be found in a shared file */
+	string folder;
+	int rank = parseTraceName(filename, &folder);
+	if (rank < 0)
+		return false;
+
+	string name = makeContainerName(folder);
+	if (!readIndex(name) || rank >= (int) index.size())
+		return false;
+
+	*container = name;
+	*offset = index[rank].first;
+	*size = index[rank].second;
+	return true;
+}
+
+int TraceContainer::countSegments(string folder) {
+	if (!readIndex(makeContainerName(folder)))
+		return -1;
+	return index.size();
+}
+
+string TraceContainer::makeNodeFileName(string folder, int node) {
+	stringstream file;
+	file << folder << "/node-" << node << ".z";
+	return file.str();
+}
+
+int TraceContainer::writeNodeMap(string folder, int *nodes, int count) {
+	string name = folder + "/" + WMTRACENODEMAP;
+	int fd = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return 1;
+
+	bool ok = write(fd, &count, sizeof(int)) == sizeof(int)
+			&& write(fd, nodes, count * sizeof(int))
+					== (ssize_t) (count * sizeof(int));
+	close(fd);
+
+	return ok ? 0 : 1;
+}
+
+bool TraceContainer::readNodeMap(string folder) {
+	if (folder == node_map_name)
+		return !node_map.empty();
+
+	/* Remembered even if not found, as for the shared file index */
+	node_map_name = folder;
+	node_map.clear();
+
+	string name = folder + "/" + WMTRACENODEMAP;
+	int fd = open(name.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	int count;
+	if (read(fd, &count, sizeof(int)) == sizeof(int) && count > 0) {
+		node_map.resize(count);
+		if (read(fd, &node_map[0], count * sizeof(int))
+				!= (ssize_t) (count * sizeof(int)))
+			node_map.clear();
+	}
+
+	close(fd);
+	return !node_map.empty();
+}
+
+bool TraceContainer::findNodeStream(string filename, string *node_file,
+		int *rank) {
+	string folder;
+	int r = parseTraceName(filename, &folder);
+	if (r < 0 || !readNodeMap(folder) || r >= (int) node_map.size())
+		return false;
+
+	*node_file = makeNodeFileName(folder, node_map[r]);
+	*rank = r;
+	return true;
+}
+
+int TraceContainer::countNodeRanks(string folder) {
+	if (!readNodeMap(folder))
+		return -1;
+	return node_map.size();
+}
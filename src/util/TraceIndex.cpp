@@ -0,0 +1,149 @@
+#include "../../include/util/TraceIndex.h"
+
+/* Serialised size of each entry */
+static const long BLOCKENTRYSIZE = 4 * sizeof(long) + sizeof(int);
+static const long FRAMEENTRYSIZE = sizeof(char) + sizeof(long);
+static const long TRAILERSIZE = sizeof(long) + 2 * sizeof(int)
+		+ sizeof(INDEXMAGIC) - 1;
+
+/**
+ * Append a value to a byte vector.
+ */
+template<typename T>
+static void put(vector<char> &out, T value) {
+	const char *bytes = (const char *) &value;
+	out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+/**
+ * Read a value from a byte array, moving past it.
+ */
+template<typename T>
+static T get(const char **pos) {
+	T value;
+	memcpy(&value, *pos, sizeof(T));
+	*pos += sizeof(T);
+	return value;
+}
+
+void TraceIndex::write(vector<char> &out, long index_offset) const {
+	out.reserve(
+			blocks.size() * BLOCKENTRYSIZE + frames.size() * FRAMEENTRYSIZE
+					+ TRAILERSIZE);
+
+	unsigned int i;
+	for (i = 0; i < blocks.size(); i++) {
+		const IndexBlock &b = blocks[i];
+		put<long>(out, b.file_offset);
+		put<long>(out, b.raw_offset);
+		put<long>(out, b.raw_size);
+		put<int>(out, b.events);
+		put<unsigned long>(out, b.ticks);
+	}
+
+	for (i = 0; i < frames.size(); i++) {
+		put<char>(out, frames[i].flag);
+		put<long>(out, frames[i].raw_offset);
+	}
+
+	put<long>(out, index_offset);
+	put<int>(out, blocks.size());
+	put<int>(out, frames.size());
+	out.insert(out.end(), INDEXMAGIC, INDEXMAGIC + sizeof(INDEXMAGIC) - 1);
+}
+
+bool TraceIndex::read(ifstream &source, long start, long size) {
+	blocks.clear();
+	frames.clear();
+
+	if (size < 0) {
+		source.seekg(0, ios::end);
+		size = (long) source.tellg() - start;
+	}
+	if (size < TRAILERSIZE)
+		return false;
+
+	/* The trailer at the very end of the trace */
+	char trailer[TRAILERSIZE];
+	source.seekg(start + size - TRAILERSIZE, ios::beg);
+	source.read(trailer, TRAILERSIZE);
+	if (source.gcount() != TRAILERSIZE
+			|| memcmp(trailer + TRAILERSIZE - (sizeof(INDEXMAGIC) - 1),
+					INDEXMAGIC, sizeof(INDEXMAGIC) - 1) != 0)
+		return false;
+
+	const char *pos = trailer;
+	long index_offset = get<long>(&pos);
+	int block_count = get<int>(&pos);
+	int frame_count = get<int>(&pos);
+
+	long index_size = block_count * BLOCKENTRYSIZE
+			+ frame_count * FRAMEENTRYSIZE;
+	if (block_count < 0 || frame_count < 0
+			|| index_offset + index_size + TRAILERSIZE != size)
+		return false;
+
+	/* Then the entries before it */
+	vector<char> data(index_size + 1);
+	source.seekg(start + index_offset, ios::beg);
+	source.read(&data[0], index_size);
+	if (source.gcount() != index_size)
+		return false;
+
+	pos = &data[0];
+	blocks.resize(block_count);
+	int i;
+	for (i = 0; i < block_count; i++) {
+		IndexBlock &b = blocks[i];
+		b.file_offset = get<long>(&pos);
+		b.raw_offset = get<long>(&pos);
+		b.raw_size = get<long>(&pos);
+		b.events = get<int>(&pos);
+		b.ticks = get<unsigned long>(&pos);
+	}
+
+	frames.resize(frame_count);
+	for (i = 0; i < frame_count; i++) {
+		frames[i].flag = get<char>(&pos);
+		frames[i].raw_offset = get<long>(&pos);
+	}
+
+	return true;
+}
+
+int TraceIndex::findRawOffset(long raw_offset) const {
+	/* The last block starting at or before the offset */
+	int low = 0, high = blocks.size();
+	while (low < high) {
+		int mid = (low + high) / 2;
+		if (blocks[mid].raw_offset <= raw_offset)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	if (low == 0)
+		return -1;
+
+	const IndexBlock &b = blocks[low - 1];
+	return raw_offset < b.raw_offset + b.raw_size ? low - 1 : -1;
+}
+
+long TraceIndex::findFrame(long raw_offset, const char *flags) const {
+	/* The first frame at or after the offset, then the first of those with a wanted flag */
+	int low = 0, high = frames.size();
+	while (low < high) {
+		int mid = (low + high) / 2;
+		if (frames[mid].raw_offset < raw_offset)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	unsigned int i;
+	for (i = low; i < frames.size(); i++)
+		if (strchr(flags, frames[i].flag) != NULL)
+			return frames[i].raw_offset;
+
+	return -1;
+}
@@ -1,7 +1,10 @@
 #include "../../include/util/TraceReader.h"
 
+map<string, vector<pair<long, string> > > TraceReader::symbol_cache;
+
 TraceReader::TraceReader(string filename, bool consumptionGraph,
-		bool functionGraph, bool allocationGraph, bool samples, long searchID, double searchTime) {
+		bool functionGraph, bool allocationGraph, bool samples, long searchID, double searchTime,
+		const vector<double> &queryTimes) {
 	/* Set simple / complex flags */
 	/* Consumption graph not considered complex as doesn't use any other info. */
 	this->complex = functionGraph || allocationGraph;
@@ -18,6 +21,20 @@ TraceReader::TraceReader(string filename, bool consumptionGraph,
 
 	quick_finish = false;
 	static_mem = 0;
+	load_bias = 0;
+	symbols_loaded = false;
+	trace_version = 1;
+	sample_rate = 0;
+	untracked_frees = 0;
+	ticks_per_second = 1.0e9;
+	start_ticks = 0;
+	calibration_count = 0;
+	start_wall = 0;
+	start_cpu = 0;
+	wall_time = 0.0;
+	cpu_time = 0.0;
+	resume_sequence = 0;
+	merge_watermark = 0;
 
 	/* Only make a new file if one was not provided */
 	if (filename.empty())
@@ -27,6 +44,9 @@ TraceReader::TraceReader(string filename, bool consumptionGraph,
 	zlib_decomp = new ZlibDecompress(filename);
 	frame_data = new FrameData();
 	hwm_tracker = new ConsumptionHWMTracker(filename, consumptionGraph, samples);
+	hwm_tracker->setTrackStacks(complex);
+	if (complex && !queryTimes.empty())
+		hwm_tracker->setQueryTimes(queryTimes, QUERYTOPALLOCATIONS);
 	f_map = new FunctionMap();
 	stack_map = new StackProcessingMap();
 
@@ -52,114 +72,286 @@ TraceReader::~TraceReader() {
 }
 
 void TraceReader::read() {
+	/* The frames still needed once the search has finished */
+	const char metadata[] = { frame_data->ELFFLAG, frame_data->BINARYFLAG,
+			frame_data->VIRTUALFLAG, frame_data->CORESFLAG,
+			frame_data->SAMPLEFLAG, frame_data->VERSIONFLAG,
+			frame_data->CALIBRATIONFLAG, frame_data->UNTRACKEDFLAG,
+			frame_data->FINISHFLAG, 0 };
+	const TraceIndex *index = zlib_decomp->getIndex();
+
+	/* A search need not replay the events before the last checkpoint */
+	resumeFromCheckpoint();
+
 	char flag;
 	do {
+		/* With an index, jump over the events and stacks left rather than inflating them */
+		if (quick_finish && index != NULL) {
+			long next = index->findFrame(zlib_decomp->tell(), metadata);
+			if (next >= 0)
+				zlib_decomp->seekRaw(next);
+		}
+
 		/* Read the flag, to know what to do next */
 		zlib_decomp->request(&flag, 1);
 
-		if (flag == frame_data->FINISHFLAG) {		//End of compression stream
-			break;
-		} else if (flag == frame_data->ELFFLAG) {//Elf data, both static memory and functions
-			processElf();
-		} else if (flag == frame_data->STACKFLAG) {	//Stack ID Data
-			processStacks();
-		} else if (flag == frame_data->VIRTUALFLAG) {	//Process Functions
-			processFunctions();
-		} else if (flag == frame_data->DATAFLAG) { //Process Data events
-			processEvents();
-		} else if (flag == frame_data->CORESFLAG) { //Process Data events
-			processCores();
-		} else {
-			flag = frame_data->FINISHFLAG;
-		}
+	} while (processFrame(flag) && !zlib_decomp->eof());
 
-	} while (flag != frame_data->FINISHFLAG && !zlib_decomp->eof());
+	/* Every thread has finished, so apply any events left waiting */
+	mergeThreadEvents(true);
+	flushColumns();
 
 
 }
 
-long TraceReader::processMalloc() {
-	/* Temp variables to request data with */
-	long address, size;
-	float time;
-	int stack;
-
-	/* Fetch the values from the decompression object */
-	zlib_decomp->request(&address, sizeof(long));
-	zlib_decomp->request(&time, sizeof(float));
-	zlib_decomp->request(&size, sizeof(long));
-	zlib_decomp->request(&stack, sizeof(int));
+bool TraceReader::processFrame(char flag) {
+	if (flag == frame_data->FINISHFLAG) {		//End of compression stream
+		return false;
+	} else if (flag == frame_data->ELFFLAG) {//Elf data, both static memory and functions
+		processElf();
+	} else if (flag == frame_data->BINARYFLAG) {//Binary identity, symbols loaded on demand
+		processBinary();
+	} else if (flag == frame_data->STACKFLAG) {	//Stack ID Data
+		processStacks();
+	} else if (flag == frame_data->VIRTUALFLAG) {	//Process Functions
+		processFunctions();
+	} else if (flag == frame_data->DATAFLAG) { //Process Data events
+		processEvents();
+	} else if (flag == frame_data->CORESFLAG) { //Process Data events
+		processCores();
+	} else if (flag == frame_data->THREADDATAFLAG) { //Process Thread data events
+		processThreadEvents();
+	} else if (flag == frame_data->THREADFLAG) { //Thread start / exit
+		processThread();
+	} else if (flag == frame_data->SAMPLEFLAG) { //Call stack sampling
+		processSampleRate();
+	} else if (flag == frame_data->VERSIONFLAG) { //Trace format version
+		processVersion();
+	} else if (flag == frame_data->CALIBRATIONFLAG) { //Timer calibration
+		processCalibration();
+	} else if (flag == frame_data->CHECKPOINTFLAG) { //Live heap checkpoint
+		processCheckpoint();
+	} else if (flag == frame_data->UNTRACKEDFLAG) { //Frees dropped by the tracer
+		processUntrackedFrees();
+	} else {
+		return false;
+	}
 
-	/* Make Malloc Object */
-	MallocObj mal(address, size, time, stack);
+	return true;
+}
 
-	/* Add the object to the storage structure */
-	return hwm_tracker->addAllocation(mal);
+bool TraceReader::processFrameAt(long offset) {
+	char flag;
+	if (zlib_decomp->seekRaw(offset) < 0
+			|| zlib_decomp->request(&flag, 1) != 1)
+		return false;
+	return processFrame(flag);
 }
 
-long TraceReader::processCalloc() {
-	/* Temp variables to request data with */
-	long address, size;
-	float time;
-	int stack;
+double TraceReader::findFinishTime(string filename) {
+	ZlibDecompress decomp(filename);
+	const TraceIndex *index = decomp.getIndex();
+	const char calibration_flags[] = { FrameData::CALIBRATIONFLAG, 0 };
 
-	zlib_decomp->request(&address, sizeof(long));
-	zlib_decomp->request(&time, sizeof(float));
-	zlib_decomp->request(&size, sizeof(long));
-	zlib_decomp->request(&stack, sizeof(int));
+	if (index == NULL || index->getBlockCount() == 0)
+		return -1.0;
 
-	/* Make Calloc Object (actually a malloc) */
-	MallocObj mal(address, size, time, stack);
+	long calibration = index->findFrame(0, calibration_flags);
+	char flag;
+	CalibrationRecord record;
+	if (calibration < 0 || decomp.seekRaw(calibration) < 0
+			|| decomp.request(&flag, 1) != 1
+			|| decomp.request(&record, sizeof(CalibrationRecord)) != 1)
+		return -1.0;
+
+	/* As ticksToSeconds, from the origin of the timeline */
+	double rate = record.rate > 0 ? record.rate : 1.0e9;
+	unsigned long ticks = index->getBlock(index->getBlockCount() - 1).ticks;
+	return (long) (ticks - record.ticks) / rate;
+}
 
-	/* Add the object to the storage structure */
-	return hwm_tracker->addAllocation(mal);
+bool TraceReader::isBeforeSearch(long offset) {
+	CheckpointRecord header;
+	if (zlib_decomp->seekRaw(offset + frame_data->getDataForward()) < 0
+			|| zlib_decomp->request(&header, sizeof(CheckpointRecord)) != 1)
+		return false;
 
+	/* The searched event must come after the checkpoint */
+	return searchID != -1 ?
+			header.allocation_id < searchID :
+			ticksToSeconds(header.ticks) <= searchTime;
 }
 
-long TraceReader::processRealloc() {
-	/* Temp variables to request data with */
-	long address_old, address_new, size;
-	float time;
+void TraceReader::resumeFromCheckpoint() {
+	const TraceIndex *index = zlib_decomp->getIndex();
+	const char checkpoint_flags[] = { frame_data->CHECKPOINTFLAG, 0 };
+	const char calibration_flags[] = { frame_data->CALIBRATIONFLAG, 0 };
 
-	zlib_decomp->request(&address_old, sizeof(long));
-	zlib_decomp->request(&address_new, sizeof(long));
-	zlib_decomp->request(&time, sizeof(float));
-	zlib_decomp->request(&size, sizeof(long));
+	if (!complex || (searchID == -1 && searchTime <= 0.0) || index == NULL
+			|| index->findFrame(0, checkpoint_flags) < 0)
+		return;
 
-	/* Collect old malloc object, if it existed */
-	MallocObj *mal = hwm_tracker->getAllocation(address_old);
+	/* A time search needs the origin of the timeline, from the first calibration frame */
+	long calibration = -1;
+	if (searchID == -1) {
+		calibration = index->findFrame(0, calibration_flags);
+		if (calibration < 0)
+			return;
+		processFrameAt(calibration);
+	}
 
-	/* If object didnt exist, then act as malloc - otherwise free then malloc */
-	if (mal == NULL) {
-		MallocObj mal2(address_new, size, time, -1);
-		return hwm_tracker->addAllocation(mal2);
-	} else {
-		MallocObj mal2(address_new, size, time, mal->getStackID());
-		FreeObj fr(address_old, 0.0);
+	/* The checkpoints only, each header read is a block to inflate */
+	vector<int> checkpoints;
+	int i;
+	for (i = 0; i < index->getFrameCount(); i++)
+		if (index->getFrame(i).flag == frame_data->CHECKPOINTFLAG)
+			checkpoints.push_back(i);
+
+	/* The last checkpoint before the search */
+	int low = 0, high = checkpoints.size();
+	while (low < high) {
+		int mid = (low + high) / 2;
+		if (isBeforeSearch(index->getFrame(checkpoints[mid]).raw_offset))
+			low = mid + 1;
+		else
+			high = mid;
+	}
 
-		hwm_tracker->addFree(fr);
-		return hwm_tracker->addAllocation(mal2);
+	/* Then the metadata frames before it */
+	long checkpoint = -1;
+	if (low > 0) {
+		int last = checkpoints[low - 1];
+		for (i = 0; i < last; i++) {
+			const IndexFrame &frame = index->getFrame(i);
+			if (frame.raw_offset != calibration
+					&& frame.flag != frame_data->CHECKPOINTFLAG)
+				processFrameAt(frame.raw_offset);
+		}
+		checkpoint = index->getFrame(last).raw_offset;
 	}
 
+	char flag;
+	if (checkpoint >= 0 && zlib_decomp->seekRaw(checkpoint) >= 0
+			&& zlib_decomp->request(&flag, 1) == 1) {
+		loadCheckpoint();
+	} else {
+		/* Nothing to start from, so read the whole trace */
+		calibration_count = 0;
+		zlib_decomp->seekRaw(0);
+	}
 }
 
-long TraceReader::processFree() {
-	/* Temp variables to request data with */
-	long address;
-	float time;
+long TraceReader::applyEvent(const EventObj& event, float time) {
+	char flag = event.getFlag();
+
+	/* Malloc and Calloc are not differentiated at this point */
+	if (flag == frame_data->MALLOCFLAG || flag == frame_data->CALLOCFLAG) {
+		MallocObj mal(event.getPointer(), event.getSize(), time,
+				event.getStackID());
+		return hwm_tracker->addAllocation(mal);
+	} else if (flag == frame_data->REALLOCFLAG) {
+		return hwm_tracker->addRealloc(event.getPointer(),
+				event.getNewPointer(), event.getSize(), time);
+	} else if (flag == frame_data->TRANSIENTFLAG) {
+		/* The search stops at this event, so leave the allocation live for the breakdown */
+		if (complex && searchID == hwm_tracker->getCurrentID() + 1) {
+			MallocObj mal(event.getPointer(), event.getSize(), time,
+					event.getStackID());
+			return hwm_tracker->addAllocation(mal);
+		}
+		return hwm_tracker->addTransient(event.getSize(), event.getStackID(),
+				time, event.getEndTime() - event.getTime());
+	} else if (flag == frame_data->AGGREGATEFLAG) {
+		/* The peak is carried in the pointer */
+		return hwm_tracker->addAggregate(event.getPointer(), event.getSize(),
+				time);
+	} else if (flag == frame_data->AGGREGATESTACKFLAG) {
+		/* The count is carried in the pointer */
+		hwm_tracker->addAggregateStack(event.getStackID(), event.getSize(),
+				event.getPointer());
+		return -1;
+	} else {
+		FreeObj fr(event.getPointer(), time);
+		return hwm_tracker->addFree(fr);
+	}
+}
 
-	zlib_decomp->request(&address, sizeof(long));
-	zlib_decomp->request(&time, sizeof(float));
+void TraceReader::processEvents() {
 
-	FreeObj fr(address, time);
+	long data_remaining;
 
-	return hwm_tracker->addFree(fr);
+	zlib_decomp->request(&data_remaining, sizeof(long));
+
+	//If we do not need more allocations then skip them
+	if (quick_finish) {
+		zlib_decomp->skip(data_remaining);
+		return;
+	}
+
+	/* Decode the whole frame in place, then apply it in one go */
+	const char *data = zlib_decomp->span(data_remaining);
+	if (data == NULL)
+		return;
+
+	event_batch.clear();
+	decodeDataEvents(data, data_remaining, event_batch);
+
+	/* The tracker stops at the event searched for, so the rest of the frame is dropped */
+	long allocID = complex ?
+			hwm_tracker->addBatch(event_batch, searchID, searchTime) :
+			hwm_tracker->addBatch(event_batch, -1, -1);
+
+	/* Check the alloc ID against the search */
+	checkIDSearch(allocID);
 
 }
 
-void TraceReader::processEvents() {
+void TraceReader::decodeDataEvents(const char *data, long size,
+		EventBatch &batch) {
+	const char *pos = data;
+	const char *end = data + size;
+
+	while (pos < end) {
+		char flag = *pos;
+
+		if ((flag == frame_data->MALLOCFLAG || flag == frame_data->CALLOCFLAG)
+				&& end - pos >= frame_data->getMallocFrameSize()) {	//Malloc / Calloc event
+			MallocRecord record;
+			memcpy(&record, pos + 1, sizeof(MallocRecord));
+			batch.add(flag, record.address, 0, record.size, record.time,
+					record.stack);
+			pos += frame_data->getMallocFrameSize();
+		} else if (flag == frame_data->REALLOCFLAG
+				&& end - pos >= frame_data->getReallocFrameSize()) {		//Realloc event
+			ReallocRecord record;
+			memcpy(&record, pos + 1, sizeof(ReallocRecord));
+			batch.add(flag, record.address, record.address_new, record.size,
+					record.time, -1);
+			pos += frame_data->getReallocFrameSize();
+		} else if (flag == frame_data->FREEFLAG
+				&& end - pos >= frame_data->getFreeFrameSize()) { 		//Free event
+			FreeRecord record;
+			memcpy(&record, pos + 1, sizeof(FreeRecord));
+			batch.add(flag, record.address, 0, 0, record.time, -1);
+			pos += frame_data->getFreeFrameSize();
+		} else if (flag == frame_data->TIMERFLAG
+				&& end - pos >= frame_data->getTimerFrameSize()) { 		//Timer frame
+			double elapsed_time;
+			memcpy(&elapsed_time, pos + 1, sizeof(double));
+			batch.add(flag, 0, 0, 0, elapsed_time, -1);
+			pos += frame_data->getTimerFrameSize();
+		} else {
+			/* End of the compression stream, or nothing more we understand */
+			break;
+		}
+	}
+
+}
+
+void TraceReader::processThreadEvents() {
 
 	long data_remaining;
+	ThreadDataRecord header;
 
 	zlib_decomp->request(&data_remaining, sizeof(long));
 
@@ -169,46 +361,404 @@ void TraceReader::processEvents() {
 		return;
 	}
 
-	//cout << "Data: " << dataRemaining << "\n";
-	char flag;
-	long allocID = -1;
+	/* Base ticks were added in version 3 */
+	long header_size = sizeof(ThreadDataRecord);
+	if (trace_version < 3)
+		header_size = offsetof(ThreadDataRecord, base_ticks);
+	zlib_decomp->request(&header, header_size);
+	data_remaining -= header_size;
 
-	while (data_remaining > 0) {
-		/* Read the flag to know what is next */
-		zlib_decomp->request(&flag, 1);
+	ThreadStream &stream = getThreadStream(header.thread_id,
+			header.base_sequence, 0.0);
+	stream.last_sequence = header.base_sequence;
+
+	/* Timestamps are tick deltas from the base of the frame */
+	if (trace_version >= 3)
+		stream.ticks = header.base_ticks;
+
+	if (trace_version >= 2)
+		decodeCompactEvents(stream, data_remaining);
+	else
+		decodeThreadEvents(stream, data_remaining);
+
+	stream.watermark = header.watermark;
+	if (header.watermark > merge_watermark)
+		merge_watermark = header.watermark;
+
+	mergeThreadEvents(false);
+
+}
+
+void TraceReader::decodeThreadEvents(ThreadStream &stream,
+		long data_remaining) {
+	/* Decode the whole frame in place */
+	const char *pos = zlib_decomp->span(data_remaining);
+	if (pos == NULL)
+		return;
+	const char *end = pos + data_remaining;
 
-		if (flag == frame_data->FINISHFLAG) {		//End of compression stream
-			data_remaining--;
+	int sequence_delta;
+	long address, address_new, size;
+	float time;
+	int stack;
+	long delta_size = frame_data->getSequenceDeltaSize();
+
+	while (pos < end) {
+		/* Read the flag to know what is next */
+		char flag = *pos;
+
+		if ((flag == frame_data->MALLOCFLAG || flag == frame_data->CALLOCFLAG)
+				&& end - pos >= frame_data->getMallocFrameSize() + delta_size) {	//Malloc / Calloc event
+			MallocRecord record;
+			memcpy(&sequence_delta, pos + 1, sizeof(int));
+			memcpy(&record, pos + 1 + delta_size, sizeof(MallocRecord));
+			pos += frame_data->getMallocFrameSize() + delta_size;
+			address = record.address;
+			address_new = 0;
+			time = record.time;
+			size = record.size;
+			stack = record.stack;
+		} else if (flag == frame_data->REALLOCFLAG
+				&& end - pos >= frame_data->getReallocFrameSize() + delta_size) {		//Realloc event
+			ReallocRecord record;
+			memcpy(&sequence_delta, pos + 1, sizeof(int));
+			memcpy(&record, pos + 1 + delta_size, sizeof(ReallocRecord));
+			pos += frame_data->getReallocFrameSize() + delta_size;
+			address = record.address;
+			address_new = record.address_new;
+			time = record.time;
+			size = record.size;
+			stack = -1;
+		} else if (flag == frame_data->FREEFLAG
+				&& end - pos >= frame_data->getFreeFrameSize() + delta_size) { 		//Free event
+			FreeRecord record;
+			memcpy(&sequence_delta, pos + 1, sizeof(int));
+			memcpy(&record, pos + 1 + delta_size, sizeof(FreeRecord));
+			pos += frame_data->getFreeFrameSize() + delta_size;
+			address = record.address;
+			address_new = 0;
+			time = record.time;
+			size = 0;
+			stack = -1;
+		} else if (flag == frame_data->TIMERFLAG
+				&& end - pos >= frame_data->getTimerFrameSize()) { 		//Timer frame for this thread
+			memcpy(&stream.clock, pos + 1, sizeof(double));
+			pos += frame_data->getTimerFrameSize();
+			continue;
+		} else if (flag == frame_data->SEQUENCEFLAG
+				&& end - pos >= frame_data->getSequenceFrameSize()) { 	//Full sequence restatement
+			memcpy(&stream.last_sequence, pos + 1, sizeof(long));
+			pos += frame_data->getSequenceFrameSize();
+			continue;
+		} else {
 			break;
-		} else if (flag == frame_data->MALLOCFLAG) {		//Malloc event
-			allocID = processMalloc();
-			data_remaining -= frame_data->getMallocFrameSize();
-		} else if (flag == frame_data->CALLOCFLAG) {		//Calloc event
-			allocID = processCalloc();
-			data_remaining -= frame_data->getCallocFrameSize();
+		}
+
+		/* Place the event on the timeline of its thread */
+		stream.last_sequence += sequence_delta;
+		stream.clock += time;
+
+		stream.events.push_back(
+				EventObj(flag, stream.last_sequence, address, address_new, size,
+						stream.clock, stack));
+	}
+
+}
+
+void TraceReader::decodeCompactEvents(ThreadStream &stream, long size) {
+
+	/* Decode the whole frame in place */
+	const unsigned char *pos = (const unsigned char *) zlib_decomp->span(size);
+	if (pos == NULL)
+		return;
+	const unsigned char *end = pos + size;
+
+	/* Deltas restart with each frame */
+	long address = 0, address_new, alloc_size;
+	long stack = 0;
+	bool ticked = trace_version >= 3;
+	bool sized = trace_version >= 4;
+	bool split = useColumns();
+
+	while (pos < end) {
+		char flag = *pos++;
+
+		if (flag == frame_data->TIMERFLAG) { 		//Timer frame for this thread
+			memcpy(&stream.clock, pos, sizeof(double));
+			pos += sizeof(double);
+			continue;
+		}
+
+		stream.last_sequence += VarInt::decode(&pos);
+
+		/* Version 3 - the exact time follows from the tick count */
+		if (ticked) {
+			stream.ticks += VarInt::decodeSigned(&pos);
+			stream.clock = ticksToSeconds(stream.ticks);
+		}
+
+		if (flag == frame_data->MALLOCFLAG || flag == frame_data->CALLOCFLAG) {	//Malloc / Calloc event
+			address += VarInt::decodeSigned(&pos);
+			if (!ticked)
+				stream.clock += VarInt::decode(&pos) * 1.0e-9;
+			alloc_size = VarInt::decode(&pos);
+			stack += VarInt::decodeSigned(&pos);
+			stream.events.push_back(
+					EventObj(flag, stream.last_sequence, address, 0, alloc_size,
+							stream.clock, (int) stack));
 		} else if (flag == frame_data->REALLOCFLAG) {		//Realloc event
-			allocID = processRealloc();
-			data_remaining -= frame_data->getReallocFrameSize();
+			address += VarInt::decodeSigned(&pos);
+			address_new = address + VarInt::decodeSigned(&pos);
+			if (!ticked)
+				stream.clock += VarInt::decode(&pos) * 1.0e-9;
+			alloc_size = VarInt::decode(&pos);
+			long old_size = sized ? VarInt::decodeSigned(&pos) : -1;
+
+			/* A free of the old allocation, if traced, then the new allocation, each with its own ID */
+			if (split) {
+				if (old_size >= 0)
+					stream.events.push_back(
+							EventObj(frame_data->FREEFLAG, stream.last_sequence,
+									address, 0, old_size, stream.clock, -1));
+				stream.events.push_back(
+						EventObj(frame_data->MALLOCFLAG, stream.last_sequence,
+								address_new, 0, alloc_size, stream.clock, -1));
+			} else {
+				stream.events.push_back(
+						EventObj(flag, stream.last_sequence, address,
+								address_new, alloc_size, stream.clock, -1));
+			}
+			address = address_new;
 		} else if (flag == frame_data->FREEFLAG) { 		//Free event
-					allocID = processFree();
-					data_remaining -= frame_data->getFreeFrameSize();
-		} else if (flag == frame_data->TIMERFLAG) { 		//Timer frame
-					processTimer();
-					data_remaining -= frame_data->getTimerFrameSize();
+			address += VarInt::decodeSigned(&pos);
+			if (!ticked)
+				stream.clock += VarInt::decode(&pos) * 1.0e-9;
+
+			/* Version 4 - the size and call stack of the freed allocation */
+			long free_size = 0;
+			int free_stack = -1;
+			if (sized) {
+				free_size = VarInt::decode(&pos);
+				stack += VarInt::decodeSigned(&pos);
+				free_stack = (int) stack;
+			}
+			stream.events.push_back(
+					EventObj(flag, stream.last_sequence, address, 0, free_size,
+							stream.clock, free_stack));
+		} else if (flag == frame_data->TRANSIENTFLAG) {	//Run of allocations freed straight after
+			address += VarInt::decodeSigned(&pos);
+			alloc_size = VarInt::decode(&pos);
+			stack += VarInt::decodeSigned(&pos);
+
+			/* The count and tick span are fixed width */
+			int count;
+			unsigned long span;
+			memcpy(&count, pos, sizeof(int));
+			pos += sizeof(int);
+			memcpy(&span, pos, sizeof(long));
+			pos += sizeof(long);
+
+			/* The run ends with its last free, though the next event still counts its ticks from the start */
+			double end_time = ticksToSeconds(stream.ticks + span);
+			stream.events.push_back(
+					EventObj(flag, stream.last_sequence, address, count,
+							alloc_size, stream.clock, (int) stack, end_time));
+			stream.clock = end_time;
+		} else if (flag == frame_data->AGGREGATEFLAG) {	//Aggregate of small allocations
+			alloc_size = VarInt::decodeSigned(&pos);
+			long peak = VarInt::decode(&pos);
+			long entries = VarInt::decode(&pos);
+
+			/* The call stack entries go first, so are applied before the aggregate itself */
+			long i;
+			for (i = 0; i < entries; i++) {
+				stack += VarInt::decodeSigned(&pos);
+				long entry_bytes = VarInt::decodeSigned(&pos);
+				long entry_count = VarInt::decodeSigned(&pos);
+				stream.events.push_back(
+						EventObj(frame_data->AGGREGATESTACKFLAG,
+								stream.last_sequence, entry_count, 0,
+								entry_bytes, stream.clock, (int) stack));
+			}
+			stream.events.push_back(
+					EventObj(flag, stream.last_sequence, peak, 0, alloc_size,
+							stream.clock, -1));
 		} else {
-			flag = frame_data->FINISHFLAG;
-			data_remaining--;
+			break;
 		}
+	}
 
-		/* Check the alloc ID against the search */
-		if (checkIDSearch(allocID)) {
-			/* Skip any remaining data */
-			zlib_decomp->skip(data_remaining);
-			/* Return so as to not read any more symbols */
+}
+
+void TraceReader::processThread() {
+	ThreadRecord record;
+	zlib_decomp->request(&record, sizeof(ThreadRecord));
+
+	ThreadStream &stream = getThreadStream(record.thread_id, record.sequence,
+			record.time);
+
+	/* Once exited the thread no longer holds back the merge */
+	if (record.state == frame_data->THREADEXIT) {
+		stream.exited = true;
+		mergeThreadEvents(false);
+	}
+}
+
+ThreadStream &TraceReader::getThreadStream(int thread_id, long sequence,
+		double time) {
+	map<int, ThreadStream>::iterator it = thread_streams.find(thread_id);
+	if (it != thread_streams.end())
+		return it->second;
+
+	ThreadStream stream;
+	stream.watermark = sequence;
+	stream.last_sequence = sequence;
+	stream.clock = time;
+	stream.ticks = start_ticks;
+	stream.exited = false;
+
+	return thread_streams.insert(make_pair(thread_id, stream)).first->second;
+}
+
+void TraceReader::mergeThreadEvents(bool flush) {
+
+	while (!quick_finish) {
+		/*
+		 * Find the bound below which no thread can still hold an event, and the thread with the next event.
+		 * From version 5 each watermark covers every thread, before then only the lowest of the live threads does.
+		 */
+		long bound = LONG_MAX;
+		if (!flush && trace_version >= 5)
+			bound = merge_watermark;
+		ThreadStream *next = NULL;
+
+		map<int, ThreadStream>::iterator it;
+		for (it = thread_streams.begin(); it != thread_streams.end(); it++) {
+			ThreadStream &stream = it->second;
+			if (!flush && trace_version < 5 && !stream.exited
+					&& stream.watermark < bound)
+				bound = stream.watermark;
+			if (!stream.events.empty()
+					&& (next == NULL
+							|| stream.events.front().getSequence()
+									< next->events.front().getSequence()))
+				next = &stream;
+		}
+
+		/* Stop if a live thread may still hold an earlier event */
+		if (next == NULL || next->events.front().getSequence() >= bound)
 			return;
+
+		EventObj event = next->events.front();
+		next->events.pop_front();
+
+		/* Already held by the checkpoint the reader started from */
+		if (event.getSequence() < resume_sequence)
+			continue;
+
+		/* Only the change in live bytes is needed */
+		if (useColumns()) {
+			addToColumns(event);
+			continue;
 		}
+
+		/* Thread clocks are not synchronised, so never step the timeline backwards */
+		if (event.getTime() > hwm_tracker->getCurrTime())
+			hwm_tracker->updateElapsedTime(event.getTime());
+
+		checkIDSearch(applyEvent(event, 0.0));
+	}
+
+}
+
+void TraceReader::addToColumns(const EventObj& event) {
+	char flag = event.getFlag();
+	long delta, peak;
+
+	if (flag == frame_data->MALLOCFLAG || flag == frame_data->CALLOCFLAG) {
+		delta = event.getSize();
+		peak = delta;
+	} else if (flag == frame_data->FREEFLAG) {
+		delta = -event.getSize();
+		peak = delta;
+	} else if (flag == frame_data->TRANSIENTFLAG) {
+		delta = 0;
+		peak = event.getSize();
+	} else if (flag == frame_data->AGGREGATEFLAG) {
+		/* The peak is carried in the pointer */
+		delta = event.getSize();
+		peak = event.getPointer();
+	} else {
+		/* The call stacks of an aggregate are only kept for the functional breakdown */
+		return;
 	}
 
+	/* Thread clocks are not synchronised, so never step the timeline backwards */
+	double time = event.getTime();
+	double last = end_column.empty() ?
+			hwm_tracker->getCurrTime() : end_column.back();
+	if (time < last)
+		time = last;
+	double end = time + (event.getEndTime() - event.getTime());
+
+	delta_column.push_back(delta);
+	peak_column.push_back(peak);
+	time_column.push_back(time);
+	end_column.push_back(end);
+
+	if ((long) delta_column.size() >= PEAKSCANCOLUMN)
+		flushColumns();
+}
+
+void TraceReader::flushColumns() {
+	if (delta_column.empty())
+		return;
+
+	hwm_tracker->addColumn(&delta_column[0], &peak_column[0], &time_column[0],
+			&end_column[0], delta_column.size());
+
+	delta_column.clear();
+	peak_column.clear();
+	time_column.clear();
+	end_column.clear();
+}
+
+void TraceReader::processCheckpoint() {
+	long size;
+
+	zlib_decomp->request(&size, sizeof(long));
+	zlib_decomp->skip(size);
+}
+
+void TraceReader::loadCheckpoint() {
+	long size;
+	CheckpointRecord header;
+
+	zlib_decomp->request(&size, sizeof(long));
+	zlib_decomp->request(&header, sizeof(CheckpointRecord));
+
+	long i;
+	for (i = 0; i < header.allocations; i++) {
+		CheckpointAllocationRecord allocation;
+		zlib_decomp->request(&allocation, sizeof(CheckpointAllocationRecord));
+
+		MallocObj mal(allocation.address, allocation.size, 0.0,
+				allocation.stack);
+		hwm_tracker->addCheckpointAllocation(mal);
+	}
+
+	/* Aggregated small allocations, as totals per call stack */
+	for (i = 0; i < header.stacks; i++) {
+		CheckpointStackRecord stack;
+		zlib_decomp->request(&stack, sizeof(CheckpointStackRecord));
+
+		hwm_tracker->addCheckpointAggregate(stack.stack, stack.bytes,
+				stack.count);
+	}
+
+	hwm_tracker->startFromCheckpoint(header.allocation_id,
+			ticksToSeconds(header.ticks));
+	resume_sequence = header.sequence;
 }
 
 void TraceReader::processStacks() {
@@ -265,13 +815,10 @@ void TraceReader::processElf() {
 		return;
 	}
 
-	/* Use _init and _end as markers to start and stop function recording */
+	vector < pair<long, string> > symbols;
+	symbols.reserve(elf_functions);
 
 	int i;
-	long prev_addr = -1;
-	string prev_name;
-	bool started = false;
-
 	/* Loop over functions, de-compressing and storing them */
 	for (i = 0; i < elf_functions; i++) {
 		long function_address;
@@ -283,9 +830,84 @@ void TraceReader::processElf() {
 		char name[function_name_length];
 		zlib_decomp->request(name, function_name_length);
 
+		symbols.push_back(pair<long, string>(function_address, name));
+	}
+
+	/* The symbols came with the trace, so there is nothing left to load */
+	addElfSymbols(symbols, 0);
+	symbols_loaded = true;
+
+}
+
+void TraceReader::processBinary() {
+	long frame_size, static_mem;
+	int id_len, path_len;
+
+	zlib_decomp->request(&frame_size, sizeof(long));
+	zlib_decomp->request(&static_mem, sizeof(long));
+	zlib_decomp->request(&load_bias, sizeof(long));
+
+	zlib_decomp->request(&id_len, sizeof(int));
+	char id[id_len];
+	zlib_decomp->request(id, id_len);
+	build_id = id;
+
+	zlib_decomp->request(&path_len, sizeof(int));
+	char path[path_len];
+	zlib_decomp->request(path, path_len);
+	binary_path = path;
+
+	/* Pass the static mem through to the graph */
+	hwm_tracker->setElf(static_mem);
+	this->static_mem = static_mem;
+}
+
+void TraceReader::loadSymbols() {
+	/* Only load once, and only if there is a binary to load from */
+	if (symbols_loaded || binary_path.empty())
+		return;
+	symbols_loaded = true;
+
+	string key = build_id.empty() ? binary_path : build_id;
+
+	map<string, vector<pair<long, string> > >::iterator it = symbol_cache.find(key);
+	if (it == symbol_cache.end()) {
+		vector < pair<long, string> > symbols;
+
+		ElfData elf(binary_path);
+		if (!elf.isValid()) {
+			cerr << "Warning: Unable to read binary " << binary_path
+					<< ", functions will not be named\n";
+		} else if (!build_id.empty() && elf.getBuildID() != build_id) {
+			cerr << "Warning: Binary " << binary_path
+					<< " has been rebuilt since it was traced, functions will not be named\n";
+		} else {
+			elf.getSymbols(symbols);
+		}
+
+		it = symbol_cache.insert(make_pair(key, symbols)).first;
+	}
+
+	addElfSymbols(it->second, load_bias);
+}
+
+void TraceReader::addElfSymbols(const vector<pair<long, string> > &symbols,
+		long bias) {
+
+	/* Use _init and _end as markers to start and stop function recording */
+
+	unsigned int i;
+	long prev_addr = -1;
+	string prev_name;
+	bool started = false;
+
+	for (i = 0; i < symbols.size(); i++) {
+		long function_address = symbols[i].first + bias;
+		const string &name = symbols[i].second;
+
 		/* If we have started then look for end, or process otherwise look for start */
 		if (started) {
-			if (strcmp(name, "_end") == 0) {
+			if (name == "_end") {
 				started = false;
 			}
 			f_map->addDynamicFunction(prev_addr, function_address,
@@ -293,7 +915,7 @@ void TraceReader::processElf() {
 			prev_addr = function_address;
 			prev_name = name;
 		} else {
-			if (strcmp(name, "_init") == 0) {
+			if (name == "_init") {
 				started = true;
 			}
 		}
@@ -377,6 +999,8 @@ bool TraceReader::checkIDSearch(long id) {
 }
 
 vector<string> TraceReader::getCallStack(int id) {
+	loadSymbols();
+
 	/* Fetch the vector of addresses from the stackMap object */
 	vector<long> addresses = stack_map->getVector(id);
 	int address_count = addresses.size();
@@ -401,11 +1025,43 @@ vector<string> TraceReader::getCallStack(int id) {
 }
 
 
-void TraceReader::processTimer(){
-	/* Elapsed time variable */
-	double elapsed_time;
-	zlib_decomp->request(&elapsed_time, sizeof(double));
-	hwm_tracker->updateElapsedTime(elapsed_time);
+void TraceReader::processVersion(){
+	VersionRecord record;
+	zlib_decomp->request(&record, sizeof(VersionRecord));
+
+	trace_version = record.version;
+}
+
+void TraceReader::processSampleRate(){
+	SampleRecord record;
+	zlib_decomp->request(&record, sizeof(SampleRecord));
+
+	sample_rate = record.sample_rate;
+	hwm_tracker->setSampleRate(sample_rate);
+
+}
+
+void TraceReader::processUntrackedFrees(){
+	UntrackedRecord record;
+	zlib_decomp->request(&record, sizeof(UntrackedRecord));
 
+	untracked_frees += record.frees;
 }
 
+void TraceReader::processCalibration(){
+	CalibrationRecord record;
+	zlib_decomp->request(&record, sizeof(CalibrationRecord));
+
+	if (calibration_count++ == 0) {
+		/* The origin of the timeline */
+		if (record.rate > 0)
+			ticks_per_second = record.rate;
+		start_ticks = record.ticks;
+		start_wall = record.wall;
+		start_cpu = record.cpu;
+	} else {
+		wall_time = (record.wall - start_wall) * 1.0e-9;
+		cpu_time = (record.cpu - start_cpu) * 1.0e-9;
+	}
+
+}
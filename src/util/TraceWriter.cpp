@@ -0,0 +1,438 @@
+#include "../../include/util/TraceWriter.h"
+#include "../../include/util/TraceBuffer.h"
+
+TraceWriter::TraceWriter(StackMap *stackmap, void (*worker_init)(),
+		bool shared, bool node, char codec_id, int codec_level,
+		int compress_threads) {
+
+	this->stack_map = stackmap;
+
+	/* Initiate new data objects */
+	string filename = WMUtils::makeFileName(true);
+	z_comp = NULL;
+	node_collector = NULL;
+	if (node)
+		node_collector = new NodeCollector(WMUtils::extractFolder(filename),
+				worker_init, codec_id, codec_level, compress_threads);
+	else if (shared)
+		z_comp = new Compress(
+				TraceContainer::makeContainerName(
+						WMUtils::extractFolder(filename)), worker_init, true,
+				codec_id, codec_level, compress_threads);
+	else
+		z_comp = new Compress(filename, worker_init, false, codec_id,
+				codec_level, compress_threads);
+	frame_data = new FrameData();
+
+	pthread_mutex_init(&writer_lock, NULL);
+	event_sequence = 0;
+	last_watermark = 0;
+	thread_count = 0;
+	thread_data_bytes = 0;
+	finished = false;
+	static_mem = 0;
+
+	/* Get data for start of trace file */
+	fetchVersion();
+	fetchBinaryData();
+	fetchCoreData();
+
+}
+
+TraceWriter::~TraceWriter() {
+	delete z_comp;
+	delete node_collector;
+	delete frame_data;
+	pthread_mutex_destroy(&writer_lock);
+}
+
+int TraceWriter::registerThread(double time, long *sequence) {
+	pthread_mutex_lock(&writer_lock);
+
+	/* Read the sequence under the lock, so no earlier frame can refer to later events */
+	int thread_id = thread_count++;
+	*sequence = event_sequence;
+	writeThreadFrame(thread_id, frame_data->THREADSTART, *sequence, time);
+
+	pthread_mutex_unlock(&writer_lock);
+	return thread_id;
+}
+
+void TraceWriter::exitThread(int thread_id, double time) {
+	pthread_mutex_lock(&writer_lock);
+	if (!finished)
+		writeThreadFrame(thread_id, frame_data->THREADEXIT, event_sequence,
+				time);
+	pthread_mutex_unlock(&writer_lock);
+}
+
+void TraceWriter::writeThreadFrame(int thread_id, char state, long sequence,
+		double time) {
+	ThreadRecord record;
+	record.thread_id = thread_id;
+	record.state = state;
+	record.sequence = sequence;
+	record.time = time;
+
+	writeRecord(frame_data->THREADFLAG, record);
+}
+
+void TraceWriter::addSampleRate(long sample_rate) {
+	SampleRecord record;
+	record.sample_rate = sample_rate;
+
+	pthread_mutex_lock(&writer_lock);
+	writeRecord(frame_data->SAMPLEFLAG, record);
+	pthread_mutex_unlock(&writer_lock);
+}
+
+void TraceWriter::addUntrackedFrees(long frees) {
+	UntrackedRecord record;
+	record.frees = frees;
+
+	pthread_mutex_lock(&writer_lock);
+	if (!finished)
+		writeRecord(frame_data->UNTRACKEDFLAG, record);
+	pthread_mutex_unlock(&writer_lock);
+}
+
+void TraceWriter::addCalibration(double rate, unsigned long ticks, long wall,
+		long cpu) {
+	CalibrationRecord record;
+	record.rate = rate;
+	record.ticks = ticks;
+	record.wall = wall;
+	record.cpu = cpu;
+
+	pthread_mutex_lock(&writer_lock);
+	if (!finished)
+		writeRecord(frame_data->CALIBRATIONFLAG, record);
+	pthread_mutex_unlock(&writer_lock);
+}
+
+void TraceWriter::attachBuffer(TraceBuffer *buffer) {
+	pthread_mutex_lock(&writer_lock);
+	buffers.push_back(buffer);
+	pthread_mutex_unlock(&writer_lock);
+}
+
+void TraceWriter::detachBuffer(TraceBuffer *buffer) {
+	pthread_mutex_lock(&writer_lock);
+	vector<TraceBuffer *>::iterator it = find(buffers.begin(), buffers.end(),
+			buffer);
+	if (it != buffers.end())
+		buffers.erase(it);
+	pthread_mutex_unlock(&writer_lock);
+}
+
+int TraceWriter::addThreadData(TraceBuffer *buffer) {
+	pthread_mutex_lock(&writer_lock);
+	if (finished) {
+		pthread_mutex_unlock(&writer_lock);
+		long size;
+		buffer->getPool()->release(buffer->sealFrame(&size));
+		return 1;
+	}
+
+	fetchCallStacks();
+
+	/*
+	 * Hand over the partial buffers of threads holding the watermark back since the last frame,
+	 * such as idle workers, should their owner be between events.
+	 */
+	unsigned int i;
+	for (i = 0; i < buffers.size(); i++) {
+		TraceBuffer *idle = buffers[i];
+		if (idle == buffer || idle->getPendingSequence() > last_watermark
+				|| !idle->tryLockEvents())
+			continue;
+		if (idle->getPendingSequence() <= last_watermark) {
+			queueThreadData(idle);
+			idle->nextFrame();
+		}
+		idle->unlockEvents();
+	}
+
+	int ret = queueThreadData(buffer);
+
+	pthread_mutex_unlock(&writer_lock);
+	return ret;
+}
+
+int TraceWriter::queueThreadData(TraceBuffer *buffer) {
+	long size;
+	char *data = buffer->sealFrame(&size);
+	IndexBlock *stats = buffer->getStats();
+
+	/*
+	 * Every event of any thread below the watermark is now in this frame or an earlier one.
+	 * The sequence is read before the buffers, so a buffer first seen empty takes a later sequence.
+	 */
+	long watermark = event_sequence;
+	__sync_synchronize();
+	unsigned int i;
+	for (i = 0; i < buffers.size(); i++) {
+		/* The frame holds every event of its own buffer, bar one with a sequence reserved */
+		long held =
+				buffers[i] == buffer ?
+						buffer->getReservedSequence() :
+						buffers[i]->getPendingSequence();
+		if (held < watermark)
+			watermark = held;
+	}
+
+	/* A bound already written still holds, so the watermarks written to file only ever increase */
+	if (watermark < last_watermark)
+		watermark = last_watermark;
+	last_watermark = watermark;
+	memcpy(data + frame_data->getThreadDataWatermarkOffset(), &watermark,
+			sizeof(long));
+
+	thread_data_bytes += size;
+
+	/* Queued under the lock, so frames reach the file in watermark order */
+	if (node_collector != NULL)
+		return node_collector->addBuffer(data, size, buffer->getPool());
+	return z_comp->addBuffer(data, size, buffer->getPool(), stats);
+}
+
+void TraceWriter::addCheckpoint(long sequence, long allocation_id,
+		unsigned long ticks,
+		const vector<LiveAllocationTable::LiveEntry> &allocations,
+		const map<int, long> &small_bytes, const map<int, long> &small_counts) {
+
+	/* Only call stacks holding small allocations are written */
+	int stack_count = 0;
+	long memory = 0;
+	map<int, long>::const_iterator it;
+	for (it = small_bytes.begin(); it != small_bytes.end(); it++) {
+		if (it->second == 0 && small_counts.find(it->first)->second == 0)
+			continue;
+		memory += it->second;
+		stack_count++;
+	}
+
+	unsigned long i;
+	for (i = 0; i < allocations.size(); i++)
+		memory += allocations[i].size;
+
+	long out_size = frame_data->getCheckpointForward()
+			+ allocations.size() * sizeof(CheckpointAllocationRecord)
+			+ stack_count * sizeof(CheckpointStackRecord);
+	char * checkpoint_array = new char[out_size];
+
+	SizedFrameRecord<CheckpointRecord> header;
+	header.flag = frame_data->CHECKPOINTFLAG;
+	header.size = out_size - frame_data->getDataForward();
+	header.record.sequence = sequence;
+	header.record.allocation_id = allocation_id;
+	header.record.ticks = ticks;
+	header.record.memory = memory;
+	header.record.allocations = allocations.size();
+	header.record.stacks = stack_count;
+	char *pos = putRecord(checkpoint_array, header);
+
+	for (i = 0; i < allocations.size(); i++) {
+		CheckpointAllocationRecord allocation;
+		allocation.address = allocations[i].address;
+		allocation.size = allocations[i].size;
+		allocation.stack = allocations[i].stack;
+		pos = putRecord(pos, allocation);
+	}
+
+	for (it = small_bytes.begin(); it != small_bytes.end(); it++) {
+		CheckpointStackRecord stack;
+		stack.stack = it->first;
+		stack.bytes = it->second;
+		stack.count = small_counts.find(it->first)->second;
+		if (stack.bytes == 0 && stack.count == 0)
+			continue;
+		pos = putRecord(pos, stack);
+	}
+
+	/* The stacks of the live allocations must reach the reader first */
+	pthread_mutex_lock(&writer_lock);
+	if (!finished) {
+		fetchCallStacks();
+		writeData(checkpoint_array, out_size);
+	}
+	pthread_mutex_unlock(&writer_lock);
+
+	/* Free buffer */
+	delete[] checkpoint_array;
+}
+
+void TraceWriter::finish() {
+	pthread_mutex_lock(&writer_lock);
+	if (!finished) {
+		fetchCallStacks();
+		fetchVirtualAddresses();
+		if (node_collector != NULL)
+			node_collector->finish();
+		else
+			z_comp->finish();
+		finished = true;
+	}
+	pthread_mutex_unlock(&writer_lock);
+}
+
+int TraceWriter::writeData(char *data, int size) {
+	if (node_collector != NULL)
+		return node_collector->addData(data, size);
+	return z_comp->addData(data, size);
+}
+
+int TraceWriter::fetchCallStacks() {
+	long size;
+	int count;
+
+	char * data = stack_map->getPrintQueue(&size, &count);
+	if (size == 0 || count == 0) {
+		delete[] data;
+		return 1;
+	}
+
+	/* Set up string buffer */
+	long out_size = frame_data->getStacksForward() + size;
+	char * stack_array = new char[out_size];
+	stringbuf out_data;
+	out_data.pubsetbuf(stack_array, out_size);
+
+	/* Extract data */
+	long data_size = size + sizeof(int);
+	char sf = frame_data->STACKFLAG;
+
+	/* Write data to the buffer */
+	out_data.sputn((char *) &sf, sizeof(char));
+	out_data.sputn((char *) &data_size, sizeof(long));
+	out_data.sputn((char *) &count, sizeof(int));
+	out_data.sputn((char *) data, size);
+
+	/* Write data to compression buffer */
+	int ret = writeData(stack_array, out_size);
+
+	/* Free buffer */
+	delete[] data;
+	delete[] stack_array;
+
+	return 0;
+
+}
+
+void TraceWriter::fetchVersion() {
+	VersionRecord record;
+	record.version = frame_data->TRACEVERSION;
+
+	writeRecord(frame_data->VERSIONFLAG, record);
+}
+
+int TraceWriter::fetchCoreData() {
+
+	/* Collect MPI information */
+	int rank = WMUtils::getMPIRank();
+	int comm = WMUtils::getMPICommSize();
+
+	string name = WMUtils::getMPIProcName();
+	char * name_str = (char *) name.c_str();
+	int name_len = name.size() + 1;
+
+	/* Set up string buffer */
+	long out_size = frame_data->getCoresForward() + name_len;
+	char * stack_array = new char[out_size];
+	stringbuf out_data;
+	out_data.pubsetbuf(stack_array, out_size);
+
+	/* Set up variables */
+	long data_size = 3 * sizeof(int) + name_len;
+	char cf = frame_data->CORESFLAG;
+
+	/* Copy data into string buffer */
+	out_data.sputn((char *) &cf, sizeof(char));
+	out_data.sputn((char *) &data_size, sizeof(long));
+	out_data.sputn((char *) &rank, sizeof(int));
+	out_data.sputn((char *) &comm, sizeof(int));
+	out_data.sputn((char *) &name_len, sizeof(int));
+	out_data.sputn((char *) name_str, name_len);
+
+	/* Write data to compression buffer */
+	int ret = writeData(stack_array, out_size);
+
+	/* Free buffer */
+	delete[] stack_array;
+
+	return 0;
+
+}
+
+int TraceWriter::fetchVirtualAddresses() {
+	VirtualMemoryData *vmd = new VirtualMemoryData();
+	char * vFunctions_data;
+	int vFunctions_size;
+	int vFunctions_count = vmd->getData(&vFunctions_data, &vFunctions_size);
+
+	/* Set up string buffer */
+	long out_size = frame_data->getVirtualForward() + vFunctions_size;
+	char * stack_array = new char[out_size];
+	stringbuf out_data;
+	out_data.pubsetbuf(stack_array, out_size);
+
+	/* Set up variables */
+	long size = vFunctions_size + sizeof(int);
+	char vf = frame_data->VIRTUALFLAG;
+
+	/* Copy data into string buffer */
+	out_data.sputn((char *) &vf, sizeof(char));
+	out_data.sputn((char *) &size, sizeof(long));
+	out_data.sputn((char *) &vFunctions_count, sizeof(int));
+	out_data.sputn((char *) vFunctions_data, vFunctions_size);
+
+	/* Write data to compression buffer */
+	int ret = writeData(stack_array, out_size);
+
+	/* Free buffer */
+	delete[] stack_array;
+	delete[] vFunctions_data;
+	delete vmd;
+
+	return 0;
+
+}
+
+int TraceWriter::fetchBinaryData() {
+
+	string path, build_id;
+	long load_bias;
+	static_mem = ElfData::getProcessImage(&path, &build_id, &load_bias);
+
+	int path_len = path.size() + 1;
+	int id_len = build_id.size() + 1;
+
+	/* Set up string buffer */
+	long out_size = frame_data->getBinaryForward() + id_len + path_len;
+	char * stack_array = new char[out_size];
+	stringbuf out_data;
+	out_data.pubsetbuf(stack_array, out_size);
+
+	/* Set up variables */
+	long data_size = out_size - sizeof(char) - sizeof(long);
+	char bf = frame_data->BINARYFLAG;
+
+	/* Copy data into string buffer */
+	out_data.sputn((char *) &bf, sizeof(char));
+	out_data.sputn((char *) &data_size, sizeof(long));
+	out_data.sputn((char *) &static_mem, sizeof(long));
+	out_data.sputn((char *) &load_bias, sizeof(long));
+	out_data.sputn((char *) &id_len, sizeof(int));
+	out_data.sputn(build_id.c_str(), id_len);
+	out_data.sputn((char *) &path_len, sizeof(int));
+	out_data.sputn(path.c_str(), path_len);
+
+	/* Write data to compression buffer */
+	int ret = writeData(stack_array, out_size);
+
+	/* Free buffer */
+	delete[] stack_array;
+
+	return 0;
+
+}
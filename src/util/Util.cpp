@@ -1,4 +1,5 @@
 #include "../../include/util/Util.h"
+#include "../../include/util/TraceContainer.h"
 
 string WMUtils::cppDemangle(string input) {
 
@@ -126,6 +127,12 @@ string WMUtils::makeFunctionsFilename(string filename) {
 	return prefix;
 }
 
+string WMUtils::makeTimesFilename(string filename) {
+	string prefix = stripSuffix(filename);
+	prefix.append(WMANALYSISTIMES);
+	return prefix;
+}
+
 string WMUtils::makeAllocationsFilename(string filename) {
 	string prefix = stripSuffix(filename);
 	prefix.append(WMANALYSISALLOCATIONS);
@@ -206,7 +213,16 @@ string WMUtils::findUniqueFolder(string base) {
 }
 
 int WMUtils::countRunSize(string base) {
-	int count = -1;
+	/* A shared trace file records the number of ranks in its index */
+	int count = TraceContainer::countSegments(base);
+	if (count >= 0)
+		return count;
+
+	/* As does the node map of a run written through node collectors */
+	count = TraceContainer::countNodeRanks(base);
+	if (count >= 0)
+		return count;
+
 	struct stat my_stat;
 	char name[200];
 	do {
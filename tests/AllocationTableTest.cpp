@@ -0,0 +1,74 @@
+
+#include "../include/util/AllocationTable.h"
+
+#include <iostream>
+#include <assert.h>
+
+using namespace std;
+
+/* Find the longest run of slots in use, the longest a probe can walk */
+long longestRun(const AllocationTable &table) {
+	long longest = 0, run = 0;
+	long i;
+	for (i = 0; i < table.getCapacity(); i++) {
+		run = table.isLive(i) ? run + 1 : 0;
+		if (run > longest)
+			longest = run;
+	}
+	return longest;
+}
+
+int main(){
+	AllocationTable table;
+	AllocationTable::AllocationEntry entry;
+	long i;
+
+	/* Insert, find and replace */
+	table.insert(0x1000, 64, 3, 1);
+	table.insert(0, 64, 3, 2); //Ignored
+	assert(table.getCount() == 1);
+	assert(table.find(0x1000)->size == 64);
+	assert(table.find(0x2000) == NULL);
+	table.insert(0x1000, 128, 4, 3); //Stale entry replaced
+	assert(table.getCount() == 1);
+	assert(table.find(0x1000)->size == 128 && table.find(0x1000)->stack == 4);
+	assert(table.remove(0x1000, &entry) && entry.id == 3);
+	assert(!table.remove(0x1000, &entry));
+	assert(table.getCount() == 0);
+
+	/* Grow past the initial size, keeping every entry */
+	long count = ALLOCATIONTABLESIZE * 2;
+	for (i = 1; i <= count; i++)
+		table.insert(i * 16, i, (int) (i % 7), i);
+	assert(table.getCount() == count);
+	assert(table.getCapacity() > ALLOCATIONTABLESIZE);
+	for (i = 1; i <= count; i++)
+		assert(table.find(i * 16) != NULL && table.find(i * 16)->id == i);
+
+	/* Remove every other entry, the rest must still be found past the holes */
+	for (i = 1; i <= count; i += 2)
+		assert(table.remove(i * 16, &entry) && entry.size == i);
+	assert(table.getCount() == count / 2);
+	for (i = 1; i <= count; i++)
+		assert((table.find(i * 16) != NULL) == (i % 2 == 0));
+	for (i = 2; i <= count; i += 2)
+		assert(table.remove(i * 16, &entry) && entry.stack == (int) (i % 7));
+	assert(table.getCount() == 0);
+
+	/* Strided addresses, as from an allocator handing out aligned blocks, must spread across the table */
+	AllocationTable strided;
+	long stride = 1L << 20;
+	count = ALLOCATIONTABLESIZE / 4;
+	for (i = 1; i <= count; i++)
+		strided.insert(i * stride, stride, 0, i);
+	assert(strided.getCount() == count);
+	assert(longestRun(strided) < 64);
+	for (i = 1; i <= count; i++)
+		assert(strided.remove(i * stride, &entry) && entry.id == i);
+	assert(strided.getCount() == 0);
+
+	cout << "All tests passed\n";
+
+	return 0; //Success
+
+}
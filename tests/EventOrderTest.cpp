@@ -0,0 +1,145 @@
+
+#include "../include/util/TraceWriter.h"
+#include "../include/util/TraceBuffer.h"
+#include "../include/util/TraceReader.h"
+
+#include <iostream>
+#include <math.h>
+#include <assert.h>
+
+using namespace std;
+
+/*
+ * Write a trace of two threads, A and B both coalescing, through the writer, then read it back.
+ * Each test interleaves the events of the two threads, as the global sequence orders them,
+ * and checks the HWM read back is that of the events in that order.
+ */
+struct TwoThreads {
+	StackMap stack_map;
+	TraceWriter *writer;
+	TraceBuffer *a;
+	TraceBuffer *b;
+	unsigned long ticks;
+
+	TwoThreads() {
+		writer = new TraceWriter(&stack_map);
+		writer->addCalibration(1.0e9, 0, 0, 0);
+		long sequence;
+		int id = writer->registerThread(0.0, &sequence);
+		a = new TraceBuffer(writer, id, sequence, 0, BUFFERSIZE, true);
+		id = writer->registerThread(0.0, &sequence);
+		b = new TraceBuffer(writer, id, sequence, 0, BUFFERSIZE, true);
+		ticks = 0;
+	}
+
+	/* An allocation freed straight after, on thread A */
+	void cycle(long address, long size) {
+		a->addMalloc(address, ++ticks, size, 1);
+		a->addFree(address, ++ticks, size, 1);
+	}
+
+	/* Finish the trace, returning the skipped sequences of thread A and the HWM read back */
+	long finish(long *skipped) {
+		unsigned long last_ticks = ticks;
+		*skipped = a->getSkippedSequences();
+		a->finishBuffer();
+		b->finishBuffer();
+		writer->exitThread(a->getThreadID(), 1.0);
+		writer->exitThread(b->getThreadID(), 1.0);
+		writer->finish();
+		delete a;
+		delete b;
+		delete writer;
+
+		/* The index gives the time of the last event without reading the events */
+		double finish_time = TraceReader::findFinishTime(WMUtils::makeFileName(false));
+		assert(fabs(finish_time - last_ticks * 1.0e-9) < 1.0e-12);
+
+		TraceReader reader(WMUtils::makeFileName(false));
+		return reader.getHWMMemory();
+	}
+};
+
+int main(int argc, char *argv[]){
+#ifndef NO_MPI
+	MPI_Init(&argc, &argv);
+#endif
+	long skipped;
+
+	/* A run of identical pairs folds into one transient event, keeping its peak */
+	{
+		TwoThreads trace;
+		int i;
+		for (i = 0; i < 5; i++)
+			trace.cycle(0x1000, 300);
+		trace.b->addMalloc(0x9000, ++trace.ticks, 50, 2);
+		trace.b->addFree(0x9000, ++trace.ticks, 50, 2);
+		assert(trace.finish(&skipped) == 300);
+		assert(skipped == 4);
+	}
+
+	/* A free after another thread took a sequence is not folded, both allocations were live */
+	{
+		TwoThreads trace;
+		trace.a->addMalloc(0x1000, ++trace.ticks, 100, 1);
+		trace.b->addMalloc(0x9000, ++trace.ticks, 1000, 2);
+		trace.a->addFree(0x1000, ++trace.ticks, 100, 1);
+		trace.b->addFree(0x9000, ++trace.ticks, 1000, 2);
+		assert(trace.finish(&skipped) == 1100);
+		assert(skipped == 0);
+	}
+
+	/* A pair after another thread took a sequence does not join the run, its peak lands on the other allocation */
+	{
+		TwoThreads trace;
+		trace.cycle(0x1000, 100);
+		trace.b->addMalloc(0x9000, ++trace.ticks, 1000, 2);
+		trace.cycle(0x1000, 100);
+		trace.b->addFree(0x9000, ++trace.ticks, 1000, 2);
+		assert(trace.finish(&skipped) == 1100);
+		assert(skipped == 0);
+	}
+
+	/* A free of a different size or call stack from the allocation is not folded */
+	{
+		TwoThreads trace;
+		trace.a->addMalloc(0x1000, ++trace.ticks, 100, 1);
+		trace.a->addFree(0x1000, ++trace.ticks, 100, 3);
+		trace.cycle(0x2000, 200);
+		assert(trace.finish(&skipped) == 200);
+		assert(skipped == 0);
+	}
+
+	/* Small allocations of an aggregate, on either side of an allocation of another thread */
+	{
+		TwoThreads trace;
+		trace.a->addSmallAllocation(40, 1, ++trace.ticks);
+		trace.b->addMalloc(0x9000, ++trace.ticks, 1000, 2);
+		trace.a->addSmallFree(40, 1, ++trace.ticks);
+		trace.a->addSmallAllocation(20, 1, ++trace.ticks);
+		trace.b->addFree(0x9000, ++trace.ticks, 1000, 2);
+		assert(trace.finish(&skipped) == 1040);
+	}
+
+	/* Small allocations with nothing between them stay in one aggregate, keeping its peak */
+	{
+		TwoThreads trace;
+		trace.b->addMalloc(0x9000, ++trace.ticks, 1000, 2);
+		int i;
+		for (i = 0; i < 10; i++)
+			trace.a->addSmallAllocation(8, 1, ++trace.ticks);
+		for (i = 0; i < 10; i++)
+			trace.a->addSmallFree(8, 1, ++trace.ticks);
+		trace.b->addFree(0x9000, ++trace.ticks, 1000, 2);
+		assert(trace.finish(&skipped) == 1080);
+	}
+
+	cout << "All tests passed\n";
+
+#ifndef NO_MPI
+	MPI_Finalize();
+#endif
+
+	return 0; //Success
+
+}
@@ -0,0 +1,76 @@
+
+#include "../include/util/PeakScan.h"
+
+#include <iostream>
+#include <vector>
+#include <stdlib.h>
+#include <assert.h>
+
+using namespace std;
+
+/* Check a scan against the prefix sum taken the long way */
+void checkScan(const vector<long> &deltas, const vector<long> &peaks, long start) {
+	long count = deltas.size();
+	long expected_hwm = LONG_MIN, expected_index = -1, expected_memory = start;
+	long i;
+	for (i = 0; i < count; i++) {
+		if (expected_memory + peaks[i] > expected_hwm) {
+			expected_hwm = expected_memory + peaks[i];
+			expected_index = i;
+		}
+		expected_memory += deltas[i];
+	}
+
+	long memory = start;
+	long index;
+	long hwm = PeakScan::scan(count ? &deltas[0] : NULL,
+			count ? &peaks[0] : NULL, count, &memory, &index);
+	assert(hwm == expected_hwm);
+	assert(index == expected_index);
+	assert(memory == expected_memory);
+}
+
+int main(){
+	vector<long> deltas, peaks;
+	long i;
+
+	/* No events */
+	checkScan(deltas, peaks, 100);
+
+	/* A single allocation then its free, the HWM at the allocation */
+	long d1[] = {64, -64};
+	deltas.assign(d1, d1 + 2);
+	peaks = deltas;
+	checkScan(deltas, peaks, 0);
+
+	/* Equal peaks in different lanes and blocks, the first must be taken */
+	long d2[] = {10, -10, 10, -10, 10, -10, 10, -10, 10};
+	deltas.assign(d2, d2 + 9);
+	peaks = deltas;
+	checkScan(deltas, peaks, 5);
+
+	/* A transient event peaks above its net change, an aggregate can peak and then fall */
+	long d3[] = {100, 0, -50, 20, 0, 30};
+	long p3[] = {100, 500, 200, 20, 600, 30};
+	deltas.assign(d3, d3 + 6);
+	peaks.assign(p3, p3 + 6);
+	checkScan(deltas, peaks, 1000);
+
+	/* Random runs of every length around the vector width, and a whole column */
+	srand(42);
+	long count;
+	for (count = 1; count <= PEAKSCANCOLUMN; count = count < 64 ? count + 1 : count * 2) {
+		deltas.resize(count);
+		peaks.resize(count);
+		for (i = 0; i < count; i++) {
+			deltas[i] = (rand() % 2001) - 1000;
+			peaks[i] = rand() % 4 == 0 ? deltas[i] + rand() % 500 : deltas[i];
+		}
+		checkScan(deltas, peaks, rand() % 100000);
+	}
+
+	cout << "All tests passed\n";
+
+	return 0; //Success
+
+}
@@ -13,23 +13,26 @@ int main(){
 	long t4[] = {123421,12342,23134,321454}; //Different ordering of T1
 
 
-	vector<long> t1_vec (t1, t1 + sizeof(t1_vec) / sizeof(t1_vec[0]));
-	vector<long> t2_vec (t2, t2 + sizeof(t2_vec) / sizeof(t2_vec[0]));
-	vector<long> t3_vec (t3, t3 + sizeof(t3_vec) / sizeof(t3_vec[0]));
-	vector<long> t4_vec (t4, t4 + sizeof(t4_vec) / sizeof(t4_vec[0]));
-
-
 	StackMap sm;
 
 
-	int t1_res = sm.AddStack(t1_vec);
-	int t2_res = sm.AddStack(t2_vec);
-	int t3_res = sm.AddStack(t3_vec);
-	int t4_res = sm.AddStack(t4_vec);
+	int t1_res = sm.addStack(t1, sizeof(t1) / sizeof(t1[0]));
+	int t2_res = sm.addStack(t2, sizeof(t2) / sizeof(t2[0]));
+	int t3_res = sm.addStack(t3, sizeof(t3) / sizeof(t3[0]));
+	int t4_res = sm.addStack(t4, sizeof(t4) / sizeof(t4[0]));
+	int t5_res = sm.addStack(t1, 3); //Prefix of T1
 
 	assert(t2_res == t1_res);
 	assert(t3_res != t1_res);
 	assert(t4_res != t1_res);
+	assert(t5_res != t1_res);
+
+	/* Only the four unique stacks should be queued for printing */
+	long size;
+	int count;
+	char *queue = sm.getPrintQueue(&size, &count);
+	assert(count == 4);
+	delete[] queue;
 
 	cout << "All tests passed\n";
 
@@ -0,0 +1,71 @@
+
+#include "../include/util/TimeQuery.h"
+
+#include <iostream>
+#include <math.h>
+#include <assert.h>
+
+using namespace std;
+
+bool near(double a, double b) {
+	return fabs(a - b) < 1.0e-9;
+}
+
+int main(){
+	TimeQuery query;
+	vector<double> times;
+
+	/* A single time */
+	assert(query.parse("2.5"));
+	assert(query.isSingle() && !query.needsEndTime());
+	times = query.getTimes(10.0);
+	assert(times.size() == 1 && times[0] == 2.5);
+
+	/* A list, returned in order without repeats */
+	assert(query.parse("3,1,2,1"));
+	assert(!query.isSingle());
+	times = query.getTimes(10.0);
+	assert(times.size() == 3 && times[0] == 1.0 && times[1] == 2.0 && times[2] == 3.0);
+
+	/* A range including its end, with a step that is not exact in binary */
+	assert(query.parse("0:0.3:0.1"));
+	times = query.getTimes(10.0);
+	assert(times.size() == 4);
+	assert(near(times[1], 0.1) && near(times[3], 0.3));
+
+	assert(query.parse("1:2:0.25"));
+	times = query.getTimes(10.0);
+	assert(times.size() == 5 && near(times[4], 2.0));
+
+	/* A range whose end is not on a step stops short of it */
+	assert(query.parse("0:1:0.4"));
+	times = query.getTimes(10.0);
+	assert(times.size() == 3 && near(times[2], 0.8));
+
+	/* A count of times, spread across the run */
+	assert(query.parse("@4"));
+	assert(query.needsEndTime() && !query.isSingle());
+	times = query.getTimes(8.0);
+	assert(times.size() == 4 && times[0] == 2.0 && times[3] == 8.0);
+
+	/* Up to the cap of times, but no more */
+	assert(query.parse("1:10000:1"));
+	assert(query.getTimes(10.0).size() == TIMEQUERYMAX);
+	assert(query.parse("@10000"));
+
+	/* Bad input leaves the query empty */
+	const char *bad[] = {"", "x", "1,", ",1", "1,,2", "1s", "1:2", "2:1:0.5",
+			"0:1:0", "0:1:-1", "0:x:1", "@", "@0", "@-2", "@2x",
+			"0:10000:1", "0:1e9:1e-9", "0:1:1e-300", "0:nan:1", "@10001"};
+	unsigned int i;
+	for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+		assert(!query.parse(bad[i]));
+		assert(!query.isSingle() && !query.needsEndTime());
+		assert(query.getTimes(10.0).empty());
+	}
+
+	cout << "All tests passed\n";
+
+	return 0; //Success
+
+}
@@ -0,0 +1,56 @@
+
+#include "../include/util/VarInt.h"
+
+#include <iostream>
+#include <limits.h>
+#include <assert.h>
+
+using namespace std;
+
+int main(){
+	unsigned long values[] = {0, 1, 127, 128, 255, 16383, 16384, 1UL << 32,
+			(1UL << 63) - 1, 1UL << 63, ULONG_MAX};
+	long signed_values[] = {0, 1, -1, 63, -64, 64, -65, 123456789, -123456789,
+			LONG_MAX, LONG_MIN};
+	unsigned char buffer[VarInt::MAXBYTES * 16];
+	unsigned int i;
+
+	/* Unsigned values, each taking a byte per 7 bits */
+	for (i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+		int size = VarInt::encode(buffer, values[i]);
+		assert(size >= 1 && size <= VarInt::MAXBYTES);
+
+		const unsigned char *pos = buffer;
+		assert(VarInt::decode(&pos) == values[i]);
+		assert(pos == buffer + size);
+	}
+	assert(VarInt::encode(buffer, 127) == 1);
+	assert(VarInt::encode(buffer, 128) == 2);
+	assert(VarInt::encode(buffer, ULONG_MAX) == VarInt::MAXBYTES);
+
+	/* Signed values, small negative deltas staying small */
+	for (i = 0; i < sizeof(signed_values) / sizeof(signed_values[0]); i++) {
+		int size = VarInt::encodeSigned(buffer, signed_values[i]);
+		assert(size >= 1 && size <= VarInt::MAXBYTES);
+
+		const unsigned char *pos = buffer;
+		assert(VarInt::decodeSigned(&pos) == signed_values[i]);
+		assert(pos == buffer + size);
+	}
+	assert(VarInt::encodeSigned(buffer, -64) == 1);
+	assert(VarInt::encodeSigned(buffer, -65) == 2);
+
+	/* Values back to back, as in a frame */
+	unsigned char *out = buffer;
+	for (i = 0; i < sizeof(signed_values) / sizeof(signed_values[0]); i++)
+		out += VarInt::encodeSigned(out, signed_values[i]);
+	const unsigned char *in = buffer;
+	for (i = 0; i < sizeof(signed_values) / sizeof(signed_values[0]); i++)
+		assert(VarInt::decodeSigned(&in) == signed_values[i]);
+	assert(in == out);
+
+	cout << "All tests passed\n";
+
+	return 0; //Success
+
+}